@@ -0,0 +1,85 @@
+#ifndef BPKG_INDEX_H
+#define BPKG_INDEX_H
+
+#include "chk/pkgchk.h"
+
+// The binary index of a package is looked up next to its .bpkg file, with
+// this suffix appended to the path
+#define BPKG_INDEX_SUFFIX ".idx"
+#define BPKG_INDEX_MAGIC "BPKGIDX"
+#define BPKG_INDEX_MAGIC_SIZE 8
+#define BPKG_INDEX_VERSION 1
+#define SHA256_DIGEST_SIZE 32
+
+/**
+ * Header of a binary package index. The header is followed by the binary
+ * digests of all nodes in level order, then by one bpkg_index_chunk per
+ * leaf. All fields are in host byte order, so the file is used as mapped.
+ */
+struct bpkg_index_header {
+    char magic[BPKG_INDEX_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t digest_size;
+    uint64_t size;
+    uint64_t nhashes;
+    uint64_t nchunks;
+    char ident[MAX_IDENT_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+};
+
+struct bpkg_index_chunk {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/**
+ * Convert a binary digest to a null terminated lowercase hex string
+ * @param digest SHA256_DIGEST_SIZE bytes
+ * @param hex buffer with size >= SHA256_HEX_STRLEN
+ */
+void digest_to_hex(const uint8_t *digest, char *hex);
+
+/**
+ * Convert a hex string to a binary digest
+ * @param hex SHA256_HEX_LEN hex digits
+ * @param digest buffer with size >= SHA256_DIGEST_SIZE
+ * @return 1 if success, 0 if the string has a non hex digit
+ */
+int hex_to_digest(const char *hex, uint8_t *digest);
+
+/**
+ * Load a package from a binary index, mapping the file instead of reading
+ * it. The index at path is used if path is an index, otherwise the index
+ * next to path if it is not older than the text package.
+ * @param path path of a binary index or a .bpkg file
+ * @return heap address of the bpkg_obj, NULL if there is no valid index
+ */
+struct bpkg_obj *bpkg_index_load(const char *path);
+
+/**
+ * Load only the header and root hash of a package from a binary index, see
+ * bpkg_index_load
+ * @param path
+ * @return heap address of the bpkg_obj with no tree, NULL if there is no
+ * valid index
+ */
+struct bpkg_obj *bpkg_index_load_header(const char *path);
+
+/**
+ * Write the binary index of a package
+ * @param obj
+ * @param path
+ * @return 1 if success, 0 otherwise
+ */
+int bpkg_index_write(struct bpkg_obj *obj, const char *path);
+
+/**
+ * Write a package in the text .bpkg format
+ * @param obj
+ * @param path
+ * @return 1 if success, 0 otherwise
+ */
+int bpkg_text_write(struct bpkg_obj *obj, const char *path);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef BPKG_PARSE_H
+#define BPKG_PARSE_H
+
+#include "chk/pkgchk.h"
+
+// Reasons a text package fails to load, see bpkg_error_message
+enum bpkg_error {
+    BPKG_OK,
+    BPKG_INVALID_PATH,
+    BPKG_MISSING_IDENT,
+    BPKG_INVALID_IDENT,
+    BPKG_MISSING_FILENAME,
+    BPKG_INVALID_FILENAME,
+    BPKG_MISSING_SIZE,
+    BPKG_INVALID_SIZE,
+    BPKG_MISSING_NHASHES,
+    BPKG_INVALID_NHASHES,
+    BPKG_MISSING_HASHES_HEADER,
+    BPKG_MISSING_HASHES,
+    BPKG_INVALID_HASHES,
+    BPKG_MISSING_NCHUNKS,
+    BPKG_INVALID_NCHUNKS,
+    BPKG_MISSING_CHUNKS_HEADER,
+    BPKG_INVALID_CHUNKS,
+    NUM_BPKG_ERRORS
+};
+
+/**
+ * Get the value of a hex digit
+ * @param digit
+ * @return value, -1 if not a hex digit
+ */
+int hex_digit_value(char digit);
+
+/**
+ * Parse a text package. The file is mapped and scanned once, the hashes are
+ * copied straight from the mapping into a tree allocated in one block.
+ * @param path
+ * @param obj_out set to the heap address of the bpkg_obj if success
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error bpkg_parse(const char *path, struct bpkg_obj **obj_out);
+
+/**
+ * Parse only the header of a text package: ident, filename, size, counts and
+ * root hash. The whole file is checked in one pass, but no tree is built.
+ * @param path
+ * @param obj_out set to the heap address of the bpkg_obj, with no tree, if
+ * success
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error bpkg_parse_header(const char *path, struct bpkg_obj
+        **obj_out);
+
+/**
+ * Get the message printed when a package fails to load
+ * @param error
+ * @return the message, without a newline
+ */
+const char *bpkg_error_message(enum bpkg_error error);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Seed of the table of random values of the rolling hash, changing it moves
+// every chunk boundary
+#define CDC_GEAR_SEED 0x6274696465636463ULL
+#define CDC_GEAR_SIZE 256
+
+/**
+ * Bounds and masks of content-defined chunking. A boundary is placed where
+ * the rolling hash of the data has its masked bits all zero, with a mask of
+ * more bits before the average size and of fewer bits after it, so chunk
+ * sizes stay close to the average.
+ */
+struct cdc_params {
+    uint32_t min_size;
+    uint32_t avg_size;
+    uint32_t max_size;
+    uint64_t mask_small; // used until the chunk reaches the average size
+    uint64_t mask_large;
+    uint64_t gear[CDC_GEAR_SIZE];
+};
+
+// Progress of the chunk being cut, carried between the pieces of a file
+struct cdc_state {
+    uint64_t hash;
+    uint64_t length;
+};
+
+/**
+ * Set up the parameters of content-defined chunking
+ * @param params
+ * @param min_size no boundary is placed before this size
+ * @param avg_size
+ * @param max_size a boundary is always placed at this size
+ * @return 1 if success, 0 if the sizes are not ordered or max_size is 0
+ */
+int init_cdc_params(struct cdc_params *params, uint32_t min_size, uint32_t
+        avg_size, uint32_t max_size);
+
+/**
+ * Scan a piece of a file for the end of the current chunk. The bytes before
+ * the minimum size are skipped without hashing.
+ * @param params
+ * @param state state of the current chunk, reset when a boundary is found
+ * @param data
+ * @param length
+ * @param cut set to 1 if the chunk ends in this piece, 0 otherwise
+ * @return bytes of the piece that belong to the current chunk
+ */
+size_t scan_cdc_boundary(struct cdc_params *params, struct cdc_state *state,
+                         const uint8_t *data, size_t length, int *cut);
+
+#endif
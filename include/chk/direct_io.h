@@ -0,0 +1,98 @@
+#ifndef DIRECT_IO_H
+#define DIRECT_IO_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "chk/pkgchk.h"
+
+// O_DIRECT transfers start, end and are buffered on this boundary
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_BUFFER_SIZE (1 << 20)
+// Free buffers kept for reuse per NUMA node, more are allocated when all are
+// in use
+#define DIRECT_IO_POOL_SIZE 16
+#define DIRECT_IO_MAX_NODES 8
+
+// Aligned buffers shared by all threads, a thread reuses the buffers freed on
+// its NUMA node so they stay in local memory
+struct direct_buffer_pool {
+    pthread_mutex_t lock;
+    int num_free[DIRECT_IO_MAX_NODES];
+    char *buffers[DIRECT_IO_MAX_NODES][DIRECT_IO_POOL_SIZE];
+};
+
+/**
+ * Open a file with O_DIRECT, bypassing the page cache
+ * @param path
+ * @param flags open flags
+ * @return fd, -1 if failed or the filesystem does not support O_DIRECT
+ */
+int open_direct(char *path, int flags);
+
+/**
+ * Get the NUMA node of the CPU the calling thread runs on
+ * @return node, 0 if unknown
+ */
+unsigned int current_numa_node();
+
+/**
+ * Take an aligned buffer of DIRECT_IO_BUFFER_SIZE bytes from the pool of the
+ * NUMA node of the calling thread
+ * @return the buffer
+ */
+char *take_direct_buffer();
+
+/**
+ * Return a buffer to the pool of the NUMA node of the calling thread
+ * @param buffer
+ */
+void put_direct_buffer(char *buffer);
+
+/**
+ * Read any range of a file opened with O_DIRECT through aligned buffers
+ * @param fd
+ * @param data buffer with size >= size
+ * @param size
+ * @param offset
+ * @return number of bytes read, less than size at the end of the file, -1
+ * if failed
+ */
+ssize_t direct_pread(int fd, char *data, uint32_t size, uint64_t offset);
+
+/**
+ * Write buffers at any offset of a file. The aligned blocks in the range are
+ * written through direct_fd, and the unaligned head and tail through fd, so
+ * the blocks shared with neighbouring chunks are never read and rewritten.
+ * @param direct_fd the file opened with O_DIRECT
+ * @param fd the file opened without O_DIRECT
+ * @param iov
+ * @param num_iov
+ * @param offset
+ * @return 1 if success, 0 otherwise
+ */
+int direct_pwritev(int direct_fd, int fd, struct iovec *iov, int num_iov,
+                   uint64_t offset);
+
+/**
+ * Get data of the data file of a package, with O_DIRECT if the package
+ * bypasses the page cache
+ * @param package
+ * @param data buffer with size >= size
+ * @param size
+ * @param offset
+ * @return 1 if success, 0 otherwise
+ */
+int read_package_data(struct bpkg_obj *package, char *data, uint32_t size,
+                      uint64_t offset);
+
+/**
+ * Compute the hashes of all leaves, reading the data file with O_DIRECT
+ * @param hashes
+ * @param full_filename
+ */
+void compute_leaf_hashes_direct(merkle_tree *hashes, char *full_filename);
+
+void free_direct_buffers();
+
+#endif
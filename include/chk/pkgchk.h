@@ -1,6 +1,8 @@
 #ifndef PKGCHK_H
 #define PKGCHK_H
 
+#include <inttypes.h>
+
 #include "tree/merkletree.h"
 
 #define FILE_EXIST_MESSAGE "File Exists"
@@ -11,31 +13,64 @@
 #define MAX_DATA_DIRECTORY_SIZE 4097
 #define MAX_FILENAME_SIZE 257
 #define MAX_BPKG_LINE_SIZE 1048
+#define MAX_BPKG_PATH_SIZE 4097
+// Data file of a new version being built from the old version
+#define DELTA_TEMP_SUFFIX ".upgrade"
 
 /**
  * Query object, allows you to assign
  * hash strings to it.
- * Typically: malloc N number of strings for hashes
- *    after malloc the space for each string
- *    Make sure you deallocate in the destroy function
+ * The array of strings and the strings are one allocation, made by
+ * create_query and freed by bpkg_query_destroy
  */
 struct bpkg_query {
     char **hashes;
     size_t len;
 };
 
+/**
+ * Plan to build a new version of a package from the data of an old version.
+ * Chunks with the same hash are copied from the old data file, at any
+ * offset, and the rest is fetched.
+ */
+struct bpkg_delta {
+    size_t len; // number of chunks of the new version
+    chunk **chunks; // chunks of the new version, owned by its tree
+    char **hashes; // expected hashes of the chunks, owned by the tree
+    int64_t *old_offsets; // offset of the chunk in the old data file, -1
+                          // if it has to be fetched
+    size_t num_copied;
+};
+
+// Identity of a data file, the hashes computed from it are trusted while it
+// is unchanged
+struct data_identity {
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
 struct bpkg_obj {
     char ident[MAX_IDENT_SIZE];
     char directory[MAX_DATA_DIRECTORY_SIZE]; // directory that contain the data file
     char filename[MAX_FILENAME_SIZE]; // data file name
-    uint32_t size; // data file size
-    uint32_t nhashes;
-    uint32_t nchunks;
-    struct merkle_tree *hashes;
+    uint64_t size; // data file size
+    uint64_t nhashes;
+    uint64_t nchunks;
+    char root_hash[SHA256_HEX_STRLEN];
+    char bpkg_path[MAX_BPKG_PATH_SIZE]; // file the package was loaded from
+    struct merkle_tree *hashes; // NULL while only the header is loaded
+    int direct_io; // read and write the data file with O_DIRECT
+    int resume_state; // keep the verified leaves in a file next to the data
+    // Data file the leaf hashes of the tree were computed from, zero while
+    // they are unknown
+    struct data_identity hashed_identity;
 };
 
 /**
- * Loads the package for when a value path is given
+ * Loads the package for when a value path is given, from its binary index
+ * if there is an up to date one
  */
 struct bpkg_obj *bpkg_load(const char *path);
 
@@ -46,6 +81,29 @@ struct bpkg_obj *bpkg_load(const char *path);
  */
 struct bpkg_obj *bpkg_load_no_message(const char *path, char *directory);
 
+/**
+ * Loads only the header of a package (ident, filename, size, counts and root
+ * hash), with no error messages printed. The tree is built later with
+ * bpkg_load_tree.
+ * @return heap address of the bpkg_obj, NULL if failed to load
+ */
+struct bpkg_obj *bpkg_load_header(const char *path, char *directory);
+
+/**
+ * Build the tree of a package loaded with bpkg_load_header, from the file it
+ * was loaded from
+ * @param obj
+ * @return 1 if success or already built, 0 if the file no longer loads or no
+ * longer matches the header
+ */
+int bpkg_load_tree(struct bpkg_obj *obj);
+
+/**
+ * Free the tree of a package, keeping its header
+ * @param obj
+ */
+void bpkg_unload_tree(struct bpkg_obj *obj);
+
 /**
  * Get the full path of the data file in bpkg
  * @param full_path_buf buffer to store the full path
@@ -55,6 +113,14 @@ void get_file_full_path(char *full_path_buf, struct bpkg_obj *obj);
 
 int check_file_existence(char *full_filename);
 
+/**
+ * Create the data file of a package with its full size, as a sparse file, if
+ * it does not exist
+ * @param bpkg
+ * @return 1 if the file exists or was created, 0 otherwise
+ */
+int create_data_file(struct bpkg_obj *bpkg);
+
 /**
  * Get the data in the bpkg data file, with specified file offset and size
  * @param obj bpkg object
@@ -63,19 +129,27 @@ int check_file_existence(char *full_filename);
  * @param data_buf buffer to store the data (with size >= data size)
  * @return
  */
-int get_data(struct bpkg_obj *obj, uint32_t size, uint32_t file_offset, char
+int get_data(struct bpkg_obj *obj, uint32_t size, uint64_t file_offset, char
         *data_buf);
 
+/**
+ * Open the data file of a package for reading and writing, creating it if
+ * missing and extending it to the package size if shorter
+ * @param obj bpkg object
+ * @return file descriptor, -1 if failed
+ */
+int open_data_file(struct bpkg_obj *obj);
+
 /**
  * Write the data in the data buffer into the bpkg data file
  * @param obj bpkg object
  * @param file_size data size
  * @param file_offset file offset
  * @param data_buf buffer that contains the data (with size >= data size)
- * @return
+ * @return 1 if success, 0 otherwise
  */
-int write_data(struct bpkg_obj *obj, uint32_t file_size, uint32_t file_offset, char
-        *data_buf);
+int write_data(struct bpkg_obj *obj, uint32_t file_size, uint64_t
+        file_offset, char *data_buf);
 
 /**
  * Checks to see if the referenced filename in the bpkg file
@@ -96,13 +170,20 @@ struct bpkg_query bpkg_file_check(struct bpkg_obj *bpkg);
  */
 struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj *bpkg);
 
+/**
+ * Compute the hashes of all chunks in the data file of the package
+ * @param bpkg
+ * @return 1 if success, 0 if the data file doesn't exist
+ */
+int compute_chunk_hashes(struct bpkg_obj *bpkg);
+
 /**
  * Check if the data file is complete in the package
  * @return 1 if is complete, 0 otherwise
  */
 int bpkg_complete_check(struct bpkg_obj *bpkg);
 
-int check_chunk_completion(struct bpkg_obj *bpkg, char *hash, uint32_t
+int check_chunk_completion(struct bpkg_obj *bpkg, char *hash, uint64_t
 file_offset);
 
 /**
@@ -112,9 +193,20 @@ file_offset);
  * @param file_offset
  * @return heap memory address of the chunk, NULL if not found
  */
-chunk *get_chunk_from_hash(struct bpkg_obj *bpkg, char *hash, uint32_t
+chunk *get_chunk_from_hash(struct bpkg_obj *bpkg, char *hash, uint64_t
 file_offset);
 
+/**
+ * Get the leaf of the chunk starting at an offset, by the offset index of
+ * the tree if it has one
+ * @param bpkg package with its tree
+ * @param hash expected hash of the chunk
+ * @param chunk_offset offset where the chunk starts
+ * @return index of the leaf among the leaves, num_leaves if not found
+ */
+size_t find_chunk_leaf(struct bpkg_obj *bpkg, char *hash, uint64_t
+        chunk_offset);
+
 /**
  * Retrieves all completed chunks of a package object
  * @param bpkg, constructed bpkg object
@@ -151,6 +243,67 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj *bpkg);
 struct bpkg_query
 bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj *bpkg, char *hash);
 
+/**
+ * Allocate a query of len strings in one block
+ * @param len
+ * @param string_size size of each string, null byte included
+ * @return query with zeroed strings
+ */
+struct bpkg_query create_query(size_t len, size_t string_size);
+
+/**
+ * Find the complete chunks of a package without allocating, as keys of
+ * leaves in the tree
+ * @param bpkg
+ * @param keys buffer of at least nchunks keys, filled in order
+ * @return number of keys written, 0 if the data file doesn't exist
+ */
+size_t bpkg_find_completed_chunks(struct bpkg_obj *bpkg, size_t *keys);
+
+/**
+ * Find the smallest set of complete nodes covering the complete chunks
+ * without allocating, see bpkg_get_min_completed_hashes
+ * @param bpkg
+ * @param keys buffer of at least nchunks keys, filled in level order
+ * @return number of keys written
+ */
+size_t bpkg_find_min_completed_hashes(struct bpkg_obj *bpkg, size_t *keys);
+
+/**
+ * Find the chunks under the node with a hash, or the node itself if it is a
+ * leaf. The leaves of a subtree are consecutive in the tree.
+ * @param bpkg
+ * @param hash
+ * @param first set to the key of the first leaf
+ * @return number of leaves, 0 if the hash is not in the tree
+ */
+size_t bpkg_find_chunk_span(struct bpkg_obj *bpkg, char *hash, size_t
+        *first);
+
+
+/**
+ * Diff the leaf hashes of a new version of a package against the complete
+ * chunks of an old version
+ * @param old_obj package with the old data file
+ * @param new_obj package of the new version
+ * @return the delta plan, to deallocate with bpkg_delta_destroy
+ */
+struct bpkg_delta bpkg_get_delta(struct bpkg_obj *old_obj, struct bpkg_obj
+        *new_obj);
+
+/**
+ * Create the data file of the new version with the chunks copied from the
+ * old data file, the chunks to fetch are left zeroed. The file is built
+ * aside and renamed over the data file, so the old data file can be the same.
+ * @param old_obj
+ * @param new_obj
+ * @param delta
+ * @return 1 if success, 0 otherwise
+ */
+int bpkg_apply_delta(struct bpkg_obj *old_obj, struct bpkg_obj *new_obj,
+                     struct bpkg_delta *delta);
+
+void bpkg_delta_destroy(struct bpkg_delta *delta);
 
 /**
  * Deallocates the query result after it has been constructed from
@@ -0,0 +1,75 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "chk/pkgchk.h"
+
+// The verified leaves of a data file are kept next to it, with this suffix
+// appended to its path
+#define RESUME_SUFFIX ".resume"
+#define RESUME_MAGIC "BPKGRSM"
+#define RESUME_MAGIC_SIZE 8
+#define RESUME_VERSION 1
+
+/**
+ * Header of a resume file. The header is followed by a bitmap of the leaves
+ * verified in the data file, one bit per leaf in order. All fields are in
+ * host byte order.
+ */
+struct resume_header {
+    char magic[RESUME_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t reserved;
+    struct data_identity identity; // data file the leaves were verified in
+    uint64_t nchunks;
+    char root_hash[SHA256_HEX_STRLEN]; // tree the leaves belong to
+};
+
+/**
+ * Get the identity of a data file: inode, size and modification time
+ * @param full_path
+ * @param identity set to the identity if success
+ * @return 1 if success, 0 if the file cannot be read
+ */
+int get_data_identity(char *full_path, struct data_identity *identity);
+
+/**
+ * Set the computed hashes of the leaves from the resume file of a data file,
+ * verified leaves to their expected hash and the others to an empty hash.
+ * Nothing is read if the leaves were already computed from the same file.
+ * @param bpkg
+ * @param full_path path of the data file
+ * @param identity current identity of the data file
+ * @return 1 if the leaves are set, 0 if the resume file is missing or no
+ * longer matches the data file
+ */
+int load_resume_state(struct bpkg_obj *bpkg, char *full_path, struct
+        data_identity *identity);
+
+/**
+ * Write the leaves whose computed hash matches to the resume file of a data
+ * file, replacing it at once
+ * @param bpkg
+ * @param full_path path of the data file
+ * @param identity identity of the data file when the leaves were computed
+ * @return 1 if success, 0 otherwise
+ */
+int write_resume_state(struct bpkg_obj *bpkg, char *full_path, struct
+        data_identity *identity);
+
+/**
+ * Mark a chunk written to the data file as verified, if the other leaves are
+ * known. The resume file is updated by save_resume_state.
+ * @param bpkg
+ * @param hash expected hash of the chunk
+ * @param file_offset offset of the chunk
+ */
+void record_verified_chunk(struct bpkg_obj *bpkg, char *hash, uint64_t
+        file_offset);
+
+/**
+ * Write the resume file after chunks were written, synced and recorded
+ * @param bpkg
+ */
+void save_resume_state(struct bpkg_obj *bpkg);
+
+#endif
@@ -2,16 +2,25 @@
 #define CONFIG_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "net/packet.h"
+#include "net/affinity.h"
+
 #define MAX_CONFIG_LINE_SIZE 5012
 #define MAX_DIRECTORY_SIZE 4097
 #define MIN_PEER_NUM 1
 #define MAX_PEER_NUM 2048
 #define MIN_PORT_NUM 1025
 #define MAX_PORT_NUM 65535
+#define MAX_RATE_KEY_SIZE 32
+#define MAX_RATE_DIGITS 19
+#define MAX_CPU_KEY_SIZE 16
 
 // Error codes
 #define INVALID_CONFIG 1
@@ -20,10 +29,38 @@
 #define INVALID_PEER_NUM 4
 #define INVALID_PORT_NUM 5
 
+// When received chunks reach the disk
+enum durability {
+    DURABILITY_NONE, // left to the kernel
+    DURABILITY_PERIODIC, // written data files are synced every second
+    DURABILITY_SYNC // synced before a chunk is marked complete
+};
+
 struct config {
     char directory[MAX_DIRECTORY_SIZE];
     int max_peers;
     u_int16_t port;
+    // Optional limits in bytes per second, 0 for unlimited
+    uint64_t upload_rate;
+    uint64_t download_rate;
+    uint64_t peer_upload_rate;
+    uint64_t peer_download_rate;
+    // Optional AF_UNIX socket for peers on the same host, empty if unused
+    char unix_socket[MAX_SOCKET_PATH_SIZE];
+    // Optional deduplication of chunks shared by packages
+    int chunk_store;
+    // Optional O_DIRECT access to the data files of all packages
+    int direct_io;
+    // Optional registration of all packages of the directory at startup
+    int startup_scan;
+    // Optional files of the verified leaves kept next to the data files
+    int resume_state;
+    enum durability durability;
+    // Optional seconds after which unused package trees are freed, 0 to keep
+    // them
+    uint64_t tree_idle_timeout;
+    // Optional CPUs of the network, verification and I/O threads
+    struct affinity affinity;
 };
 
 int parse_config(char *filename, struct config *config);
@@ -0,0 +1,54 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+
+#define MAX_CPU_LIST_SIZE 256
+
+// Kinds of threads that are pinned separately
+enum thread_role {
+    THREAD_NETWORK, // server, connector, peer readers, scheduler and timers
+    THREAD_VERIFY, // command line thread, which verifies whole packages
+    THREAD_IO, // write-back stage and streams
+    NUM_THREAD_ROLES
+};
+
+// CPUs each kind of thread runs on, set once before any thread starts
+struct affinity {
+    cpu_set_t cpus[NUM_THREAD_ROLES];
+    int pinned[NUM_THREAD_ROLES]; // 0 if the threads may run on any CPU
+};
+
+/**
+ * Parse a list of CPUs, such as 0-3,8
+ * @param list
+ * @param cpus set to the listed CPUs
+ * @return 1 if success, 0 otherwise
+ */
+int parse_cpu_list(char *list, cpu_set_t *cpus);
+
+/**
+ * Set the CPUs of the threads started after, threads of a role without CPUs
+ * are not pinned
+ * @param affinity
+ */
+void set_thread_affinity(struct affinity *affinity);
+
+/**
+ * Pin the calling thread to the CPUs of its role. Memory is then allocated
+ * on the NUMA node of the thread that first touches it, so buffers filled by
+ * a thread stay local to it.
+ * @param role
+ * @return 1 if pinned or the role is not pinned, 0 if failed
+ */
+int pin_current_thread(enum thread_role role);
+
+/**
+ * Count the CPUs a kind of threads runs on
+ * @param role
+ * @return number of CPUs of the role, or of online CPUs if not pinned
+ */
+int count_role_cpus(enum thread_role role);
+
+#endif
@@ -5,27 +5,56 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <bits/types/struct_timeval.h>
 
+#include "net/timer_wheel.h"
+
 #define PACKET_SIZE 4096
 #define IDENT_SIZE 1024
 #define CHUNK_HASH_SIZE 64
 #define MAX_DATA_SIZE 2998
+// RES2 gives 4 bytes of data to the high half of the file offset
+#define MAX_DATA_SIZE_V2 (MAX_DATA_SIZE - 4)
+#define HANDSHAKE_TIMEOUT_US 3000000
+#define MAX_BURST_PACKETS 64
+// Size of sun_path in struct sockaddr_un
+#define MAX_SOCKET_PATH_SIZE 108
+// Most fds passed with a packet, the fds of a shared memory channel
+#define MAX_PASSED_FDS 5
+// Version of the protocol sent in ACP and ACK, peers use the lower version
+// of the two. Version 2 has 64-bit file offsets.
+#define PROTOCOL_VERSION 2
 
 #define PKT_MSG_ACK 0x0c
 #define PKT_MSG_ACP 0x02
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_CAN 0x08
+// RES over AF_UNIX carrying the data file descriptor instead of the data
+#define PKT_MSG_RFD 0x09
+// Sent over AF_UNIX after the handshake, carries the fds of the shared
+// memory rings that all further packets use
+#define PKT_MSG_SHM 0x0A
+// RES with a 64-bit file offset, sent to peers of version 2 for data beyond
+// 4 GB
+#define PKT_MSG_RES2 0x0B
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
+// Payload of ACP and ACK, all zero from peers of version 1
+struct handshake_payload {
+    uint32_t version;
+};
+
 struct request_payload {
     uint32_t file_offset;
     uint32_t data_len;
     char chunk_hash[CHUNK_HASH_SIZE];
     char ident[IDENT_SIZE];
+    uint32_t file_offset_high; // version 2, zero from peers of version 1
 };
 
 struct response_payload {
@@ -36,9 +65,29 @@ struct response_payload {
     char ident[IDENT_SIZE];
 };
 
+struct response_payload_v2 {
+    uint32_t file_offset;
+    uint32_t file_offset_high;
+    char data[MAX_DATA_SIZE_V2];
+    uint16_t data_len;
+    char chunk_hash[CHUNK_HASH_SIZE];
+    char ident[IDENT_SIZE];
+};
+
 union btide_payload {
+    struct handshake_payload handshake;
     struct request_payload request;
     struct response_payload response;
+    struct response_payload_v2 response_v2;
+};
+
+// Fields of a RES or RES2 packet, pointing into the packet
+struct response_fields {
+    uint64_t file_offset;
+    char *data;
+    uint16_t data_len;
+    char *chunk_hash;
+    char *ident;
 };
 
 struct btide_packet {
@@ -47,27 +96,92 @@ struct btide_packet {
     union btide_payload pl;
 };
 
+/**
+ * Get the current time of a monotonic clock
+ * @return time in microseconds
+ */
+uint64_t get_time_us();
+
+/**
+ * Send a burst of packets to a peer with a single writev
+ * @param packets
+ * @param num_packets at most MAX_BURST_PACKETS
+ * @param peer_fd
+ * @return 1 if success, 0 for error
+ */
+int send_packets(struct btide_packet *packets, int num_packets, int peer_fd);
+
 /**
  * Wait for a packet with a timeout of 3 seconds
+ * @param timers
  * @param packet_buf
  * @param peer_fd
- * @return
+ * @return 1 if success, 0 otherwise
  */
-int get_packet_tm(struct btide_packet *packet_buf, int peer_fd);
+int get_packet_tm(struct timer_wheel *timers, struct btide_packet
+        *packet_buf, int peer_fd);
 
 /**
  * Send ACP to peer and wait for ACK with 3 seconds timeout
+ * @param timers
  * @param peer_fd
+ * @param version set to the protocol version of the connection
  * @return 1 if success, 0 otherwise
  */
-int send_ACP(int peer_fd);
+int send_ACP(struct timer_wheel *timers, int peer_fd, uint32_t *version);
 
 /**
  * Handle ACP by sending back ACK
+ * @param acp the ACP packet
  * @param peer_fd
+ * @param version set to the protocol version of the connection
  * @return 1 if success, 0 otherwise
  */
-int handle_ACP(int peer_fd);
+int handle_ACP(struct btide_packet *acp, int peer_fd, uint32_t *version);
+
+/**
+ * Get the file offset of a REQ, CAN or RFD payload
+ * @param req
+ * @param version protocol version of the peer that sent it
+ * @return the offset
+ */
+uint64_t get_request_offset(struct request_payload *req, uint32_t version);
+
+/**
+ * Set the file offset of a REQ, CAN or RFD payload
+ * @param req
+ * @param offset
+ */
+void set_request_offset(struct request_payload *req, uint64_t offset);
+
+/**
+ * Get the most data a RES packet can carry at a file offset
+ * @param file_offset
+ * @return MAX_DATA_SIZE, or MAX_DATA_SIZE_V2 if the offset needs a RES2
+ */
+uint16_t max_response_data(uint64_t file_offset);
+
+/**
+ * Fill a RES packet, a RES2 if the file offset does not fit in 32 bits
+ * @param packet zeroed packet
+ * @param err
+ * @param file_offset
+ * @param chunk_hash
+ * @param ident
+ * @param data NULL for no data
+ * @param data_len at most max_response_data(file_offset)
+ */
+void fill_response(struct btide_packet *packet, uint16_t err, uint64_t
+        file_offset, char *chunk_hash, char *ident, char *data, uint16_t
+        data_len);
+
+/**
+ * Get the fields of a RES or RES2 packet
+ * @param packet
+ * @param fields
+ */
+void get_response_fields(struct btide_packet *packet, struct response_fields
+        *fields);
 
 /**
  * Send DSN to peer
@@ -92,6 +206,61 @@ int send_REQ(union btide_payload *req, int peer_fd);
  */
 int send_RES(uint16_t err, union btide_payload *res, int peer_fd);
 
+/**
+ * Send CAN to peer to cancel a REQ that is no longer needed
+ * @param req payload of the cancelled REQ
+ * @param peer_fd
+ * @return 1 if success, 0 otherwise
+ */
+int send_CAN(union btide_payload *req, int peer_fd);
+
+/**
+ * Send RFD to a peer on the same host, passing a read-only fd of the data
+ * file with SCM_RIGHTS
+ * @param res request payload with the offset and length of the chunk
+ * @param file_fd
+ * @param peer_fd AF_UNIX socket
+ * @return 1 if success, 0 otherwise
+ */
+int send_RFD(union btide_payload *res, int file_fd, int peer_fd);
+
+/**
+ * Send SHM to a peer on the same host, passing the fds of a shared memory
+ * channel with SCM_RIGHTS
+ * @param fds
+ * @param num_fds at most MAX_PASSED_FDS
+ * @param peer_fd AF_UNIX socket
+ * @return 1 if success, 0 otherwise
+ */
+int send_SHM(int *fds, int num_fds, int peer_fd);
+
+/**
+ * Receive a packet and the file descriptors passed with it, if any. Packets
+ * of a connection with a shared memory channel are read from its ring.
+ * @param peer_fd
+ * @param packet_buf
+ * @param passed_fds buffer with MAX_PASSED_FDS entries, set to the received
+ * fds followed by -1
+ * @return number of bytes received, 0 or less if disconnected
+ */
+ssize_t recv_packet(int peer_fd, struct btide_packet *packet_buf, int
+        *passed_fds);
+
+/**
+ * Copy the packets queued for a connection without consuming them
+ * @param peer_fd
+ * @param packets buffer with size of max_packets packets
+ * @param max_packets
+ * @return number of whole packets copied
+ */
+int peek_packets(int peer_fd, struct btide_packet *packets, int max_packets);
+
+/**
+ * Close the fds received with a packet
+ * @param passed_fds buffer with MAX_PASSED_FDS entries
+ */
+void close_passed_fds(int *passed_fds);
+
 /**
  * Send PNG
  * @param peer_fd
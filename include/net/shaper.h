@@ -0,0 +1,113 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "net/packet.h"
+
+// A bucket holds this much traffic at its rate, but at least one burst of
+// packets, so senders wake up rarely and send in large bursts
+#define SHAPER_BURST_US 50000
+#define MIN_BURST_BYTES (SHAPER_BATCH_PACKETS * PACKET_SIZE)
+// RES packets sent with a single writev
+#define SHAPER_BATCH_PACKETS 16
+#define SHAPER_FDS_INIT_SIZE 64
+
+// Limits are named as in the config file
+enum rate_limit {
+    LIMIT_UPLOAD,
+    LIMIT_DOWNLOAD,
+    LIMIT_PEER_UPLOAD,
+    LIMIT_PEER_DOWNLOAD
+};
+
+/**
+ * Token bucket that lets senders go into debt, a sender waits until the debt
+ * is paid back instead of polling for tokens
+ */
+struct token_bucket {
+    pthread_mutex_t lock;
+    uint64_t rate; // bytes per second, 0 for unlimited
+    uint64_t burst; // capacity in bytes
+    double tokens; // negative while in debt
+    uint64_t last_us; // time of the last refill
+};
+
+struct peer_shaping {
+    struct token_bucket upload;
+    struct token_bucket download;
+};
+
+// Global and per-peer limits, peers are indexed by the fd of the connection
+struct shaper {
+    pthread_mutex_t lock;
+    struct token_bucket upload;
+    struct token_bucket download;
+    uint64_t peer_upload_rate;
+    uint64_t peer_download_rate;
+    int max_fds;
+    struct peer_shaping **peers;
+};
+
+/**
+ * Create a shaper, a rate of 0 is unlimited
+ * @param upload_rate bytes per second sent to all peers
+ * @param download_rate bytes per second requested from all peers
+ * @param peer_upload_rate bytes per second sent to each peer
+ * @param peer_download_rate bytes per second requested from each peer
+ */
+struct shaper *create_shaper(uint64_t upload_rate, uint64_t download_rate,
+                             uint64_t peer_upload_rate, uint64_t
+                             peer_download_rate);
+
+/**
+ * Change a limit, per-peer limits also apply to the connected peers
+ * @param shaper
+ * @param limit
+ * @param rate bytes per second, 0 for unlimited
+ */
+void set_rate_limit(struct shaper *shaper, enum rate_limit limit, uint64_t
+        rate);
+
+/**
+ * Find a limit by its name in the config file
+ * @param name such as upload_rate
+ * @return the limit, -1 if the name is unknown
+ */
+int find_rate_limit(char *name);
+
+/**
+ * Start shaping a new connection with fresh per-peer buckets
+ * @param shaper
+ * @param peer_fd
+ */
+void reset_peer_shaping(struct shaper *shaper, int peer_fd);
+
+/**
+ * Take tokens for bytes sent to a peer and sleep until the global and peer
+ * buckets are out of debt
+ * @param shaper
+ * @param peer_fd
+ * @param bytes
+ */
+void shape_upload(struct shaper *shaper, int peer_fd, uint64_t bytes);
+
+/**
+ * Take tokens for bytes about to be requested from a peer, never waits
+ * @param shaper
+ * @param peer_fd
+ * @param bytes
+ * @return 1 if the bytes can be requested now, 0 if a bucket is in debt
+ */
+int shape_download(struct shaper *shaper, int peer_fd, uint64_t bytes);
+
+/**
+ * Print the current limits
+ * @param shaper
+ */
+void print_rate_limits(struct shaper *shaper);
+
+void free_shaper(struct shaper *shaper);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "net/packet.h"
+
+// Packets held by each direction, 1 MiB of shared memory per ring
+#define SHM_RING_SLOTS 256
+#define SHM_CACHE_LINE 64
+// A sender waiting for space wakes up this often to check for a closed
+// channel, the receiver may have exited without consuming
+#define SHM_SPACE_WAIT_MS 100
+// File descriptors passed in the SHM packet: the memfd, then the data and
+// space eventfds of both rings
+#define SHM_CHANNEL_FDS MAX_PASSED_FDS
+#define SHM_CHANNELS_INIT_SIZE 64
+
+/**
+ * Single-producer/single-consumer ring of packets in shared memory. Each side
+ * only writes its own index, and announces that it is about to block so the
+ * other side knows when an eventfd wakeup is needed.
+ */
+struct shm_ring {
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t head; // next slot to write
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t tail; // next slot to read
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t reader_idle;
+    _Atomic uint32_t writer_idle;
+    _Alignas(SHM_CACHE_LINE) struct btide_packet slots[SHM_RING_SLOTS];
+};
+
+// Both rings of a connection, mapped from a memfd shared with the peer
+struct shm_channel {
+    pthread_mutex_t send_lock; // all sending threads share the producer side
+    int refs;
+    int closed;
+    int memfd;
+    struct shm_ring *rings; // rings[0] is written by the dialing side
+    struct shm_ring *tx;
+    struct shm_ring *rx;
+    int tx_data_event; // signalled to the peer when tx becomes non-empty
+    int tx_space_event; // signalled by the peer when tx has space again
+    int rx_data_event;
+    int rx_space_event;
+};
+
+/**
+ * Create a channel with empty rings, as the dialing side
+ * @return the channel, NULL if shared memory is not available
+ */
+struct shm_channel *create_shm_channel();
+
+/**
+ * Map the channel created by the peer, as the accepting side
+ * @param fds SHM_CHANNEL_FDS fds received in the SHM packet, owned by the
+ * channel afterwards
+ * @return the channel, NULL if the fds are not a valid channel
+ */
+struct shm_channel *open_shm_channel(int *fds);
+
+/**
+ * Get the fds to pass to the peer
+ * @param channel
+ * @param fds buffer with SHM_CHANNEL_FDS entries
+ */
+void get_shm_channel_fds(struct shm_channel *channel, int *fds);
+
+/**
+ * Send and receive the packets of a connection through a channel from now
+ * on, the channel is freed once detached and no longer used
+ * @param peer_fd
+ * @param channel
+ */
+void attach_shm_channel(int peer_fd, struct shm_channel *channel);
+
+/**
+ * Stop using the channel of a connection and wake its blocked senders, must
+ * be called before the socket is closed
+ * @param peer_fd
+ */
+void detach_shm_channel(int peer_fd);
+
+/**
+ * Get the channel of a connection, which stays valid until released
+ * @param peer_fd
+ * @return the channel, NULL if the connection uses its socket only
+ */
+struct shm_channel *get_shm_channel(int peer_fd);
+
+void put_shm_channel(struct shm_channel *channel);
+
+/**
+ * Write packets into the ring, waiting while it is full
+ * @param channel
+ * @param packets
+ * @param num_packets
+ * @return 1 if success, 0 if the channel was closed
+ */
+int shm_send(struct shm_channel *channel, struct btide_packet *packets, int
+        num_packets);
+
+/**
+ * Wait for a packet in the ring or for the socket to become readable, the
+ * socket still carries packets with fds and the end of the connection
+ * @param channel
+ * @param peer_fd
+ * @param packet_buf
+ * @return 1 if a packet was read from the ring, 0 if the socket is readable
+ */
+int shm_recv(struct shm_channel *channel, int peer_fd, struct btide_packet
+        *packet_buf);
+
+/**
+ * Copy the packets queued in the ring without consuming them
+ * @param channel
+ * @param packets buffer with size of max_packets packets
+ * @param max_packets
+ * @return number of packets copied
+ */
+int shm_peek(struct shm_channel *channel, struct btide_packet *packets, int
+        max_packets);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Each level has 2^WHEEL_BITS slots and every slot of a level covers a
+// whole revolution of the level below it. With 10 ms ticks the levels cover
+// 0.64 s, 41 s, 44 min and 47 h.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_US 10000
+
+struct timer_wheel;
+
+typedef void (*timer_callback)(void *arg);
+
+/**
+ * Timer embedded in the object it supervises, the object must stay at the
+ * same address while the timer is pending
+ */
+struct timer {
+    uint64_t expires; // tick at which the timer fires
+    timer_callback callback;
+    void *arg;
+    struct timer *prev;
+    struct timer *next;
+    struct timer **list; // head of the list the timer is in, NULL if disarmed
+};
+
+struct timer_wheel {
+    pthread_mutex_t lock;
+    pthread_cond_t callback_done;
+    pthread_t thread;
+    int running;
+    uint64_t start_us;
+    uint64_t current_tick; // every tick before this one has been processed
+    struct timer *running_timer; // timer whose callback is being executed
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+struct timer_wheel *create_timer_wheel();
+
+/**
+ * Start the thread that advances the wheel and runs expired callbacks
+ * @param wheel
+ * @return 1 if success, 0 otherwise
+ */
+int start_timer_wheel(struct timer_wheel *wheel);
+
+/**
+ * Stop the wheel thread, pending timers never fire afterwards
+ * @param wheel
+ */
+void stop_timer_wheel(struct timer_wheel *wheel);
+
+void init_timer(struct timer *timer, timer_callback callback, void *arg);
+
+/**
+ * Arm a timer, or move it if it is already pending, in O(1)
+ * @param wheel
+ * @param timer
+ * @param delay_us time until the callback runs, rounded up to a tick
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t
+        delay_us);
+
+/**
+ * Disarm a timer in O(1), without waiting for a callback that is running
+ * @param wheel
+ * @param timer
+ * @return 1 if the timer was pending, 0 if it already fired or was not armed
+ */
+int timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Disarm a timer and wait until its callback is not running, after which
+ * the timer can be freed. Must not be called while holding a lock that the
+ * callback takes.
+ * @param wheel
+ * @param timer
+ * @return 1 if the timer was pending, 0 if it already fired or was not armed
+ */
+int timer_cancel_sync(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Run the callbacks of all timers that expired before a given time
+ * @param wheel
+ * @param now_us
+ */
+void advance_timer_wheel(struct timer_wheel *wheel, uint64_t now_us);
+
+void free_timer_wheel(struct timer_wheel *wheel);
+
+#endif
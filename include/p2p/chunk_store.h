@@ -0,0 +1,116 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <pthread.h>
+
+#include "p2p/package.h"
+
+#define CHUNK_STORE_BUCKETS 4096
+
+// A verified copy of a chunk in the data file of a managed package
+struct chunk_holder {
+    char ident[MIN_IDENT_MATCH + 1];
+    uint64_t offset;
+    struct chunk_holder *next;
+};
+
+// Chunk content present locally, keyed by its hash
+struct stored_chunk {
+    char hash[SHA256_HEX_STRLEN];
+    uint32_t size;
+    int refs; // number of holders, the chunk is dropped when it reaches 0
+    struct chunk_holder *holders;
+    struct stored_chunk *next;
+};
+
+/**
+ * Content-addressed index of the chunks held by all managed packages, so a
+ * chunk present in one package is served for and copied into any other
+ */
+struct chunk_store {
+    pthread_mutex_t lock;
+    int num_chunks;
+    struct stored_chunk *buckets[CHUNK_STORE_BUCKETS];
+};
+
+struct chunk_store *create_chunk_store();
+
+/**
+ * Hash the data file of a package and add its complete chunks
+ * @param store
+ * @param package
+ */
+void store_package_chunks(struct chunk_store *store, struct bpkg_obj
+        *package);
+
+/**
+ * Add the complete chunks of a package whose leaf hashes are already
+ * computed, see compute_chunk_hashes
+ * @param store
+ * @param package
+ */
+void store_computed_chunks(struct chunk_store *store, struct bpkg_obj
+        *package);
+
+/**
+ * Add a verified chunk of a package
+ * @param store
+ * @param package
+ * @param hash
+ * @param offset offset of the chunk in the data file
+ * @param size ignored unless it is the whole chunk
+ */
+void store_chunk(struct chunk_store *store, struct bpkg_obj *package, char
+        *hash, uint64_t offset, uint32_t size);
+
+/**
+ * Drop all chunks held by a package
+ * @param store
+ * @param pkg_ident
+ */
+void release_package_chunks(struct chunk_store *store, char *pkg_ident);
+
+/**
+ * Find a package that holds a chunk
+ * @param store
+ * @param hash
+ * @param size
+ * @param ident_buf buffer to store the ident prefix of the holder, with size
+ * >= MIN_IDENT_MATCH + 1
+ * @param offset set to the offset of the chunk in the holder
+ * @return 1 if found, 0 otherwise
+ */
+int find_stored_chunk(struct chunk_store *store, char *hash, uint32_t size,
+                      char *ident_buf, uint64_t *offset);
+
+/**
+ * Copy a chunk from another data file into the data file of a package. The
+ * source is verified before the copy and the copy after it.
+ * @param src_fd
+ * @param src_offset offset of the chunk in src_fd
+ * @param package
+ * @param file_offset offset of the chunk in the package
+ * @param data_size
+ * @param hash expected chunk hash
+ * @return 1 if the copied chunk matches the hash, 0 otherwise
+ */
+int copy_chunk(int src_fd, uint64_t src_offset, struct bpkg_obj *package,
+               uint64_t file_offset, uint32_t data_size, char *hash);
+
+/**
+ * Complete a chunk of a package by copying it from another package that
+ * holds it locally
+ * @param store
+ * @param list
+ * @param package
+ * @param target_chunk
+ * @param hash
+ * @return 1 if copied, 0 if the chunk has to be downloaded
+ */
+int fill_from_store(struct chunk_store *store, struct package_list *list,
+                    struct bpkg_obj *package, chunk *target_chunk, char
+                    *hash);
+
+void free_chunk_store(struct chunk_store *store);
+
+#endif
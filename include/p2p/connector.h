@@ -0,0 +1,100 @@
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "net/packet.h"
+#include "net/shm_ring.h"
+#include "net/timer_wheel.h"
+#include "p2p/peer.h"
+
+// Connection and handshake attempts per peer before giving up
+#define CONNECT_ATTEMPTS 3
+// Wait before the second attempt, doubled for every further attempt
+#define CONNECT_BACKOFF_US 250000
+#define CONNECTOR_MAX_EVENTS 64
+#define ATTEMPTS_INIT_SIZE 16
+
+struct p2p_node;
+
+enum connect_state {
+    CONNECT_WAITING, // waiting for the next attempt
+    CONNECT_CONNECTING, // waiting for the non-blocking connect to complete
+    CONNECT_HANDSHAKE // waiting for the ACP of the peer
+};
+
+// Outbound connection to a peer that is being established
+struct connect_attempt {
+    char ip[MAX_IP_SIZE];
+    u_int16_t port;
+    char path[MAX_SOCKET_PATH_SIZE]; // socket path of a local peer
+    int shared; // move the packets to shared memory after the handshake
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd; // -1 while waiting for the next attempt
+    enum connect_state state;
+    int attempts; // failed attempts so far
+    int expired; // the timer fired, start the next attempt or time out
+    int timer_armed; // the timer is armed and its callback has not run
+    size_t bytes_recv; // bytes of the ACP packet received so far
+    struct btide_packet packet_buf;
+    int index; // position in the attempts array, -1 once removed
+    struct connector *connector;
+    struct timer timer;
+};
+
+// Establishes outbound connections for all peers from a single epoll thread
+struct connector {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int running;
+    int epoll_fd;
+    int event_fd; // wakes the thread for new attempts and expired timers
+    int max_peers;
+    struct p2p_node *node;
+    int num_attempts;
+    int max_attempts;
+    struct connect_attempt **attempts;
+};
+
+struct connector *create_connector(struct p2p_node *node, int max_peers);
+
+/**
+ * Start the connector thread
+ * @param connector
+ * @return 1 if success, 0 otherwise
+ */
+int start_connector(struct connector *connector);
+
+/**
+ * Start connecting to a peer without waiting for the connection, the
+ * connector prints the result once the handshake completes or fails
+ * @param connector
+ * @param ip
+ * @param port
+ * @return 1 if the attempt started, 0 if the address is invalid or a
+ * connection to the peer is already being established
+ */
+int connect_peer(struct connector *connector, char *ip, u_int16_t port);
+
+/**
+ * Start connecting to a peer on the same host through its AF_UNIX socket
+ * @param connector
+ * @param path
+ * @param shared 1 to exchange packets over shared memory rings instead of
+ * the socket
+ * @return 1 if the attempt started, 0 if the path is too long or a
+ * connection to the peer is already being established
+ */
+int connect_local_peer(struct connector *connector, char *path, int
+        shared);
+
+/**
+ * Stop the connector thread and free it, the timer wheel must be stopped
+ * before
+ * @param connector
+ */
+void free_connector(struct connector *connector);
+
+#endif
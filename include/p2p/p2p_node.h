@@ -8,29 +8,63 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
+#include "net/timer_wheel.h"
+#include "net/shaper.h"
+#include "net/shm_ring.h"
 #include "p2p/peer.h"
 #include "p2p/package.h"
+#include "p2p/chunk_store.h"
+#include "p2p/scheduler.h"
+#include "p2p/write_back.h"
 
-#define MIN_IDENT_MATCH 20
+// Number of queued packets inspected for a CAN while sending a chunk
+#define CANCEL_PEEK_PACKETS 8
+// A peer that sent nothing for KEEPALIVE_IDLE_US is sent a PNG, and dropped
+// if it still sent nothing KEEPALIVE_TIMEOUT_US later
+#define KEEPALIVE_IDLE_US 15000000
+#define KEEPALIVE_TIMEOUT_US 10000000
 
-struct client_handler_args {
-    struct peer new_peer;
+// State shared by the command line interface and all network threads
+struct p2p_node {
     struct peer_list *peer_list;
     struct package_list *package_list;
+    struct scheduler *scheduler;
+    struct timer_wheel *timers;
+    struct shaper *shaper;
+    struct chunk_store *chunk_store; // NULL if deduplication is disabled
+    struct write_back *write_back;
+};
+
+// Supervises the connection of a peer, owned by its reader thread
+struct keepalive {
+    struct timer timer;
+    struct p2p_node *node;
+    struct peer *peer;
+    uint64_t last_recv_us; // time of the last packet from the peer
+    int pinged;
+};
+
+// Chunk being reassembled from the RES packets of a peer
+struct chunk_assembly {
+    char ident[MAX_IDENT_SIZE];
+    char chunk_hash[SHA256_HEX_STRLEN];
+    uint64_t file_offset; // file offset of the first byte in data
+    uint32_t chunk_len; // expected number of bytes
+    uint32_t bytes_recv;
+    char *data; // NULL when no chunk is being received
+    int discard; // duplicate of a chunk that is already complete
+};
+
+struct client_handler_args {
+    struct peer new_peer;
+    struct p2p_node *node;
 };
 
 struct server_args {
     int max_peers;
     u_int16_t port;
-    struct peer_list *peer_list;
-    struct package_list *package_list;
-};
-
-struct client_args {
-    char ip[MAX_IP_SIZE];
-    uint16_t port;
-    struct peer_list *peer_list;
-    struct package_list *package_list;
+    char unix_path[MAX_SOCKET_PATH_SIZE]; // listen on AF_UNIX if not empty
+    struct p2p_node *node;
 };
 
 /**
@@ -40,15 +74,15 @@ struct client_args {
  */
 void *start_server(void *args);
 
-struct client_args *create_client_args(char *ip, uint16_t port, struct
-        peer_list *peer_list, struct package_list *package_list);
+struct client_handler_args *create_client_handler_args(int peer_fd, char
+        *peer_ip, uint16_t peer_port, struct p2p_node *node);
 
 /**
- * Start a client thread to connect to a new peer and handle any packets
- * received from the peer
- * @param arg struct client_args type
+ * Start a thread to handle the packets received from a peer that completed
+ * the handshake
+ * @param args struct client_handler_args type
  * @return
  */
-void *start_client(void *arg);
+void *start_peer_reader(void *args);
 
 #endif
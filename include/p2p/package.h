@@ -1,14 +1,47 @@
 #ifndef PACKAGE_H
 #define PACKAGE_H
 
+#include <stdatomic.h>
+#include <pthread.h>
+
 #include "chk/pkgchk.h"
 
-#define PACKAGES_INIT_SIZE 8
+// Packages are identified by the first characters of their ident
+#define MIN_IDENT_MATCH 20
+// Entries are allocated in slabs that never move, so lookups can read an
+// entry while it is being removed
+#define PACKAGE_SLAB_SIZE 64
+#define PACKAGE_MAX_SLABS 1024
+#define PACKAGE_HASH_BUCKETS 1024
+
+/**
+ * Handle of a managed package. A handle returned by get_package keeps the
+ * package alive until put_package, even if it is removed meanwhile.
+ */
+struct package_entry {
+    struct bpkg_obj *package; // NULL while the entry is free
+    _Atomic uint32_t ident_hash; // hash of the first MIN_IDENT_MATCH chars
+    _Atomic int refs; // the registry holds one while the package is managed
+    _Atomic int next; // next entry in the hash chain, -1 if none
+    int listed; // still managed, guarded by the lock
+    pthread_mutex_t tree_lock; // guards building and freeing the tree
+    _Atomic uint64_t last_used_us; // when a handle last used the tree
+};
 
+/**
+ * Registry of managed packages. Lookups take no lock: they walk the hash
+ * chains and retry if a writer changed them meanwhile (seqlock). Adding and
+ * removing packages are serialised by the lock.
+ */
 struct package_list {
-    int max_size;
+    pthread_mutex_t lock;
+    _Atomic uint32_t seq; // odd while a hash chain is being changed
     int num_packages;
-    struct bpkg_obj **packages;
+    _Atomic int num_entries; // entries allocated so far
+    struct package_entry *slabs[PACKAGE_MAX_SLABS];
+    _Atomic int buckets[PACKAGE_HASH_BUCKETS]; // first entry, -1 if none
+    // Trees unused for this long are freed until next used, 0 to keep them
+    uint64_t idle_timeout_us;
 };
 
 struct package_list *create_package_list();
@@ -16,18 +49,64 @@ struct package_list *create_package_list();
 void add_package(struct package_list *list, struct bpkg_obj *new_package);
 
 /**
- * Find the package with pkg_ident in the package list
+ * Find the package whose ident starts with the first MIN_IDENT_MATCH
+ * characters of pkg_ident, without taking any lock
+ * @param list
+ * @param pkg_ident
+ * @return handle of the package to release with put_package, NULL when failed
+ */
+struct package_entry *get_package(struct package_list *list, char *pkg_ident);
+
+/**
+ * Find a package like get_package, without building its tree, for commands
+ * that only need its header
+ * @param list
+ * @param pkg_ident
+ * @return handle of the package to release with put_package, NULL when failed
+ */
+struct package_entry *get_package_header(struct package_list *list, char
+        *pkg_ident);
+
+/**
+ * Take another handle of a package from a handle already held
+ * @param entry
+ */
+void hold_package(struct package_entry *entry);
+
+/**
+ * Release a handle, the package is destroyed once it is removed and its last
+ * handle is released
+ * @param list
+ * @param entry
+ */
+void put_package(struct package_list *list, struct package_entry *entry);
+
+/**
+ * Stop managing a package without printing, handles in use keep it alive
+ * until released
  * @param list
  * @param pkg_ident
- * @param match first n character to match
- * @return the index in the package list, -1 when failed
+ * @return 1 if success, 0 if the package is not managed
  */
-int find_package(struct package_list *list, char *pkg_ident, int match);
+int unlist_package(struct package_list *list, char *pkg_ident);
 
+/**
+ * Stop managing a package, handles in use keep it alive until released
+ * @param list
+ * @param pkg_ident
+ */
 void remove_package(struct package_list *list, char *pkg_ident);
 
 void print_package_list(struct package_list *list);
 
+/**
+ * Free the trees of the managed packages that had no handle for
+ * idle_timeout_us, they are built again when next used
+ * @param list
+ * @return number of trees freed
+ */
+int reclaim_idle_trees(struct package_list *list);
+
 void free_package_list(struct package_list *list);
 
-#endif
\ No newline at end of file
+#endif
@@ -6,27 +6,106 @@
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "net/packet.h"
+#include "net/shm_ring.h"
 
 #define MAX_IP_SIZE 16
-#define PEERS_INIT_SIZE 8
+// Address of peers connected over AF_UNIX, their port is the socket fd
+#define LOCAL_PEER_IP "unix"
+// Slots of the peer table, as many as the most peers a config allows. Slots
+// are allocated in slabs that never move, so a slot index stays valid.
+#define PEER_TABLE_SIZE 2048
+#define PEER_SLAB_SIZE 64
+#define PEER_HASH_BUCKETS 4096
+
+// Weight of a new sample in the smoothed measurements (RFC 6298 style)
+#define RTT_ALPHA 0.125
+#define RTT_BETA 0.25
+#define RATE_ALPHA 0.25
+// Assumed round trip time and throughput of a peer that is not measured yet
+#define DEFAULT_RTT_US 100000
+#define DEFAULT_RATE 65536.0
+// Mean deviations above the mean chunk latency taken as its 95th percentile
+#define LATENCY_DEVIATIONS 2
+
+struct peer_stats {
+    uint64_t srtt_us; // smoothed PNG/POG round trip time, 0 if not measured
+    uint64_t rttvar_us; // round trip time variation
+    uint64_t png_sent_us; // time of the outstanding PNG, 0 if none
+    uint64_t last_recv_us; // time the last chunk from the peer completed
+    uint64_t bytes_recv; // chunk bytes delivered by the peer
+    uint64_t bytes_sent; // chunk bytes served to the peer
+    double recv_rate; // smoothed bytes per second delivered by the peer
+    double send_rate; // smoothed bytes per second served to the peer
+    uint64_t latency_us; // smoothed time to deliver a chunk
+    uint64_t latvar_us; // chunk latency variation
+    uint32_t chunks_recv;
+    uint32_t failures; // error RES, corrupted chunks and broken transfers
+};
 
 struct peer {
     int peer_fd; // -1 indicates non-existence
     char peer_ip[MAX_IP_SIZE];
     u_int16_t peer_port;
+    int local; // connected over AF_UNIX, chunks are passed as fds
+    int shared; // packets are exchanged over shared memory rings
+    uint32_t version; // protocol version agreed in the handshake
+    char path[MAX_SOCKET_PATH_SIZE]; // socket path of a dialed local peer
+    struct peer_stats stats;
+};
+
+// Entry of the peer table
+struct peer_slot {
+    struct peer peer; // peer_fd is -1 while the slot is free
+    pthread_mutex_t stats_lock; // serialises updates of the peer stats
+    int hash_next; // next slot in the hash chain or free list, -1 if none
+    int live_index; // position in the live array
 };
 
+/**
+ * Table of connected peers shared by all threads. Lookups hash (ip, port)
+ * and take the read lock, adding and removing peers take the write lock.
+ * Code that uses the fd or slot of a peer holds the read lock, so the peer
+ * cannot be removed meanwhile.
+ */
 struct peer_list {
-    int max_size;
+    pthread_rwlock_t lock;
+    int max_size; // number of slots, indices are below it
     int num_peers;
-    struct peer *peers;
+    int num_slots; // slots allocated so far
+    struct peer_slot *slabs[PEER_TABLE_SIZE / PEER_SLAB_SIZE];
+    int buckets[PEER_HASH_BUCKETS]; // first slot of each chain, -1 if none
+    int free_slots; // first free slot, -1 if none
+    int *live; // slots of the connected peers
 };
 
 struct peer_list *create_peer_list();
 
-void add_peer(struct peer_list *list, struct peer new_peer);
+/**
+ * Take the read lock of the peer list, may be nested
+ * @param list
+ */
+void read_lock_peers(struct peer_list *list);
+
+void unlock_peers(struct peer_list *list);
+
+/**
+ * Get the peer in a slot, the read lock must be held while using it
+ * @param list
+ * @param index slot returned by find_peer
+ * @return the peer
+ */
+struct peer *get_peer(struct peer_list *list, int index);
+
+/**
+ * Add a peer to a free slot
+ * @param list
+ * @param new_peer
+ * @return 1 if success, 0 if the table is full
+ */
+int add_peer(struct peer_list *list, struct peer new_peer);
 
 /**
  * Find the index of the peer in the peer list
@@ -37,13 +116,104 @@ void add_peer(struct peer_list *list, struct peer new_peer);
 int find_peer(struct peer_list *list, char *ip, u_int16_t port);
 
 /**
- * Close the peer socket and remove the peer from peer list
+ * Find a peer connected over AF_UNIX by its socket path
+ * @param list
+ * @param path
+ * @return index of the peer, -1 otherwise
+ */
+int find_local_peer(struct peer_list *list, char *path);
+
+/**
+ * Remove the peer from peer list and shut down its socket, which ends its
+ * reader thread. The reader thread closes the socket.
  * @param list
  * @param ip
  * @param port
  */
 void remove_peer(struct peer_list *list, char *ip, u_int16_t port);
 
+/**
+ * Remove the peer only if it is still connected through a socket
+ * @param list
+ * @param ip
+ * @param port
+ * @param peer_fd
+ */
+void remove_peer_fd(struct peer_list *list, char *ip, u_int16_t port, int
+        peer_fd);
+
+/**
+ * Send PNG to all peers and record the time for RTT measurement
+ * @param list
+ */
+void ping_all_peers(struct peer_list *list);
+
+/**
+ * Send PNG to a peer and record the time for RTT measurement
+ * @param list
+ * @param ip
+ * @param port
+ */
+void ping_peer(struct peer_list *list, char *ip, u_int16_t port);
+
+/**
+ * Record the round trip time of a PNG when the POG arrives
+ * @param list
+ * @param ip
+ * @param port
+ */
+void peer_record_rtt(struct peer_list *list, char *ip, u_int16_t port);
+
+/**
+ * Record a chunk delivered by a peer
+ * @param list
+ * @param ip
+ * @param port
+ * @param bytes chunk size
+ * @param sent_us time the REQ was sent, 0 if unknown
+ */
+void peer_record_recv(struct peer_list *list, char *ip, u_int16_t port,
+                      uint32_t bytes, uint64_t sent_us);
+
+/**
+ * Record a chunk served to a peer
+ * @param list
+ * @param ip
+ * @param port
+ * @param bytes bytes sent in RES packets
+ * @param elapsed_us time spent sending the RES packets
+ */
+void peer_record_sent(struct peer_list *list, char *ip, u_int16_t port,
+                      uint32_t bytes, uint64_t elapsed_us);
+
+void peer_record_failure(struct peer_list *list, char *ip, u_int16_t port);
+
+/**
+ * Estimate the time for a peer to deliver a chunk, penalised by failures
+ * @param peer
+ * @param chunk_size
+ * @return expected time in microseconds, lower is better
+ */
+double peer_score(struct peer *peer, uint32_t chunk_size);
+
+/**
+ * Estimate the time within which a peer delivers 95% of its chunks
+ * @param peer
+ * @param chunk_size
+ * @return time in microseconds
+ */
+uint64_t peer_deadline_us(struct peer *peer, uint32_t chunk_size);
+
+/**
+ * Get the indices of connected peers ordered from the best score, the read
+ * lock must be held while using them
+ * @param list
+ * @param chunk_size
+ * @param indices buffer with size >= list->max_size
+ * @return number of indices stored
+ */
+int rank_peers(struct peer_list *list, uint32_t chunk_size, int *indices);
+
 void print_peer_list(struct peer_list *list);
 
 void free_peer_list(struct peer_list *list);
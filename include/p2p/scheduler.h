@@ -0,0 +1,209 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+
+#include "net/timer_wheel.h"
+#include "net/shaper.h"
+#include "p2p/peer.h"
+#include "p2p/package.h"
+#include "p2p/chunk_store.h"
+
+#define SCHEDULER_TICK_US 20000
+// How often the trees of idle packages are looked for
+#define TREE_RECLAIM_INTERVAL_US 1000000
+#define MAX_REQUESTS_PER_PEER 4
+#define REQUESTS_INIT_SIZE 16
+#define DOWNLOADS_INIT_SIZE 4
+#define OUTBOX_INIT_SIZE 16
+// Wait before retrying a chunk, multiplied by the number of failures
+#define RETRY_BACKOFF_US 100000
+#define MAX_RETRY_BACKOFF_US 2000000
+// A request is hedged to a second peer once it is outstanding longer than
+// the deadline of its peer, but never sooner than this
+#define MIN_HEDGE_DELAY_US 100000
+// A request that has not started arriving in this time is given up
+#define REQUEST_TIMEOUT_US 10000000
+// Endgame starts when this percentage of chunks (or fewer chunks than the
+// minimum) remains, every remaining chunk is then requested from all peers
+#define ENDGAME_PERCENT 5
+#define ENDGAME_MIN_CHUNKS 4
+#define ENDGAME_REQUESTS_PER_PEER 16
+// Chunks of a streamed download within this many leaves of the read cursor
+// are requested first, later chunks only from peers with spare capacity
+#define STREAM_WINDOW_CHUNKS 16
+#define STREAM_BACKGROUND_REQUESTS 2
+
+enum chunk_status {
+    CHUNK_MISSING,
+    CHUNK_REQUESTED,
+    CHUNK_COMPLETE
+};
+
+// Download state of a single leaf of a package
+struct chunk_task {
+    enum chunk_status status;
+    int num_requests; // outstanding requests for the chunk
+    uint32_t failures;
+    uint64_t retry_us; // do not request the chunk before this time
+    char failed_ip[MAX_IP_SIZE]; // last peer that failed to deliver the chunk
+    u_int16_t failed_port;
+};
+
+struct download {
+    char ident[MAX_IDENT_SIZE];
+    struct bpkg_obj *package;
+    struct package_entry *entry; // handle that keeps the tree built
+    size_t num_chunks;
+    size_t num_completed;
+    struct chunk_task *tasks; // indexed by leaf number
+    int streaming; // a stream reads the chunks in order
+    size_t cursor; // next leaf read by the stream, all leaves before are done
+};
+
+struct scheduler;
+struct stream;
+
+// REQ or CAN recorded under the scheduler lock and sent after releasing it,
+// so a peer with a full socket buffer does not block the scheduler. The peer
+// is found again when sending, as its fd may be reused once it is removed.
+struct outgoing_packet {
+    uint16_t msg_code;
+    char peer_ip[MAX_IP_SIZE];
+    u_int16_t peer_port;
+    union btide_payload payload;
+};
+
+// A REQ sent to a peer that is waiting for its RES, its timer hedges and
+// then expires the request
+struct request {
+    char ident[MAX_IDENT_SIZE];
+    char chunk_hash[SHA256_HEX_STRLEN];
+    uint64_t file_offset;
+    char peer_ip[MAX_IP_SIZE];
+    u_int16_t peer_port;
+    uint64_t sent_us;
+    struct download *download; // NULL for REQ sent by FETCH
+    size_t leaf;
+    int hedged; // the chunk is also requested from another peer
+    int index; // position in the requests array, -1 once removed
+    struct scheduler *scheduler;
+    struct timer timer;
+};
+
+struct scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t progress; // broadcast when chunks or downloads finish
+    pthread_t thread;
+    int running;
+    struct peer_list *peer_list;
+    struct package_list *package_list;
+    struct timer_wheel *timers;
+    struct shaper *shaper;
+    struct chunk_store *chunk_store; // NULL if deduplication is disabled
+    int num_downloads;
+    int max_downloads;
+    struct download **downloads;
+    int num_requests;
+    int max_requests;
+    struct request **requests;
+    int num_outgoing;
+    int max_outgoing;
+    struct outgoing_packet *outbox;
+    struct stream *streams;
+    uint64_t last_reclaim_us; // only used by the scheduler thread
+};
+
+struct scheduler *create_scheduler(struct peer_list *peer_list, struct
+        package_list *package_list, struct timer_wheel *timers, struct shaper
+        *shaper, struct chunk_store *chunk_store);
+
+/**
+ * Start the scheduler thread that keeps requesting missing chunks of the
+ * downloads from the peers with the best scores
+ * @param scheduler
+ * @return 1 if success, 0 otherwise
+ */
+int start_scheduler(struct scheduler *scheduler);
+
+/**
+ * Download all incomplete chunks of a managed package, chunks held by other
+ * packages are copied locally instead
+ * @param scheduler
+ * @param entry handle of the package, the download takes its own handle
+ * @return number of chunks to download, -1 if already downloading
+ */
+int add_download(struct scheduler *scheduler, struct package_entry *entry);
+
+/**
+ * Find the download of a package, the scheduler lock must be held
+ * @param scheduler
+ * @param package
+ * @return the download, NULL if the package is not downloading
+ */
+struct download *find_download(struct scheduler *scheduler, struct bpkg_obj
+        *package);
+
+/**
+ * Stop downloading a package, used when the package is removed
+ * @param scheduler
+ * @param package
+ */
+void remove_download(struct scheduler *scheduler, struct bpkg_obj *package);
+
+/**
+ * Keep track of a REQ sent outside of the scheduler (FETCH)
+ * @param scheduler
+ * @param req REQ payload
+ * @param ip
+ * @param port
+ */
+void track_request(struct scheduler *scheduler, union btide_payload *req,
+                   char *ip, u_int16_t port);
+
+/**
+ * Complete the request of a verified chunk and update the peer measurements
+ * @param scheduler
+ * @param ip peer that delivered the chunk
+ * @param port
+ * @param package package of the chunk
+ * @param ident ident in the RES
+ * @param hash
+ * @param file_offset offset of the chunk in the file
+ * @param bytes
+ */
+void scheduler_on_chunk(struct scheduler *scheduler, char *ip, u_int16_t
+        port, struct bpkg_obj *package, char *ident, char *hash, uint64_t
+        file_offset, uint32_t bytes);
+
+/**
+ * Check if a chunk is still needed, used to discard duplicate RES of hedged
+ * and endgame requests
+ * @param scheduler
+ * @param package
+ * @param hash
+ * @param file_offset offset of the chunk in the file
+ * @return 0 if a download of the package already completed the chunk, 1
+ * otherwise
+ */
+int scheduler_wants_chunk(struct scheduler *scheduler, struct bpkg_obj
+        *package, char *hash, uint64_t file_offset);
+
+/**
+ * Fail the request of a chunk so it is requested from another peer
+ * @param scheduler
+ * @param ip peer that failed to deliver the chunk
+ * @param port
+ * @param ident empty if unknown
+ * @param hash empty if unknown
+ */
+void scheduler_on_failure(struct scheduler *scheduler, char *ip, u_int16_t
+        port, char *ident, char *hash);
+
+/**
+ * Free the scheduler, the timer wheel must be stopped before
+ * @param scheduler
+ */
+void free_scheduler(struct scheduler *scheduler);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef STARTUP_SCAN_H
+#define STARTUP_SCAN_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "config/config.h"
+#include "p2p/p2p_node.h"
+
+#define BPKG_SUFFIX ".bpkg"
+#define MAX_SCAN_THREADS 64
+// Progress is printed this many times during a scan
+#define SCAN_PROGRESS_STEPS 10
+
+/**
+ * Startup phase that registers every package in the data directory. The
+ * packages are loaded and verified on a pool of threads, and each one is
+ * served as soon as it is verified while the rest are scanned.
+ */
+struct startup_scan {
+    pthread_t threads[MAX_SCAN_THREADS];
+    int num_threads;
+    int direct_io;
+    int resume_state;
+    char directory[MAX_DIRECTORY_SIZE];
+    struct dirent **names; // .bpkg files of the directory
+    int num_names;
+    _Atomic int next; // next file to take
+    _Atomic int num_done;
+    _Atomic int num_complete; // data file complete
+    _Atomic int num_failed;
+    _Atomic int stopping;
+    struct p2p_node *node;
+};
+
+/**
+ * List the packages of the data directory of a config
+ * @param node
+ * @param config directory and options of the packages
+ * @return heap address of the scan, NULL if the directory cannot be read
+ */
+struct startup_scan *create_startup_scan(struct p2p_node *node, struct
+        config *config);
+
+/**
+ * Start loading the listed packages, on one thread per CPU of the
+ * verification threads
+ * @param scan
+ * @return 1 if success, 0 otherwise
+ */
+int start_startup_scan(struct startup_scan *scan);
+
+/**
+ * Stop taking packages, wait for the threads and free the scan
+ * @param scan
+ */
+void free_startup_scan(struct startup_scan *scan);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+
+#include "p2p/scheduler.h"
+
+#define MAX_STREAM_PATH_SIZE 256
+// Output path that streams to the standard output
+#define STREAM_STDOUT "-"
+// Interval to check whether a stream was stopped while its output is full
+// or has no reader yet
+#define STREAM_POLL_MS 100
+
+/**
+ * Consumer that writes the chunks of a package to an output in order, each
+ * chunk once it is verified, while the rest of the package downloads
+ */
+struct stream {
+    pthread_t thread;
+    struct scheduler *scheduler;
+    struct package_entry *entry; // handle released when the stream ends
+    char path[MAX_STREAM_PATH_SIZE];
+    int stopped; // guarded by the scheduler lock
+    int done; // the thread finished, guarded by the scheduler lock
+    struct stream *next;
+};
+
+/**
+ * Start streaming a managed package, its download has to be added before so
+ * the scheduler requests the chunks ahead of the read cursor first
+ * @param scheduler
+ * @param entry handle of the package, released when the stream ends
+ * @param path output file or FIFO, STREAM_STDOUT for the standard output
+ * @return 1 if success, 0 if the package is already streaming or the thread
+ * failed to start, the handle is released
+ */
+int start_stream(struct scheduler *scheduler, struct package_entry *entry,
+                 char *path);
+
+/**
+ * Stop all streams and wait for their threads, before the scheduler is freed
+ * @param scheduler
+ */
+void stop_streams(struct scheduler *scheduler);
+
+/**
+ * Stop the streams of a package and wait for their threads, before its data
+ * file is replaced
+ * @param scheduler
+ * @param package
+ */
+void stop_package_streams(struct scheduler *scheduler, struct bpkg_obj
+        *package);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef WRITE_BACK_H
+#define WRITE_BACK_H
+
+#include <pthread.h>
+
+#include "config/config.h"
+#include "chk/direct_io.h"
+#include "p2p/scheduler.h"
+
+// Interval of the periodic durability policy
+#define WRITE_BACK_SYNC_INTERVAL_US 1000000
+
+// A verified chunk waiting to be written
+struct pending_chunk {
+    struct package_entry *entry; // handle released once the chunk is written
+    char peer_ip[MAX_IP_SIZE]; // peer that delivered the chunk
+    u_int16_t peer_port;
+    char ident[MAX_IDENT_SIZE];
+    char hash[SHA256_HEX_STRLEN];
+    uint64_t file_offset;
+    uint32_t size;
+    char *data;
+    struct pending_chunk *next;
+};
+
+// Data file written since the last periodic sync
+struct dirty_file {
+    char path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    // handle of the package whose resume file is saved once the data file
+    // is synced, NULL if none
+    struct package_entry *entry;
+    struct dirty_file *next;
+};
+
+/**
+ * Write-back stage of received chunks. A single thread takes all queued
+ * chunks at once, writes adjacent chunks of a package with one pwritev, and
+ * applies the durability policy before the chunks are marked complete in
+ * the scheduler.
+ */
+struct write_back {
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // signalled when chunks are queued or it stops
+    pthread_cond_t drained; // broadcast when a batch is written
+    pthread_t thread;
+    int running;
+    int writing; // a batch taken from the queue is being written
+    enum durability durability;
+    struct scheduler *scheduler;
+    struct package_list *package_list;
+    struct pending_chunk *pending; // queued chunks, newest first
+    struct dirty_file *dirty;
+    uint64_t synced_us; // time of the last periodic sync
+};
+
+struct write_back *create_write_back(struct scheduler *scheduler, struct
+        package_list *package_list, enum durability durability);
+
+/**
+ * Start the thread that writes the queued chunks
+ * @param writer
+ * @return 1 if success, 0 otherwise
+ */
+int start_write_back(struct write_back *writer);
+
+/**
+ * Queue a verified chunk, which is marked complete once written. The chunk
+ * is written before returning if the thread is not running.
+ * @param writer
+ * @param entry handle of the package, taken over
+ * @param ip peer that delivered the chunk
+ * @param port
+ * @param ident ident in the RES
+ * @param hash
+ * @param file_offset offset of the chunk in the file
+ * @param data chunk data, taken over
+ * @param size
+ */
+void queue_chunk(struct write_back *writer, struct package_entry *entry, char
+        *ip, u_int16_t port, char *ident, char *hash, uint64_t file_offset,
+                 char *data, uint32_t size);
+
+/**
+ * Apply the durability policy to a chunk written to a data file outside of
+ * the write-back stage
+ * @param writer
+ * @param package
+ * @return 1 if the chunk can be marked complete, 0 if it failed to sync
+ */
+int commit_written_chunk(struct write_back *writer, struct bpkg_obj *package);
+
+/**
+ * Flush the written data of a file to the disk
+ * @param full_path
+ * @return 1 if success, 0 otherwise
+ */
+int sync_data_file(char *full_path);
+
+/**
+ * Save the resume file of a package once the chunks recorded in it are on
+ * the disk: at once if the data file is synced, after an explicit sync
+ * without durability, or at the next periodic sync
+ * @param writer
+ * @param entry handle of the package, the writer takes its own handle
+ */
+void commit_resume_state(struct write_back *writer, struct package_entry
+        *entry);
+
+/**
+ * Wait until all queued chunks are written, used before a data file is
+ * replaced
+ * @param writer
+ */
+void flush_write_back(struct write_back *writer);
+
+/**
+ * Write the queued chunks, sync the dirty data files and free the stage
+ * @param writer
+ */
+void free_write_back(struct write_back *writer);
+
+#endif
@@ -2,6 +2,7 @@
 #define MERKLE_TREE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -14,12 +15,12 @@
 #define SHA256_HEX_STRLEN (SHA256_HEX_LEN + 1)
 
 typedef struct chunk {
-    uint32_t offset;
+    uint64_t offset;
     uint32_t size;
 } chunk;
 
 typedef struct merkle_tree_node {
-    int key;
+    size_t key; // index of the node in level order
     chunk *value; // NULL for non-leaf nodes
     struct merkle_tree_node *left;
     struct merkle_tree_node *right;
@@ -27,22 +28,66 @@ typedef struct merkle_tree_node {
     char computed_hash[SHA256_HEX_STRLEN];
 } merkle_tree_node;
 
+// How the leaf of a file offset is found, see index_chunk_offsets
+enum chunk_layout {
+    CHUNKS_UNINDEXED, // chunks overlap, the leaves are scanned one by one
+    CHUNKS_UNIFORM, // offsets follow from a chunk size
+    CHUNKS_SORTED, // leaves in offset order, binary searched
+    CHUNKS_INDEXED, // leaves binary searched through leaves_by_offset
+};
+
 typedef struct merkle_tree {
     size_t num_nodes;
     size_t num_inner_nodes;
     size_t num_leaves;
     size_t max_depth;
     merkle_tree_node **nodes;
+    // Nodes and chunks allocated in one block each, NULL if every node was
+    // allocated on its own
+    merkle_tree_node *node_block;
+    chunk *chunk_block;
+    enum chunk_layout layout;
+    // For CHUNKS_UNIFORM, the first num_larger chunks are one byte larger
+    // than uniform_size, and the last chunk may be smaller
+    uint64_t uniform_size;
+    size_t num_larger;
+    size_t *leaves_by_offset; // keys of the leaves, for CHUNKS_INDEXED
 } merkle_tree;
 
-chunk *create_chunk(uint32_t offset, uint32_t size);
+chunk *create_chunk(uint64_t offset, uint32_t size);
 
-merkle_tree_node *create_node(int key, chunk *value, char
+merkle_tree_node *create_node(size_t key, chunk *value, char
         *expected_hash);
 
-merkle_tree *create_tree(merkle_tree_node **nodes, uint32_t nhashes, uint32_t
+merkle_tree *create_tree(merkle_tree_node **nodes, uint64_t nhashes, uint64_t
 nchunks);
 
+/**
+ * Create a tree with all nodes and chunks allocated in one block each, with
+ * the nodes linked and the leaves pointing to their chunks. The expected
+ * hashes and the chunks are left zeroed for the caller to fill.
+ * @param nhashes
+ * @param nchunks
+ * @return the tree
+ */
+merkle_tree *create_tree_block(uint64_t nhashes, uint64_t nchunks);
+
+/**
+ * Choose how to find the leaf of a file offset once the chunks of a tree are
+ * set: from the chunk size if the chunks are uniform, by binary search
+ * otherwise
+ * @param hashes
+ */
+void index_chunk_offsets(merkle_tree *hashes);
+
+/**
+ * Find the leaf whose chunk contains a file offset
+ * @param hashes tree indexed by index_chunk_offsets, not CHUNKS_UNINDEXED
+ * @param file_offset
+ * @return key of the leaf, num_nodes if no chunk contains the offset
+ */
+size_t find_leaf_by_offset(merkle_tree *hashes, uint64_t file_offset);
+
 void free_node(merkle_tree_node *node);
 
 void free_tree(merkle_tree *tree);
@@ -57,6 +102,12 @@ void compute_hash(char *data, uint32_t data_size, char *hash_buf);
 
 void compute_leaf_hashes(merkle_tree  *hashes, char *full_filename);
 
+/**
+ * Compute the hash of an inner node from the computed hashes of its children
+ * @param node
+ */
+void compute_inner_hash(merkle_tree_node *node);
+
 void compute_inner_hashes(merkle_tree  *hashes);
 
 /**
@@ -66,16 +117,4 @@ void compute_inner_hashes(merkle_tree  *hashes);
  */
 int compare_node_hash(merkle_tree_node *node);
 
-char **get_all_leaf_hashes_from_node(merkle_tree *hashes, merkle_tree_node
-*node);
-
-/**
- * Check if a node (with child_key) is a descendant of another node (with
- * parent_key)
- * @param parent_key
- * @param child_key
- * @return 1 if true, 0 otherwise
- */
-int check_child_from_node(int parent_key, int child_key);
-
 #endif
@@ -0,0 +1 @@
+./pkgmain $(dirname "$0")/new.bpkg -delta $(dirname "$0")/old.bpkg | diff $(dirname "$0")/package_delta_plan.out -
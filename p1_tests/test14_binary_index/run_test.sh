@@ -0,0 +1 @@
+tmp=$(mktemp -d) && ./pkgmain $(dirname "$0")/test.bpkg -write_index $tmp/test.bpkg.idx && ./pkgmain $tmp/test.bpkg.idx -write_text $tmp/test.bpkg && diff $(dirname "$0")/test.bpkg $tmp/test.bpkg && ./pkgmain $tmp/test.bpkg.idx -all_hashes | diff $(dirname "$0")/binary_index.out -; rm -rf $tmp
@@ -0,0 +1 @@
+tmp=$(mktemp -d) && ./pkgmake $(dirname "$0")/test.data --nchunks 8 --output $tmp/nchunks.bpkg && grep -v '^ident:' $tmp/nchunks.bpkg | diff $(dirname "$0")/nchunks.out - && ./pkgmake $(dirname "$0")/test.data --chunksz 1500 --output $tmp/chunksz.bpkg && grep -v '^ident:' $tmp/chunksz.bpkg | diff $(dirname "$0")/chunksz.out -; rm -rf $tmp
@@ -0,0 +1 @@
+tmp=$(mktemp -d) && cp $(dirname "$0")/test.data $tmp/a.data && (printf x; cat $(dirname "$0")/test.data) > $tmp/b.data && ./pkgmake $tmp/a.data --cdc --chunksz 1024 && ./pkgmake $tmp/b.data --cdc --chunksz 1024 && awk -F, '$3 > 0 {print $1}' $tmp/a.data.bpkg | sort > $tmp/a.hashes && awk -F, '$3 > 0 {print $1}' $tmp/b.data.bpkg | sort > $tmp/b.hashes && echo "$(comm -12 $tmp/a.hashes $tmp/b.hashes | wc -l) of $(wc -l < $tmp/b.hashes) chunks kept" | diff $(dirname "$0")/cdc_insert.out -; rm -rf $tmp
@@ -0,0 +1 @@
+./pkgmain $(dirname "$0")/test.bpkg -hashes_of 0000000000000000000000000000000000000000000000000000000000000000 | diff $(dirname "$0")/hashes_of_unknown_hash.out -
@@ -0,0 +1 @@
+./pkgmain $(dirname "$0")/uniform.bpkg -chunk_check | diff $(dirname "$0")/uniform_chunk_check.out - && ./pkgmain $(dirname "$0")/cdc.bpkg -chunk_check | diff $(dirname "$0")/cdc_chunk_check.out - && ./pkgmain $(dirname "$0")/swapped.bpkg -chunk_check | diff $(dirname "$0")/swapped_chunk_check.out -
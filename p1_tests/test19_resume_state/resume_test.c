@@ -0,0 +1,91 @@
+#include <stdio.h>
+
+#include "chk/resume.h"
+
+/**
+ * Load a package and print which of its leaves the resume file marks as
+ * verified
+ * @param bpkg_path
+ * @param directory directory of the data file
+ * @param full_path path of the data file
+ * @param identity identity the data file is checked against
+ */
+void print_resume_state(char *bpkg_path, char *directory, char *full_path,
+                        struct data_identity *identity) {
+    struct bpkg_obj *bpkg = bpkg_load_no_message(bpkg_path, directory);
+    merkle_tree *hashes = bpkg->hashes;
+    if (!load_resume_state(bpkg, full_path, identity)) {
+        printf("rejected\n");
+        bpkg_obj_destroy(bpkg);
+        return;
+    }
+    printf("verified:");
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        printf(" %d", compare_node_hash(hashes->nodes[hashes->num_inner_nodes
+                                                      + leaf]));
+    }
+    printf("\n");
+    bpkg_obj_destroy(bpkg);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: resume_test <bpkg file> <data directory>\n");
+        return 1;
+    }
+    struct bpkg_obj *bpkg = bpkg_load_no_message(argv[1], argv[2]);
+    if (bpkg == NULL) {
+        return 1;
+    }
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, bpkg);
+    struct data_identity identity;
+    if (!get_data_identity(full_path, &identity)) {
+        printf("Unable to stat the data file\n");
+        bpkg_obj_destroy(bpkg);
+        return 1;
+    }
+
+    // Every other leaf and the last one are verified
+    merkle_tree *hashes = bpkg->hashes;
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes + leaf];
+        if (leaf % 2 == 0 || leaf == hashes->num_leaves - 1) {
+            memcpy(node->computed_hash, node->expected_hash,
+                   SHA256_HEX_STRLEN);
+        } else {
+            node->computed_hash[0] = '\0';
+        }
+    }
+    printf("written: %d\n", write_resume_state(bpkg, full_path, &identity));
+    bpkg_obj_destroy(bpkg);
+
+    printf("same file: ");
+    print_resume_state(argv[1], argv[2], full_path, &identity);
+
+    struct data_identity changed = identity;
+    changed.inode++;
+    printf("other inode: ");
+    print_resume_state(argv[1], argv[2], full_path, &changed);
+    changed = identity;
+    changed.size--;
+    printf("other size: ");
+    print_resume_state(argv[1], argv[2], full_path, &changed);
+    changed = identity;
+    changed.mtime_sec++;
+    printf("other mtime: ");
+    print_resume_state(argv[1], argv[2], full_path, &changed);
+    changed = identity;
+    changed.mtime_nsec++;
+    printf("other mtime nsec: ");
+    print_resume_state(argv[1], argv[2], full_path, &changed);
+
+    // The data file itself changing after the resume file was written
+    FILE *data_file = fopen(full_path, "ab");
+    fputc(0, data_file);
+    fclose(data_file);
+    get_data_identity(full_path, &changed);
+    printf("appended to: ");
+    print_resume_state(argv[1], argv[2], full_path, &changed);
+    return 0;
+}
@@ -0,0 +1 @@
+tmp=$(mktemp -d) && cp $(dirname "$0")/test.bpkg $(dirname "$0")/test.data $tmp && $(dirname "$0")/resume_test $tmp/test.bpkg $tmp | diff $(dirname "$0")/resume_state.out -; rm -rf $tmp
@@ -0,0 +1 @@
+$(dirname "$0")/timer_wheel_test | diff $(dirname "$0")/timer_wheel.out -
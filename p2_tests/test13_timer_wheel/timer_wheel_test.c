@@ -0,0 +1,92 @@
+#include <stdio.h>
+
+#include "net/timer_wheel.h"
+#include "net/packet.h"
+
+struct timer_wheel *wheel;
+
+struct test_timer {
+    char name;
+    struct timer timer;
+};
+
+void on_timer(void *arg) {
+    struct test_timer *test = arg;
+    printf("%c fired at tick %lu\n", test->name, wheel->current_tick - 1);
+}
+
+void init_test_timer(struct test_timer *test, char name) {
+    test->name = name;
+    init_timer(&test->timer, on_timer, test);
+}
+
+/**
+ * Arm a timer to fire a number of ticks after the last processed one, the
+ * wheel is driven by hand so its start is moved to line it up with the clock
+ * @param test
+ * @param ticks
+ */
+void add_after(struct test_timer *test, uint64_t ticks) {
+    wheel->start_us = get_time_us() - (wheel->current_tick - 1) *
+            WHEEL_TICK_US;
+    timer_add(wheel, &test->timer, ticks * WHEEL_TICK_US - WHEEL_TICK_US / 2);
+}
+
+/**
+ * Process every tick up to and including a given one
+ * @param tick
+ */
+void advance_to(uint64_t tick) {
+    printf("advance to tick %lu\n", tick);
+    advance_timer_wheel(wheel, wheel->start_us + tick * WHEEL_TICK_US);
+}
+
+int main() {
+    wheel = create_timer_wheel();
+    // Tick 0 is processed so every timer is armed after a processed tick
+    advance_timer_wheel(wheel, wheel->start_us);
+
+    struct test_timer a, b, c, d, e, f, g, h, i, j, k;
+    init_test_timer(&a, 'a');
+    init_test_timer(&b, 'b');
+    init_test_timer(&c, 'c');
+    init_test_timer(&d, 'd');
+    init_test_timer(&e, 'e');
+    init_test_timer(&f, 'f');
+    init_test_timer(&g, 'g');
+    init_test_timer(&h, 'h');
+    init_test_timer(&i, 'i');
+    init_test_timer(&j, 'j');
+    init_test_timer(&k, 'k');
+
+    // One timer on each level and on both sides of the level boundaries
+    add_after(&a, 5);
+    add_after(&f, 63);
+    add_after(&g, 64);
+    add_after(&b, 100);
+    add_after(&e, 4096);
+    add_after(&i, 4100);
+    add_after(&c, 5000);
+    add_after(&d, 300000);
+    add_after(&h, 200);
+    add_after(&j, 50);
+
+    printf("cancel pending h: %d\n", timer_cancel(wheel, &h.timer));
+    printf("cancel disarmed h: %d\n", timer_cancel(wheel, &h.timer));
+    // Arming a pending timer again moves it
+    add_after(&j, 10);
+
+    advance_to(10);
+    printf("cancel fired a: %d\n", timer_cancel(wheel, &a.timer));
+
+    // i has cascaded down to the lowest level by now
+    advance_to(4097);
+    printf("cancel cascaded i: %d\n", timer_cancel_sync(wheel, &i.timer));
+
+    // Armed on a later tick, it crosses the boundary of level 1 at 4160
+    add_after(&k, 70);
+    advance_to(300000);
+
+    free_timer_wheel(wheel);
+    return 0;
+}
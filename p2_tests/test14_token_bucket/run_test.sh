@@ -0,0 +1 @@
+$(dirname "$0")/token_bucket_test | diff $(dirname "$0")/token_bucket.out -
@@ -0,0 +1,66 @@
+#include <stdio.h>
+
+#include "net/shaper.h"
+
+#define TEST_RATE 100000
+
+/**
+ * Pretend that time passed since the last refill of a bucket
+ * @param bucket
+ * @param us
+ */
+void age_bucket(struct token_bucket *bucket, uint64_t us) {
+    pthread_mutex_lock(&bucket->lock);
+    bucket->last_us -= us;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/**
+ * Measure how long sending bytes to a peer waits
+ * @param shaper
+ * @param peer_fd
+ * @param bytes
+ * @return time waited in microseconds
+ */
+uint64_t time_upload(struct shaper *shaper, int peer_fd, uint64_t bytes) {
+    uint64_t start_us = get_time_us();
+    shape_upload(shaper, peer_fd, bytes);
+    return get_time_us() - start_us;
+}
+
+int main() {
+    struct shaper *shaper = create_shaper(TEST_RATE, TEST_RATE, 0, 0);
+    struct token_bucket *download = &shaper->download;
+    printf("burst: %lu\n", download->burst);
+
+    // A full bucket lets a request through and goes into debt for the rest
+    printf("over the burst: %d\n", shape_download(shaper, 3, 100000));
+    printf("in debt: %d\n", shape_download(shaper, 3, 4096));
+
+    // 34464 bytes of debt are paid back after 0.35 s
+    age_bucket(download, 300000);
+    printf("after 0.3 s: %d\n", shape_download(shaper, 3, 4096));
+    age_bucket(download, 100000);
+    printf("after 0.4 s: %d\n", shape_download(shaper, 3, 4096));
+
+    // Refills never fill the bucket past its burst
+    age_bucket(download, 10000000);
+    shape_download(shaper, 3, 0);
+    printf("full after 10 s: %d\n", download->tokens == (double)
+            download->burst);
+
+    // Each peer has its own bucket, the global one is now unlimited
+    set_rate_limit(shaper, LIMIT_DOWNLOAD, 0);
+    set_rate_limit(shaper, LIMIT_PEER_DOWNLOAD, TEST_RATE);
+    printf("peer 3 over the burst: %d\n", shape_download(shaper, 3, 100000));
+    printf("peer 3 in debt: %d\n", shape_download(shaper, 3, 4096));
+    printf("peer 4: %d\n", shape_download(shaper, 4, 4096));
+
+    // Senders wait until their debt is paid back, 10000 bytes take 0.1 s
+    printf("burst sent at once: %d\n", time_upload(shaper, 5,
+                                                   MIN_BURST_BYTES) < 10000);
+    printf("debt waited for: %d\n", time_upload(shaper, 5, 10000) >= 90000);
+
+    free_shaper(shaper);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+
+#include "net/affinity.h"
+
+/**
+ * Parse a list of CPUs and print the CPUs found in it
+ * @param list
+ */
+void print_cpu_list(char *list) {
+    cpu_set_t cpus;
+    printf("\"%s\":", list);
+    if (!parse_cpu_list(list, &cpus)) {
+        printf(" invalid\n");
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &cpus)) {
+            printf(" %d", cpu);
+        }
+    }
+    printf("\n");
+}
+
+int main() {
+    char *lists[] = {
+            "0", "0-3", "2-2", "1,3,5", "0-3,8", "6-7,0-1,3", "1,1-2",
+            "1023", "", "3-1", "x", "1x", "1,", ",1", "1,,2", "1-",
+            "-1", "1-x", "1;2", "0-1024", "1024"
+    };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(char *); ++i) {
+        print_cpu_list(lists[i]);
+    }
+    return 0;
+}
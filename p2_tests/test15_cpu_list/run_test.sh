@@ -0,0 +1 @@
+$(dirname "$0")/cpu_list_test | diff $(dirname "$0")/cpu_list.out -
@@ -1,10 +1,68 @@
+#include <ctype.h>
+
 #include "config/config.h"
 #include "p2p/p2p_node.h"
+#include "p2p/connector.h"
+#include "p2p/stream.h"
+#include "p2p/startup_scan.h"
 
 #define MAX_BTIDE_LINE_SIZE 5521
 #define MAX_COMMAND_SIZE 16
 #define IP_BUFFER_SIZE 16
 #define MIN_IDENT_SIZE 20
+#define MAX_ADDRESS_SIZE 128
+
+/**
+ * Start connecting to a peer given as ip:port, or unix:path for a peer on the
+ * same host and shm:path to also exchange packets over shared memory, the
+ * connector prints the result once the handshake completes
+ * @param connector
+ * @param peer_list
+ * @param max_peers
+ * @param address
+ */
+void connect_address(struct connector *connector, struct peer_list
+        *peer_list, int max_peers, char *address) {
+    int shared = strncmp(address, "shm:", 4) == 0;
+    if (shared || strncmp(address, "unix:", 5) == 0) {
+        char *path = address + (shared ? 4 : 5);
+        if (find_local_peer(peer_list, path) != -1) {
+            printf("Already connected to peer\n");
+            return;
+        }
+        if (peer_list->num_peers >= max_peers || !connect_local_peer
+                (connector, path, shared)) {
+            printf("Unable to connect to request peer\n");
+        }
+        return;
+    }
+
+    char ip_buf[IP_BUFFER_SIZE] = {0};
+    int port_buf = 0;
+    if (!isdigit(address[0]) || sscanf(address, "%15[^:]:%d", ip_buf,
+                                       &port_buf) != 2) {
+        printf("Missing address and port argument\n");
+        return;
+    }
+
+    // Invalid port number
+    if (port_buf < MIN_PORT_NUM || port_buf > MAX_PORT_NUM) {
+        printf("Invalid Input\n");
+        return;
+    }
+
+    if (find_peer(peer_list, ip_buf, port_buf) != -1) {
+        printf("Already connected to peer\n");
+        return;
+    }
+
+    // Maximum number of peers reached or invalid address
+    if (peer_list->num_peers >= max_peers || !connect_peer(connector,
+                                                           ip_buf,
+                                                           port_buf)) {
+        printf("Unable to connect to request peer\n");
+    }
+}
 
 int main(int argc, char **argv) {
     // Load the configuration file
@@ -15,20 +73,88 @@ int main(int argc, char **argv) {
         return result;
     }
 
+    // Threads pin themselves to the CPUs of their role when they start, the
+    // command line thread verifies whole packages
+    set_thread_affinity(&config.affinity);
+    if (!pin_current_thread(THREAD_VERIFY)) {
+        printf("btide: Failed to pin threads\n");
+    }
+
     // Peer and package management structure
     struct peer_list *peer_list = create_peer_list();
     struct package_list *package_list = create_package_list();
+    package_list->idle_timeout_us = config.tree_idle_timeout * 1000000;
+    struct timer_wheel *timers = create_timer_wheel();
+    struct shaper *shaper = create_shaper(config.upload_rate,
+                                          config.download_rate,
+                                          config.peer_upload_rate,
+                                          config.peer_download_rate);
+    struct chunk_store *chunk_store = NULL;
+    if (config.chunk_store) {
+        chunk_store = create_chunk_store();
+    }
+    struct scheduler *scheduler = create_scheduler(peer_list, package_list,
+                                                   timers, shaper,
+                                                   chunk_store);
+    struct write_back *write_back = create_write_back(scheduler,
+                                                      package_list,
+                                                      config.durability);
+    struct p2p_node node = {peer_list, package_list, scheduler, timers,
+                            shaper, chunk_store, write_back};
+    struct connector *connector = create_connector(&node, config.max_peers);
+
+    // Keepalives, handshake timeouts and request deadlines
+    if (!start_timer_wheel(timers)) {
+        printf("btide: Failed to start timers\n");
+    }
 
     // Start the server in a new thread
-    struct server_args args = {config.max_peers, config.port, peer_list, package_list};
+    struct server_args args = {config.max_peers, config.port, "", &node};
     pthread_t server_thread;
     if (pthread_create(&server_thread, NULL, start_server, &args) != 0) {
         printf("btide: Failed to start server\n");
+        stop_timer_wheel(timers);
+        free_connector(connector);
+        free_write_back(write_back);
+        free_scheduler(scheduler);
+        free_timer_wheel(timers);
+        free_shaper(shaper);
         free_peer_list(peer_list);
         free_package_list(package_list);
+        free_chunk_store(chunk_store);
         return -1;
     }
 
+    // Peers on the same host connect to the AF_UNIX socket
+    struct server_args unix_args = {config.max_peers, 0, "", &node};
+    strncpy(unix_args.unix_path, config.unix_socket, MAX_SOCKET_PATH_SIZE -
+            1);
+    pthread_t unix_server_thread;
+    if (unix_args.unix_path[0] != '\0' && pthread_create
+            (&unix_server_thread, NULL, start_server, &unix_args) != 0) {
+        printf("btide: Failed to start unix socket server\n");
+    }
+
+    // Start requesting chunks of downloads in a new thread
+    if (!start_scheduler(scheduler)) {
+        printf("btide: Failed to start scheduler\n");
+    }
+    // Received chunks are written in batches in a new thread
+    if (!start_write_back(write_back)) {
+        printf("btide: Failed to start write back\n");
+    }
+    // Establish outbound connections in a new thread
+    if (!start_connector(connector)) {
+        printf("btide: Failed to start connector\n");
+    }
+    // Packages of the directory are served as they are verified, while the
+    // command line already runs
+    struct startup_scan *scan = NULL;
+    if (config.startup_scan && (scan = create_startup_scan(&node, &config)) !=
+                               NULL && !start_startup_scan(scan)) {
+        printf("btide: Failed to start startup scan\n");
+    }
+
     // Command line interface
     char current_line[MAX_BTIDE_LINE_SIZE] = {0};
     while (fgets(current_line, MAX_BTIDE_LINE_SIZE, stdin) != NULL) {
@@ -49,16 +175,18 @@ int main(int argc, char **argv) {
 
         if (strncmp(command_buf, "PEERS", MAX_COMMAND_SIZE) == 0 && (strlen
         (current_line) == 5 || strlen(current_line) == 6)) {
-            // Send PNG to all peers
-            for (int i = 0; i < peer_list->max_size; ++i) {
-                if (peer_list->peers[i].peer_fd > 0) {
-                    send_PNG(peer_list->peers[i].peer_fd);
-                }
-            }
+            // Send PNG to all peers, the POG updates the measured RTT
+            ping_all_peers(peer_list);
             print_peer_list(peer_list);
             continue;
         }
 
+        if (strncmp(command_buf, "RATELIMIT", MAX_COMMAND_SIZE) == 0 && (strlen
+        (current_line) == 9 || strlen(current_line) == 10)) {
+            print_rate_limits(shaper);
+            continue;
+        }
+
         // Append a space at the end of the command string for strcmp
         for (int i = 0; i < (MAX_COMMAND_SIZE - 1); ++i) {
             if (command_buf[i] == '\0') {
@@ -67,40 +195,88 @@ int main(int argc, char **argv) {
             }
         }
 
+        // Connect to all listed peers at once
         if (strncmp(command_buf, "CONNECT ", MAX_COMMAND_SIZE) == 0) {
-            char ip_buf[IP_BUFFER_SIZE] = {0};
-            int port_buf = 0;
-            if (sscanf(current_line, "%15[^0-9]%15[^:]:%d", command_buf,
-                       ip_buf, &port_buf) != 3 || strncmp(command_buf,
-                       "CONNECT ", MAX_COMMAND_SIZE) != 0) {
+            char address_buf[MAX_ADDRESS_SIZE] = {0};
+            int offset = 0;
+            int length = 0;
+            sscanf(current_line, "%15s%n", command_buf, &offset);
+            if (sscanf(current_line + offset, "%127s%n", address_buf, &length)
+                != 1) {
                 printf("Missing address and port argument\n");
                 continue;
             }
+            do {
+                connect_address(connector, peer_list, config.max_peers,
+                                address_buf);
+                offset += length;
+            } while (sscanf(current_line + offset, "%127s%n", address_buf,
+                            &length) == 1);
+            continue;
+        }
 
-            // Invalid port number
-            if (port_buf < MIN_PORT_NUM || port_buf > MAX_PORT_NUM) {
-                printf("Invalid Input\n");
+        // Connect to the peers listed in a file, one ip:port per line
+        if (strncmp(command_buf, "BOOTSTRAP ", MAX_COMMAND_SIZE) == 0) {
+            char space_buf = 0;
+            char filename_buf[MAX_FILENAME_SIZE] = {0};
+            if (sscanf(current_line, "%15s%c%256[^\n]", command_buf,
+                       &space_buf, filename_buf) != 3 || space_buf != ' ') {
+                printf("Missing file argument\n");
                 continue;
             }
 
-            if (find_peer(peer_list, ip_buf, port_buf) != -1) {
-                printf("Already connected to peer\n");
+            FILE *fp = fopen(filename_buf, "r");
+            if (fp == NULL) {
+                printf("Cannot open file\n");
                 continue;
             }
+            char address_buf[MAX_ADDRESS_SIZE] = {0};
+            while (fscanf(fp, "%127s", address_buf) == 1) {
+                connect_address(connector, peer_list, config.max_peers,
+                                address_buf);
+            }
+            fclose(fp);
+            continue;
+        }
 
-            // Maximum number of peers reached
-            if (peer_list->num_peers >= config.max_peers) {
-                printf("Unable to connect to request peer\n");
+        // Change a rate limit at runtime, 0 for unlimited
+        if (strncmp(command_buf, "RATELIMIT ", MAX_COMMAND_SIZE) == 0) {
+            char limit_buf[MAX_RATE_KEY_SIZE] = {0};
+            char rate_buf[MAX_RATE_DIGITS + 1] = {0};
+            if (sscanf(current_line, "%15s %31s %19s", command_buf, limit_buf,
+                       rate_buf) != 3) {
+                printf("Missing rate limit arguments\n");
                 continue;
             }
 
-            // Make a new client thread to connect the new peer
-            struct client_args *new_args = create_client_args(ip_buf,
-                    port_buf, peer_list, package_list);
-            pthread_t client_thread;
-            if (pthread_create(&client_thread, NULL, start_client, new_args) != 0) {
-                printf("btide: Failed to start client\n");
+            int limit = find_rate_limit(limit_buf);
+            if (limit == -1 || strspn(rate_buf, "0123456789") != strlen
+                    (rate_buf)) {
+                printf("Invalid Input\n");
+                continue;
             }
+            set_rate_limit(shaper, limit, strtoull(rate_buf, NULL, 10));
+            printf("Rate limit updated\n");
+            continue;
+        }
+
+        if (strncmp(command_buf, "DISCONNECT ", MAX_COMMAND_SIZE) == 0 &&
+            strncmp(current_line, "DISCONNECT unix:", 16) == 0) {
+            char path_buf[MAX_SOCKET_PATH_SIZE] = {0};
+            sscanf(current_line + 16, "%107[^\n]", path_buf);
+            read_lock_peers(peer_list);
+            int index;
+            if ((index = find_local_peer(peer_list, path_buf)) == -1) {
+                unlock_peers(peer_list);
+                printf("Unknown peer, not connected\n");
+                continue;
+            }
+
+            struct peer local_peer = *get_peer(peer_list, index);
+            send_DSN(local_peer.peer_fd);
+            unlock_peers(peer_list);
+            remove_peer(peer_list, local_peer.peer_ip, local_peer.peer_port);
+            printf("Disconnected from peer\n");
             continue;
         }
 
@@ -120,13 +296,16 @@ int main(int argc, char **argv) {
                 continue;
             }
 
+            read_lock_peers(peer_list);
             int index;
             if ((index = find_peer(peer_list, ip_buf, port_buf)) == -1) {
+                unlock_peers(peer_list);
                 printf("Unknown peer, not connected\n");
                 continue;
             }
 
-            send_DSN(peer_list->peers[index].peer_fd);
+            send_DSN(get_peer(peer_list, index)->peer_fd);
+            unlock_peers(peer_list);
             remove_peer(peer_list, ip_buf, port_buf);
             printf("Disconnected from peer\n");
             continue;
@@ -146,29 +325,27 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            struct bpkg_obj *package = bpkg_load_no_message(filename_buf,
-                    config.directory);
+            // The tree is built when the package is first used
+            struct bpkg_obj *package = bpkg_load_header(filename_buf,
+                                                        config.directory);
             if (package == NULL) {
                 printf("Unable to parse bpkg file\n");
                 continue;
             }
 
-            // Create the data file if it doesn't exist
-            char data_full_path[MAX_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
-            get_file_full_path(data_full_path, package);
-            if (!check_file_existence(data_full_path)) {
-                FILE *fp = NULL;
-                if ((fp = fopen(data_full_path, "wb")) == NULL) {
-                    perror("fopen - wb:");
-                }
-                // Create file with specified size
-                char null_byte = 0;
-                for (size_t i = 0; i < package->size; ++i) {
-                    fwrite(&null_byte, sizeof(char), 1, fp);
+            create_data_file(package);
+            package->direct_io = config.direct_io;
+            package->resume_state = config.resume_state;
+            // Chunks already present locally are shared with other packages,
+            // indexing them needs the tree
+            if (chunk_store != NULL) {
+                if (!bpkg_load_tree(package)) {
+                    bpkg_obj_destroy(package);
+                    printf("Unable to parse bpkg file\n");
+                    continue;
                 }
-                fclose(fp);
+                store_package_chunks(chunk_store, package);
             }
-
             add_package(package_list, package);
             continue;
         }
@@ -184,10 +361,185 @@ int main(int argc, char **argv) {
                 continue;
             }
 
+            struct package_entry *entry = get_package_header(package_list,
+                                                             ident_buf);
+            if (entry != NULL) {
+                remove_download(scheduler, entry->package);
+                put_package(package_list, entry);
+                if (chunk_store != NULL) {
+                    release_package_chunks(chunk_store, ident_buf);
+                }
+            }
             remove_package(package_list, ident_buf);
             continue;
         }
 
+        if (strncmp(command_buf, "DOWNLOAD ", MAX_COMMAND_SIZE) == 0) {
+            char space_buf = 0;
+            char ident_buf[MAX_IDENT_SIZE] = {0};
+            if (sscanf(current_line, "%15s%c%1024s", command_buf, &space_buf,
+                       ident_buf) != 3 || space_buf != ' ' || strlen
+                       (ident_buf) < MIN_IDENT_SIZE) {
+                printf("Missing identifier argument, please specify whole "
+                       "1024 character or at least 20 characters\n");
+                continue;
+            }
+
+            struct package_entry *entry;
+            if ((entry = get_package(package_list, ident_buf)) == NULL) {
+                printf("Unable to download, package is not managed\n");
+                continue;
+            }
+
+            // Only this thread removes packages, which stops the download
+            int remaining = add_download(scheduler, entry);
+            put_package(package_list, entry);
+            if (remaining == -1) {
+                printf("Package is already downloading\n");
+            } else if (remaining == 0) {
+                printf("Package is already complete\n");
+            } else {
+                printf("Downloading %d chunks\n", remaining);
+            }
+            continue;
+        }
+
+        if (strncmp(command_buf, "UPGRADE ", MAX_COMMAND_SIZE) == 0) {
+            char space_buf1 = 0;
+            char ident_buf[MAX_IDENT_SIZE] = {0};
+            char space_buf2 = 0;
+            char filename_buf[MAX_FILENAME_SIZE] = {0};
+            if (sscanf(current_line, "%15s%c%1024s%c%256[^\n]", command_buf,
+                       &space_buf1, ident_buf, &space_buf2, filename_buf) !=
+                       5 || space_buf1 != ' ' || space_buf2 != ' ' || strlen
+                       (ident_buf) < MIN_IDENT_SIZE) {
+                printf("Missing arguments, please specify the identifier and "
+                       "the bpkg file of the new version\n");
+                continue;
+            }
+
+            struct package_entry *entry;
+            if ((entry = get_package(package_list, ident_buf)) == NULL) {
+                printf("Unable to upgrade, package is not managed\n");
+                continue;
+            }
+            struct bpkg_obj *package = NULL;
+            if (!check_file_existence(filename_buf) || (package =
+                    bpkg_load_no_message(filename_buf, config.directory)) ==
+                                                       NULL) {
+                put_package(package_list, entry);
+                printf("Unable to parse bpkg file\n");
+                continue;
+            }
+            package->direct_io = entry->package->direct_io;
+            package->resume_state = entry->package->resume_state;
+
+            // Nothing writes or reads the old data file once the download
+            // and the streams are stopped and the queued chunks written
+            remove_download(scheduler, entry->package);
+            stop_package_streams(scheduler, entry->package);
+            flush_write_back(write_back);
+
+            // Unchanged chunks are copied from the old data file at any
+            // offset, only the changed chunks are downloaded
+            struct bpkg_delta delta = bpkg_get_delta(entry->package, package);
+            if (!bpkg_apply_delta(entry->package, package, &delta)) {
+                bpkg_delta_destroy(&delta);
+                bpkg_obj_destroy(package);
+                put_package(package_list, entry);
+                printf("Unable to upgrade package\n");
+                continue;
+            }
+            printf("Copied %zu of %zu chunks from the old version\n",
+                   delta.num_copied, delta.len);
+            bpkg_delta_destroy(&delta);
+
+            // The new version replaces the old one
+            put_package(package_list, entry);
+            if (chunk_store != NULL) {
+                release_package_chunks(chunk_store, ident_buf);
+            }
+            unlist_package(package_list, ident_buf);
+            if (chunk_store != NULL) {
+                store_package_chunks(chunk_store, package);
+            }
+            add_package(package_list, package);
+
+            // Only this thread removes packages, so the new version is found
+            entry = get_package(package_list, package->ident);
+            int remaining = entry == NULL ? 0 : add_download(scheduler,
+                                                             entry);
+            if (entry != NULL) {
+                put_package(package_list, entry);
+            }
+            if (remaining > 0) {
+                printf("Downloading %d chunks\n", remaining);
+            }
+            continue;
+        }
+
+        if (strncmp(command_buf, "DIRECTIO ", MAX_COMMAND_SIZE) == 0) {
+            char space_buf1 = 0;
+            char ident_buf[MAX_IDENT_SIZE] = {0};
+            char space_buf2 = 0;
+            char switch_buf[4] = {0};
+            if (sscanf(current_line, "%15s%c%1024s%c%3s", command_buf,
+                       &space_buf1, ident_buf, &space_buf2, switch_buf) != 5
+                       || space_buf1 != ' ' || space_buf2 != ' ' || strlen
+                       (ident_buf) < MIN_IDENT_SIZE || (strcmp(switch_buf,
+                       "on") != 0 && strcmp(switch_buf, "off") != 0)) {
+                printf("Missing arguments, please specify the identifier and "
+                       "on or off\n");
+                continue;
+            }
+
+            struct package_entry *entry;
+            if ((entry = get_package_header(package_list, ident_buf)) ==
+                NULL) {
+                printf("Unable to set direct I/O, package is not managed\n");
+                continue;
+            }
+            // Transfers in progress finish with the mode they started with
+            entry->package->direct_io = strcmp(switch_buf, "on") == 0;
+            printf("Direct I/O %s\n", entry->package->direct_io ? "enabled" :
+                   "disabled");
+            put_package(package_list, entry);
+            continue;
+        }
+
+        if (strncmp(command_buf, "STREAM ", MAX_COMMAND_SIZE) == 0) {
+            char space_buf1 = 0;
+            char ident_buf[MAX_IDENT_SIZE] = {0};
+            char space_buf2 = 0;
+            char path_buf[MAX_STREAM_PATH_SIZE] = {0};
+            if (sscanf(current_line, "%15s%c%1024s%c%255[^\n]", command_buf,
+                       &space_buf1, ident_buf, &space_buf2, path_buf) != 5 ||
+                       space_buf1 != ' ' || space_buf2 != ' ' || strlen
+                       (ident_buf) < MIN_IDENT_SIZE) {
+                printf("Missing arguments, please specify the identifier and "
+                       "the output path\n");
+                continue;
+            }
+
+            struct package_entry *entry;
+            if ((entry = get_package(package_list, ident_buf)) == NULL) {
+                printf("Unable to stream, package is not managed\n");
+                continue;
+            }
+
+            // The chunks are downloaded from the read cursor onwards, and the
+            // stream keeps its handle of the package until it ends
+            int remaining = add_download(scheduler, entry);
+            if (!start_stream(scheduler, entry, path_buf)) {
+                printf("Unable to stream, package is already streaming\n");
+            } else if (remaining > 0) {
+                printf("Streaming while downloading %d chunks\n", remaining);
+            } else {
+                printf("Streaming package\n");
+            }
+            continue;
+        }
+
         if (strncmp(command_buf, "FETCH ", MAX_COMMAND_SIZE) == 0) {
             char ip_buf[IP_BUFFER_SIZE] = {0};
             int port_buf = 0;
@@ -196,8 +548,9 @@ int main(int argc, char **argv) {
             char space_buf2 = 0;
             char hash_buf[SHA256_HEX_STRLEN] = {0};
             char space_buf3 = 0;
-            uint32_t offset_buf = 0;
-            if (sscanf(current_line, "%15[^0-9]%15[^:]:%d%c%1024s%c%64s%c%d",
+            uint64_t offset_buf = 0;
+            if (sscanf(current_line, "%15[^0-9]%15[^:]:%d%c%1024s%c%64s%c%"
+                                     SCNu64,
                        command_buf, ip_buf, &port_buf, &space_buf1,
                        ident_buf, &space_buf2, hash_buf, &space_buf3,
                        &offset_buf) < 7 || strncmp(command_buf, "FETCH ",
@@ -213,32 +566,42 @@ int main(int argc, char **argv) {
                 printf("Unable to request chunk, peer not in list\n");
                 continue;
             }
-            int peer_fd = peer_list->peers[peer_index].peer_fd;
 
             // Look for the package
-            int package_index;
-            if ((package_index = find_package(package_list, ident_buf,
-                                              MIN_IDENT_SIZE)) == -1) {
+            struct package_entry *entry;
+            if ((entry = get_package(package_list, ident_buf)) == NULL) {
                 printf("Unable to request chunk, package is not managed\n");
                 continue;
             }
-            struct bpkg_obj *package = package_list->packages[package_index];
 
             // Look for the hash in the package
-            chunk *target_chunk = get_chunk_from_hash(package, hash_buf, offset_buf);
+            chunk *target_chunk = get_chunk_from_hash(entry->package,
+                                                      hash_buf, offset_buf);
             if (target_chunk == NULL) {
+                put_package(package_list, entry);
                 printf("Unable to request chunk, chunk hash does not belong to package\n");
                 continue;
             }
 
             // Construct REQ payload
             union btide_payload payload = {0};
-            payload.request.file_offset = offset_buf;
+            set_request_offset(&payload.request, offset_buf);
             payload.request.data_len = target_chunk->size;
+            put_package(package_list, entry);
             strncpy(payload.request.chunk_hash, hash_buf, SHA256_HEX_LEN);
             strncpy(payload.request.ident, ident_buf, IDENT_SIZE);
 
-            send_REQ(&payload, peer_fd);
+            // The peer may have disconnected meanwhile
+            read_lock_peers(peer_list);
+            int sent = 0;
+            if ((peer_index = find_peer(peer_list, ip_buf, port_buf)) != -1) {
+                sent = send_REQ(&payload, get_peer(peer_list, peer_index)
+                        ->peer_fd);
+            }
+            unlock_peers(peer_list);
+            if (sent) {
+                track_request(scheduler, &payload, ip_buf, port_buf);
+            }
 
             continue;
         }
@@ -246,6 +609,19 @@ int main(int argc, char **argv) {
         printf("Invalid Input\n");
     }
 
+    if (config.unix_socket[0] != '\0') {
+        unlink(config.unix_socket);
+    }
+    free_startup_scan(scan);
+    stop_streams(scheduler);
+    stop_timer_wheel(timers);
+    free_connector(connector);
+    free_write_back(write_back);
+    free_scheduler(scheduler);
+    free_timer_wheel(timers);
+    free_shaper(shaper);
     free_peer_list(peer_list);
     free_package_list(package_list);
+    free_chunk_store(chunk_store);
+    free_direct_buffers();
 }
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chk/bpkg_index.h"
+#include "chk/bpkg_parse.h"
+
+void digest_to_hex(const uint8_t *digest, char *hex) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        hex[2 * i] = hex_digits[digest[i] >> 4];
+        hex[2 * i + 1] = hex_digits[digest[i] & 0x0F];
+    }
+    hex[SHA256_HEX_LEN] = '\0';
+}
+
+int hex_to_digest(const char *hex, uint8_t *digest) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        int high = hex_digit_value(hex[2 * i]);
+        int low = hex_digit_value(hex[2 * i + 1]);
+        if (high == -1 || low == -1) {
+            return 0;
+        }
+        digest[i] = (uint8_t) (high << 4 | low);
+    }
+    return 1;
+}
+
+/**
+ * Check that a mapped file is a complete index of a full binary tree
+ * @param header
+ * @param length length of the mapped file
+ * @return 1 if valid, 0 otherwise
+ */
+int check_index_header(const struct bpkg_index_header *header, size_t
+        length) {
+    if (memcmp(header->magic, BPKG_INDEX_MAGIC, BPKG_INDEX_MAGIC_SIZE) != 0 ||
+        header->version != BPKG_INDEX_VERSION ||
+        header->digest_size != SHA256_DIGEST_SIZE ||
+        header->ident[MAX_IDENT_SIZE - 1] != '\0' ||
+        header->filename[MAX_FILENAME_SIZE - 1] != '\0') {
+        return 0;
+    }
+    // Every inner node has two children
+    if (header->nchunks != header->nhashes + 1) {
+        return 0;
+    }
+    size_t entry_size = SHA256_DIGEST_SIZE * 2 + sizeof(struct
+            bpkg_index_chunk);
+    if (header->nchunks > length / entry_size) {
+        return 0;
+    }
+    size_t num_nodes = header->nhashes + header->nchunks;
+    return length == sizeof(struct bpkg_index_header) + num_nodes *
+                                                         SHA256_DIGEST_SIZE +
+                     header->nchunks * sizeof(struct bpkg_index_chunk);
+}
+
+/**
+ * Build a package from a mapped index, the nodes are allocated in one block
+ * @param header
+ * @param header_only 1 to leave the tree NULL
+ * @return heap address of the bpkg_obj
+ */
+struct bpkg_obj *build_from_index(const struct bpkg_index_header *header,
+                                  int header_only) {
+    struct bpkg_obj *obj = calloc(1, sizeof(struct bpkg_obj));
+    memcpy(obj->ident, header->ident, MAX_IDENT_SIZE);
+    memcpy(obj->filename, header->filename, MAX_FILENAME_SIZE);
+    obj->size = header->size;
+    obj->nhashes = header->nhashes;
+    obj->nchunks = header->nchunks;
+    const uint8_t *digests = (const uint8_t *) (header + 1);
+    digest_to_hex(digests, obj->root_hash);
+    if (header_only) {
+        return obj;
+    }
+
+    merkle_tree *hashes = create_tree_block(obj->nhashes, obj->nchunks);
+    for (size_t i = 0; i < hashes->num_nodes; ++i) {
+        digest_to_hex(digests + i * SHA256_DIGEST_SIZE,
+                      hashes->node_block[i].expected_hash);
+    }
+    const struct bpkg_index_chunk *chunks = (const void *) (digests +
+            hashes->num_nodes * SHA256_DIGEST_SIZE);
+    for (size_t i = 0; i < hashes->num_leaves; ++i) {
+        hashes->chunk_block[i].offset = chunks[i].offset;
+        hashes->chunk_block[i].size = chunks[i].size;
+    }
+    index_chunk_offsets(hashes);
+    obj->hashes = hashes;
+    return obj;
+}
+
+/**
+ * Map a file and build a package from it if it is a valid index
+ * @param path
+ * @param header_only 1 to leave the tree NULL
+ * @return heap address of the bpkg_obj, NULL if not a valid index
+ */
+struct bpkg_obj *map_index(const char *path, int header_only) {
+    int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (index_fd == -1) {
+        return NULL;
+    }
+    struct stat index_stat;
+    if (fstat(index_fd, &index_stat) == -1 || (size_t) index_stat.st_size <
+                                              sizeof(struct
+                                                      bpkg_index_header)) {
+        close(index_fd);
+        return NULL;
+    }
+    size_t length = index_stat.st_size;
+    void *mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct bpkg_obj *obj = NULL;
+    if (check_index_header(mapped, length)) {
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        obj = build_from_index(mapped, header_only);
+    }
+    munmap(mapped, length);
+    return obj;
+}
+
+/**
+ * Load a package from the index at path, or from the index next to path if
+ * it is not older than the text package
+ * @param path
+ * @param header_only 1 to leave the tree NULL
+ * @return heap address of the bpkg_obj, NULL if there is no valid index
+ */
+struct bpkg_obj *load_index(const char *path, int header_only) {
+    struct bpkg_obj *obj = map_index(path, header_only);
+    if (obj != NULL) {
+        return obj;
+    }
+
+    char index_path[PATH_MAX];
+    if (snprintf(index_path, PATH_MAX, "%s%s", path, BPKG_INDEX_SUFFIX) >=
+        PATH_MAX) {
+        return NULL;
+    }
+    struct stat index_stat;
+    if (stat(index_path, &index_stat) == -1) {
+        return NULL;
+    }
+    // An index older than the text package was not rebuilt after an edit
+    struct stat bpkg_stat;
+    if (stat(path, &bpkg_stat) == 0 && (index_stat.st_mtim.tv_sec <
+                                        bpkg_stat.st_mtim.tv_sec ||
+                                        (index_stat.st_mtim.tv_sec ==
+                                         bpkg_stat.st_mtim.tv_sec &&
+                                         index_stat.st_mtim.tv_nsec <
+                                         bpkg_stat.st_mtim.tv_nsec))) {
+        return NULL;
+    }
+    return map_index(index_path, header_only);
+}
+
+struct bpkg_obj *bpkg_index_load(const char *path) {
+    return load_index(path, 0);
+}
+
+struct bpkg_obj *bpkg_index_load_header(const char *path) {
+    return load_index(path, 1);
+}
+
+int bpkg_index_write(struct bpkg_obj *obj, const char *path) {
+    FILE *index_file = fopen(path, "wb");
+    if (index_file == NULL) {
+        perror("Failed to create the index");
+        return 0;
+    }
+
+    struct bpkg_index_header header;
+    memset(&header, 0, sizeof(struct bpkg_index_header));
+    memcpy(header.magic, BPKG_INDEX_MAGIC, sizeof(BPKG_INDEX_MAGIC));
+    header.version = BPKG_INDEX_VERSION;
+    header.digest_size = SHA256_DIGEST_SIZE;
+    header.size = obj->size;
+    header.nhashes = obj->nhashes;
+    header.nchunks = obj->nchunks;
+    strncpy(header.ident, obj->ident, MAX_IDENT_SIZE - 1);
+    strncpy(header.filename, obj->filename, MAX_FILENAME_SIZE - 1);
+    int written = fwrite(&header, sizeof(struct bpkg_index_header), 1,
+                         index_file) == 1;
+
+    merkle_tree *hashes = obj->hashes;
+    for (size_t i = 0; written && i < hashes->num_nodes; ++i) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        written = hex_to_digest(hashes->nodes[i]->expected_hash, digest) &&
+                  fwrite(digest, SHA256_DIGEST_SIZE, 1, index_file) == 1;
+    }
+    for (size_t i = hashes->num_inner_nodes; written && i < hashes->num_nodes;
+         ++i) {
+        chunk *current_chunk = hashes->nodes[i]->value;
+        struct bpkg_index_chunk entry = {current_chunk->offset,
+                                         current_chunk->size, 0};
+        written = fwrite(&entry, sizeof(struct bpkg_index_chunk), 1,
+                         index_file) == 1;
+    }
+
+    if (fclose(index_file) != 0) {
+        written = 0;
+    }
+    if (!written) {
+        printf("Failed to write the index\n");
+        remove(path);
+    }
+    return written;
+}
+
+int bpkg_text_write(struct bpkg_obj *obj, const char *path) {
+    FILE *bpkg_file = fopen(path, "w");
+    if (bpkg_file == NULL) {
+        perror("Failed to create the package file");
+        return 0;
+    }
+
+    merkle_tree *hashes = obj->hashes;
+    fprintf(bpkg_file, "ident:%s\nfilename:%s\nsize:%" PRIu64 "\nnhashes:%"
+            PRIu64 "\nhashes:\n", obj->ident, obj->filename, obj->size,
+            obj->nhashes);
+    for (size_t i = 0; i < hashes->num_inner_nodes; ++i) {
+        fprintf(bpkg_file, "\t%.64s\n", hashes->nodes[i]->expected_hash);
+    }
+    fprintf(bpkg_file, "nchunks:%" PRIu64 "\nchunks:\n", obj->nchunks);
+    for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
+        merkle_tree_node *current_node = hashes->nodes[i];
+        fprintf(bpkg_file, "\t%.64s,%" PRIu64 ",%" PRIu32 "\n",
+                current_node->expected_hash, current_node->value->offset,
+                current_node->value->size);
+    }
+
+    int failed = ferror(bpkg_file);
+    if (fclose(bpkg_file) != 0 || failed) {
+        printf("Failed to write the package file\n");
+        remove(path);
+        return 0;
+    }
+    return 1;
+}
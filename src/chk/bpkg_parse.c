@@ -0,0 +1,453 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "chk/bpkg_parse.h"
+
+// Value of each hex digit plus one, 0 for the other characters
+static const uint8_t hex_values[256] = {
+        ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+        ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+        ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+        ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+static const char *const bpkg_error_messages[NUM_BPKG_ERRORS] = {
+        [BPKG_OK] = "",
+        [BPKG_INVALID_PATH] = "Invalid Path to Package File",
+        [BPKG_MISSING_IDENT] = "Missing Field in Package File: ident",
+        [BPKG_INVALID_IDENT] = "Invalid Field in Package File: ident",
+        [BPKG_MISSING_FILENAME] = "Missing Field in Package File: filename",
+        [BPKG_INVALID_FILENAME] = "Invalid Field in Package File: filename",
+        [BPKG_MISSING_SIZE] = "Missing Field in Package File: size",
+        [BPKG_INVALID_SIZE] = "Invalid Field in Package File: size",
+        [BPKG_MISSING_NHASHES] = "Missing Field in Package File: nhashes",
+        [BPKG_INVALID_NHASHES] = "Invalid Field in Package File: nhashes",
+        [BPKG_MISSING_HASHES_HEADER] = "Invalid format in Package File: "
+                                       "missing 'hashes:'",
+        [BPKG_MISSING_HASHES] = "Missing Field in Package File: hashes",
+        [BPKG_INVALID_HASHES] = "Invalid Field in Package File: hashes",
+        [BPKG_MISSING_NCHUNKS] = "Missing Field in Package File: nchunks",
+        [BPKG_INVALID_NCHUNKS] = "Invalid Field in Package File: nchunks",
+        [BPKG_MISSING_CHUNKS_HEADER] = "Invalid format in Package File: "
+                                       "missing 'chunks:'",
+        [BPKG_INVALID_CHUNKS] = "Invalid Field in Package File: chunks"
+};
+
+// Position in a buffer being split into lines
+struct line_cursor {
+    const char *current;
+    const char *end;
+};
+
+int hex_digit_value(char digit) {
+    return hex_values[(unsigned char) digit] - 1;
+}
+
+/**
+ * Take the next line of a buffer, without its newline and trailing
+ * whitespace
+ * @param cursor
+ * @param line set to the start of the line
+ * @param length set to the length of the line
+ * @return 1 if there is a line, 0 at the end of the buffer
+ */
+int next_line(struct line_cursor *cursor, const char **line, size_t *length) {
+    if (cursor->current >= cursor->end) {
+        return 0;
+    }
+    const char *start = cursor->current;
+    const char *newline = memchr(start, '\n', cursor->end - start);
+    const char *line_end = newline == NULL ? cursor->end : newline;
+    cursor->current = newline == NULL ? cursor->end : newline + 1;
+    while (line_end > start && isspace((unsigned char) line_end[-1])) {
+        line_end--;
+    }
+    *line = start;
+    *length = line_end - start;
+    return 1;
+}
+
+/**
+ * Check that a line starts with a key, and skip the key and the whitespace
+ * after it
+ * @param line
+ * @param length
+ * @param key
+ * @param value set to the start of the value
+ * @return length of the value, 0 if the key does not match or the value is
+ * empty
+ */
+size_t skip_key(const char *line, size_t length, const char *key, const char
+        **value) {
+    size_t key_length = strlen(key);
+    if (length < key_length || memcmp(line, key, key_length) != 0) {
+        return 0;
+    }
+    size_t start = key_length;
+    while (start < length && isspace((unsigned char) line[start])) {
+        start++;
+    }
+    *value = line + start;
+    return length - start;
+}
+
+/**
+ * Parse a "key:value" line, the value ends at the first whitespace and is
+ * truncated to max_size - 1 characters
+ * @param line
+ * @param length
+ * @param key
+ * @param value buffer with size >= max_size
+ * @param max_size
+ * @return 1 if success, 0 otherwise
+ */
+int parse_string_field(const char *line, size_t length, const char *key, char
+        *value, size_t max_size) {
+    const char *start = NULL;
+    size_t value_length = skip_key(line, length, key, &start);
+    size_t token_length = 0;
+    while (token_length < value_length && !isspace((unsigned char)
+            start[token_length])) {
+        token_length++;
+    }
+    if (token_length == 0) {
+        return 0;
+    }
+    if (token_length > max_size - 1) {
+        token_length = max_size - 1;
+    }
+    memcpy(value, start, token_length);
+    value[token_length] = '\0';
+    return 1;
+}
+
+/**
+ * Parse a decimal number that fills a range of characters
+ * @param start
+ * @param length
+ * @param max largest valid value
+ * @param value
+ * @return 1 if success, 0 if empty, not a number or larger than max
+ */
+int parse_number(const char *start, size_t length, uint64_t max, uint64_t
+        *value) {
+    if (length == 0) {
+        return 0;
+    }
+    uint64_t result = 0;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned int digit = (unsigned char) start[i] - '0';
+        if (digit > 9 || result > (max - digit) / 10) {
+            return 0;
+        }
+        result = result * 10 + digit;
+    }
+    *value = result;
+    return 1;
+}
+
+/**
+ * Parse a "key:number" line
+ * @return 1 if success, 0 otherwise
+ */
+int parse_number_field(const char *line, size_t length, const char *key,
+                       uint64_t *value) {
+    const char *start = NULL;
+    size_t value_length = skip_key(line, length, key, &start);
+    return parse_number(start, value_length, UINT64_MAX, value);
+}
+
+/**
+ * Check that a range of characters are all hex digits
+ */
+int check_hex(const char *hex, size_t length) {
+    uint8_t valid = 1;
+    for (size_t i = 0; i < length; ++i) {
+        valid &= hex_values[(unsigned char) hex[i]] != 0;
+    }
+    return valid;
+}
+
+/**
+ * Check that a line is a tab followed by a hash
+ */
+int check_hash_line(const char *line, size_t length) {
+    return length == SHA256_HEX_LEN + 1 && line[0] == '\t' &&
+           check_hex(line + 1, SHA256_HEX_LEN);
+}
+
+/**
+ * Check a chunk line, a tab followed by hash,offset,size
+ * @param line
+ * @param length
+ * @param offset set to the offset of the chunk if success
+ * @param size set to the size of the chunk if success
+ * @return 1 if success, 0 otherwise
+ */
+int check_chunk_line(const char *line, size_t length, uint64_t *offset,
+                     uint64_t *size) {
+    if (length < SHA256_HEX_LEN + 2 || line[0] != '\t' ||
+        line[SHA256_HEX_LEN + 1] != ',' || !check_hex(line + 1,
+                                                      SHA256_HEX_LEN)) {
+        return 0;
+    }
+    const char *offset_start = line + SHA256_HEX_LEN + 2;
+    const char *line_end = line + length;
+    const char *separator = memchr(offset_start, ',', line_end -
+                                                      offset_start);
+    if (separator == NULL) {
+        return 0;
+    }
+    return parse_number(offset_start, separator - offset_start, UINT64_MAX,
+                        offset) &&
+           parse_number(separator + 1, line_end - separator - 1, UINT32_MAX,
+                        size);
+}
+
+/**
+ * Parse a chunk line into a leaf, see check_chunk_line
+ * @param line
+ * @param length
+ * @param leaf leaf to fill, its chunk included
+ * @return 1 if success, 0 otherwise
+ */
+int parse_chunk_line(const char *line, size_t length, merkle_tree_node
+        *leaf) {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    if (!check_chunk_line(line, length, &offset, &size)) {
+        return 0;
+    }
+    memcpy(leaf->expected_hash, line + 1, SHA256_HEX_LEN);
+    leaf->value->offset = offset;
+    leaf->value->size = (uint32_t) size;
+    return 1;
+}
+
+/**
+ * Parse the lines of a text package up to and including "hashes:"
+ * @param cursor set to the line after "hashes:"
+ * @param obj package to fill
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error parse_header_lines(struct line_cursor *cursor, struct
+        bpkg_obj *obj) {
+    const char *line = NULL;
+    size_t line_length = 0;
+
+    if (!next_line(cursor, &line, &line_length)) {
+        return BPKG_MISSING_IDENT;
+    }
+    if (!parse_string_field(line, line_length, "ident:", obj->ident,
+                            MAX_IDENT_SIZE)) {
+        return BPKG_INVALID_IDENT;
+    }
+    if (!next_line(cursor, &line, &line_length)) {
+        return BPKG_MISSING_FILENAME;
+    }
+    if (!parse_string_field(line, line_length, "filename:", obj->filename,
+                            MAX_FILENAME_SIZE)) {
+        return BPKG_INVALID_FILENAME;
+    }
+    if (!next_line(cursor, &line, &line_length)) {
+        return BPKG_MISSING_SIZE;
+    }
+    if (!parse_number_field(line, line_length, "size:", &obj->size)) {
+        return BPKG_INVALID_SIZE;
+    }
+    if (!next_line(cursor, &line, &line_length)) {
+        return BPKG_MISSING_NHASHES;
+    }
+    if (!parse_number_field(line, line_length, "nhashes:", &obj->nhashes)) {
+        return BPKG_INVALID_NHASHES;
+    }
+    if (!next_line(cursor, &line, &line_length) || line_length != 7 ||
+        memcmp(line, "hashes:", 7) != 0) {
+        return BPKG_MISSING_HASHES_HEADER;
+    }
+    return BPKG_OK;
+}
+
+/**
+ * Parse the nchunks and "chunks:" lines of a text package
+ * @param cursor set to the line after "chunks:"
+ * @param obj package to fill
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error parse_chunks_header(struct line_cursor *cursor, struct
+        bpkg_obj *obj) {
+    const char *line = NULL;
+    size_t line_length = 0;
+
+    if (!next_line(cursor, &line, &line_length)) {
+        return BPKG_MISSING_NCHUNKS;
+    }
+    // Every inner node has two children
+    if (!parse_number_field(line, line_length, "nchunks:", &obj->nchunks) ||
+        obj->nchunks != obj->nhashes + 1) {
+        return BPKG_INVALID_NCHUNKS;
+    }
+    if (!next_line(cursor, &line, &line_length) || line_length != 7 ||
+        memcmp(line, "chunks:", 7) != 0) {
+        return BPKG_MISSING_CHUNKS_HEADER;
+    }
+    return BPKG_OK;
+}
+
+/**
+ * Parse a text package held in a buffer
+ * @param data
+ * @param length
+ * @param obj package to fill, its tree is set once the counts are known
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error parse_bpkg_buffer(const char *data, size_t length, struct
+        bpkg_obj *obj) {
+    struct line_cursor cursor = {data, data + length};
+    const char *line = NULL;
+    size_t line_length = 0;
+    enum bpkg_error error = parse_header_lines(&cursor, obj);
+    if (error != BPKG_OK) {
+        return error;
+    }
+
+    // The hashes are only checked here, and copied once the tree is
+    // allocated for both counts
+    struct line_cursor hash_lines = cursor;
+    for (uint64_t i = 0; i < obj->nhashes; ++i) {
+        if (!next_line(&cursor, &line, &line_length)) {
+            return BPKG_MISSING_HASHES;
+        }
+        if (!check_hash_line(line, line_length)) {
+            return BPKG_INVALID_HASHES;
+        }
+    }
+    if ((error = parse_chunks_header(&cursor, obj)) != BPKG_OK) {
+        return error;
+    }
+
+    merkle_tree *hashes = create_tree_block(obj->nhashes, obj->nchunks);
+    obj->hashes = hashes;
+    for (size_t i = 0; i < hashes->num_inner_nodes; ++i) {
+        next_line(&hash_lines, &line, &line_length);
+        memcpy(hashes->node_block[i].expected_hash, line + 1, SHA256_HEX_LEN);
+    }
+    for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
+        if (!next_line(&cursor, &line, &line_length) ||
+            !parse_chunk_line(line, line_length, &hashes->node_block[i])) {
+            return BPKG_INVALID_CHUNKS;
+        }
+    }
+    index_chunk_offsets(hashes);
+    memcpy(obj->root_hash, hashes->nodes[0]->expected_hash, SHA256_HEX_LEN);
+    return BPKG_OK;
+}
+
+/**
+ * Check a text package held in a buffer and parse its header and root hash.
+ * Every line is checked as by parse_bpkg_buffer, but the tree is not built.
+ * @param data
+ * @param length
+ * @param obj package to fill, its tree is left NULL
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error parse_bpkg_header_buffer(const char *data, size_t length,
+                                         struct bpkg_obj *obj) {
+    struct line_cursor cursor = {data, data + length};
+    const char *line = NULL;
+    size_t line_length = 0;
+    enum bpkg_error error = parse_header_lines(&cursor, obj);
+    if (error != BPKG_OK) {
+        return error;
+    }
+
+    // The root is the first hash, or the only chunk of a package without
+    // inner nodes
+    for (uint64_t i = 0; i < obj->nhashes; ++i) {
+        if (!next_line(&cursor, &line, &line_length)) {
+            return BPKG_MISSING_HASHES;
+        }
+        if (!check_hash_line(line, line_length)) {
+            return BPKG_INVALID_HASHES;
+        }
+        if (i == 0) {
+            memcpy(obj->root_hash, line + 1, SHA256_HEX_LEN);
+        }
+    }
+    if ((error = parse_chunks_header(&cursor, obj)) != BPKG_OK) {
+        return error;
+    }
+    for (uint64_t i = 0; i < obj->nchunks; ++i) {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        if (!next_line(&cursor, &line, &line_length) ||
+            !check_chunk_line(line, line_length, &offset, &size)) {
+            return BPKG_INVALID_CHUNKS;
+        }
+        if (obj->nhashes == 0) {
+            memcpy(obj->root_hash, line + 1, SHA256_HEX_LEN);
+        }
+    }
+    return BPKG_OK;
+}
+
+/**
+ * Map a text package and parse it
+ * @param path
+ * @param parse_buffer parse_bpkg_buffer or parse_bpkg_header_buffer
+ * @param obj_out set to the heap address of the bpkg_obj if success
+ * @return BPKG_OK if success, the reason of the failure otherwise
+ */
+enum bpkg_error map_and_parse(const char *path, enum bpkg_error
+        (*parse_buffer)(const char *, size_t, struct bpkg_obj *), struct
+        bpkg_obj **obj_out) {
+    *obj_out = NULL;
+    int bpkg_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (bpkg_fd == -1) {
+        return BPKG_INVALID_PATH;
+    }
+    struct stat bpkg_stat;
+    if (fstat(bpkg_fd, &bpkg_stat) == -1 || S_ISDIR(bpkg_stat.st_mode)) {
+        close(bpkg_fd);
+        return BPKG_INVALID_PATH;
+    }
+    size_t length = bpkg_stat.st_size;
+    void *mapped = NULL;
+    if (length > 0) {
+        mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, bpkg_fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(bpkg_fd);
+            return BPKG_INVALID_PATH;
+        }
+        madvise(mapped, length, MADV_SEQUENTIAL);
+    }
+    close(bpkg_fd);
+
+    struct bpkg_obj *obj = calloc(1, sizeof(struct bpkg_obj));
+    enum bpkg_error error = parse_buffer(mapped == NULL ? "" : mapped,
+                                         length, obj);
+    if (mapped != NULL) {
+        munmap(mapped, length);
+    }
+    if (error != BPKG_OK) {
+        bpkg_obj_destroy(obj);
+        return error;
+    }
+    *obj_out = obj;
+    return BPKG_OK;
+}
+
+enum bpkg_error bpkg_parse(const char *path, struct bpkg_obj **obj_out) {
+    return map_and_parse(path, parse_bpkg_buffer, obj_out);
+}
+
+enum bpkg_error bpkg_parse_header(const char *path, struct bpkg_obj
+        **obj_out) {
+    return map_and_parse(path, parse_bpkg_header_buffer, obj_out);
+}
+
+const char *bpkg_error_message(enum bpkg_error error) {
+    return bpkg_error_messages[error];
+}
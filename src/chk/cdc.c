@@ -0,0 +1,86 @@
+#include "chk/cdc.h"
+
+/**
+ * Next value of a splitmix64 sequence, used to fill the gear table the same
+ * way on every machine
+ * @param seed advanced by the call
+ * @return value
+ */
+uint64_t next_gear_value(uint64_t *seed) {
+    uint64_t value = (*seed += 0x9e3779b97f4a7c15ULL);
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+/**
+ * Mask of the highest bits of the hash, which depend on the last 64 bytes
+ * rather than only the last few
+ * @param num_bits
+ * @return mask
+ */
+uint64_t high_bits_mask(int num_bits) {
+    if (num_bits <= 0) {
+        return 0;
+    }
+    if (num_bits >= 64) {
+        return UINT64_MAX;
+    }
+    return UINT64_MAX << (64 - num_bits);
+}
+
+int init_cdc_params(struct cdc_params *params, uint32_t min_size, uint32_t
+        avg_size, uint32_t max_size) {
+    if (max_size == 0 || min_size > avg_size || avg_size > max_size) {
+        return 0;
+    }
+    params->min_size = min_size;
+    params->avg_size = avg_size;
+    params->max_size = max_size;
+
+    // A boundary is expected every 2^bits bytes past the minimum size
+    int bits = 0;
+    while (bits < 31 && (1U << (bits + 1)) <= avg_size) {
+        bits++;
+    }
+    params->mask_small = high_bits_mask(bits + 1);
+    params->mask_large = high_bits_mask(bits - 1);
+
+    uint64_t seed = CDC_GEAR_SEED;
+    for (int i = 0; i < CDC_GEAR_SIZE; ++i) {
+        params->gear[i] = next_gear_value(&seed);
+    }
+    return 1;
+}
+
+size_t scan_cdc_boundary(struct cdc_params *params, struct cdc_state *state,
+                         const uint8_t *data, size_t length, int *cut) {
+    size_t position = 0;
+    *cut = 0;
+    while (position < length) {
+        if (state->length < params->min_size) {
+            uint64_t skip = params->min_size - state->length;
+            if (skip > length - position) {
+                skip = length - position;
+            }
+            position += skip;
+            state->length += skip;
+            if (state->length < params->max_size) {
+                continue;
+            }
+        } else {
+            state->hash = (state->hash << 1) + params->gear[data[position]];
+            position++;
+            state->length++;
+        }
+        uint64_t mask = state->length < params->avg_size ?
+                        params->mask_small : params->mask_large;
+        if ((state->hash & mask) == 0 || state->length >= params->max_size) {
+            state->hash = 0;
+            state->length = 0;
+            *cut = 1;
+            break;
+        }
+    }
+    return position;
+}
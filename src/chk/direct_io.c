@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chk/direct_io.h"
+
+struct direct_buffer_pool direct_buffers = {PTHREAD_MUTEX_INITIALIZER, {0},
+                                            {{0}}};
+
+int open_direct(char *path, int flags) {
+    return open(path, flags | O_DIRECT | O_CLOEXEC);
+}
+
+unsigned int current_numa_node() {
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (getcpu(&cpu, &node) == -1) {
+        return 0;
+    }
+    return node % DIRECT_IO_MAX_NODES;
+}
+
+char *take_direct_buffer() {
+    unsigned int node = current_numa_node();
+    pthread_mutex_lock(&direct_buffers.lock);
+    if (direct_buffers.num_free[node] > 0) {
+        direct_buffers.num_free[node]--;
+        char *buffer = direct_buffers.buffers[node][direct_buffers.num_free[
+                node]];
+        pthread_mutex_unlock(&direct_buffers.lock);
+        return buffer;
+    }
+    pthread_mutex_unlock(&direct_buffers.lock);
+
+    // The pages are placed on the node of the thread that first touches them
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, DIRECT_IO_ALIGN, DIRECT_IO_BUFFER_SIZE) !=
+        0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+void put_direct_buffer(char *buffer) {
+    unsigned int node = current_numa_node();
+    pthread_mutex_lock(&direct_buffers.lock);
+    if (direct_buffers.num_free[node] < DIRECT_IO_POOL_SIZE) {
+        direct_buffers.buffers[node][direct_buffers.num_free[node]] = buffer;
+        direct_buffers.num_free[node]++;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&direct_buffers.lock);
+    free(buffer);
+}
+
+/**
+ * Round a file position down to the alignment of direct I/O
+ */
+off_t align_down(off_t position) {
+    return position & ~((off_t) DIRECT_IO_ALIGN - 1);
+}
+
+/**
+ * Round a file position up to the alignment of direct I/O
+ */
+off_t align_up(off_t position) {
+    return align_down(position + DIRECT_IO_ALIGN - 1);
+}
+
+ssize_t direct_pread(int fd, char *data, uint32_t size, uint64_t offset) {
+    char *buffer = take_direct_buffer();
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    uint32_t bytes_read = 0;
+    while (bytes_read < size) {
+        // Read the aligned blocks around the rest of the range
+        off_t position = (off_t) offset + bytes_read;
+        off_t start = align_down(position);
+        size_t skip = position - start;
+        size_t length = align_up(position + (size - bytes_read)) - start;
+        if (length > DIRECT_IO_BUFFER_SIZE) {
+            length = DIRECT_IO_BUFFER_SIZE;
+        }
+
+        ssize_t nread = pread(fd, buffer, length, start);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread == -1) {
+            put_direct_buffer(buffer);
+            return -1;
+        }
+        // The tail of the file ends within the range
+        if ((size_t) nread <= skip) {
+            break;
+        }
+        size_t available = nread - skip;
+        if (available > size - bytes_read) {
+            available = size - bytes_read;
+        }
+        memcpy(data + bytes_read, buffer + skip, available);
+        bytes_read += available;
+        if ((size_t) nread < length) {
+            break;
+        }
+    }
+    put_direct_buffer(buffer);
+    return bytes_read;
+}
+
+/**
+ * Copy a range of the bytes of buffers as if they were concatenated
+ * @param iov
+ * @param num_iov
+ * @param start position of the range in the concatenated buffers
+ * @param length
+ * @param dest buffer with size >= length
+ */
+void copy_iov_range(struct iovec *iov, int num_iov, size_t start, size_t
+        length, char *dest) {
+    for (int i = 0; i < num_iov && length > 0; ++i) {
+        if (start >= iov[i].iov_len) {
+            start -= iov[i].iov_len;
+            continue;
+        }
+        size_t piece = iov[i].iov_len - start;
+        if (piece > length) {
+            piece = length;
+        }
+        memcpy(dest, (char *) iov[i].iov_base + start, piece);
+        dest += piece;
+        length -= piece;
+        start = 0;
+    }
+}
+
+/**
+ * Write a buffer at an offset, continuing after short writes
+ * @return 1 if success, 0 otherwise
+ */
+int pwrite_all(int fd, char *data, size_t size, off_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(fd, data + written, size - written, offset +
+                                                                    written);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return 0;
+        }
+        written += result;
+    }
+    return 1;
+}
+
+/**
+ * Write the part of buffers that falls within a file range through a
+ * buffer, so it is aligned for O_DIRECT
+ * @param fd
+ * @param iov
+ * @param num_iov
+ * @param iov_offset file offset of the first byte of the buffers
+ * @param start start of the range
+ * @param end end of the range
+ * @param buffer buffer with size >= DIRECT_IO_BUFFER_SIZE
+ * @return 1 if success, 0 otherwise
+ */
+int write_iov_range(int fd, struct iovec *iov, int num_iov, off_t
+        iov_offset, off_t start, off_t end, char *buffer) {
+    while (start < end) {
+        size_t length = end - start;
+        if (length > DIRECT_IO_BUFFER_SIZE) {
+            length = DIRECT_IO_BUFFER_SIZE;
+        }
+        copy_iov_range(iov, num_iov, start - iov_offset, length, buffer);
+        if (!pwrite_all(fd, buffer, length, start)) {
+            return 0;
+        }
+        start += length;
+    }
+    return 1;
+}
+
+int direct_pwritev(int direct_fd, int fd, struct iovec *iov, int num_iov,
+                   uint64_t offset) {
+    size_t size = 0;
+    for (int i = 0; i < num_iov; ++i) {
+        size += iov[i].iov_len;
+    }
+    off_t end = (off_t) offset + size;
+    off_t head_end = align_up(offset) < end ? align_up(offset) : end;
+    off_t tail_start = align_down(end) > head_end ? align_down(end) :
+            head_end;
+
+    char *buffer = take_direct_buffer();
+    if (buffer == NULL) {
+        return 0;
+    }
+    int written = write_iov_range(fd, iov, num_iov, offset, offset,
+                                  head_end, buffer) &&
+                  write_iov_range(direct_fd, iov, num_iov, offset, head_end,
+                                  tail_start, buffer) &&
+                  write_iov_range(fd, iov, num_iov, offset, tail_start, end,
+                                  buffer);
+    put_direct_buffer(buffer);
+    return written;
+}
+
+int read_package_data(struct bpkg_obj *package, char *data, uint32_t size,
+                      uint64_t offset) {
+    if (!package->direct_io) {
+        return get_data(package, size, offset, data);
+    }
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    int data_fd = open_direct(full_path, O_RDONLY);
+    // The filesystem may not support O_DIRECT
+    if (data_fd == -1) {
+        return get_data(package, size, offset, data);
+    }
+    ssize_t bytes_read = direct_pread(data_fd, data, size, offset);
+    close(data_fd);
+    return bytes_read != -1;
+}
+
+void compute_leaf_hashes_direct(merkle_tree *hashes, char *full_filename) {
+    int data_fd = open_direct(full_filename, O_RDONLY);
+    if (data_fd == -1) {
+        compute_leaf_hashes(hashes, full_filename);
+        return;
+    }
+
+    for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
+        merkle_tree_node *current_node = hashes->nodes[i];
+        chunk *current_chunk = current_node->value;
+        char *data_buf = calloc(current_chunk->size, sizeof(char));
+        if (direct_pread(data_fd, data_buf, current_chunk->size,
+                         current_chunk->offset) == -1) {
+            perror("Failed to read the file");
+        }
+        compute_hash(data_buf, current_chunk->size,
+                     current_node->computed_hash);
+        free(data_buf);
+    }
+    close(data_fd);
+}
+
+void free_direct_buffers() {
+    pthread_mutex_lock(&direct_buffers.lock);
+    for (int node = 0; node < DIRECT_IO_MAX_NODES; ++node) {
+        for (int i = 0; i < direct_buffers.num_free[node]; ++i) {
+            free(direct_buffers.buffers[node][i]);
+        }
+        direct_buffers.num_free[node] = 0;
+    }
+    pthread_mutex_unlock(&direct_buffers.lock);
+}
@@ -1,193 +1,27 @@
-#include "chk/pkgchk.h"
-
-void free_node_buf(merkle_tree_node **buf, uint32_t size) {
-    if (buf == NULL) {
-        return;
-    }
-
-    for (int i = 0; i < size; ++i) {
-        if (buf[i] != NULL) {
-            free_node(buf[i]);
-        }
-    }
-    free(buf);
-}
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
+#include "chk/pkgchk.h"
+#include "chk/bpkg_index.h"
+#include "chk/bpkg_parse.h"
+#include "chk/direct_io.h"
+#include "chk/resume.h"
 
 /**
  * Loads the package for when a valid path is given
  */
 struct bpkg_obj *bpkg_load(const char *path) {
-    FILE *bpkg_file = fopen(path, "r");
-    if (bpkg_file == NULL) {
-        printf("Invalid Path to Package File\n");
-        return NULL;
-    }
-
-    struct bpkg_obj *obj = calloc(1, sizeof(struct bpkg_obj));
-    char current_line[MAX_BPKG_LINE_SIZE] = {0};
-
-    // Parsing ident
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Missing Field in Package File: ident\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "ident:%1024s", obj->ident) != 1) {
-        printf("Invalid Field in Package File: ident\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-
-    // Parsing filename
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Missing Field in Package File: filename\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "filename:%256s", obj->filename) != 1) {
-        printf("Invalid Field in Package File: filename\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-
-    // Parsing size
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Missing Field in Package File: size\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "size:%u", &(obj->size)) != 1) {
-        printf("Invalid Field in Package File: size\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-
-    // Parsing nhashes
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Missing Field in Package File: nhashes\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "nhashes:%u", &(obj->nhashes)) != 1) {
-        printf("Invalid Field in Package File: nhashes\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
+    struct bpkg_obj *obj = bpkg_index_load(path);
+    if (obj != NULL) {
+        return obj;
     }
 
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Invalid format in Package File: missing 'hashes:'\n");
-        fclose(bpkg_file);
-        free(obj);
+    enum bpkg_error error = bpkg_parse(path, &obj);
+    if (error != BPKG_OK) {
+        printf("%s\n", bpkg_error_message(error));
         return NULL;
     }
-    char str_buf[FILENAME_MAX] = {0};
-    if (sscanf(current_line, "%s", str_buf) != 1 || !strcmp(str_buf,
-                                                            "hashes:\n")) {
-        printf("Invalid format in Package File: missing 'hashes:'\n");
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-
-    // Parsing non-leaf nodes into a buffer
-    merkle_tree_node **all_nodes = calloc(obj->nhashes, sizeof
-            (merkle_tree_node *));
-    char hash_buf[SHA256_HEX_STRLEN] = {0};
-    char tab_buf = 0;
-    for (int i = 0; i < obj->nhashes; ++i) {
-        if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-            printf("Missing Field in Package File: hashes\n");
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, obj->nhashes);
-            free(obj);
-            return NULL;
-        }
-        if (sscanf(current_line, "%1c%64s", &tab_buf, hash_buf) != 2 ||
-        tab_buf != '\t') {
-            printf("Invalid Field in Package File: hashes\n");
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, obj->nhashes);
-            free(obj);
-            return NULL;
-        }
-        all_nodes[i] = create_node(i, NULL, hash_buf);
-    }
-
-    // Parsing nchunks
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Missing Field in Package File: nchunks\n");
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "nchunks:%u", &(obj->nchunks)) != 1) {
-        printf("Invalid Field in Package File: nchunks\n");
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
-
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        printf("Invalid format in Package File: missing 'chunks:'\n");
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "%s", str_buf) != 1 || !strcmp(str_buf,
-                                                            "chunks:\n")) {
-        printf("Invalid format in Package File: missing 'chunks:'\n");
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
-
-    // Parsing leaf nodes into a buffer
-    size_t num_nodes = obj->nhashes + obj->nchunks;
-    size_t new_buf_size = num_nodes * sizeof(merkle_tree_node *);
-    // Reallocate a larger memory to include the leaf nodes
-    all_nodes = realloc(all_nodes, new_buf_size);
-    for (size_t i = obj->nhashes; i < num_nodes; ++i) {
-        all_nodes[i] = NULL;
-    }
-    uint32_t offset_buf = 0;
-    uint32_t size_buf = 0;
-    for (int i = 0; i < obj->nchunks; ++i) {
-        if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-            printf("Invalid Field in Package File: chunks\n");
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, num_nodes);
-            free(obj);
-            return NULL;
-        }
-        if (sscanf(current_line, "%1c%64s,%u,%u", &tab_buf, hash_buf,
-                   &offset_buf, &size_buf) != 4 || tab_buf != '\t') {
-            printf("Invalid Field in Package File: chunks\n");
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, num_nodes);
-            free(obj);
-            return NULL;
-        }
-        int index = obj->nhashes + i;
-        chunk *new_chunk = create_chunk(offset_buf, size_buf);
-        all_nodes[index] = create_node(index, new_chunk, hash_buf);
-    }
-
-    merkle_tree *new_tree = create_tree(all_nodes, obj->nhashes, obj->nchunks);
-    obj->hashes = new_tree;
-    fclose(bpkg_file);
     return obj;
 }
 
@@ -197,159 +31,57 @@ struct bpkg_obj *bpkg_load(const char *path) {
  * printed
  */
 struct bpkg_obj *bpkg_load_no_message(const char *path, char *directory) {
-    FILE *bpkg_file = fopen(path, "r");
-    if (bpkg_file == NULL) {
-        return NULL;
-    }
-
-    struct bpkg_obj *obj = calloc(1, sizeof(struct bpkg_obj));
-    char current_line[MAX_BPKG_LINE_SIZE] = {0};
-
-    // Parsing ident
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "ident:%1024s", obj->ident) != 1) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-
-    strncpy(obj->directory, directory, MAX_DATA_DIRECTORY_SIZE);
-    // Parsing filename
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "filename:%256s", obj->filename) != 1) {
-        fclose(bpkg_file);
-        free(obj);
+    struct bpkg_obj *obj = bpkg_index_load(path);
+    if (obj == NULL && bpkg_parse(path, &obj) != BPKG_OK) {
         return NULL;
     }
+    strncpy(obj->directory, directory, MAX_DATA_DIRECTORY_SIZE - 1);
+    strncpy(obj->bpkg_path, path, MAX_BPKG_PATH_SIZE - 1);
+    return obj;
+}
 
-    // Parsing size
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "size:%u", &(obj->size)) != 1) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
 
-    // Parsing nhashes
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "nhashes:%u", &(obj->nhashes)) != 1) {
-        fclose(bpkg_file);
-        free(obj);
+struct bpkg_obj *bpkg_load_header(const char *path, char *directory) {
+    struct bpkg_obj *obj = bpkg_index_load_header(path);
+    if (obj == NULL && bpkg_parse_header(path, &obj) != BPKG_OK) {
         return NULL;
     }
+    strncpy(obj->directory, directory, MAX_DATA_DIRECTORY_SIZE - 1);
+    strncpy(obj->bpkg_path, path, MAX_BPKG_PATH_SIZE - 1);
+    return obj;
+}
 
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
-    char str_buf[FILENAME_MAX] = {0};
-    if (sscanf(current_line, "%s", str_buf) != 1 || !strcmp(str_buf,
-                                                            "hashes:\n")) {
-        fclose(bpkg_file);
-        free(obj);
-        return NULL;
-    }
 
-    // Parsing non-leaf nodes into a buffer
-    merkle_tree_node **all_nodes = calloc(obj->nhashes, sizeof
-            (merkle_tree_node *));
-    char hash_buf[SHA256_HEX_STRLEN] = {0};
-    char tab_buf = 0;
-    for (int i = 0; i < obj->nhashes; ++i) {
-        if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, obj->nhashes);
-            free(obj);
-            return NULL;
-        }
-        if (sscanf(current_line, "%1c%64s", &tab_buf, hash_buf) != 2 ||
-            tab_buf != '\t') {
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, obj->nhashes);
-            free(obj);
-            return NULL;
-        }
-        all_nodes[i] = create_node(i, NULL, hash_buf);
-    }
-
-    // Parsing nchunks
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
+int bpkg_load_tree(struct bpkg_obj *obj) {
+    if (obj->hashes != NULL) {
+        return 1;
     }
-    if (sscanf(current_line, "nchunks:%u", &(obj->nchunks)) != 1) {
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
+    struct bpkg_obj *full = bpkg_load_no_message(obj->bpkg_path,
+                                                 obj->directory);
+    if (full == NULL) {
+        return 0;
     }
+    // The file may have been replaced since the header was loaded
+    int same = strcmp(full->ident, obj->ident) == 0 &&
+               strcmp(full->filename, obj->filename) == 0 &&
+               full->size == obj->size && full->nhashes == obj->nhashes &&
+               full->nchunks == obj->nchunks &&
+               strncmp(full->root_hash, obj->root_hash, SHA256_HEX_LEN) == 0;
+    if (same) {
+        obj->hashes = full->hashes;
+        full->hashes = NULL;
+    }
+    bpkg_obj_destroy(full);
+    return same;
+}
 
-    if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
-    if (sscanf(current_line, "%s", str_buf) != 1 || !strcmp(str_buf,
-                                                            "chunks:\n")) {
-        fclose(bpkg_file);
-        free_node_buf(all_nodes, obj->nhashes);
-        free(obj);
-        return NULL;
-    }
 
-    // Parsing leaf nodes into a buffer
-    size_t num_nodes = obj->nhashes + obj->nchunks;
-    size_t new_buf_size = num_nodes * sizeof(merkle_tree_node *);
-    // Reallocate a larger memory to include the leaf nodes
-    all_nodes = realloc(all_nodes, new_buf_size);
-    for (size_t i = obj->nhashes; i < num_nodes; ++i) {
-        all_nodes[i] = NULL;
-    }
-    uint32_t offset_buf = 0;
-    uint32_t size_buf = 0;
-    for (int i = 0; i < obj->nchunks; ++i) {
-        if (fgets(current_line, MAX_BPKG_LINE_SIZE, bpkg_file) == NULL) {
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, num_nodes);
-            free(obj);
-            return NULL;
-        }
-        if (sscanf(current_line, "%1c%64s,%u,%u", &tab_buf, hash_buf,
-                   &offset_buf, &size_buf) != 4 || tab_buf != '\t') {
-            fclose(bpkg_file);
-            free_node_buf(all_nodes, num_nodes);
-            free(obj);
-            return NULL;
-        }
-        int index = obj->nhashes + i;
-        chunk *new_chunk = create_chunk(offset_buf, size_buf);
-        all_nodes[index] = create_node(index, new_chunk, hash_buf);
+void bpkg_unload_tree(struct bpkg_obj *obj) {
+    if (obj->hashes != NULL) {
+        free_tree(obj->hashes);
+        obj->hashes = NULL;
     }
-
-    merkle_tree *new_tree = create_tree(all_nodes, obj->nhashes, obj->nchunks);
-    obj->hashes = new_tree;
-    fclose(bpkg_file);
-    return obj;
+    memset(&obj->hashed_identity, 0, sizeof(struct data_identity));
 }
 
 
@@ -379,6 +111,27 @@ int check_file_existence(char *full_filename) {
 }
 
 
+int create_data_file(struct bpkg_obj *bpkg) {
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, bpkg);
+    if (check_file_existence(full_path)) {
+        return 1;
+    }
+    FILE *fp = fopen(full_path, "wb");
+    if (fp == NULL) {
+        perror("fopen - wb:");
+        return 0;
+    }
+    // Create file with specified size, as a sparse file
+    int created = ftruncate(fileno(fp), (off_t) bpkg->size) != -1;
+    if (!created) {
+        perror("ftruncate:");
+    }
+    fclose(fp);
+    return created;
+}
+
+
 /**
  * Get the data in the bpkg data file, with specified file offset and size
  * @param obj bpkg object
@@ -387,7 +140,7 @@ int check_file_existence(char *full_filename) {
  * @param data_buf buffer to store the data (with size >= data size)
  * @return
  */
-int get_data(struct bpkg_obj *obj, uint32_t size, uint32_t file_offset,
+int get_data(struct bpkg_obj *obj, uint32_t size, uint64_t file_offset,
         char
         *data_buf) {
     char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
@@ -401,7 +154,7 @@ int get_data(struct bpkg_obj *obj, uint32_t size, uint32_t file_offset,
     }
 
     FILE *fp = fopen(full_path, "rb");
-    if (fseek(fp, file_offset, SEEK_SET) != 0) {
+    if (fseeko(fp, (off_t) file_offset, SEEK_SET) != 0) {
         perror("Failed to offset the file");
         fclose(fp);
         return 0;
@@ -418,59 +171,72 @@ int get_data(struct bpkg_obj *obj, uint32_t size, uint32_t file_offset,
 }
 
 
+int open_data_file(struct bpkg_obj *obj) {
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, obj);
+    int data_fd = open(full_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (data_fd == -1) {
+        return -1;
+    }
+    // A new or short file is extended to the package size, as a sparse file
+    struct stat data_stat;
+    if (fstat(data_fd, &data_stat) == -1 || (data_stat.st_size <
+            (off_t) obj->size && ftruncate(data_fd, (off_t) obj->size) ==
+            -1)) {
+        close(data_fd);
+        return -1;
+    }
+    return data_fd;
+}
+
 /**
  * Write the data in the data buffer into the bpkg data file
  * @param obj bpkg object
  * @param file_size data size
  * @param file_offset file offset
  * @param data_buf buffer that contains the data (with size >= data size)
- * @return
+ * @return 1 if success, 0 otherwise
  */
-int write_data(struct bpkg_obj *obj, uint32_t file_size, uint32_t file_offset, char
-*data_buf) {
-    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
-    get_file_full_path(full_path, obj);
+int write_data(struct bpkg_obj *obj, uint32_t file_size, uint64_t
+        file_offset, char *data_buf) {
+    int data_fd = open_data_file(obj);
+    if (data_fd == -1) {
+        perror("write_data:open:");
+        return 0;
+    }
 
-    FILE *fp = NULL;
-    if (check_file_existence(full_path) == 0) {
-        if ((fp = fopen(full_path, "wb")) == NULL) {
-            perror("write_data - wb:");
-        }
-        // Create file with specified size
-        char null_byte = 0;
-        for (size_t i = 0; i < obj->size; ++i) {
-            fwrite(&null_byte, sizeof(char), 1, fp);
-        }
-        fseek(fp, 0, SEEK_SET);
-    } else {
-        if ((fp = fopen(full_path, "r+b")) == NULL) {
-            perror("write_data - r+b:");
+    uint32_t written = 0;
+    while (written < file_size) {
+        ssize_t result = pwrite(data_fd, data_buf + written, file_size -
+                                written, (off_t) (file_offset + written));
+        if (result == -1 && errno == EINTR) {
+            continue;
         }
-        // Make sure the file size is correct
-        fseek(fp, 0, SEEK_END);
-        long file_size = ftell(fp);
-        char null_byte = 0;
-        for (long i = file_size; i < obj->size; ++i) {
-            fwrite(&null_byte, sizeof(char), 1, fp);
+        if (result <= 0) {
+            perror("write_data:pwrite:");
+            break;
         }
-        fseek(fp, 0, SEEK_SET);
+        written += result;
     }
+    close(data_fd);
+    return written == file_size;
+}
 
-    if (fseek(fp, file_offset, SEEK_SET) != 0) {
-        perror("Failed to offset the file");
-        fclose(fp);
-        return 0;
-    }
 
-    // printf("WRITING DATA: size: %u offset: %u\n\n", size, abs_offset);
-    if (fwrite(data_buf, sizeof(char), file_size, fp) < file_size) {
-        perror("write_data:fwrite:");
+struct bpkg_query create_query(size_t len, size_t string_size) {
+    struct bpkg_query qry = {NULL, len};
+    if (len == 0) {
+        return qry;
     }
-    fclose(fp);
-    return 1;
+    // The strings follow the array of pointers to them
+    qry.hashes = calloc(1, len * (sizeof(char *) + string_size));
+    char *strings = (char *) (qry.hashes + len);
+    for (size_t i = 0; i < len; ++i) {
+        qry.hashes[i] = strings + i * string_size;
+    }
+    return qry;
 }
 
-
 /**
  * Checks to see if the referenced filename in the bpkg file
  * exists or not.
@@ -486,19 +252,21 @@ struct bpkg_query bpkg_file_check(struct bpkg_obj *bpkg) {
         return query;
     }
 
-    query.hashes = calloc(1, sizeof(char *));
+    query = create_query(1, sizeof(FILE_CREATED_MESSAGE) >
+                            sizeof(FILE_EXIST_MESSAGE) ?
+                            sizeof(FILE_CREATED_MESSAGE) :
+                            sizeof(FILE_EXIST_MESSAGE));
     if (check_file_existence(bpkg->filename)) {
-        query.hashes[0] = calloc(strlen(FILE_EXIST_MESSAGE) + 1, sizeof(char));
         strcpy(query.hashes[0], FILE_EXIST_MESSAGE);
     } else {
         // Create a new file with specified byte size, initialised with NULLs
         FILE *new_file = fopen(bpkg->filename, "wb");
-        char null_byte = 0;
-        for (size_t i = 0; i < bpkg->size; ++i) {
-            fwrite(&null_byte, sizeof(char), 1, new_file);
+        if (new_file != NULL) {
+            if (ftruncate(fileno(new_file), (off_t) bpkg->size) == -1) {
+                perror("bpkg_file_check");
+            }
+            fclose(new_file);
         }
-        fclose(new_file);
-        query.hashes[0] = calloc(strlen(FILE_CREATED_MESSAGE) + 1, sizeof(char));
         strcpy(query.hashes[0], FILE_CREATED_MESSAGE);
     }
 
@@ -513,12 +281,11 @@ struct bpkg_query bpkg_file_check(struct bpkg_obj *bpkg) {
  * 		and the number of hashes that have been retrieved
  */
 struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj *bpkg) {
-    struct bpkg_query qry = {NULL, bpkg->hashes->num_nodes};
-
-    qry.hashes = calloc(bpkg->hashes->num_nodes, sizeof(char *));
+    struct bpkg_query qry = create_query(bpkg->hashes->num_nodes,
+                                         SHA256_HEX_STRLEN);
     for (size_t i = 0; i < bpkg->hashes->num_nodes; ++i) {
-        qry.hashes[i] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-        strcpy(qry.hashes[i], bpkg->hashes->nodes[i]->expected_hash);
+        memcpy(qry.hashes[i], bpkg->hashes->nodes[i]->expected_hash,
+               SHA256_HEX_LEN);
     }
 
     return qry;
@@ -537,9 +304,24 @@ int compute_chunk_hashes(struct bpkg_obj *bpkg) {
     if (check_file_existence(full_filename) == 0) {
         return 0;
     }
+    // The leaves verified before are trusted while the data file is unchanged
+    struct data_identity identity = {0};
+    if (bpkg->resume_state && get_data_identity(full_filename, &identity) &&
+        load_resume_state(bpkg, full_filename, &identity)) {
+        return 1;
+    }
 
-    // Compute the hashes of the leaves
-    compute_leaf_hashes(bpkg->hashes, full_filename);
+    // Compute the hashes of the leaves, bulk verification of a package that
+    // bypasses the page cache does not evict the data of other processes
+    if (bpkg->direct_io) {
+        compute_leaf_hashes_direct(bpkg->hashes, full_filename);
+    } else {
+        compute_leaf_hashes(bpkg->hashes, full_filename);
+    }
+    // A file changed while it was hashed no longer matches the identity
+    if (bpkg->resume_state) {
+        write_resume_state(bpkg, full_filename, &identity);
+    }
     return 1;
 }
 
@@ -564,10 +346,37 @@ int bpkg_complete_check(struct bpkg_obj *bpkg) {
 }
 
 
-int check_chunk_completion(struct bpkg_obj *bpkg, char *hash, uint32_t
+/**
+ * Find the leaf of a chunk by the offset of its data, without scanning the
+ * leaves if the tree is indexed
+ * @param hashes
+ * @param hash expected hash of the chunk
+ * @param file_offset offset in the chunk, not 0
+ * @param found set to the leaf or NULL if the tree is indexed
+ * @return 1 if the tree is indexed, 0 if the leaves have to be scanned
+ */
+int find_leaf_at_offset(merkle_tree *hashes, char *hash, uint64_t
+        file_offset, merkle_tree_node **found) {
+    if (file_offset == 0 || hashes->layout == CHUNKS_UNINDEXED) {
+        return 0;
+    }
+    size_t key = find_leaf_by_offset(hashes, file_offset);
+    *found = NULL;
+    if (key < hashes->num_nodes && strncmp(hashes->nodes[key]->expected_hash,
+                                           hash, SHA256_HEX_LEN) == 0) {
+        *found = hashes->nodes[key];
+    }
+    return 1;
+}
+
+int check_chunk_completion(struct bpkg_obj *bpkg, char *hash, uint64_t
 file_offset) {
     compute_chunk_hashes(bpkg);
     merkle_tree *hashes = bpkg->hashes;
+    merkle_tree_node *found = NULL;
+    if (find_leaf_at_offset(hashes, hash, file_offset, &found)) {
+        return found != NULL && compare_node_hash(found);
+    }
     // Iterate through all leaf nodes
     for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
         struct merkle_tree_node *current_node = hashes->nodes[i];
@@ -601,9 +410,13 @@ file_offset) {
  * @param file_offset
  * @return heap memory address of the chunk, NULL if not found
  */
-chunk *get_chunk_from_hash(struct bpkg_obj *bpkg, char *hash, uint32_t
+chunk *get_chunk_from_hash(struct bpkg_obj *bpkg, char *hash, uint64_t
 file_offset) {
     merkle_tree *hashes = bpkg->hashes;
+    merkle_tree_node *found = NULL;
+    if (find_leaf_at_offset(hashes, hash, file_offset, &found)) {
+        return found != NULL ? found->value : NULL;
+    }
     // Iterate through all leaf nodes
     for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
         struct merkle_tree_node *current_node = hashes->nodes[i];
@@ -629,32 +442,76 @@ file_offset) {
 }
 
 
-/**
- * Retrieves all completed chunks of a package object
- * @param bpkg, constructed bpkg object
- * @return query_result, This structure will contain a list of hashes
- * 		and the number of hashes that have been retrieved
- */
-struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj *bpkg) {
-    struct bpkg_query qry = {0};
+size_t find_chunk_leaf(struct bpkg_obj *bpkg, char *hash, uint64_t
+        chunk_offset) {
+    merkle_tree *hashes = bpkg->hashes;
+    if (hashes->layout != CHUNKS_UNINDEXED) {
+        size_t key = find_leaf_by_offset(hashes, chunk_offset);
+        if (key < hashes->num_nodes &&
+            hashes->nodes[key]->value->offset == chunk_offset &&
+            strncmp(hashes->nodes[key]->expected_hash, hash,
+                    SHA256_HEX_LEN) == 0) {
+            return key - hashes->num_inner_nodes;
+        }
+        return hashes->num_leaves;
+    }
+
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes +
+                                               leaf];
+        if (node->value->offset == chunk_offset &&
+            strncmp(node->expected_hash, hash, SHA256_HEX_LEN) == 0) {
+            return leaf;
+        }
+    }
+    return hashes->num_leaves;
+}
+
+
+size_t bpkg_find_completed_chunks(struct bpkg_obj *bpkg, size_t *keys) {
     // The file doesn't exist hence no completed chunks
     if (compute_chunk_hashes(bpkg) == 0) {
-        return qry;
+        return 0;
     }
 
-    size_t qry_size = 0;
-    qry.hashes = calloc(qry_size, sizeof(char *));
+    size_t num_keys = 0;
     merkle_tree *hashes = bpkg->hashes;
     for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
         if (compare_node_hash(hashes->nodes[i])) {
-            qry_size++;
-            qry.hashes = realloc(qry.hashes, qry_size * sizeof(char *));
-            qry.hashes[qry_size - 1] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-            strcpy(qry.hashes[qry_size - 1], hashes->nodes[i]->expected_hash);
+            keys[num_keys++] = i;
         }
     }
+    return num_keys;
+}
+
+/**
+ * Copy the expected hashes of nodes into a query
+ * @param hashes
+ * @param keys
+ * @param num_keys
+ * @return query of the hashes
+ */
+struct bpkg_query query_from_keys(merkle_tree *hashes, size_t *keys, size_t
+        num_keys) {
+    struct bpkg_query qry = create_query(num_keys, SHA256_HEX_STRLEN);
+    for (size_t i = 0; i < num_keys; ++i) {
+        memcpy(qry.hashes[i], hashes->nodes[keys[i]]->expected_hash,
+               SHA256_HEX_LEN);
+    }
+    return qry;
+}
 
-    qry.len = qry_size;
+/**
+ * Retrieves all completed chunks of a package object
+ * @param bpkg, constructed bpkg object
+ * @return query_result, This structure will contain a list of hashes
+ * 		and the number of hashes that have been retrieved
+ */
+struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj *bpkg) {
+    size_t *keys = malloc(bpkg->hashes->num_leaves * sizeof(size_t));
+    size_t num_keys = bpkg_find_completed_chunks(bpkg, keys);
+    struct bpkg_query qry = query_from_keys(bpkg->hashes, keys, num_keys);
+    free(keys);
     return qry;
 }
 
@@ -670,6 +527,39 @@ void compute_all_hashes(struct bpkg_obj *bpkg) {
 }
 
 
+int compare_keys(const void *a, const void *b) {
+    size_t key_a = *(const size_t *) a;
+    size_t key_b = *(const size_t *) b;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+size_t bpkg_find_min_completed_hashes(struct bpkg_obj *bpkg, size_t *keys) {
+    compute_all_hashes(bpkg);
+    merkle_tree *hashes = bpkg->hashes;
+
+    // Depth-first walk that takes a complete node instead of its subtree,
+    // a left child has an odd key and its sibling the next key
+    size_t num_keys = 0;
+    size_t key = 0;
+    while (1) {
+        if (compare_node_hash(hashes->nodes[key])) {
+            keys[num_keys++] = key;
+        } else if (key < hashes->num_inner_nodes) {
+            key = 2 * key + 1;
+            continue;
+        }
+        while (key != 0 && key % 2 == 0) {
+            key = (key - 1) / 2;
+        }
+        if (key == 0) {
+            break;
+        }
+        key++;
+    }
+    qsort(keys, num_keys, sizeof(size_t), compare_keys);
+    return num_keys;
+}
+
 /**
  * Gets only the required/min hashes to represent the current completion state
  * Return the smallest set of hashes of completed branches to represent
@@ -680,52 +570,38 @@ void compute_all_hashes(struct bpkg_obj *bpkg) {
  * 		and the number of hashes that have been retrieved
  */
 struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj *bpkg) {
-    struct bpkg_query qry = {0};
-    compute_all_hashes(bpkg);
-    merkle_tree *hashes = bpkg->hashes;
+    size_t *keys = malloc(bpkg->hashes->num_leaves * sizeof(size_t));
+    size_t num_keys = bpkg_find_min_completed_hashes(bpkg, keys);
+    struct bpkg_query qry = query_from_keys(bpkg->hashes, keys, num_keys);
+    free(keys);
+    return qry;
+}
 
-    // The root node is complete
-    if (compare_node_hash(hashes->nodes[0])) {
-        qry.len = 1;
-        qry.hashes = calloc(qry.len, sizeof(char *));
-        qry.hashes[0] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-        strcpy(qry.hashes[0], hashes->nodes[0]->expected_hash);
-        return qry;
-    }
 
-    size_t qry_size = 0;
-    qry.hashes = calloc(qry_size, sizeof(char *));
-    int *added_keys = calloc(qry_size, sizeof(int));
-    // BFS on every node
-    for (size_t i = 1 ; i < hashes->num_nodes; ++i) {
-        merkle_tree_node *current_node = hashes->nodes[i];
-        if (compare_node_hash(current_node)) {
-            // Check if the node is a descent of any existing hashes
-            int add = 1;
-            for (size_t j = 0;  j < qry_size; ++j) {
-                if (check_child_from_node(added_keys[j], current_node->key)) {
-                    add = 0;
-                    break;
-                }
-            }
-            if (add) {
-                qry_size++;
-                qry.hashes = realloc(qry.hashes, qry_size * sizeof(char *));
-                qry.hashes[qry_size - 1] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-                strcpy(qry.hashes[qry_size - 1], current_node->expected_hash);
-
-                added_keys = realloc(added_keys, qry_size * sizeof(int));
-                added_keys[qry_size - 1] = current_node->key;
-            }
-        }
+size_t bpkg_find_chunk_span(struct bpkg_obj *bpkg, char *hash, size_t
+        *first) {
+    merkle_tree *hashes = bpkg->hashes;
+    size_t key = 0;
+    while (key < hashes->num_nodes && strncmp(hashes->nodes[key]
+                                                      ->expected_hash, hash,
+                                              SHA256_HEX_LEN) != 0) {
+        key++;
+    }
+    // The given hash is not in the merkle tree
+    if (key == hashes->num_nodes) {
+        return 0;
     }
 
-    free(added_keys);
-    qry.len = qry_size;
-    return qry;
+    // The leftmost and rightmost leaves of the subtree bound its leaves
+    size_t last = key;
+    while (key < hashes->num_inner_nodes) {
+        key = 2 * key + 1;
+        last = 2 * last + 2;
+    }
+    *first = key;
+    return last - key + 1;
 }
 
-
 /**
  * Retrieves all chunk hashes given a certain an ancestor hash (or itself)
  * Example: If the root hash was given, all chunk hashes will be outputted
@@ -739,50 +615,152 @@ struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj *bpkg) {
  */
 struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj *bpkg,
                                                       char *hash) {
-    struct bpkg_query qry = {0};
+    size_t first = 0;
+    size_t num_leaves = bpkg_find_chunk_span(bpkg, hash, &first);
+    struct bpkg_query qry = create_query(num_leaves, SHA256_HEX_STRLEN);
+    for (size_t i = 0; i < num_leaves; ++i) {
+        memcpy(qry.hashes[i], bpkg->hashes->nodes[first + i]->expected_hash,
+               SHA256_HEX_LEN);
+    }
+    return qry;
+}
 
-    merkle_tree *hashes = bpkg->hashes;
-    merkle_tree_node *current_node = NULL;
-    for (size_t i = 0; i < hashes->num_nodes; ++i) {
-        current_node = hashes->nodes[i];
-        if (strncmp(current_node->expected_hash, hash, SHA256_HEX_LEN) == 0) {
-            break;
+
+// Complete chunk of the old version, sorted by hash for the delta plan
+struct delta_source {
+    char *hash;
+    uint64_t offset;
+    uint32_t size;
+};
+
+int compare_delta_source(const void *a, const void *b) {
+    return strcmp(((struct delta_source *) a)->hash, ((struct delta_source *)
+            b)->hash);
+}
+
+struct bpkg_delta bpkg_get_delta(struct bpkg_obj *old_obj, struct bpkg_obj
+        *new_obj) {
+    struct bpkg_delta delta = {0};
+    if (old_obj == NULL || new_obj == NULL) {
+        return delta;
+    }
+
+    // Only the chunks present in the old data file can be copied
+    merkle_tree *old_hashes = old_obj->hashes;
+    struct delta_source *sources = calloc(old_hashes->num_leaves + 1,
+                                          sizeof(struct delta_source));
+    size_t num_sources = 0;
+    if (compute_chunk_hashes(old_obj)) {
+        for (size_t i = old_hashes->num_inner_nodes;
+             i < old_hashes->num_nodes; ++i) {
+            merkle_tree_node *current_node = old_hashes->nodes[i];
+            if (compare_node_hash(current_node)) {
+                sources[num_sources].hash = current_node->expected_hash;
+                sources[num_sources].offset = current_node->value->offset;
+                sources[num_sources].size = current_node->value->size;
+                num_sources++;
+            }
         }
     }
-    // The given hash is not in the merkle tree
-    if (current_node == NULL) {
-        return qry;
-        // The given hash is a leaf node
-    } else if (current_node->value != NULL) {
-        qry.len = 1;
-        qry.hashes = calloc(qry.len, sizeof(char *));
-        qry.hashes[0] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-        strncpy(qry.hashes[0], hash, SHA256_HEX_LEN);
-        return qry;
+    qsort(sources, num_sources, sizeof(struct delta_source),
+          compare_delta_source);
+
+    merkle_tree *new_hashes = new_obj->hashes;
+    delta.len = new_hashes->num_leaves;
+    delta.chunks = calloc(delta.len, sizeof(chunk *));
+    delta.hashes = calloc(delta.len, sizeof(char *));
+    delta.old_offsets = calloc(delta.len, sizeof(int64_t));
+    for (size_t i = 0; i < delta.len; ++i) {
+        merkle_tree_node *current_node = new_hashes->nodes[new_hashes
+                ->num_inner_nodes + i];
+        delta.chunks[i] = current_node->value;
+        delta.hashes[i] = current_node->expected_hash;
+        delta.old_offsets[i] = -1;
+
+        struct delta_source key = {current_node->expected_hash, 0, 0};
+        struct delta_source *found = bsearch(&key, sources, num_sources,
+                                             sizeof(struct delta_source),
+                                             compare_delta_source);
+        if (found != NULL && found->size == current_node->value->size) {
+            delta.old_offsets[i] = found->offset;
+            delta.num_copied++;
+        }
     }
+    free(sources);
+    return delta;
+}
 
-    // Get all leaf hashes, with NULL at the end of the array
-    char** leaf_hashes = get_all_leaf_hashes_from_node(hashes, current_node);
-    size_t qry_size = 0;
-    qry.hashes = calloc(qry_size, sizeof(char *));
-    while (leaf_hashes[qry_size] != NULL) {
-        qry_size++;
-        qry.hashes = realloc(qry.hashes, qry_size * sizeof(char *));
-        qry.hashes[qry_size - 1] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-        strcpy(qry.hashes[qry_size - 1], leaf_hashes[qry_size - 1]);
-    }
-    qry.len = qry_size;
-    // Free the memory of leaf_hashes
-    for (size_t i = 0; i < qry_size; ++i) {
-        if (leaf_hashes[i] != NULL) {
-            free(leaf_hashes[i]);
+int bpkg_apply_delta(struct bpkg_obj *old_obj, struct bpkg_obj *new_obj,
+                     struct bpkg_delta *delta) {
+    char old_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(old_path, old_obj);
+    char new_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(new_path, new_obj);
+    char temp_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE +
+                   sizeof(DELTA_TEMP_SUFFIX)];
+    snprintf(temp_path, sizeof(temp_path), "%s%s", new_path,
+             DELTA_TEMP_SUFFIX);
+
+    int old_fd = open(old_path, O_RDONLY | O_CLOEXEC);
+    if (old_fd == -1 && delta->num_copied > 0) {
+        return 0;
+    }
+    int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       0644);
+    if (temp_fd == -1 || ftruncate(temp_fd, new_obj->size) == -1) {
+        perror("bpkg_apply_delta");
+        if (temp_fd != -1) {
+            close(temp_fd);
+            unlink(temp_path);
+        }
+        if (old_fd != -1) {
+            close(old_fd);
         }
+        return 0;
     }
-    free(leaf_hashes);
 
-    return qry;
+    // Unchanged chunks are copied within the kernel
+    int success = 1;
+    for (size_t i = 0; i < delta->len && success; ++i) {
+        if (delta->old_offsets[i] == -1) {
+            continue;
+        }
+        loff_t offset_in = delta->old_offsets[i];
+        loff_t offset_out = delta->chunks[i]->offset;
+        uint32_t bytes_copied = 0;
+        while (bytes_copied < delta->chunks[i]->size) {
+            ssize_t copied = copy_file_range(old_fd, &offset_in, temp_fd,
+                                             &offset_out,
+                                             delta->chunks[i]->size -
+                                             bytes_copied, 0);
+            if (copied <= 0) {
+                success = 0;
+                break;
+            }
+            bytes_copied += copied;
+        }
+    }
+    if (old_fd != -1) {
+        close(old_fd);
+    }
+    close(temp_fd);
+
+    if (!success || rename(temp_path, new_path) == -1) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
 }
 
+void bpkg_delta_destroy(struct bpkg_delta *delta) {
+    if (delta == NULL) {
+        return;
+    }
+
+    free(delta->chunks);
+    free(delta->hashes);
+    free(delta->old_offsets);
+}
 
 /**
  * Deallocates the query result after it has been constructed from
@@ -792,13 +770,8 @@ void bpkg_query_destroy(struct bpkg_query *qry) {
     if (qry == NULL || qry->hashes == NULL) {
         return;
     }
-
-    for (size_t i = 0; i < qry->len; ++i) {
-        if (qry->hashes[i] != NULL) {
-            free(qry->hashes[i]);
-        }
-    }
     free(qry->hashes);
+    qry->hashes = NULL;
 }
 
 /**
@@ -0,0 +1,177 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chk/resume.h"
+
+#define RESUME_PATH_SIZE (MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE + \
+                          sizeof(RESUME_SUFFIX))
+// Room for the thread id appended to the path of a file being written
+#define RESUME_TEMP_PATH_SIZE (RESUME_PATH_SIZE + 16)
+
+int get_data_identity(char *full_path, struct data_identity *identity) {
+    struct stat data_stat;
+    if (stat(full_path, &data_stat) == -1) {
+        return 0;
+    }
+    identity->inode = data_stat.st_ino;
+    identity->size = data_stat.st_size;
+    identity->mtime_sec = data_stat.st_mtim.tv_sec;
+    identity->mtime_nsec = data_stat.st_mtim.tv_nsec;
+    return 1;
+}
+
+/**
+ * Check if two identities are of the same unchanged file
+ * @return 1 if true, 0 otherwise
+ */
+int same_identity(struct data_identity *a, struct data_identity *b) {
+    return a->inode != 0 && a->inode == b->inode && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * Size of the bitmap of the verified leaves
+ * @param num_leaves
+ * @return bytes
+ */
+size_t resume_bitmap_size(size_t num_leaves) {
+    return (num_leaves + 7) / 8;
+}
+
+/**
+ * Read the bitmap of the verified leaves of a package from a resume file
+ * @param bpkg
+ * @param resume_path
+ * @param identity current identity of the data file
+ * @return heap address of the bitmap, NULL if the file does not match
+ */
+uint8_t *read_resume_bitmap(struct bpkg_obj *bpkg, char *resume_path,
+                            struct data_identity *identity) {
+    FILE *resume_file = fopen(resume_path, "rb");
+    if (resume_file == NULL) {
+        return NULL;
+    }
+    merkle_tree *hashes = bpkg->hashes;
+    struct resume_header header;
+    if (fread(&header, sizeof(struct resume_header), 1, resume_file) != 1 ||
+        memcmp(header.magic, RESUME_MAGIC, RESUME_MAGIC_SIZE) != 0 ||
+        header.version != RESUME_VERSION ||
+        !same_identity(&header.identity, identity) ||
+        header.nchunks != hashes->num_leaves ||
+        strncmp(header.root_hash, bpkg->root_hash, SHA256_HEX_LEN) != 0) {
+        fclose(resume_file);
+        return NULL;
+    }
+
+    size_t bitmap_size = resume_bitmap_size(hashes->num_leaves);
+    uint8_t *bitmap = malloc(bitmap_size + 1);
+    // The file ends right after the bitmap
+    if (fread(bitmap, 1, bitmap_size + 1, resume_file) != bitmap_size) {
+        free(bitmap);
+        bitmap = NULL;
+    }
+    fclose(resume_file);
+    return bitmap;
+}
+
+int load_resume_state(struct bpkg_obj *bpkg, char *full_path, struct
+        data_identity *identity) {
+    if (same_identity(&bpkg->hashed_identity, identity)) {
+        return 1;
+    }
+    char resume_path[RESUME_PATH_SIZE];
+    snprintf(resume_path, RESUME_PATH_SIZE, "%s%s", full_path, RESUME_SUFFIX);
+    uint8_t *bitmap = read_resume_bitmap(bpkg, resume_path, identity);
+    if (bitmap == NULL) {
+        return 0;
+    }
+
+    merkle_tree *hashes = bpkg->hashes;
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes + leaf];
+        if (bitmap[leaf / 8] & (1 << (leaf % 8))) {
+            memcpy(node->computed_hash, node->expected_hash,
+                   SHA256_HEX_STRLEN);
+        } else {
+            node->computed_hash[0] = '\0';
+        }
+    }
+    free(bitmap);
+    bpkg->hashed_identity = *identity;
+    return 1;
+}
+
+int write_resume_state(struct bpkg_obj *bpkg, char *full_path, struct
+        data_identity *identity) {
+    if (identity->inode == 0) {
+        return 0;
+    }
+    // The leaves stay valid in memory even if the file cannot be written
+    bpkg->hashed_identity = *identity;
+
+    merkle_tree *hashes = bpkg->hashes;
+    struct resume_header header;
+    memset(&header, 0, sizeof(struct resume_header));
+    memcpy(header.magic, RESUME_MAGIC, sizeof(RESUME_MAGIC));
+    header.version = RESUME_VERSION;
+    header.identity = *identity;
+    header.nchunks = hashes->num_leaves;
+    memcpy(header.root_hash, bpkg->root_hash, SHA256_HEX_LEN);
+    size_t bitmap_size = resume_bitmap_size(hashes->num_leaves);
+    uint8_t *bitmap = calloc(bitmap_size, sizeof(uint8_t));
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        if (compare_node_hash(hashes->nodes[hashes->num_inner_nodes +
+                                            leaf])) {
+            bitmap[leaf / 8] |= 1 << (leaf % 8);
+        }
+    }
+
+    // Threads saving the same package at once each write their own file
+    char resume_path[RESUME_PATH_SIZE];
+    char temp_path[RESUME_TEMP_PATH_SIZE];
+    snprintf(resume_path, RESUME_PATH_SIZE, "%s%s", full_path, RESUME_SUFFIX);
+    snprintf(temp_path, RESUME_TEMP_PATH_SIZE, "%s.%d", resume_path, gettid());
+    FILE *resume_file = fopen(temp_path, "wb");
+    // The contents are on the disk before the rename makes them visible
+    int written = resume_file != NULL &&
+                  fwrite(&header, sizeof(struct resume_header), 1,
+                         resume_file) == 1 &&
+                  fwrite(bitmap, 1, bitmap_size, resume_file) ==
+                  bitmap_size && fflush(resume_file) == 0 &&
+                  fsync(fileno(resume_file)) == 0;
+    if (resume_file != NULL && fclose(resume_file) != 0) {
+        written = 0;
+    }
+    free(bitmap);
+    if (!written || rename(temp_path, resume_path) == -1) {
+        printf("Failed to write the resume file\n");
+        remove(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+void record_verified_chunk(struct bpkg_obj *bpkg, char *hash, uint64_t
+        file_offset) {
+    merkle_tree *hashes = bpkg->hashes;
+    if (hashes == NULL || bpkg->hashed_identity.inode == 0) {
+        return;
+    }
+    size_t leaf = find_chunk_leaf(bpkg, hash, file_offset);
+    if (leaf < hashes->num_leaves) {
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes + leaf];
+        memcpy(node->computed_hash, node->expected_hash, SHA256_HEX_STRLEN);
+    }
+}
+
+void save_resume_state(struct bpkg_obj *bpkg) {
+    if (bpkg->hashes == NULL || bpkg->hashed_identity.inode == 0) {
+        return;
+    }
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, bpkg);
+    struct data_identity identity;
+    if (get_data_identity(full_path, &identity)) {
+        write_resume_state(bpkg, full_path, &identity);
+    }
+}
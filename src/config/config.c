@@ -1,5 +1,167 @@
 #include "config/config.h"
 
+/**
+ * Parse an optional rate limit line, such as upload_rate:1048576
+ * @param line
+ * @param config
+ * @return 1 if success, 0 otherwise
+ */
+int parse_rate_limit(char *line, struct config *config) {
+    char key_buf[MAX_RATE_KEY_SIZE] = {0};
+    char value_buf[MAX_RATE_DIGITS + 1] = {0};
+    char end_buf = 0;
+    int matched = sscanf(line, "%31[^:]:%19[0-9]%c", key_buf, value_buf,
+                         &end_buf);
+    if (matched < 2 || (matched == 3 && end_buf != '\n')) {
+        return 0;
+    }
+    uint64_t rate = strtoull(value_buf, NULL, 10);
+
+    if (strcmp(key_buf, "upload_rate") == 0) {
+        config->upload_rate = rate;
+    } else if (strcmp(key_buf, "download_rate") == 0) {
+        config->download_rate = rate;
+    } else if (strcmp(key_buf, "peer_upload_rate") == 0) {
+        config->peer_upload_rate = rate;
+    } else if (strcmp(key_buf, "peer_download_rate") == 0) {
+        config->peer_download_rate = rate;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Parse the optional unix_socket line, the path of the AF_UNIX socket that
+ * peers on the same host connect to
+ * @param line
+ * @param config
+ * @return 1 if success, 0 otherwise
+ */
+int parse_unix_socket(char *line, struct config *config) {
+    char path_buf[MAX_CONFIG_LINE_SIZE] = {0};
+    if (sscanf(line, "unix_socket:%5011[^\n]", path_buf) != 1 || strlen
+            (path_buf) >= MAX_SOCKET_PATH_SIZE) {
+        return 0;
+    }
+    strncpy(config->unix_socket, path_buf, MAX_SOCKET_PATH_SIZE - 1);
+    return 1;
+}
+
+/**
+ * Parse an optional on/off line, such as chunk_store:on (serve and copy
+ * chunks shared by packages from any package that holds them) or
+ * direct_io:on (access the data files with O_DIRECT), startup_scan:on
+ * (register the packages of the directory at startup) or resume_state:on
+ * (keep the verified leaves of the data files across restarts)
+ * @param line
+ * @param key
+ * @param value set to 1 for on, 0 for off
+ * @return 1 if success, 0 otherwise
+ */
+int parse_switch(char *line, char *key, int *value) {
+    char value_buf[4] = {0};
+    char end_buf = 0;
+    size_t key_len = strlen(key);
+    if (strncmp(line, key, key_len) != 0 || line[key_len] != ':') {
+        return 0;
+    }
+    int matched = sscanf(line + key_len + 1, "%3[a-z]%c", value_buf,
+                         &end_buf);
+    if (matched < 1 || (matched == 2 && end_buf != '\n')) {
+        return 0;
+    }
+
+    if (strcmp(value_buf, "on") == 0) {
+        *value = 1;
+    } else if (strcmp(value_buf, "off") == 0) {
+        *value = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Parse the optional durability line, durability:none, durability:periodic
+ * or durability:sync
+ * @param line
+ * @param config
+ * @return 1 if success, 0 otherwise
+ */
+int parse_durability(char *line, struct config *config) {
+    char value_buf[9] = {0};
+    char end_buf = 0;
+    int matched = sscanf(line, "durability:%8[a-z]%c", value_buf, &end_buf);
+    if (matched < 1 || (matched == 2 && end_buf != '\n')) {
+        return 0;
+    }
+
+    if (strcmp(value_buf, "none") == 0) {
+        config->durability = DURABILITY_NONE;
+    } else if (strcmp(value_buf, "periodic") == 0) {
+        config->durability = DURABILITY_PERIODIC;
+    } else if (strcmp(value_buf, "sync") == 0) {
+        config->durability = DURABILITY_SYNC;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Parse the optional tree_idle_timeout line, the seconds after which the tree
+ * of an unused package is freed, such as tree_idle_timeout:300
+ * @param line
+ * @param config
+ * @return 1 if success, 0 otherwise
+ */
+int parse_tree_idle_timeout(char *line, struct config *config) {
+    char value_buf[MAX_RATE_DIGITS + 1] = {0};
+    char end_buf = 0;
+    int matched = sscanf(line, "tree_idle_timeout:%10[0-9]%c", value_buf,
+                         &end_buf);
+    if (matched < 1 || (matched == 2 && end_buf != '\n')) {
+        return 0;
+    }
+    config->tree_idle_timeout = strtoull(value_buf, NULL, 10);
+    return 1;
+}
+
+/**
+ * Parse an optional CPU list of a kind of threads, such as cpus_network:0-3,
+ * cpus_verify:4,5 or cpus_io:6-7
+ * @param line
+ * @param config
+ * @return 1 if success, 0 otherwise
+ */
+int parse_cpu_affinity(char *line, struct config *config) {
+    char key_buf[MAX_CPU_KEY_SIZE] = {0};
+    char list_buf[MAX_CPU_LIST_SIZE] = {0};
+    char end_buf = 0;
+    int matched = sscanf(line, "%15[^:]:%255[0-9,-]%c", key_buf, list_buf,
+                         &end_buf);
+    if (matched < 2 || (matched == 3 && end_buf != '\n')) {
+        return 0;
+    }
+
+    enum thread_role role;
+    if (strcmp(key_buf, "cpus_network") == 0) {
+        role = THREAD_NETWORK;
+    } else if (strcmp(key_buf, "cpus_verify") == 0) {
+        role = THREAD_VERIFY;
+    } else if (strcmp(key_buf, "cpus_io") == 0) {
+        role = THREAD_IO;
+    } else {
+        return 0;
+    }
+    if (!parse_cpu_list(list_buf, &config->affinity.cpus[role])) {
+        return 0;
+    }
+    config->affinity.pinned[role] = 1;
+    return 1;
+}
+
 int parse_config(char *filename, struct config *config) {
     FILE *config_file = fopen(filename, "r");
     if (config_file == NULL) {
@@ -58,6 +220,41 @@ int parse_config(char *filename, struct config *config) {
     }
     config->port = (u_int16_t)config->max_peers;
 
+    // Parsing optional rate limits, unix socket and switches
+    while (fgets(current_line, MAX_CONFIG_LINE_SIZE, config_file) != NULL) {
+        if (current_line[0] == '\n') {
+            continue;
+        }
+        int parsed;
+        if (strncmp(current_line, "unix_socket:", 12) == 0) {
+            parsed = parse_unix_socket(current_line, config);
+        } else if (strncmp(current_line, "chunk_store:", 12) == 0) {
+            parsed = parse_switch(current_line, "chunk_store",
+                                  &config->chunk_store);
+        } else if (strncmp(current_line, "direct_io:", 10) == 0) {
+            parsed = parse_switch(current_line, "direct_io",
+                                  &config->direct_io);
+        } else if (strncmp(current_line, "startup_scan:", 13) == 0) {
+            parsed = parse_switch(current_line, "startup_scan",
+                                  &config->startup_scan);
+        } else if (strncmp(current_line, "resume_state:", 13) == 0) {
+            parsed = parse_switch(current_line, "resume_state",
+                                  &config->resume_state);
+        } else if (strncmp(current_line, "durability:", 11) == 0) {
+            parsed = parse_durability(current_line, config);
+        } else if (strncmp(current_line, "tree_idle_timeout:", 18) == 0) {
+            parsed = parse_tree_idle_timeout(current_line, config);
+        } else if (strncmp(current_line, "cpus_", 5) == 0) {
+            parsed = parse_cpu_affinity(current_line, config);
+        } else {
+            parsed = parse_rate_limit(current_line, config);
+        }
+        if (!parsed) {
+            closedir(dp);
+            return INVALID_FIELD;
+        }
+    }
+
     closedir(dp);
     return 0;
 }
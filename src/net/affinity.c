@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net/affinity.h"
+
+struct affinity thread_affinity = {0};
+
+int parse_cpu_list(char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    char *current = list;
+    while (*current != '\0') {
+        char *end = NULL;
+        long first = strtol(current, &end, 10);
+        if (end == current || first < 0 || first >= CPU_SETSIZE) {
+            return 0;
+        }
+        long last = first;
+        if (*end == '-') {
+            current = end + 1;
+            last = strtol(current, &end, 10);
+            if (end == current || last < first || last >= CPU_SETSIZE) {
+                return 0;
+            }
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (*end == ',' && end[1] != '\0') {
+            end++;
+        } else if (*end != '\0') {
+            return 0;
+        }
+        current = end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+void set_thread_affinity(struct affinity *affinity) {
+    memcpy(&thread_affinity, affinity, sizeof(struct affinity));
+}
+
+int pin_current_thread(enum thread_role role) {
+    if (!thread_affinity.pinned[role]) {
+        return 1;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                  &thread_affinity.cpus[role]) == 0;
+}
+
+int count_role_cpus(enum thread_role role) {
+    if (thread_affinity.pinned[role]) {
+        return CPU_COUNT(&thread_affinity.cpus[role]);
+    }
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus > 0 ? (int) num_cpus : 1;
+}
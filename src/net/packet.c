@@ -1,4 +1,90 @@
-#include "net/packet.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "net/shm_ring.h"
+
+#define SEND_LOCKS_INIT_SIZE 64
+
+// Sends to a socket are serialised per fd, so the pieces of a partial write
+// of one thread are never interleaved with the packets of another
+struct send_lock_table {
+    pthread_mutex_t lock;
+    int max_fds;
+    pthread_mutex_t **locks; // allocated on first use and kept for the fd
+} send_lock_table = {PTHREAD_MUTEX_INITIALIZER, 0, NULL};
+
+/**
+ * Get the current time of a monotonic clock
+ * @return time in microseconds
+ */
+uint64_t get_time_us() {
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+/**
+ * Get the send lock of a socket
+ * @param peer_fd
+ * @return the lock, kept for later connections reusing the fd
+ */
+pthread_mutex_t *get_send_lock(int peer_fd) {
+    pthread_mutex_lock(&send_lock_table.lock);
+    if (peer_fd >= send_lock_table.max_fds) {
+        int old_size = send_lock_table.max_fds;
+        if (send_lock_table.max_fds == 0) {
+            send_lock_table.max_fds = SEND_LOCKS_INIT_SIZE;
+        }
+        while (peer_fd >= send_lock_table.max_fds) {
+            send_lock_table.max_fds *= 2;
+        }
+        send_lock_table.locks = realloc(send_lock_table.locks,
+                send_lock_table.max_fds * sizeof(pthread_mutex_t *));
+        for (int i = old_size; i < send_lock_table.max_fds; ++i) {
+            send_lock_table.locks[i] = NULL;
+        }
+    }
+    if (send_lock_table.locks[peer_fd] == NULL) {
+        send_lock_table.locks[peer_fd] = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(send_lock_table.locks[peer_fd], NULL);
+    }
+    pthread_mutex_t *send_lock = send_lock_table.locks[peer_fd];
+    pthread_mutex_unlock(&send_lock_table.lock);
+    return send_lock;
+}
+
+/**
+ * Write buffers to a socket, continuing after partial writes and signals.
+ * The caller holds the send lock of the socket.
+ * @param peer_fd
+ * @param iov modified as the buffers are written
+ * @param num_iov
+ * @return 1 if success, 0 if the socket is disconnected
+ */
+int write_all(int peer_fd, struct iovec *iov, int num_iov) {
+    struct iovec *current = iov;
+    while (num_iov > 0) {
+        ssize_t send_result = writev(peer_fd, current, num_iov);
+        if (send_result == -1 && errno == EINTR) {
+            continue;
+        }
+        // The socket is disconnected
+        if (send_result <= 0) {
+            return 0;
+        }
+        while (num_iov > 0 && (size_t) send_result >= current->iov_len) {
+            send_result -= current->iov_len;
+            current++;
+            num_iov--;
+        }
+        if (num_iov > 0) {
+            current->iov_base = (char *) current->iov_base + send_result;
+            current->iov_len -= send_result;
+        }
+    }
+    return 1;
+}
 
 /**
  * Send a packet to a peer
@@ -14,40 +100,93 @@ int send_packet(uint16_t msg_code, uint16_t err, union btide_payload *payload,
     packet_buf.msg_code = msg_code;
     packet_buf.error = err;
 
-    if (payload != NULL && msg_code == PKT_MSG_REQ) {
+    if (payload != NULL && (msg_code == PKT_MSG_REQ || msg_code ==
+                                                      PKT_MSG_CAN)) {
         packet_buf.pl.request = payload->request;
     } else if (payload != NULL && msg_code == PKT_MSG_RES) {
         packet_buf.pl.response = payload->response;
+    } else if (payload != NULL && (msg_code == PKT_MSG_ACP || msg_code ==
+                                                             PKT_MSG_ACK)) {
+        packet_buf.pl.handshake = payload->handshake;
     }
 
-    ssize_t send_result = send(peer_fd, &packet_buf, PACKET_SIZE, 0);
-    // The socket is disconnected
-    if (send_result <= 0) {
-        return 0;
+    struct shm_channel *channel = get_shm_channel(peer_fd);
+    if (channel != NULL) {
+        int result = shm_send(channel, &packet_buf, 1);
+        put_shm_channel(channel);
+        return result;
     }
 
-    if (send_result < PACKET_SIZE) {
-        printf("Failed to send all contents in %hu Packet to Client FD: %d\n",
-               msg_code, peer_fd);
+    struct iovec iov = {&packet_buf, PACKET_SIZE};
+    pthread_mutex_t *send_lock = get_send_lock(peer_fd);
+    pthread_mutex_lock(send_lock);
+    int sent = write_all(peer_fd, &iov, 1);
+    pthread_mutex_unlock(send_lock);
+    return sent;
+}
+
+/**
+ * Send a burst of packets to a peer with a single writev
+ * @param packets
+ * @param num_packets at most MAX_BURST_PACKETS
+ * @param peer_fd
+ * @return 1 if success, 0 for error
+ */
+int send_packets(struct btide_packet *packets, int num_packets, int peer_fd) {
+    if (num_packets > MAX_BURST_PACKETS) {
         return 0;
     }
+    struct shm_channel *channel = get_shm_channel(peer_fd);
+    if (channel != NULL) {
+        int result = shm_send(channel, packets, num_packets);
+        put_shm_channel(channel);
+        return result;
+    }
 
-    return 1;
+    struct iovec iov[MAX_BURST_PACKETS];
+    int num_iov = num_packets;
+    for (int i = 0; i < num_iov; ++i) {
+        iov[i].iov_base = &packets[i];
+        iov[i].iov_len = PACKET_SIZE;
+    }
+
+    // The whole burst is written under the lock, other threads' packets go
+    // before or after it
+    pthread_mutex_t *send_lock = get_send_lock(peer_fd);
+    pthread_mutex_lock(send_lock);
+    int sent = write_all(peer_fd, iov, num_iov);
+    pthread_mutex_unlock(send_lock);
+    return sent;
+}
+
+/**
+ * Timer callback closing a connection whose handshake timed out, the
+ * blocked read then returns
+ * @param arg pointer to the peer fd
+ */
+void expire_handshake(void *arg) {
+    int *peer_fd = arg;
+    shutdown(*peer_fd, SHUT_RDWR);
 }
 
 /**
  * Wait for a packet with a timeout of 3 seconds
+ * @param timers
  * @param packet_buf
  * @param peer_fd
- * @return
+ * @return 1 if success, 0 otherwise
  */
-int get_packet_tm(struct btide_packet *packet_buf, int peer_fd) {
-    // 3 seconds timeout for receiving a response
-    struct timeval timeout = {3, 0};
-    setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
-               sizeof(timeout));
+int get_packet_tm(struct timer_wheel *timers, struct btide_packet
+        *packet_buf, int peer_fd) {
+    struct timer timeout;
+    init_timer(&timeout, expire_handshake, &peer_fd);
+    timer_add(timers, &timeout, HANDSHAKE_TIMEOUT_US);
 
     ssize_t read_result = read(peer_fd, packet_buf, PACKET_SIZE);
+    // The timer fired, the connection is already shut down
+    if (!timer_cancel_sync(timers, &timeout)) {
+        return 0;
+    }
     // Peer disconnected or error occurred
     if (read_result <= 0) {
         return 0;
@@ -59,46 +198,133 @@ int get_packet_tm(struct btide_packet *packet_buf, int peer_fd) {
         return 0;
     }
 
-    // Change the socket back to waiting indefinitely
-    timeout.tv_sec = 0;
-    setsockopt(peer_fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout,
-               sizeof(timeout));
     return 1;
 }
 
+/**
+ * Get the protocol version of a connection from the ACP or ACK of the peer
+ * @param packet_buf
+ * @return the lower version of the two peers
+ */
+uint32_t negotiate_version(struct btide_packet *packet_buf) {
+    uint32_t version = packet_buf->pl.handshake.version;
+    // Peers of version 1 send an empty payload
+    if (version < 1) {
+        version = 1;
+    }
+    return version < PROTOCOL_VERSION ? version : PROTOCOL_VERSION;
+}
+
 /**
  * Send ACP to peer and wait for ACK with 3 seconds timeout
+ * @param timers
  * @param peer_fd
+ * @param version set to the protocol version of the connection
  * @return 1 if success, 0 otherwise
  */
-int send_ACP(int peer_fd) {
+int send_ACP(struct timer_wheel *timers, int peer_fd, uint32_t *version) {
     // Send the ACP packet
-    if (!send_packet(PKT_MSG_ACP, 0, NULL, peer_fd)) {
+    union btide_payload payload = {0};
+    payload.handshake.version = PROTOCOL_VERSION;
+    if (!send_packet(PKT_MSG_ACP, 0, &payload, peer_fd)) {
         return 0;
     }
 
     // 3 seconds timeout for receiving a response
     struct btide_packet packet_buf = {0};
-    if (!get_packet_tm(&packet_buf, peer_fd)) {
+    if (!get_packet_tm(timers, &packet_buf, peer_fd)) {
         return 0;
     }
 
+    *version = negotiate_version(&packet_buf);
     return 1;
 }
 
 /**
  * Handle ACP by sending back ACK
+ * @param acp the ACP packet
  * @param peer_fd
+ * @param version set to the protocol version of the connection
  * @return 1 if success, 0 otherwise
  */
-int handle_ACP(int peer_fd) {
-    if (!send_packet(PKT_MSG_ACK, 0, NULL, peer_fd)) {
+int handle_ACP(struct btide_packet *acp, int peer_fd, uint32_t *version) {
+    union btide_payload payload = {0};
+    payload.handshake.version = PROTOCOL_VERSION;
+    if (!send_packet(PKT_MSG_ACK, 0, &payload, peer_fd)) {
         printf("Failed to send ACK Packet to Peer FD: %d\n", peer_fd);
         return 0;
     }
+    *version = negotiate_version(acp);
     return 1;
 }
 
+uint64_t get_request_offset(struct request_payload *req, uint32_t version) {
+    uint64_t offset = req->file_offset;
+    if (version >= 2) {
+        offset |= (uint64_t) req->file_offset_high << 32;
+    }
+    return offset;
+}
+
+void set_request_offset(struct request_payload *req, uint64_t offset) {
+    req->file_offset = (uint32_t) offset;
+    req->file_offset_high = (uint32_t) (offset >> 32);
+}
+
+uint16_t max_response_data(uint64_t file_offset) {
+    return (file_offset >> 32) == 0 ? MAX_DATA_SIZE : MAX_DATA_SIZE_V2;
+}
+
+void fill_response(struct btide_packet *packet, uint16_t err, uint64_t
+        file_offset, char *chunk_hash, char *ident, char *data, uint16_t
+        data_len) {
+    packet->error = err;
+    if ((file_offset >> 32) == 0) {
+        struct response_payload *res = &packet->pl.response;
+        packet->msg_code = PKT_MSG_RES;
+        res->file_offset = (uint32_t) file_offset;
+        strncpy(res->chunk_hash, chunk_hash, CHUNK_HASH_SIZE);
+        strncpy(res->ident, ident, IDENT_SIZE);
+        if (data != NULL) {
+            memcpy(res->data, data, data_len);
+        }
+        res->data_len = data_len;
+        return;
+    }
+
+    struct response_payload_v2 *res = &packet->pl.response_v2;
+    packet->msg_code = PKT_MSG_RES2;
+    res->file_offset = (uint32_t) file_offset;
+    res->file_offset_high = (uint32_t) (file_offset >> 32);
+    strncpy(res->chunk_hash, chunk_hash, CHUNK_HASH_SIZE);
+    strncpy(res->ident, ident, IDENT_SIZE);
+    if (data != NULL) {
+        memcpy(res->data, data, data_len);
+    }
+    res->data_len = data_len;
+}
+
+void get_response_fields(struct btide_packet *packet, struct response_fields
+        *fields) {
+    if (packet->msg_code == PKT_MSG_RES2) {
+        struct response_payload_v2 *res = &packet->pl.response_v2;
+        fields->file_offset = (uint64_t) res->file_offset_high << 32 |
+                              res->file_offset;
+        fields->data = res->data;
+        fields->data_len = res->data_len;
+        fields->chunk_hash = res->chunk_hash;
+        fields->ident = res->ident;
+        return;
+    }
+
+    struct response_payload *res = &packet->pl.response;
+    fields->file_offset = res->file_offset;
+    fields->data = res->data;
+    fields->data_len = res->data_len;
+    fields->chunk_hash = res->chunk_hash;
+    fields->ident = res->ident;
+}
+
 /**
  * Send DSN to peer
  * @param peer_fd
@@ -144,6 +370,182 @@ int send_RES(uint16_t err, union btide_payload *res, int peer_fd) {
     return 1;
 }
 
+/**
+ * Send CAN to peer to cancel a REQ that is no longer needed
+ * @param req payload of the cancelled REQ
+ * @param peer_fd
+ * @return 1 if success, 0 otherwise
+ */
+int send_CAN(union btide_payload *req, int peer_fd) {
+    if (!send_packet(PKT_MSG_CAN, 0, req, peer_fd)) {
+        printf("Failed to send CAN packet to Peer FD: %d\n", peer_fd);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Send a packet over an AF_UNIX socket together with fds
+ * @param packet_buf
+ * @param fds
+ * @param num_fds at most MAX_PASSED_FDS
+ * @param peer_fd
+ * @return 1 if success, 0 otherwise
+ */
+int send_with_fds(struct btide_packet *packet_buf, int *fds, int num_fds, int
+        peer_fd) {
+    if (num_fds > MAX_PASSED_FDS) {
+        return 0;
+    }
+    struct iovec iov = {packet_buf, PACKET_SIZE};
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    // The fds go with the first byte, the rest of a partial send follows
+    pthread_mutex_t *send_lock = get_send_lock(peer_fd);
+    pthread_mutex_lock(send_lock);
+    ssize_t send_result;
+    do {
+        send_result = sendmsg(peer_fd, &msg, 0);
+    } while (send_result == -1 && errno == EINTR);
+    int sent = send_result > 0;
+    if (sent && send_result < PACKET_SIZE) {
+        iov.iov_base = (char *) packet_buf + send_result;
+        iov.iov_len = PACKET_SIZE - send_result;
+        sent = write_all(peer_fd, &iov, 1);
+    }
+    pthread_mutex_unlock(send_lock);
+    return sent;
+}
+
+/**
+ * Send RFD to a peer on the same host, passing a read-only fd of the data
+ * file with SCM_RIGHTS
+ * @param res request payload with the offset and length of the chunk
+ * @param file_fd
+ * @param peer_fd AF_UNIX socket
+ * @return 1 if success, 0 otherwise
+ */
+int send_RFD(union btide_payload *res, int file_fd, int peer_fd) {
+    struct btide_packet packet_buf = {0};
+    packet_buf.msg_code = PKT_MSG_RFD;
+    packet_buf.pl.request = res->request;
+
+    if (!send_with_fds(&packet_buf, &file_fd, 1, peer_fd)) {
+        printf("Failed to send RFD packet to Peer FD: %d\n", peer_fd);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Send SHM to a peer on the same host, passing the fds of a shared memory
+ * channel with SCM_RIGHTS
+ * @param fds
+ * @param num_fds at most MAX_PASSED_FDS
+ * @param peer_fd AF_UNIX socket
+ * @return 1 if success, 0 otherwise
+ */
+int send_SHM(int *fds, int num_fds, int peer_fd) {
+    struct btide_packet packet_buf = {0};
+    packet_buf.msg_code = PKT_MSG_SHM;
+
+    if (!send_with_fds(&packet_buf, fds, num_fds, peer_fd)) {
+        printf("Failed to send SHM packet to Peer FD: %d\n", peer_fd);
+        return 0;
+    }
+    return 1;
+}
+
+ssize_t recv_packet(int peer_fd, struct btide_packet *packet_buf, int
+        *passed_fds) {
+    for (int i = 0; i < MAX_PASSED_FDS; ++i) {
+        passed_fds[i] = -1;
+    }
+    struct shm_channel *channel = get_shm_channel(peer_fd);
+    if (channel != NULL) {
+        int from_ring = shm_recv(channel, peer_fd, packet_buf);
+        put_shm_channel(channel);
+        if (from_ring) {
+            return PACKET_SIZE;
+        }
+    }
+
+    struct iovec iov = {packet_buf, PACKET_SIZE};
+    char control[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t read_result;
+    do {
+        read_result = recvmsg(peer_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (read_result == -1 && errno == EINTR);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (read_result > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(passed_fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+
+    if (read_result <= 0) {
+        return read_result;
+    }
+    // A stream socket may return part of a packet, the fds are only passed
+    // with its first byte
+    size_t bytes_recv = read_result;
+    while (bytes_recv < PACKET_SIZE) {
+        ssize_t part = recv(peer_fd, (char *) packet_buf + bytes_recv,
+                            PACKET_SIZE - bytes_recv, 0);
+        if (part == -1 && errno == EINTR) {
+            continue;
+        }
+        if (part <= 0) {
+            close_passed_fds(passed_fds);
+            return part;
+        }
+        bytes_recv += part;
+    }
+    return (ssize_t) bytes_recv;
+}
+
+int peek_packets(int peer_fd, struct btide_packet *packets, int max_packets) {
+    struct shm_channel *channel = get_shm_channel(peer_fd);
+    if (channel != NULL) {
+        int num_packets = shm_peek(channel, packets, max_packets);
+        put_shm_channel(channel);
+        return num_packets;
+    }
+
+    ssize_t peek_len = recv(peer_fd, packets, max_packets * PACKET_SIZE,
+                            MSG_PEEK | MSG_DONTWAIT);
+    if (peek_len < PACKET_SIZE) {
+        return 0;
+    }
+    return (int) (peek_len / PACKET_SIZE);
+}
+
+void close_passed_fds(int *passed_fds) {
+    for (int i = 0; i < MAX_PASSED_FDS; ++i) {
+        if (passed_fds[i] != -1) {
+            close(passed_fds[i]);
+            passed_fds[i] = -1;
+        }
+    }
+}
+
 /**
  * Send PNG
  * @param peer_fd
@@ -0,0 +1,248 @@
+#include <string.h>
+
+#include "net/shaper.h"
+
+/**
+ * Set the rate of a bucket and start it full
+ * @param bucket
+ * @param rate bytes per second, 0 for unlimited
+ */
+void set_bucket_rate(struct token_bucket *bucket, uint64_t rate) {
+    pthread_mutex_lock(&bucket->lock);
+    bucket->rate = rate;
+    bucket->burst = rate * SHAPER_BURST_US / 1000000;
+    if (bucket->burst < MIN_BURST_BYTES) {
+        bucket->burst = MIN_BURST_BYTES;
+    }
+    bucket->tokens = (double) bucket->burst;
+    bucket->last_us = get_time_us();
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+void init_bucket(struct token_bucket *bucket, uint64_t rate) {
+    pthread_mutex_init(&bucket->lock, NULL);
+    set_bucket_rate(bucket, rate);
+}
+
+/**
+ * Add the tokens earned since the last refill, the bucket lock must be held
+ * @param bucket
+ */
+void refill_bucket(struct token_bucket *bucket) {
+    uint64_t now = get_time_us();
+    bucket->tokens += (double) (now - bucket->last_us) * (double)
+            bucket->rate / 1000000.0;
+    if (bucket->tokens > (double) bucket->burst) {
+        bucket->tokens = (double) bucket->burst;
+    }
+    bucket->last_us = now;
+}
+
+/**
+ * Take tokens from a bucket, going into debt if there are not enough
+ * @param bucket
+ * @param bytes
+ * @return time until the debt is paid back in microseconds
+ */
+uint64_t take_tokens(struct token_bucket *bucket, uint64_t bytes) {
+    pthread_mutex_lock(&bucket->lock);
+    if (bucket->rate == 0) {
+        pthread_mutex_unlock(&bucket->lock);
+        return 0;
+    }
+    refill_bucket(bucket);
+    bucket->tokens -= (double) bytes;
+    uint64_t delay_us = 0;
+    if (bucket->tokens < 0) {
+        delay_us = (uint64_t) (-bucket->tokens * 1000000.0 / (double)
+                bucket->rate);
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return delay_us;
+}
+
+/**
+ * Check if a bucket is out of debt
+ * @param bucket
+ * @return 1 if tokens can be taken without waiting, 0 otherwise
+ */
+int bucket_ready(struct token_bucket *bucket) {
+    pthread_mutex_lock(&bucket->lock);
+    if (bucket->rate != 0) {
+        refill_bucket(bucket);
+    }
+    int ready = bucket->rate == 0 || bucket->tokens > 0;
+    pthread_mutex_unlock(&bucket->lock);
+    return ready;
+}
+
+struct shaper *create_shaper(uint64_t upload_rate, uint64_t download_rate,
+                             uint64_t peer_upload_rate, uint64_t
+                             peer_download_rate) {
+    struct shaper *new_shaper = calloc(1, sizeof(struct shaper));
+    pthread_mutex_init(&new_shaper->lock, NULL);
+    init_bucket(&new_shaper->upload, upload_rate);
+    init_bucket(&new_shaper->download, download_rate);
+    new_shaper->peer_upload_rate = peer_upload_rate;
+    new_shaper->peer_download_rate = peer_download_rate;
+    new_shaper->max_fds = SHAPER_FDS_INIT_SIZE;
+    new_shaper->peers = calloc(SHAPER_FDS_INIT_SIZE, sizeof(struct
+            peer_shaping *));
+    return new_shaper;
+}
+
+/**
+ * Get the per-peer buckets of a connection, creating them on first use
+ * @param shaper
+ * @param peer_fd
+ * @return the buckets, which stay at the same address until the shaper is
+ * freed
+ */
+struct peer_shaping *get_peer_shaping(struct shaper *shaper, int peer_fd) {
+    pthread_mutex_lock(&shaper->lock);
+    if (peer_fd >= shaper->max_fds) {
+        int old_size = shaper->max_fds;
+        while (peer_fd >= shaper->max_fds) {
+            shaper->max_fds *= 2;
+        }
+        shaper->peers = realloc(shaper->peers, shaper->max_fds * sizeof
+                (struct peer_shaping *));
+        for (int i = old_size; i < shaper->max_fds; ++i) {
+            shaper->peers[i] = NULL;
+        }
+    }
+    if (shaper->peers[peer_fd] == NULL) {
+        struct peer_shaping *new_shaping = calloc(1, sizeof(struct
+                peer_shaping));
+        init_bucket(&new_shaping->upload, shaper->peer_upload_rate);
+        init_bucket(&new_shaping->download, shaper->peer_download_rate);
+        shaper->peers[peer_fd] = new_shaping;
+    }
+    struct peer_shaping *shaping = shaper->peers[peer_fd];
+    pthread_mutex_unlock(&shaper->lock);
+    return shaping;
+}
+
+void reset_peer_shaping(struct shaper *shaper, int peer_fd) {
+    struct peer_shaping *shaping = get_peer_shaping(shaper, peer_fd);
+    set_bucket_rate(&shaping->upload, shaper->peer_upload_rate);
+    set_bucket_rate(&shaping->download, shaper->peer_download_rate);
+}
+
+int find_rate_limit(char *name) {
+    if (strcmp(name, "upload_rate") == 0) {
+        return LIMIT_UPLOAD;
+    }
+    if (strcmp(name, "download_rate") == 0) {
+        return LIMIT_DOWNLOAD;
+    }
+    if (strcmp(name, "peer_upload_rate") == 0) {
+        return LIMIT_PEER_UPLOAD;
+    }
+    if (strcmp(name, "peer_download_rate") == 0) {
+        return LIMIT_PEER_DOWNLOAD;
+    }
+    return -1;
+}
+
+void set_rate_limit(struct shaper *shaper, enum rate_limit limit, uint64_t
+        rate) {
+    if (limit == LIMIT_UPLOAD) {
+        set_bucket_rate(&shaper->upload, rate);
+        return;
+    }
+    if (limit == LIMIT_DOWNLOAD) {
+        set_bucket_rate(&shaper->download, rate);
+        return;
+    }
+
+    pthread_mutex_lock(&shaper->lock);
+    if (limit == LIMIT_PEER_UPLOAD) {
+        shaper->peer_upload_rate = rate;
+    } else {
+        shaper->peer_download_rate = rate;
+    }
+    for (int i = 0; i < shaper->max_fds; ++i) {
+        if (shaper->peers[i] == NULL) {
+            continue;
+        }
+        if (limit == LIMIT_PEER_UPLOAD) {
+            set_bucket_rate(&shaper->peers[i]->upload, rate);
+        } else {
+            set_bucket_rate(&shaper->peers[i]->download, rate);
+        }
+    }
+    pthread_mutex_unlock(&shaper->lock);
+}
+
+void shape_upload(struct shaper *shaper, int peer_fd, uint64_t bytes) {
+    struct peer_shaping *shaping = get_peer_shaping(shaper, peer_fd);
+    uint64_t delay_us = take_tokens(&shaper->upload, bytes);
+    uint64_t peer_delay_us = take_tokens(&shaping->upload, bytes);
+    if (peer_delay_us > delay_us) {
+        delay_us = peer_delay_us;
+    }
+    if (delay_us == 0) {
+        return;
+    }
+
+    struct timespec delay = {(time_t) (delay_us / 1000000), (long) (delay_us %
+            1000000) * 1000};
+    nanosleep(&delay, NULL);
+}
+
+int shape_download(struct shaper *shaper, int peer_fd, uint64_t bytes) {
+    struct peer_shaping *shaping = get_peer_shaping(shaper, peer_fd);
+    if (!bucket_ready(&shaper->download) || !bucket_ready
+            (&shaping->download)) {
+        return 0;
+    }
+    take_tokens(&shaper->download, bytes);
+    take_tokens(&shaping->download, bytes);
+    return 1;
+}
+
+/**
+ * Print a limit in bytes per second
+ * @param name
+ * @param rate
+ */
+void print_rate_limit(char *name, uint64_t rate) {
+    if (rate == 0) {
+        printf("%s: unlimited\n", name);
+    } else {
+        printf("%s: %lu B/s\n", name, rate);
+    }
+}
+
+void print_rate_limits(struct shaper *shaper) {
+    pthread_mutex_lock(&shaper->lock);
+    print_rate_limit("upload_rate", shaper->upload.rate);
+    print_rate_limit("download_rate", shaper->download.rate);
+    print_rate_limit("peer_upload_rate", shaper->peer_upload_rate);
+    print_rate_limit("peer_download_rate", shaper->peer_download_rate);
+    pthread_mutex_unlock(&shaper->lock);
+}
+
+void free_bucket(struct token_bucket *bucket) {
+    pthread_mutex_destroy(&bucket->lock);
+}
+
+void free_shaper(struct shaper *shaper) {
+    if (shaper == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < shaper->max_fds; ++i) {
+        if (shaper->peers[i] != NULL) {
+            free_bucket(&shaper->peers[i]->upload);
+            free_bucket(&shaper->peers[i]->download);
+            free(shaper->peers[i]);
+        }
+    }
+    free(shaper->peers);
+    free_bucket(&shaper->upload);
+    free_bucket(&shaper->download);
+    pthread_mutex_destroy(&shaper->lock);
+    free(shaper);
+}
@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "net/shm_ring.h"
+
+// Channels of all connections indexed by socket fd, global because every
+// send and receive of packets goes through it without any other state
+struct shm_registry {
+    pthread_mutex_t lock;
+    int max_fds;
+    struct shm_channel **channels;
+} shm_registry = {PTHREAD_MUTEX_INITIALIZER, 0, NULL};
+
+/**
+ * Map the rings of a memfd
+ * @param channel with memfd and event fds set
+ * @param dialer 1 for the side that created the channel
+ * @return 1 if success, 0 otherwise
+ */
+int map_shm_channel(struct shm_channel *channel, int dialer) {
+    void *map = mmap(NULL, 2 * sizeof(struct shm_ring), PROT_READ |
+            PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+    if (map == MAP_FAILED) {
+        perror("Shared memory: Failed to map rings");
+        return 0;
+    }
+    channel->rings = map;
+    channel->tx = &channel->rings[dialer ? 0 : 1];
+    channel->rx = &channel->rings[dialer ? 1 : 0];
+    channel->refs = 1;
+    pthread_mutex_init(&channel->send_lock, NULL);
+    return 1;
+}
+
+/**
+ * Close the fds of a channel that are open
+ * @param channel
+ */
+void close_shm_channel_fds(struct shm_channel *channel) {
+    int fds[SHM_CHANNEL_FDS];
+    get_shm_channel_fds(channel, fds);
+    for (int i = 0; i < SHM_CHANNEL_FDS; ++i) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+}
+
+struct shm_channel *create_shm_channel() {
+    struct shm_channel *new_channel = calloc(1, sizeof(struct shm_channel));
+    new_channel->memfd = memfd_create("btide-ring", MFD_CLOEXEC);
+    new_channel->tx_data_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    new_channel->tx_space_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    new_channel->rx_data_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    new_channel->rx_space_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // A new memfd is zero filled, which are empty rings
+    if (new_channel->memfd == -1 || new_channel->tx_data_event == -1 ||
+        new_channel->tx_space_event == -1 || new_channel->rx_data_event ==
+                                             -1 ||
+        new_channel->rx_space_event == -1 || ftruncate(new_channel->memfd, 2 *
+            sizeof(struct shm_ring)) == -1 || !map_shm_channel(new_channel,
+                                                                1)) {
+        close_shm_channel_fds(new_channel);
+        free(new_channel);
+        return NULL;
+    }
+    return new_channel;
+}
+
+struct shm_channel *open_shm_channel(int *fds) {
+    struct shm_channel *new_channel = calloc(1, sizeof(struct shm_channel));
+    // The rings of the dialing side are swapped
+    new_channel->memfd = fds[0];
+    new_channel->rx_data_event = fds[1];
+    new_channel->rx_space_event = fds[2];
+    new_channel->tx_data_event = fds[3];
+    new_channel->tx_space_event = fds[4];
+
+    struct stat memfd_stat;
+    for (int i = 0; i < SHM_CHANNEL_FDS; ++i) {
+        if (fds[i] == -1) {
+            close_shm_channel_fds(new_channel);
+            free(new_channel);
+            return NULL;
+        }
+    }
+    if (fstat(new_channel->memfd, &memfd_stat) == -1 || memfd_stat.st_size <
+            (off_t) (2 * sizeof(struct shm_ring)) || !map_shm_channel
+            (new_channel, 0)) {
+        close_shm_channel_fds(new_channel);
+        free(new_channel);
+        return NULL;
+    }
+    return new_channel;
+}
+
+void get_shm_channel_fds(struct shm_channel *channel, int *fds) {
+    fds[0] = channel->memfd;
+    fds[1] = channel->tx_data_event;
+    fds[2] = channel->tx_space_event;
+    fds[3] = channel->rx_data_event;
+    fds[4] = channel->rx_space_event;
+}
+
+/**
+ * Unmap the rings and close the fds of a channel
+ * @param channel
+ */
+void free_shm_channel(struct shm_channel *channel) {
+    munmap(channel->rings, 2 * sizeof(struct shm_ring));
+    close_shm_channel_fds(channel);
+    pthread_mutex_destroy(&channel->send_lock);
+    free(channel);
+}
+
+void attach_shm_channel(int peer_fd, struct shm_channel *channel) {
+    pthread_mutex_lock(&shm_registry.lock);
+    if (peer_fd >= shm_registry.max_fds) {
+        int old_size = shm_registry.max_fds;
+        if (shm_registry.max_fds == 0) {
+            shm_registry.max_fds = SHM_CHANNELS_INIT_SIZE;
+        }
+        while (peer_fd >= shm_registry.max_fds) {
+            shm_registry.max_fds *= 2;
+        }
+        shm_registry.channels = realloc(shm_registry.channels,
+                shm_registry.max_fds * sizeof(struct shm_channel *));
+        for (int i = old_size; i < shm_registry.max_fds; ++i) {
+            shm_registry.channels[i] = NULL;
+        }
+    }
+    shm_registry.channels[peer_fd] = channel;
+    pthread_mutex_unlock(&shm_registry.lock);
+}
+
+/**
+ * Wake a side blocked on an eventfd
+ * @param event_fd
+ */
+void signal_shm_event(int event_fd) {
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) == -1) {
+        perror("Shared memory: Failed to signal");
+    }
+}
+
+/**
+ * Reset an eventfd after waking up
+ * @param event_fd
+ */
+void drain_shm_event(int event_fd) {
+    uint64_t count = 0;
+    if (read(event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("Shared memory: Failed to drain");
+    }
+}
+
+void detach_shm_channel(int peer_fd) {
+    pthread_mutex_lock(&shm_registry.lock);
+    if (peer_fd >= shm_registry.max_fds || shm_registry.channels[peer_fd] ==
+                                           NULL) {
+        pthread_mutex_unlock(&shm_registry.lock);
+        return;
+    }
+    struct shm_channel *channel = shm_registry.channels[peer_fd];
+    shm_registry.channels[peer_fd] = NULL;
+    channel->closed = 1;
+    pthread_mutex_unlock(&shm_registry.lock);
+
+    // Senders waiting for space give up
+    signal_shm_event(channel->tx_space_event);
+    put_shm_channel(channel);
+}
+
+struct shm_channel *get_shm_channel(int peer_fd) {
+    pthread_mutex_lock(&shm_registry.lock);
+    struct shm_channel *channel = NULL;
+    if (peer_fd >= 0 && peer_fd < shm_registry.max_fds) {
+        channel = shm_registry.channels[peer_fd];
+    }
+    if (channel != NULL) {
+        channel->refs++;
+    }
+    pthread_mutex_unlock(&shm_registry.lock);
+    return channel;
+}
+
+void put_shm_channel(struct shm_channel *channel) {
+    pthread_mutex_lock(&shm_registry.lock);
+    int refs = --channel->refs;
+    pthread_mutex_unlock(&shm_registry.lock);
+    if (refs == 0) {
+        free_shm_channel(channel);
+    }
+}
+
+/**
+ * Check if the channel was detached
+ * @param channel
+ * @return 1 if closed, 0 otherwise
+ */
+int shm_closed(struct shm_channel *channel) {
+    pthread_mutex_lock(&shm_registry.lock);
+    int closed = channel->closed;
+    pthread_mutex_unlock(&shm_registry.lock);
+    return closed;
+}
+
+/**
+ * Wait until the tx ring has a free slot, the send lock must be held
+ * @param channel
+ * @return 1 if a slot is free, 0 if the channel was closed
+ */
+int shm_wait_space(struct shm_channel *channel) {
+    struct shm_ring *ring = channel->tx;
+    while (atomic_load(&ring->head) - atomic_load(&ring->tail) ==
+           SHM_RING_SLOTS) {
+        if (shm_closed(channel)) {
+            return 0;
+        }
+        // Announce the wait before checking again, so the reader either
+        // sees the flag or the check sees its progress
+        atomic_store(&ring->writer_idle, 1);
+        if (atomic_load(&ring->head) - atomic_load(&ring->tail) ==
+            SHM_RING_SLOTS) {
+            struct pollfd space = {channel->tx_space_event, POLLIN, 0};
+            poll(&space, 1, SHM_SPACE_WAIT_MS);
+            drain_shm_event(channel->tx_space_event);
+        }
+        atomic_store(&ring->writer_idle, 0);
+    }
+    return 1;
+}
+
+int shm_send(struct shm_channel *channel, struct btide_packet *packets, int
+        num_packets) {
+    struct shm_ring *ring = channel->tx;
+    pthread_mutex_lock(&channel->send_lock);
+    for (int i = 0; i < num_packets; ++i) {
+        if (!shm_wait_space(channel)) {
+            pthread_mutex_unlock(&channel->send_lock);
+            return 0;
+        }
+        uint64_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_relaxed);
+        memcpy(&ring->slots[head % SHM_RING_SLOTS], &packets[i],
+               PACKET_SIZE);
+        atomic_store(&ring->head, head + 1);
+        // Only a reader that is about to block needs a wakeup
+        if (atomic_load(&ring->reader_idle)) {
+            signal_shm_event(channel->tx_data_event);
+        }
+    }
+    pthread_mutex_unlock(&channel->send_lock);
+    return 1;
+}
+
+/**
+ * Take a packet from the rx ring without waiting
+ * @param channel
+ * @param packet_buf
+ * @return 1 if a packet was read, 0 if the ring is empty
+ */
+int shm_try_recv(struct shm_channel *channel, struct btide_packet
+        *packet_buf) {
+    struct shm_ring *ring = channel->rx;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load(&ring->head) == tail) {
+        return 0;
+    }
+    memcpy(packet_buf, &ring->slots[tail % SHM_RING_SLOTS], PACKET_SIZE);
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_load(&ring->writer_idle)) {
+        signal_shm_event(channel->rx_space_event);
+    }
+    return 1;
+}
+
+int shm_recv(struct shm_channel *channel, int peer_fd, struct btide_packet
+        *packet_buf) {
+    struct shm_ring *ring = channel->rx;
+    while (1) {
+        if (shm_try_recv(channel, packet_buf)) {
+            return 1;
+        }
+
+        atomic_store(&ring->reader_idle, 1);
+        if (shm_try_recv(channel, packet_buf)) {
+            atomic_store(&ring->reader_idle, 0);
+            return 1;
+        }
+        struct pollfd events[2] = {{channel->rx_data_event, POLLIN, 0},
+                                   {peer_fd, POLLIN, 0}};
+        if (poll(events, 2, -1) == -1 && errno != EINTR) {
+            atomic_store(&ring->reader_idle, 0);
+            return 0;
+        }
+        atomic_store(&ring->reader_idle, 0);
+        drain_shm_event(channel->rx_data_event);
+
+        // Packets already in the ring come before the end of the connection
+        if (events[1].revents != 0) {
+            return shm_try_recv(channel, packet_buf);
+        }
+    }
+}
+
+int shm_peek(struct shm_channel *channel, struct btide_packet *packets, int
+        max_packets) {
+    struct shm_ring *ring = channel->rx;
+    uint64_t tail = atomic_load(&ring->tail);
+    uint64_t head = atomic_load(&ring->head);
+    int num_packets = 0;
+    while (num_packets < max_packets && tail + num_packets < head) {
+        memcpy(&packets[num_packets], &ring->slots[(tail + num_packets) %
+                SHM_RING_SLOTS], PACKET_SIZE);
+        num_packets++;
+    }
+    return num_packets;
+}
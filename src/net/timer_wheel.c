@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "net/timer_wheel.h"
+#include "net/packet.h"
+#include "net/affinity.h"
+
+struct timer_wheel *create_timer_wheel() {
+    struct timer_wheel *wheel = calloc(1, sizeof(struct timer_wheel));
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_cond_init(&wheel->callback_done, NULL);
+    wheel->start_us = get_time_us();
+    return wheel;
+}
+
+void init_timer(struct timer *timer, timer_callback callback, void *arg) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->list = NULL;
+}
+
+/**
+ * Insert a timer at the front of a list, caller holds the wheel lock
+ * @param list
+ * @param timer
+ */
+void link_timer(struct timer **list, struct timer *timer) {
+    timer->list = list;
+    timer->prev = NULL;
+    timer->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = timer;
+    }
+    *list = timer;
+}
+
+/**
+ * Remove a timer from the list it is in, caller holds the wheel lock
+ * @param timer
+ * @return 1 if the timer was in a list, 0 otherwise
+ */
+int unlink_timer(struct timer *timer) {
+    if (timer->list == NULL) {
+        return 0;
+    }
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->list = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->list = NULL;
+    return 1;
+}
+
+/**
+ * Put a timer in the slot of the lowest level whose range covers its expiry,
+ * caller holds the wheel lock
+ * @param wheel
+ * @param timer
+ */
+void place_timer(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t max_delta = ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (timer->expires < wheel->current_tick) {
+        timer->expires = wheel->current_tick;
+    } else if (timer->expires - wheel->current_tick > max_delta) {
+        timer->expires = wheel->current_tick + max_delta;
+    }
+    uint64_t delta = timer->expires - wheel->current_tick;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    link_timer(&wheel->slots[level][slot], timer);
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t
+        delay_us) {
+    uint64_t elapsed_us = get_time_us() - wheel->start_us + delay_us;
+
+    pthread_mutex_lock(&wheel->lock);
+    unlink_timer(timer);
+    timer->expires = (elapsed_us + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+    place_timer(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+int timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    pthread_mutex_lock(&wheel->lock);
+    int pending = unlink_timer(timer);
+    pthread_mutex_unlock(&wheel->lock);
+    return pending;
+}
+
+int timer_cancel_sync(struct timer_wheel *wheel, struct timer *timer) {
+    int pending = 0;
+    pthread_mutex_lock(&wheel->lock);
+    // The callback may arm the timer again while we wait for it
+    do {
+        pending |= unlink_timer(timer);
+        while (wheel->running_timer == timer) {
+            pthread_cond_wait(&wheel->callback_done, &wheel->lock);
+        }
+    } while (timer->list != NULL);
+    pthread_mutex_unlock(&wheel->lock);
+    return pending;
+}
+
+/**
+ * Move the timers of the slots that start at the current tick down to the
+ * lower levels, caller holds the wheel lock
+ * @param wheel
+ */
+void cascade_timers(struct timer_wheel *wheel) {
+    int top = 0;
+    while (top < WHEEL_LEVELS - 1 &&
+           ((wheel->current_tick >> (WHEEL_BITS * top)) & WHEEL_MASK) == 0) {
+        top++;
+    }
+    // Higher levels first so their timers can cascade again in this tick
+    for (int level = top; level > 0; level--) {
+        int slot = (wheel->current_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        struct timer *timer = wheel->slots[level][slot];
+        wheel->slots[level][slot] = NULL;
+        while (timer != NULL) {
+            struct timer *next = timer->next;
+            place_timer(wheel, timer);
+            timer = next;
+        }
+    }
+}
+
+void advance_timer_wheel(struct timer_wheel *wheel, uint64_t now_us) {
+    uint64_t target = (now_us - wheel->start_us) / WHEEL_TICK_US;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->current_tick <= target) {
+        cascade_timers(wheel);
+
+        // Timers stay cancellable until their callback starts
+        int slot = wheel->current_tick & WHEEL_MASK;
+        struct timer *expired = NULL;
+        while (wheel->slots[0][slot] != NULL) {
+            struct timer *timer = wheel->slots[0][slot];
+            unlink_timer(timer);
+            link_timer(&expired, timer);
+        }
+        wheel->current_tick++;
+
+        while (expired != NULL) {
+            struct timer *timer = expired;
+            unlink_timer(timer);
+            wheel->running_timer = timer;
+            pthread_mutex_unlock(&wheel->lock);
+
+            timer->callback(timer->arg);
+
+            pthread_mutex_lock(&wheel->lock);
+            wheel->running_timer = NULL;
+            pthread_cond_broadcast(&wheel->callback_done);
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Thread function advancing the wheel every tick
+ * @param args timer wheel
+ */
+void *run_timer_wheel(void *args) {
+    struct timer_wheel *wheel = args;
+    pin_current_thread(THREAD_NETWORK);
+    struct timespec tick = {0, WHEEL_TICK_US * 1000};
+    while (wheel->running) {
+        nanosleep(&tick, NULL);
+        advance_timer_wheel(wheel, get_time_us());
+    }
+    pthread_exit((void*)0);
+}
+
+int start_timer_wheel(struct timer_wheel *wheel) {
+    wheel->running = 1;
+    if (pthread_create(&wheel->thread, NULL, run_timer_wheel, wheel) != 0) {
+        wheel->running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void stop_timer_wheel(struct timer_wheel *wheel) {
+    if (!wheel->running) {
+        return;
+    }
+    wheel->running = 0;
+    pthread_join(wheel->thread, NULL);
+}
+
+void free_timer_wheel(struct timer_wheel *wheel) {
+    stop_timer_wheel(wheel);
+    pthread_cond_destroy(&wheel->callback_done);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
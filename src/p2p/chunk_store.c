@@ -0,0 +1,306 @@
+#include <fcntl.h>
+
+#include "p2p/chunk_store.h"
+
+struct chunk_store *create_chunk_store() {
+    struct chunk_store *new_store = calloc(1, sizeof(struct chunk_store));
+    pthread_mutex_init(&new_store->lock, NULL);
+    return new_store;
+}
+
+/**
+ * Hash a chunk hash into a bucket (FNV-1a)
+ * @param hash
+ * @return bucket index
+ */
+int hash_chunk(char *hash) {
+    uint32_t bucket = 2166136261u;
+    for (int i = 0; i < SHA256_HEX_LEN && hash[i] != '\0'; ++i) {
+        bucket = (bucket ^ (uint8_t) hash[i]) * 16777619u;
+    }
+    return (int) (bucket % CHUNK_STORE_BUCKETS);
+}
+
+/**
+ * Find a chunk by content, the lock must be held
+ * @param store
+ * @param hash
+ * @param size
+ * @return the chunk, NULL if not present
+ */
+struct stored_chunk *lookup_chunk(struct chunk_store *store, char *hash,
+                                  uint32_t size) {
+    struct stored_chunk *current = store->buckets[hash_chunk(hash)];
+    while (current != NULL) {
+        if (current->size == size && strncmp(current->hash, hash,
+                                             SHA256_HEX_LEN) == 0) {
+            return current;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
+
+/**
+ * Remove a chunk once it has no holders left, the lock must be held
+ * @param store
+ * @param target
+ */
+void drop_chunk(struct chunk_store *store, struct stored_chunk *target) {
+    struct stored_chunk **link = &store->buckets[hash_chunk(target->hash)];
+    while (*link != target) {
+        link = &(*link)->next;
+    }
+    *link = target->next;
+    free(target);
+    store->num_chunks--;
+}
+
+/**
+ * Remove the holders of a chunk that match an ident and optionally an
+ * offset, the lock must be held
+ * @param store
+ * @param target
+ * @param pkg_ident
+ * @param offset
+ * @param any_offset 1 to remove the holders at every offset
+ */
+void remove_holders(struct chunk_store *store, struct stored_chunk *target,
+                    char *pkg_ident, uint64_t offset, int any_offset) {
+    struct chunk_holder **link = &target->holders;
+    while (*link != NULL) {
+        struct chunk_holder *current = *link;
+        if ((any_offset || current->offset == offset) && strncmp
+                (current->ident, pkg_ident, MIN_IDENT_MATCH) == 0) {
+            *link = current->next;
+            free(current);
+            target->refs--;
+        } else {
+            link = &current->next;
+        }
+    }
+    if (target->refs == 0) {
+        drop_chunk(store, target);
+    }
+}
+
+void store_chunk(struct chunk_store *store, struct bpkg_obj *package, char
+        *hash, uint64_t offset, uint32_t size) {
+    // Only whole chunks can be copied into other packages
+    chunk *target_chunk = get_chunk_from_hash(package, hash, offset);
+    if (target_chunk == NULL || target_chunk->offset != offset ||
+        target_chunk->size != size) {
+        return;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    struct stored_chunk *target = lookup_chunk(store, hash, size);
+    if (target == NULL) {
+        target = calloc(1, sizeof(struct stored_chunk));
+        strncpy(target->hash, hash, SHA256_HEX_LEN);
+        target->size = size;
+        int bucket = hash_chunk(hash);
+        target->next = store->buckets[bucket];
+        store->buckets[bucket] = target;
+        store->num_chunks++;
+    }
+    for (struct chunk_holder *current = target->holders; current != NULL;
+         current = current->next) {
+        if (current->offset == offset && strncmp(current->ident,
+                                                 package->ident,
+                                                 MIN_IDENT_MATCH) == 0) {
+            pthread_mutex_unlock(&store->lock);
+            return;
+        }
+    }
+    struct chunk_holder *holder = calloc(1, sizeof(struct chunk_holder));
+    strncpy(holder->ident, package->ident, MIN_IDENT_MATCH);
+    holder->offset = offset;
+    holder->next = target->holders;
+    target->holders = holder;
+    target->refs++;
+    pthread_mutex_unlock(&store->lock);
+}
+
+void store_package_chunks(struct chunk_store *store, struct bpkg_obj
+        *package) {
+    if (compute_chunk_hashes(package)) {
+        store_computed_chunks(store, package);
+    }
+}
+
+void store_computed_chunks(struct chunk_store *store, struct bpkg_obj
+        *package) {
+    merkle_tree *hashes = package->hashes;
+    for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
+        merkle_tree_node *leaf = hashes->nodes[i];
+        if (compare_node_hash(leaf)) {
+            store_chunk(store, package, leaf->expected_hash,
+                        leaf->value->offset, leaf->value->size);
+        }
+    }
+}
+
+void release_package_chunks(struct chunk_store *store, char *pkg_ident) {
+    pthread_mutex_lock(&store->lock);
+    for (int i = 0; i < CHUNK_STORE_BUCKETS; ++i) {
+        struct stored_chunk *current = store->buckets[i];
+        while (current != NULL) {
+            // The chunk may be dropped along with its last holder
+            struct stored_chunk *next = current->next;
+            remove_holders(store, current, pkg_ident, 0, 1);
+            current = next;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+int find_stored_chunk(struct chunk_store *store, char *hash, uint32_t size,
+                      char *ident_buf, uint64_t *offset) {
+    pthread_mutex_lock(&store->lock);
+    struct stored_chunk *target = lookup_chunk(store, hash, size);
+    if (target == NULL) {
+        pthread_mutex_unlock(&store->lock);
+        return 0;
+    }
+    strncpy(ident_buf, target->holders->ident, MIN_IDENT_MATCH + 1);
+    *offset = target->holders->offset;
+    pthread_mutex_unlock(&store->lock);
+    return 1;
+}
+
+/**
+ * Check the hash of a range of a file
+ * @param fd
+ * @param offset
+ * @param data_size
+ * @param hash expected chunk hash
+ * @return 1 if the range matches the hash, 0 otherwise
+ */
+int check_file_range(int fd, uint64_t offset, uint32_t data_size, char
+        *hash) {
+    char *data = calloc(data_size + 1, sizeof(char));
+    char chunk_hash[SHA256_HEX_STRLEN] = {0};
+    int valid = pread(fd, data, data_size, offset) == (ssize_t) data_size;
+    if (valid) {
+        compute_hash(data, data_size, chunk_hash);
+        valid = strncmp(chunk_hash, hash, SHA256_HEX_LEN) == 0;
+    }
+    free(data);
+    return valid;
+}
+
+int copy_chunk(int src_fd, uint64_t src_offset, struct bpkg_obj *package,
+               uint64_t file_offset, uint32_t data_size, char *hash) {
+    // A source that does not hold the chunk never touches the data file
+    if (!check_file_range(src_fd, src_offset, data_size, hash)) {
+        return 0;
+    }
+    int data_fd = open_data_file(package);
+    if (data_fd == -1) {
+        perror("Chunk store: Failed to open the data file");
+        return 0;
+    }
+
+    // The data never leaves the kernel, and filesystems with reflinks share
+    // the blocks instead of copying them
+    loff_t offset_in = src_offset;
+    loff_t offset_out = file_offset;
+    uint32_t bytes_copied = 0;
+    while (bytes_copied < data_size) {
+        ssize_t copied = copy_file_range(src_fd, &offset_in, data_fd,
+                                         &offset_out, data_size -
+                                         bytes_copied, 0);
+        if (copied <= 0) {
+            close(data_fd);
+            return 0;
+        }
+        bytes_copied += copied;
+    }
+
+    // Check the integrity of the chunk as written, the source may have
+    // changed since it was checked
+    int valid = check_file_range(data_fd, file_offset, data_size, hash);
+    close(data_fd);
+    return valid;
+}
+
+/**
+ * Copy a chunk held by another package
+ * @param list
+ * @param ident ident prefix of the holder
+ * @param src_offset offset of the chunk in the holder
+ * @param package
+ * @param target_chunk
+ * @param hash
+ * @return 1 if the chunk was copied and verified, 0 otherwise
+ */
+int copy_held_chunk(struct package_list *list, char *ident, uint64_t
+        src_offset, struct bpkg_obj *package, chunk *target_chunk, char
+        *hash) {
+    // Only the data file of the holder is read, its tree is not needed
+    struct package_entry *entry = get_package_header(list, ident);
+    if (entry == NULL) {
+        return 0;
+    }
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, entry->package);
+    int src_fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    put_package(list, entry);
+    if (src_fd == -1) {
+        return 0;
+    }
+    int copied = copy_chunk(src_fd, src_offset, package,
+                            target_chunk->offset, target_chunk->size, hash);
+    close(src_fd);
+    return copied;
+}
+
+int fill_from_store(struct chunk_store *store, struct package_list *list,
+                    struct bpkg_obj *package, chunk *target_chunk, char
+                    *hash) {
+    char ident_buf[MIN_IDENT_MATCH + 1] = {0};
+    uint64_t src_offset = 0;
+    while (find_stored_chunk(store, hash, target_chunk->size, ident_buf,
+                             &src_offset)) {
+        if (copy_held_chunk(list, ident_buf, src_offset, package,
+                            target_chunk, hash)) {
+            store_chunk(store, package, hash, target_chunk->offset,
+                        target_chunk->size);
+            return 1;
+        }
+
+        // The holder was removed or its data file changed since
+        pthread_mutex_lock(&store->lock);
+        struct stored_chunk *target = lookup_chunk(store, hash,
+                                                   target_chunk->size);
+        if (target != NULL) {
+            remove_holders(store, target, ident_buf, src_offset, 0);
+        }
+        pthread_mutex_unlock(&store->lock);
+    }
+    return 0;
+}
+
+void free_chunk_store(struct chunk_store *store) {
+    if (store == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < CHUNK_STORE_BUCKETS; ++i) {
+        struct stored_chunk *current = store->buckets[i];
+        while (current != NULL) {
+            struct stored_chunk *next = current->next;
+            struct chunk_holder *holder = current->holders;
+            while (holder != NULL) {
+                struct chunk_holder *next_holder = holder->next;
+                free(holder);
+                holder = next_holder;
+            }
+            free(current);
+            current = next;
+        }
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
@@ -0,0 +1,444 @@
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#include "net/affinity.h"
+#include "p2p/connector.h"
+#include "p2p/p2p_node.h"
+
+struct connector *create_connector(struct p2p_node *node, int max_peers) {
+    struct connector *new_connector = calloc(1, sizeof(struct connector));
+    pthread_mutex_init(&new_connector->lock, NULL);
+    new_connector->node = node;
+    new_connector->max_peers = max_peers;
+    new_connector->epoll_fd = epoll_create1(0);
+    new_connector->event_fd = eventfd(0, EFD_NONBLOCK);
+
+    // The event fd is the only one registered without an attempt
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(new_connector->epoll_fd, EPOLL_CTL_ADD, new_connector->event_fd,
+              &event);
+
+    new_connector->max_attempts = ATTEMPTS_INIT_SIZE;
+    new_connector->attempts = calloc(ATTEMPTS_INIT_SIZE, sizeof(struct
+            connect_attempt *));
+    return new_connector;
+}
+
+/**
+ * Wake the connector thread
+ * @param connector
+ */
+void wake_connector(struct connector *connector) {
+    uint64_t one = 1;
+    if (write(connector->event_fd, &one, sizeof(one)) == -1) {
+        perror("Connector: Failed to wake");
+    }
+}
+
+/**
+ * Timer callback of an attempt, lets the connector thread start the next
+ * attempt or time out the current one
+ * @param arg the attempt
+ */
+void attempt_expired(void *arg) {
+    struct connect_attempt *attempt = arg;
+    struct connector *connector = attempt->connector;
+    pthread_mutex_lock(&connector->lock);
+    // Removed after the timer fired
+    if (attempt->index == -1) {
+        pthread_mutex_unlock(&connector->lock);
+        free(attempt);
+        return;
+    }
+    attempt->timer_armed = 0;
+    attempt->expired = 1;
+    wake_connector(connector);
+    pthread_mutex_unlock(&connector->lock);
+}
+
+/**
+ * Remove and free an attempt, an attempt whose timer callback is in flight
+ * is freed by the callback instead, the connector lock must be held
+ * @param connector
+ * @param attempt
+ */
+void remove_attempt(struct connector *connector, struct connect_attempt
+        *attempt) {
+    if (attempt->fd != -1) {
+        close(attempt->fd);
+    }
+
+    int index = attempt->index;
+    connector->num_attempts--;
+    connector->attempts[index] = connector->attempts[connector->num_attempts];
+    connector->attempts[index]->index = index;
+    attempt->index = -1;
+    // The callback clears timer_armed under the lock once it has run
+    if (timer_cancel(connector->node->timers, &attempt->timer) ||
+        !attempt->timer_armed) {
+        free(attempt);
+    }
+}
+
+/**
+ * Add an attempt unless one to the same peer exists
+ * @param connector
+ * @param ip
+ * @param port
+ * @param path socket path of a local peer, empty otherwise
+ * @param shared 1 to move the packets to shared memory after the handshake
+ * @param addr
+ * @param addr_len
+ * @return 1 if the attempt was added, 0 otherwise
+ */
+int add_attempt(struct connector *connector, char *ip, u_int16_t port, char
+        *path, int shared, struct sockaddr *addr, socklen_t addr_len) {
+    pthread_mutex_lock(&connector->lock);
+    for (int i = 0; i < connector->num_attempts; ++i) {
+        struct connect_attempt *current = connector->attempts[i];
+        if (current->port == port && strncmp(current->ip, ip, MAX_IP_SIZE) ==
+                                     0 && strncmp(current->path, path,
+                                                  MAX_SOCKET_PATH_SIZE) == 0) {
+            pthread_mutex_unlock(&connector->lock);
+            return 0;
+        }
+    }
+
+    if (connector->num_attempts == connector->max_attempts) {
+        connector->max_attempts *= 2;
+        connector->attempts = realloc(connector->attempts,
+                connector->max_attempts * sizeof(struct connect_attempt *));
+    }
+    struct connect_attempt *new_attempt = calloc(1, sizeof(struct
+            connect_attempt));
+    strncpy(new_attempt->ip, ip, MAX_IP_SIZE - 1);
+    new_attempt->port = port;
+    strncpy(new_attempt->path, path, MAX_SOCKET_PATH_SIZE - 1);
+    new_attempt->shared = shared;
+    memcpy(&new_attempt->addr, addr, addr_len);
+    new_attempt->addr_len = addr_len;
+    new_attempt->fd = -1;
+    new_attempt->state = CONNECT_WAITING;
+    new_attempt->expired = 1;
+    new_attempt->connector = connector;
+    new_attempt->index = connector->num_attempts;
+    init_timer(&new_attempt->timer, attempt_expired, new_attempt);
+    connector->attempts[connector->num_attempts] = new_attempt;
+    connector->num_attempts++;
+
+    wake_connector(connector);
+    pthread_mutex_unlock(&connector->lock);
+    return 1;
+}
+
+int connect_peer(struct connector *connector, char *ip, u_int16_t port) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+        return 0;
+    }
+    return add_attempt(connector, ip, port, "", 0, (struct sockaddr *) &addr,
+                       sizeof(addr));
+}
+
+int connect_local_peer(struct connector *connector, char *path, int
+        shared) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (path[0] == '\0' || strlen(path) >= MAX_SOCKET_PATH_SIZE) {
+        return 0;
+    }
+    strncpy(addr.sun_path, path, MAX_SOCKET_PATH_SIZE - 1);
+    return add_attempt(connector, LOCAL_PEER_IP, 0, path, shared, (struct
+            sockaddr *) &addr, sizeof(addr));
+}
+
+/**
+ * Close the socket of a failed attempt and retry after a backoff, or give up
+ * after CONNECT_ATTEMPTS attempts, the connector lock must be held
+ * @param connector
+ * @param attempt
+ */
+void fail_attempt(struct connector *connector, struct connect_attempt
+        *attempt) {
+    attempt->attempts++;
+    if (attempt->attempts >= CONNECT_ATTEMPTS) {
+        printf("Unable to connect to request peer\n");
+        remove_attempt(connector, attempt);
+        return;
+    }
+
+    if (attempt->fd != -1) {
+        close(attempt->fd);
+        attempt->fd = -1;
+    }
+    attempt->state = CONNECT_WAITING;
+    attempt->expired = 0;
+    attempt->timer_armed = 1;
+    uint64_t backoff = (uint64_t) CONNECT_BACKOFF_US << (attempt->attempts -
+            1);
+    timer_add(connector->node->timers, &attempt->timer, backoff);
+}
+
+/**
+ * Start a non-blocking connect for an attempt, the connector lock must be
+ * held
+ * @param connector
+ * @param attempt
+ */
+void start_attempt(struct connector *connector, struct connect_attempt
+        *attempt) {
+    attempt->fd = socket(attempt->addr.ss_family, SOCK_STREAM |
+            SOCK_NONBLOCK, 0);
+    if (attempt->fd == -1) {
+        perror("Connector: Failed to create socket");
+        fail_attempt(connector, attempt);
+        return;
+    }
+
+    attempt->bytes_recv = 0;
+    attempt->state = CONNECT_CONNECTING;
+    if (connect(attempt->fd, (struct sockaddr *) &attempt->addr,
+                attempt->addr_len) == 0) {
+        attempt->state = CONNECT_HANDSHAKE;
+    } else if (errno != EINPROGRESS) {
+        fail_attempt(connector, attempt);
+        return;
+    }
+
+    struct epoll_event event = {0};
+    event.events = attempt->state == CONNECT_CONNECTING ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = attempt;
+    epoll_ctl(connector->epoll_fd, EPOLL_CTL_ADD, attempt->fd, &event);
+    // The handshake shares the timeout of the connect
+    attempt->expired = 0;
+    attempt->timer_armed = 1;
+    timer_add(connector->node->timers, &attempt->timer,
+              HANDSHAKE_TIMEOUT_US);
+}
+
+/**
+ * Hand a connected peer over to a reader thread, the connector lock must be
+ * held
+ * @param connector
+ * @param attempt
+ */
+void complete_attempt(struct connector *connector, struct connect_attempt
+        *attempt) {
+    struct p2p_node *node = connector->node;
+    int peer_fd = attempt->fd;
+    epoll_ctl(connector->epoll_fd, EPOLL_CTL_DEL, peer_fd, NULL);
+    fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL) & ~O_NONBLOCK);
+
+    uint32_t version = 0;
+    if (attempt->packet_buf.msg_code != PKT_MSG_ACP || !handle_ACP
+            (&attempt->packet_buf, peer_fd, &version)) {
+        fail_attempt(connector, attempt);
+        return;
+    }
+    int local = attempt->path[0] != '\0';
+    if ((local ? find_local_peer(node->peer_list, attempt->path) :
+         find_peer(node->peer_list, attempt->ip, attempt->port)) != -1 ||
+        node->peer_list->num_peers >= connector->max_peers) {
+        printf("Unable to connect to request peer\n");
+        remove_attempt(connector, attempt);
+        return;
+    }
+
+    // The peer maps the rings when it reads the SHM, and every packet after
+    // it is written to them
+    struct shm_channel *channel = NULL;
+    if (attempt->shared) {
+        int fds[SHM_CHANNEL_FDS];
+        channel = create_shm_channel();
+        if (channel != NULL) {
+            get_shm_channel_fds(channel, fds);
+        }
+        if (channel == NULL || !send_SHM(fds, SHM_CHANNEL_FDS, peer_fd)) {
+            if (channel != NULL) {
+                put_shm_channel(channel);
+            }
+            printf("Unable to connect to request peer\n");
+            remove_attempt(connector, attempt);
+            return;
+        }
+        attach_shm_channel(peer_fd, channel);
+    }
+
+    // Local peers have no port and are told apart by their socket fd
+    u_int16_t peer_port = local ? (u_int16_t) peer_fd : attempt->port;
+    struct client_handler_args *new_args = create_client_handler_args
+            (peer_fd, attempt->ip, peer_port, node);
+    new_args->new_peer.local = local;
+    new_args->new_peer.shared = channel != NULL;
+    new_args->new_peer.version = version;
+    strncpy(new_args->new_peer.path, attempt->path, MAX_SOCKET_PATH_SIZE - 1);
+    if (!add_peer(node->peer_list, new_args->new_peer)) {
+        printf("Unable to connect to request peer\n");
+        detach_shm_channel(peer_fd);
+        free(new_args);
+        remove_attempt(connector, attempt);
+        return;
+    }
+    printf("Connection established with peer\n");
+    pthread_t reader_thread;
+    if (pthread_create(&reader_thread, NULL, start_peer_reader, new_args) !=
+        0) {
+        printf("Failed to create new peer reader thread\n");
+        remove_peer(node->peer_list, attempt->ip, peer_port);
+        free(new_args);
+        remove_attempt(connector, attempt);
+        return;
+    }
+
+    // The reader thread owns the socket now
+    attempt->fd = -1;
+    remove_attempt(connector, attempt);
+}
+
+/**
+ * Advance an attempt whose socket is ready, the connector lock must be held
+ * @param connector
+ * @param attempt
+ */
+void handle_attempt_event(struct connector *connector, struct
+        connect_attempt *attempt) {
+    if (attempt->state == CONNECT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fail_attempt(connector, attempt);
+            return;
+        }
+
+        // Connected, wait for the ACP
+        attempt->state = CONNECT_HANDSHAKE;
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = attempt;
+        epoll_ctl(connector->epoll_fd, EPOLL_CTL_MOD, attempt->fd, &event);
+        return;
+    }
+
+    if (attempt->state != CONNECT_HANDSHAKE) {
+        return;
+    }
+    ssize_t read_result = recv(attempt->fd, (char *) &attempt->packet_buf +
+            attempt->bytes_recv, PACKET_SIZE - attempt->bytes_recv, 0);
+    if (read_result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    // Peer disconnected or error occurred
+    if (read_result <= 0) {
+        fail_attempt(connector, attempt);
+        return;
+    }
+    attempt->bytes_recv += read_result;
+    if (attempt->bytes_recv == PACKET_SIZE) {
+        complete_attempt(connector, attempt);
+    }
+}
+
+/**
+ * Start the attempts that finished their backoff and fail the ones that
+ * timed out, the connector lock must be held
+ * @param connector
+ */
+void handle_expired_attempts(struct connector *connector) {
+    // Removing an attempt moves the last one into its place
+    for (int i = connector->num_attempts - 1; i >= 0; --i) {
+        struct connect_attempt *attempt = connector->attempts[i];
+        if (!attempt->expired) {
+            continue;
+        }
+        attempt->expired = 0;
+        if (attempt->state == CONNECT_WAITING) {
+            start_attempt(connector, attempt);
+        } else {
+            fail_attempt(connector, attempt);
+        }
+    }
+}
+
+/**
+ * Thread function waiting for readiness events of all attempts
+ * @param args connector
+ */
+void *run_connector(void *args) {
+    struct connector *connector = args;
+    pin_current_thread(THREAD_NETWORK);
+    struct epoll_event events[CONNECTOR_MAX_EVENTS];
+    while (1) {
+        int num_events = epoll_wait(connector->epoll_fd, events,
+                                    CONNECTOR_MAX_EVENTS, -1);
+        if (num_events == -1 && errno != EINTR) {
+            perror("Connector: Failed to wait for events");
+            break;
+        }
+
+        pthread_mutex_lock(&connector->lock);
+        if (!connector->running) {
+            pthread_mutex_unlock(&connector->lock);
+            break;
+        }
+        for (int i = 0; i < num_events; ++i) {
+            // Wakeups only need to be drained
+            if (events[i].data.ptr == NULL) {
+                uint64_t count = 0;
+                read(connector->event_fd, &count, sizeof(count));
+                continue;
+            }
+            handle_attempt_event(connector, events[i].data.ptr);
+        }
+        handle_expired_attempts(connector);
+        pthread_mutex_unlock(&connector->lock);
+    }
+
+    pthread_exit((void *) 0);
+}
+
+int start_connector(struct connector *connector) {
+    connector->running = 1;
+    if (pthread_create(&connector->thread, NULL, run_connector, connector) !=
+        0) {
+        connector->running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void free_connector(struct connector *connector) {
+    if (connector == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&connector->lock);
+    int was_running = connector->running;
+    connector->running = 0;
+    wake_connector(connector);
+    pthread_mutex_unlock(&connector->lock);
+    if (was_running) {
+        pthread_join(connector->thread, NULL);
+    }
+
+    // No callback may run once the connector is freed
+    for (int i = connector->num_attempts - 1; i >= 0; --i) {
+        struct connect_attempt *attempt = connector->attempts[i];
+        timer_cancel_sync(connector->node->timers, &attempt->timer);
+        pthread_mutex_lock(&connector->lock);
+        attempt->timer_armed = 0;
+        remove_attempt(connector, attempt);
+        pthread_mutex_unlock(&connector->lock);
+    }
+    free(connector->attempts);
+    close(connector->event_fd);
+    close(connector->epoll_fd);
+    pthread_mutex_destroy(&connector->lock);
+    free(connector);
+}
@@ -1,124 +1,332 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "net/affinity.h"
+#include "chk/resume.h"
 #include "p2p/p2p_node.h"
 
-int p2p_handle_request(struct btide_packet *packet_buf, struct package_list
-        *package_list, int client_fd) {
-    // Retrieve the data in the REQ packet
-    uint32_t file_offset = packet_buf->pl.request.file_offset;
-    uint32_t data_size = packet_buf->pl.request.data_len;
+/**
+ * Send an error RES that echoes the requested chunk, so the requester knows
+ * which of its REQ failed
+ * @param packet_buf the REQ packet
+ * @param client
+ */
+void p2p_send_error(struct btide_packet *packet_buf, struct peer *client) {
+    struct btide_packet res = {0};
+    fill_response(&res, 1, get_request_offset(&packet_buf->pl.request,
+                                              client->version),
+                  packet_buf->pl.request.chunk_hash, packet_buf->pl.request
+                  .ident, NULL, 0);
+    if (!send_packets(&res, 1, client->peer_fd)) {
+        printf("Failed to send RES packet to Peer FD: %d\n", client->peer_fd);
+    }
+}
+
+/**
+ * Check if the peer has cancelled the REQ being served, by inspecting the
+ * packets queued on the connection without consuming them. The CAN packet is
+ * consumed later by the read loop.
+ * @param req the REQ being served
+ * @param peek_buf buffer with size of CANCEL_PEEK_PACKETS packets
+ * @param client_fd
+ * @return 1 if cancelled, 0 otherwise
+ */
+int p2p_check_cancel(struct request_payload *req, struct btide_packet
+        *peek_buf, int client_fd) {
+    int num_queued = peek_packets(client_fd, peek_buf, CANCEL_PEEK_PACKETS);
+    for (int i = 0; i < num_queued; ++i) {
+        struct btide_packet *queued = &peek_buf[i];
+        if (queued->msg_code == PKT_MSG_CAN && strncmp(queued->pl.request
+                .chunk_hash, req->chunk_hash, SHA256_HEX_LEN) == 0 &&
+            strncmp(queued->pl.request.ident, req->ident, IDENT_SIZE) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Serve a chunk to a peer on the same host by passing a read-only fd of the
+ * data file instead of sending the data
+ * @param packet_buf the REQ packet
+ * @param node
+ * @param client
+ * @param package
+ * @param start_offset file offset of the first byte to serve
+ * @param data_size
+ * @return 1 if success, 0 if the chunk has to be sent in RES packets
+ */
+int p2p_send_fd_response(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *client, struct bpkg_obj *package, uint64_t
+        start_offset, uint32_t data_size) {
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    int file_fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) {
+        return 0;
+    }
+
+    uint64_t start_us = get_time_us();
+    union btide_payload rfd_payload = {0};
+    rfd_payload.request = packet_buf->pl.request;
+    set_request_offset(&rfd_payload.request, start_offset);
+    rfd_payload.request.data_len = data_size;
+    int result = send_RFD(&rfd_payload, file_fd, client->peer_fd);
+    close(file_fd);
+    if (result) {
+        peer_record_sent(node->peer_list, client->peer_ip, client->peer_port,
+                         data_size, get_time_us() - start_us);
+    }
+    return result;
+}
+
+/**
+ * Send the requested data of a chunk in bursts of RES packets
+ * @param packet_buf the REQ packet
+ * @param node
+ * @param client
+ * @param package package to read the data from
+ * @param source_offset offset of the data in the data file of the package
+ * @param start_offset file offset of the first byte, as in the RES packets
+ * @param data_size
+ * @return 1 if success, 0 otherwise
+ */
+int p2p_send_chunk(struct btide_packet *packet_buf, struct p2p_node *node,
+                   struct peer *client, struct bpkg_obj *package, uint64_t
+                   source_offset, uint64_t start_offset, uint32_t data_size) {
+    int client_fd = client->peer_fd;
+    uint64_t start_us = get_time_us();
+    uint32_t bytes_sent = 0;
+    struct btide_packet *peek_buf = NULL;
+    if (data_size > MAX_DATA_SIZE) {
+        peek_buf = calloc(CANCEL_PEEK_PACKETS, sizeof(struct btide_packet));
+    }
+    struct btide_packet *burst = calloc(SHAPER_BATCH_PACKETS, sizeof(struct
+            btide_packet));
+    char *burst_data = calloc(SHAPER_BATCH_PACKETS * MAX_DATA_SIZE,
+                              sizeof(char));
+    // Keep sending bursts of RES until the requested data is fully sent
+    while (bytes_sent < data_size) {
+        // Stop sending a chunk that the peer received from another peer
+        if (bytes_sent > 0 && p2p_check_cancel(&packet_buf->pl.request,
+                                               peek_buf, client_fd)) {
+            break;
+        }
+
+        // Read the data of the whole burst at once
+        uint32_t burst_bytes = data_size - bytes_sent;
+        if (burst_bytes > SHAPER_BATCH_PACKETS * MAX_DATA_SIZE) {
+            burst_bytes = SHAPER_BATCH_PACKETS * MAX_DATA_SIZE;
+        }
+        read_package_data(package, burst_data, burst_bytes, source_offset +
+                                                            bytes_sent);
+
+        // Packets beyond 4 GB are RES2, which carry a little less data
+        int num_packets = 0;
+        uint32_t packed_bytes = 0;
+        while (packed_bytes < burst_bytes && num_packets <
+                                             SHAPER_BATCH_PACKETS) {
+            struct btide_packet *res = &burst[num_packets];
+            memset(res, 0, sizeof(struct btide_packet));
+            uint64_t packet_offset = start_offset + bytes_sent + packed_bytes;
+
+            // Cannot fit the remaining chunk into the packet
+            uint32_t packet_len = burst_bytes - packed_bytes;
+            if (packet_len > max_response_data(packet_offset)) {
+                packet_len = max_response_data(packet_offset);
+            }
+            fill_response(res, 0, packet_offset, packet_buf->pl.request
+                    .chunk_hash, packet_buf->pl.request.ident, burst_data +
+                                                               packed_bytes,
+                          (uint16_t) packet_len);
+
+            packed_bytes += packet_len;
+            num_packets++;
+        }
+
+        // Wait for the upload limits before sending the whole burst
+        shape_upload(node->shaper, client_fd, (uint64_t) num_packets *
+                PACKET_SIZE);
+        if (!send_packets(burst, num_packets, client_fd)) {
+            printf("Client Handler: Failed to send RES\n");
+            free(burst_data);
+            free(burst);
+            free(peek_buf);
+            return 0;
+        }
+
+        bytes_sent += packed_bytes;
+    }
+    free(burst_data);
+    free(burst);
+    free(peek_buf);
+
+    peer_record_sent(node->peer_list, client->peer_ip, client->peer_port,
+                     bytes_sent, get_time_us() - start_us);
+    return 1;
+}
+
+/**
+ * Serve a whole chunk that is missing from the requested package, or whose
+ * package is not managed, from any package that holds the same content
+ * @param packet_buf the REQ packet
+ * @param node
+ * @param client
+ * @return 1 if success, 0 otherwise
+ */
+int p2p_serve_stored_chunk(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *client) {
     char hash_buf[SHA256_HEX_STRLEN] = {0};
     strncpy(hash_buf, packet_buf->pl.request.chunk_hash, SHA256_HEX_LEN);
-    char ident_buf[MAX_IDENT_SIZE] = {0};
-    strncpy(ident_buf, packet_buf->pl.request.ident, IDENT_SIZE);
-
-    int package_index = find_package(package_list, ident_buf,
-                                     MIN_IDENT_MATCH);
-    // Package is not managed in the application
-    if (package_index == -1) {
-        send_RES(1, NULL, client_fd);
+    char holder_buf[MIN_IDENT_MATCH + 1] = {0};
+    uint64_t source_offset = 0;
+    // The chunk offsets of a package that is not managed are unknown, so
+    // only whole chunks are served
+    if (node->chunk_store == NULL || !find_stored_chunk(node->chunk_store,
+                                                        hash_buf,
+                                                        packet_buf->pl.request
+                                                        .data_len, holder_buf,
+                                                        &source_offset)) {
+        p2p_send_error(packet_buf, client);
         return 0;
     }
-    struct bpkg_obj *package = package_list->packages[package_index];
+    struct package_entry *entry = get_package(node->package_list,
+                                              holder_buf);
+    if (entry == NULL) {
+        p2p_send_error(packet_buf, client);
+        return 0;
+    }
+    int result = p2p_send_chunk(packet_buf, node, client, entry->package,
+                                source_offset, get_request_offset
+                                (&packet_buf->pl.request, client->version),
+                                packet_buf->pl.request.data_len);
+    put_package(node->package_list, entry);
+    return result;
+}
+
+/**
+ * Serve the chunk of a REQ packet from a managed package
+ * @param packet_buf the REQ packet
+ * @param node
+ * @param client
+ * @param package
+ * @return 1 if success, 0 otherwise
+ */
+int p2p_serve_request(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *client, struct bpkg_obj *package) {
+    // Retrieve the data in the REQ packet
+    uint64_t file_offset = get_request_offset(&packet_buf->pl.request,
+                                              client->version);
+    uint32_t data_size = packet_buf->pl.request.data_len;
+    char hash_buf[SHA256_HEX_STRLEN] = {0};
+    strncpy(hash_buf, packet_buf->pl.request.chunk_hash, SHA256_HEX_LEN);
 
     chunk *target_chunk = get_chunk_from_hash(package, hash_buf, file_offset);
     // Hash is not in the package
     if (target_chunk == NULL) {
-        send_RES(1, NULL, client_fd);
+        p2p_send_error(packet_buf, client);
         return 0;
     }
-    // Do not have the chunk
+    // Do not have the chunk, another package may have the same content
     if (!check_chunk_completion(package, hash_buf, file_offset)) {
-        send_RES(1, NULL, client_fd);
-        return 0;
+        return p2p_serve_stored_chunk(packet_buf, node, client);
     }
 
-    uint32_t current_file_offset = file_offset;
+    uint64_t start_offset = file_offset;
+    if (start_offset == 0) {
+        start_offset = target_chunk->offset;
+    }
     // Specified offset is beyond the start of a chunk, send the remaining
     // bytes in the chunk
-    if (current_file_offset > target_chunk->offset) {
-        uint32_t chunk_offset = current_file_offset - target_chunk->offset;
-        data_size = target_chunk->size - chunk_offset;
-    }
-    if (current_file_offset == 0) {
-        current_file_offset = target_chunk->offset;
+    uint32_t chunk_remaining = target_chunk->size - (start_offset -
+            target_chunk->offset);
+    if (start_offset > target_chunk->offset || data_size > chunk_remaining) {
+        data_size = chunk_remaining;
     }
 
-    uint32_t bytes_sent = 0;
-    uint32_t remaining;
-    // Keep sending RES until the requested data is fully sent
-    while (bytes_sent < data_size) {
-        current_file_offset += bytes_sent;
-        remaining = data_size - bytes_sent;
-
-        union btide_payload res_payload = {0};
-        res_payload.response.file_offset = current_file_offset;
-        strncpy(res_payload.response.chunk_hash, hash_buf, CHUNK_HASH_SIZE);
-        strncpy(res_payload.response.ident, ident_buf, IDENT_SIZE);
-
-        // Cannot fit the remaining chunk into the packet
-        if (remaining > MAX_DATA_SIZE) {
-            get_data(package, MAX_DATA_SIZE, current_file_offset,
-                     res_payload.response.data);
-            res_payload.response.data_len = MAX_DATA_SIZE;
-
-            if (send_RES(0, &res_payload, client_fd) == 0) {
-                printf("Client Handler: Failed to send RES\n");
-                return 0;
-            }
-
-            bytes_sent += MAX_DATA_SIZE;
-        } else {
-            get_data(package, remaining, current_file_offset,
-                     res_payload.response.data);
-            res_payload.response.data_len = (uint16_t) remaining;
-
-            if (send_RES(0, &res_payload, client_fd) == 0) {
-                printf("Client Handler: Failed to send RES\n");
-                return 0;
-            }
+    // Peers on the same host copy the chunk from the passed fd themselves,
+    // unless the chunk is as cheap to pass through the shared memory ring
+    if (client->local && !client->shared &&
+        p2p_send_fd_response(packet_buf, node, client, package, start_offset,
+                             data_size)) {
+        return 1;
+    }
+    return p2p_send_chunk(packet_buf, node, client, package, start_offset,
+                          start_offset, data_size);
+}
 
-            bytes_sent += remaining;
-        }
+int p2p_handle_request(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *client) {
+    char ident_buf[MAX_IDENT_SIZE] = {0};
+    strncpy(ident_buf, packet_buf->pl.request.ident, IDENT_SIZE);
+    struct package_entry *entry = get_package(node->package_list, ident_buf);
+    // Package is not managed in the application
+    if (entry == NULL) {
+        return p2p_serve_stored_chunk(packet_buf, node, client);
     }
+    // The handle keeps the package alive if it is removed while being served
+    int result = p2p_serve_request(packet_buf, node, client, entry->package);
+    put_package(node->package_list, entry);
+    return result;
+}
 
-    return 1;
+/**
+ * Discard the chunk being reassembled
+ * @param assembly
+ */
+void p2p_reset_assembly(struct chunk_assembly *assembly) {
+    free(assembly->data);
+    memset(assembly, 0, sizeof(struct chunk_assembly));
 }
 
-void p2p_handle_response(struct btide_packet *packet_buf, struct package_list
-*package_list, int client_fd) {
-    // The peer does not have the data requested
-    if (packet_buf->error > 0) {
-        return;
+/**
+ * Check if a RES packet continues the chunk being reassembled
+ * @return 1 if true, 0 otherwise
+ */
+int p2p_continues_assembly(struct chunk_assembly *assembly, struct
+        response_fields *res) {
+    if (assembly->data == NULL) {
+        return 0;
     }
+    return res->file_offset == assembly->file_offset + assembly->bytes_recv &&
+           strncmp(res->chunk_hash, assembly->chunk_hash, SHA256_HEX_LEN) ==
+           0 && strncmp(res->ident, assembly->ident, IDENT_SIZE) == 0;
+}
 
-    // Retrieve the data in the first received RES packet
-    uint32_t file_offset = packet_buf->pl.response.file_offset;
-    uint16_t data_size = packet_buf->pl.response.data_len;
-    char data_buf[MAX_DATA_SIZE] = {0};
-    memcpy(data_buf, packet_buf->pl.response.data, data_size);
+/**
+ * Start reassembling a chunk from its first RES packet
+ * @return 1 if success, 0 if the RES does not belong to a managed package
+ */
+int p2p_start_assembly(struct chunk_assembly *assembly, struct
+        response_fields *res, struct package_list *package_list, struct
+        scheduler *scheduler) {
     char hash_buf[SHA256_HEX_STRLEN] = {0};
-    strncpy(hash_buf, packet_buf->pl.response.chunk_hash, SHA256_HEX_LEN);
+    strncpy(hash_buf, res->chunk_hash, SHA256_HEX_LEN);
     char ident_buf[MAX_IDENT_SIZE] = {0};
-    strncpy(ident_buf, packet_buf->pl.response.ident, IDENT_SIZE);
+    strncpy(ident_buf, res->ident, IDENT_SIZE);
+    uint64_t file_offset = res->file_offset;
 
     // Locate the package and file
-    int package_index = find_package(package_list, ident_buf,
-                                     MIN_IDENT_MATCH);
+    struct package_entry *entry = get_package(package_list, ident_buf);
     // Package is not managed in the application
-    if (package_index == -1) {
+    if (entry == NULL) {
         printf("RES handling: Invalid package\n");
-        return;
+        return 0;
     }
-    struct bpkg_obj *package = package_list->packages[package_index];
+    struct bpkg_obj *package = entry->package;
 
     // Invalid file offset
     if (file_offset > package->size) {
-        return;
+        put_package(package_list, entry);
+        return 0;
     }
 
     chunk *target_chunk = get_chunk_from_hash(package, hash_buf, file_offset);
     if (target_chunk == NULL) {
+        put_package(package_list, entry);
         printf("RES handling: Invalid chunk hash\n");
-        return;
+        return 0;
     }
 
     uint32_t chunk_len = target_chunk->size;
@@ -129,45 +337,325 @@ void p2p_handle_response(struct btide_packet *packet_buf, struct package_list
         file_offset = target_chunk->offset;
     }
 
-    // Keep waiting for RES until all data is received
-    uint32_t bytes_recv = 0;
-    char *chunk_buf = calloc(chunk_len, sizeof(char));
-    memcpy(chunk_buf, data_buf, data_size);
-    bytes_recv += data_size;
-    while (bytes_recv < chunk_len) {
-        ssize_t read_result = read(client_fd, packet_buf, PACKET_SIZE);
-        // Client disconnected
-        if (read_result <= 0) {
-            free(chunk_buf);
-            return;
+    strncpy(assembly->ident, ident_buf, MAX_IDENT_SIZE);
+    strncpy(assembly->chunk_hash, hash_buf, SHA256_HEX_STRLEN);
+    assembly->file_offset = file_offset;
+    assembly->chunk_len = chunk_len;
+    assembly->bytes_recv = 0;
+    assembly->data = calloc(chunk_len + 1, sizeof(char));
+    // Another peer already delivered the chunk of a hedged or endgame request
+    assembly->discard = !scheduler_wants_chunk(scheduler, package, hash_buf,
+                                               file_offset);
+    put_package(package_list, entry);
+    return 1;
+}
+
+void p2p_handle_response(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *peer, struct chunk_assembly *assembly) {
+    struct response_fields fields = {0};
+    get_response_fields(packet_buf, &fields);
+    struct response_fields *res = &fields;
+    char hash_buf[SHA256_HEX_STRLEN] = {0};
+    strncpy(hash_buf, res->chunk_hash, SHA256_HEX_LEN);
+    char ident_buf[MAX_IDENT_SIZE] = {0};
+    strncpy(ident_buf, res->ident, IDENT_SIZE);
+
+    // The peer does not have the data requested
+    if (packet_buf->error > 0) {
+        scheduler_on_failure(node->scheduler, peer->peer_ip, peer->peer_port,
+                             ident_buf, hash_buf);
+        return;
+    }
+
+    if (!p2p_continues_assembly(assembly, res)) {
+        // The previous chunk was cut short by the peer, which is expected
+        // after a CAN
+        if (assembly->data != NULL) {
+            if (!assembly->discard) {
+                scheduler_on_failure(node->scheduler, peer->peer_ip,
+                                     peer->peer_port, assembly->ident,
+                                     assembly->chunk_hash);
+            }
+            p2p_reset_assembly(assembly);
         }
-        // Invalid RES packet
-        if (read_result < PACKET_SIZE || packet_buf->msg_code != PKT_MSG_RES) {
-            free(chunk_buf);
+        if (!p2p_start_assembly(assembly, res, node->package_list,
+                                node->scheduler)) {
             return;
         }
+    }
 
-        data_size = packet_buf->pl.response.data_len;
-        chunk_buf = realloc(chunk_buf, bytes_recv + data_size);
-        memcpy(chunk_buf + bytes_recv, packet_buf->pl.response.data, data_size);
-        bytes_recv += data_size;
+    // Invalid RES packet
+    uint16_t data_size = res->data_len;
+    uint16_t max_data_size = packet_buf->msg_code == PKT_MSG_RES2 ?
+            MAX_DATA_SIZE_V2 : MAX_DATA_SIZE;
+    if (data_size > max_data_size || assembly->bytes_recv + data_size >
+                                     assembly->chunk_len) {
+        scheduler_on_failure(node->scheduler, peer->peer_ip, peer->peer_port,
+                             assembly->ident, assembly->chunk_hash);
+        p2p_reset_assembly(assembly);
+        return;
+    }
+    if (!assembly->discard) {
+        memcpy(assembly->data + assembly->bytes_recv, res->data, data_size);
+    }
+    assembly->bytes_recv += data_size;
+    // Keep waiting for RES until all data is received
+    if (assembly->bytes_recv < assembly->chunk_len) {
+        return;
+    }
+    if (assembly->discard) {
+        p2p_reset_assembly(assembly);
+        return;
     }
 
     // Check the integrity of the received chunk
     char chunk_hash[SHA256_HEX_STRLEN] = {0};
-    compute_hash(chunk_buf, bytes_recv, chunk_hash);
-    if (strncmp(chunk_hash, hash_buf, CHUNK_HASH_SIZE) != 0) {
-        free(chunk_buf);
+    compute_hash(assembly->data, assembly->bytes_recv, chunk_hash);
+    if (strncmp(chunk_hash, assembly->chunk_hash, CHUNK_HASH_SIZE) != 0) {
+        scheduler_on_failure(node->scheduler, peer->peer_ip, peer->peer_port,
+                             assembly->ident, assembly->chunk_hash);
+        p2p_reset_assembly(assembly);
+        return;
+    }
+
+    struct package_entry *entry = get_package(node->package_list,
+                                              assembly->ident);
+    if (entry != NULL) {
+        struct bpkg_obj *package = entry->package;
+        // Suppress a duplicate that completed while it was being received
+        if (scheduler_wants_chunk(node->scheduler, package,
+                                  assembly->chunk_hash,
+                                  assembly->file_offset)) {
+            // The write-back stage takes over the data and the handle
+            queue_chunk(node->write_back, entry, peer->peer_ip,
+                        peer->peer_port, assembly->ident,
+                        assembly->chunk_hash, assembly->file_offset,
+                        assembly->data, assembly->bytes_recv);
+            assembly->data = NULL;
+        } else {
+            put_package(node->package_list, entry);
+        }
+    }
+    p2p_reset_assembly(assembly);
+}
+
+/**
+ * Handle an RFD packet, the chunk is read from the passed fd instead of RES
+ * packets
+ * @param packet_buf
+ * @param node
+ * @param peer
+ * @param file_fd the passed fd, closed before returning
+ */
+void p2p_handle_fd_response(struct btide_packet *packet_buf, struct p2p_node
+        *node, struct peer *peer, int file_fd) {
+    struct request_payload *rfd = &packet_buf->pl.request;
+    uint64_t file_offset = get_request_offset(rfd, peer->version);
+    char hash_buf[SHA256_HEX_STRLEN] = {0};
+    strncpy(hash_buf, rfd->chunk_hash, SHA256_HEX_LEN);
+    char ident_buf[MAX_IDENT_SIZE] = {0};
+    strncpy(ident_buf, rfd->ident, IDENT_SIZE);
+
+    struct package_entry *entry = NULL;
+    if (file_fd == -1 || (entry = get_package(node->package_list, ident_buf))
+                         == NULL) {
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        return;
+    }
+    struct bpkg_obj *package = entry->package;
+
+    chunk *target_chunk = get_chunk_from_hash(package, hash_buf, file_offset);
+    // Another peer already delivered the chunk of a hedged or endgame
+    // request, or the chunk is verified in the data file
+    size_t leaf = find_chunk_leaf(package, hash_buf, file_offset);
+    merkle_tree *hashes = package->hashes;
+    if (target_chunk == NULL || (leaf < hashes->num_leaves &&
+        compare_node_hash(hashes->nodes[hashes->num_inner_nodes + leaf])) ||
+        !scheduler_wants_chunk(node->scheduler, package, hash_buf,
+                               file_offset)) {
+        close(file_fd);
+        put_package(node->package_list, entry);
+        return;
+    }
+    uint32_t chunk_remaining = target_chunk->size - (file_offset -
+            target_chunk->offset);
+    if (file_offset < target_chunk->offset || rfd->data_len !=
+                                              chunk_remaining ||
+        !copy_chunk(file_fd, file_offset, package, file_offset,
+                    rfd->data_len, hash_buf)) {
+        close(file_fd);
+        scheduler_on_failure(node->scheduler, peer->peer_ip, peer->peer_port,
+                             ident_buf, hash_buf);
+        put_package(node->package_list, entry);
+        return;
+    }
+    close(file_fd);
+    if (commit_written_chunk(node->write_back, package)) {
+        if (package->resume_state) {
+            record_verified_chunk(package, hash_buf, file_offset);
+            commit_resume_state(node->write_back, entry);
+        }
+        scheduler_on_chunk(node->scheduler, peer->peer_ip, peer->peer_port,
+                           package, ident_buf, hash_buf, file_offset,
+                           rfd->data_len);
+    }
+    put_package(node->package_list, entry);
+}
+
+/**
+ * Handle an SHM packet, all further packets of the peer are exchanged over
+ * the shared memory rings it created
+ * @param peer
+ * @param passed_fds the fds of the channel, taken over if valid
+ */
+void p2p_handle_shm(struct peer *peer, int *passed_fds) {
+    struct shm_channel *channel = open_shm_channel(passed_fds);
+    // The channel closes the fds if it cannot be opened
+    for (int i = 0; i < SHM_CHANNEL_FDS; ++i) {
+        passed_fds[i] = -1;
+    }
+    if (channel == NULL) {
+        printf("SHM handling: Invalid shared memory channel\n");
         return;
     }
+    attach_shm_channel(peer->peer_fd, channel);
+    peer->shared = 1;
+}
+
+/**
+ * Handle a packet received from a connected peer
+ * @param packet_buf
+ * @param node
+ * @param peer
+ * @param assembly chunk being reassembled from the peer
+ * @param passed_fds fds received with the packet, followed by -1
+ * @return 0 if the peer closed the connection, 1 otherwise
+ */
+int p2p_handle_packet(struct btide_packet *packet_buf, struct p2p_node *node,
+                      struct peer *peer, struct chunk_assembly *assembly,
+                      int *passed_fds) {
+    // Handle different packet types
+    uint16_t msg_code = packet_buf->msg_code;
+    if (msg_code == PKT_MSG_RFD && peer->local) {
+        p2p_handle_fd_response(packet_buf, node, peer, passed_fds[0]);
+        passed_fds[0] = -1;
+    } else if (msg_code == PKT_MSG_SHM && peer->local && !peer->shared) {
+        p2p_handle_shm(peer, passed_fds);
+    }
+    // Only RFD and SHM carry fds
+    close_passed_fds(passed_fds);
+    if (msg_code == PKT_MSG_RFD || msg_code == PKT_MSG_SHM) {
+        return 1;
+    }
+    if (msg_code == PKT_MSG_REQ) {
+        p2p_handle_request(packet_buf, node, peer);
+    } else if (msg_code == PKT_MSG_RES || (msg_code == PKT_MSG_RES2 &&
+                                           peer->version >= 2)) {
+        p2p_handle_response(packet_buf, node, peer, assembly);
+    } else if (msg_code == PKT_MSG_DSN) { // Signal for closing the connection
+        remove_peer_fd(node->peer_list, peer->peer_ip, peer->peer_port,
+                       peer->peer_fd);
+        return 0;
+    } else if (msg_code == PKT_MSG_PNG) {
+        handle_PNG(peer->peer_fd);
+    } else if (msg_code == PKT_MSG_POG) {
+        peer_record_rtt(node->peer_list, peer->peer_ip, peer->peer_port);
+    } else {
+        // Should not receive: ACP, ACK
+        // No need to handle: CAN, checked while serving a REQ
+    }
+    return 1;
+}
+
+/**
+ * Timer callback of a connection, sends PNG to a peer that became idle and
+ * shuts down the connection of a peer that did not respond, which ends its
+ * reader thread
+ * @param arg struct keepalive of the connection
+ */
+void p2p_keepalive_expired(void *arg) {
+    struct keepalive *keepalive = arg;
+    struct p2p_node *node = keepalive->node;
+    struct peer *peer = keepalive->peer;
+
+    uint64_t idle = get_time_us() - keepalive->last_recv_us;
+    if (idle < KEEPALIVE_IDLE_US) {
+        keepalive->pinged = 0;
+        timer_add(node->timers, &keepalive->timer, KEEPALIVE_IDLE_US - idle);
+        return;
+    }
+    if (!keepalive->pinged) {
+        keepalive->pinged = 1;
+        ping_peer(node->peer_list, peer->peer_ip, peer->peer_port);
+    }
+    if (idle < KEEPALIVE_IDLE_US + KEEPALIVE_TIMEOUT_US) {
+        timer_add(node->timers, &keepalive->timer, KEEPALIVE_IDLE_US +
+                KEEPALIVE_TIMEOUT_US - idle);
+        return;
+    }
+
+    // The reader thread closes the socket only after cancelling this timer
+    shutdown(peer->peer_fd, SHUT_RDWR);
+}
+
+/**
+ * Handle the packets received from a connected peer until the connection
+ * ends, the peer is removed from the peer list when the connection is lost
+ * @param node
+ * @param peer
+ * @return 1 if the peer sent DSN, 0 if the connection was lost
+ */
+int p2p_read_loop(struct p2p_node *node, struct peer *peer) {
+    struct keepalive keepalive = {0};
+    keepalive.node = node;
+    keepalive.peer = peer;
+    keepalive.last_recv_us = get_time_us();
+    reset_peer_shaping(node->shaper, peer->peer_fd);
+    init_timer(&keepalive.timer, p2p_keepalive_expired, &keepalive);
+    timer_add(node->timers, &keepalive.timer, KEEPALIVE_IDLE_US);
+
+    int peer_fd = peer->peer_fd;
+    int closed = 0;
+    struct btide_packet packet_buf = {0};
+    struct chunk_assembly assembly = {0};
+    int passed_fds[MAX_PASSED_FDS];
+    while (1) {
+        ssize_t read_result = recv_packet(peer_fd, &packet_buf, passed_fds);
+        // Peer disconnected, or was dropped by the keepalive timer
+        if (read_result <= 0) {
+            break;
+        }
+        keepalive.last_recv_us = get_time_us();
+        // Try again after reading an invalid packet
+        if (read_result < PACKET_SIZE) {
+            printf("Invalid packet from Peer FD: %d LEN: %lu\n", peer_fd,
+                   read_result);
+            close_passed_fds(passed_fds);
+            continue;
+        }
+
+        if (!p2p_handle_packet(&packet_buf, node, peer, &assembly,
+                               passed_fds)) {
+            closed = 1;
+            break;
+        }
+    }
 
-    write_data(package, bytes_recv, file_offset, chunk_buf);
-    free(chunk_buf);
+    timer_cancel_sync(node->timers, &keepalive.timer);
+    p2p_reset_assembly(&assembly);
+    // The peer is already removed after a DSN or DISCONNECT, the reader
+    // thread is the only one closing the socket, so the fd cannot be reused
+    // while other threads may still send to it
+    remove_peer_fd(node->peer_list, peer->peer_ip, peer->peer_port, peer_fd);
+    detach_shm_channel(peer_fd);
+    close(peer_fd);
+    return closed;
 }
 
 struct client_handler_args *create_client_handler_args(int peer_fd, char
-        *peer_ip, uint16_t peer_port, struct peer_list *peer_list, struct
-                package_list *package_list) {
+        *peer_ip, uint16_t peer_port, struct p2p_node *node) {
     struct client_handler_args *new_args = calloc(1, sizeof(struct
             client_handler_args));
 
@@ -177,12 +665,31 @@ struct client_handler_args *create_client_handler_args(int peer_fd, char
     new_peer.peer_port = peer_port;
 
     new_args->new_peer = new_peer;
-    new_args->peer_list = peer_list;
-    new_args->package_list = package_list;
+    new_args->node = node;
 
     return new_args;
 }
 
+/**
+ * Start a thread to handle the packets received from a peer that completed
+ * the handshake
+ * @param args struct client_handler_args type
+ * @return
+ */
+void *start_peer_reader(void *args) {
+    // Retrieve arguments
+    struct peer peer = ((struct client_handler_args *) args)->new_peer;
+    struct p2p_node *node = ((struct client_handler_args *) args)->node;
+    free(args);
+    pin_current_thread(THREAD_NETWORK);
+
+    // Handle any packets received from the peer
+    if (!p2p_read_loop(node, &peer)) {
+        pthread_exit((void *) -1);
+    }
+    pthread_exit((void *) 0);
+}
+
 /**
  * Handle connection request from another peer and subsequent packets
  * @param args
@@ -191,56 +698,25 @@ struct client_handler_args *create_client_handler_args(int peer_fd, char
 void *start_client_handler(void *args) {
     // Retrieve arguments
     struct peer client = ((struct client_handler_args *) args)->new_peer;
-    struct peer_list *peer_list = ((struct client_handler_args *) args)
-            ->peer_list;
-    struct package_list *package_list = ((struct client_handler_args *) args)
-            ->package_list;
+    struct p2p_node *node = ((struct client_handler_args *) args)->node;
     free(args);
+    pin_current_thread(THREAD_NETWORK);
 
     // Failed to send ACP or receive ACK
-    if (!send_ACP(client.peer_fd)) {
+    if (!send_ACP(node->timers, client.peer_fd, &client.version)) {
         printf("Failed to send ACP or receive ACK in Client Handler\n");
+        close(client.peer_fd);
         pthread_exit((void *)-1);
     }
-    add_peer(peer_list, client);
+    if (!add_peer(node->peer_list, client)) {
+        close(client.peer_fd);
+        pthread_exit((void *) -1);
+    }
 
-    int client_fd = client.peer_fd;
-    struct btide_packet packet_buf = {0};
     // Handle packets received from the peer
-    while (1) {
-        ssize_t read_result = read(client_fd, &packet_buf, PACKET_SIZE);
-        // Client disconnected
-        if (read_result <= 0) {
-            // remove_peer(peer_list, client.peer_ip, client.peer_port);
-            pthread_exit((void *) -1);
-        }
-        // Try again after reading an invalid packet
-        if (read_result < PACKET_SIZE) {
-            printf("Invalid packet from Client FD: %d LEN: %lu\n", client_fd,
-                   read_result);
-            continue;
-        }
-
-        // Handle different packet types
-        uint16_t msg_code = packet_buf.msg_code;
-        if (msg_code == PKT_MSG_REQ) {
-            p2p_handle_request(&packet_buf, package_list, client_fd);
-            continue;
-        } else if (msg_code == PKT_MSG_RES) {
-            p2p_handle_response(&packet_buf, package_list, client_fd);
-            continue;
-        } else if (msg_code == PKT_MSG_DSN) { // Signal for closing the connection
-            remove_peer(peer_list, client.peer_ip, client.peer_port);
-            break;
-        } else if (msg_code == PKT_MSG_PNG) {
-            handle_PNG(client_fd);
-            continue;
-        } else {
-            // Should not receive: ACP, ACK
-            // No need to handle: POG
-        }
+    if (!p2p_read_loop(node, &client)) {
+        pthread_exit((void *) -1);
     }
-
     pthread_exit((void *) 0);
 }
 
@@ -265,6 +741,33 @@ int setup_server_socket(u_int16_t port) {
     return server_fd;
 }
 
+/**
+ * Set up the AF_UNIX socket that peers on the same host connect to, a stale
+ * socket file left by a previous run is replaced
+ * @param path
+ * @return server fd
+ */
+int setup_unix_socket(char *path) {
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("Server: Failed to create socket");
+        pthread_exit((void *) -1);
+    }
+
+    struct sockaddr_un socket_addr = {0};
+    socket_addr.sun_family = AF_UNIX;
+    strncpy(socket_addr.sun_path, path, MAX_SOCKET_PATH_SIZE - 1);
+    unlink(path);
+    if (bind(server_fd, (struct sockaddr *) &socket_addr, sizeof
+            (struct sockaddr_un)) == -1) {
+        perror("Server: Failed to bind");
+        close(server_fd);
+        pthread_exit((void *) -1);
+    }
+
+    return server_fd;
+}
+
 /**
  * Start a server thread to handle any new connection requests
  * @param args
@@ -273,11 +776,14 @@ int setup_server_socket(u_int16_t port) {
 void *start_server(void *args) {
     u_int16_t server_port = ((struct server_args *) args)->port;
     int max_peers = ((struct server_args *) args)->max_peers;
-    struct peer_list *peer_list = ((struct server_args *) args)->peer_list;
-    struct package_list *package_list = ((struct server_args *) args)
-            ->package_list;
-
-    int server_fd = setup_server_socket(server_port);
+    struct p2p_node *node = ((struct server_args *) args)->node;
+    char *unix_path = ((struct server_args *) args)->unix_path;
+    pin_current_thread(THREAD_NETWORK);
+    struct peer_list *peer_list = node->peer_list;
+
+    int local = unix_path[0] != '\0';
+    int server_fd = local ? setup_unix_socket(unix_path) :
+            setup_server_socket(server_port);
     // Start listening on the port
     if (listen(server_fd, max_peers) == -1) {
         perror("Server: Failed to listen");
@@ -293,7 +799,7 @@ void *start_server(void *args) {
         }
 
         int client_fd = 0;
-        struct sockaddr_in client_address = {0};
+        struct sockaddr_storage client_address = {0};
         socklen_t addr_len = sizeof(client_address);
         if ((client_fd = accept(server_fd, (struct sockaddr *)
                 &client_address, &addr_len)) == -1) {
@@ -302,10 +808,21 @@ void *start_server(void *args) {
             pthread_exit((void *) -1);
         }
 
-        // Create a client handler thread to handle the new peer
-        struct client_handler_args *new_args = create_client_handler_args
-                (client_fd, inet_ntoa(client_address.sin_addr), ntohs
-                        (client_address.sin_port), peer_list, package_list);
+        // Create a client handler thread to handle the new peer, local peers
+        // have no address and are told apart by their socket fd
+        struct client_handler_args *new_args;
+        if (local) {
+            new_args = create_client_handler_args(client_fd, LOCAL_PEER_IP,
+                                                  (u_int16_t) client_fd,
+                                                  node);
+            new_args->new_peer.local = 1;
+        } else {
+            struct sockaddr_in *inet_address = (struct sockaddr_in *)
+                    &client_address;
+            new_args = create_client_handler_args(client_fd, inet_ntoa
+                    (inet_address->sin_addr), ntohs(inet_address->sin_port),
+                    node);
+        }
         pthread_t handler_thread;
         if (pthread_create(&handler_thread, NULL, start_client_handler,
                            new_args) != 0) {
@@ -317,110 +834,3 @@ void *start_server(void *args) {
 
     pthread_exit((void *) 0);
 }
-
-struct client_args *create_client_args(char *ip, uint16_t port, struct
-        peer_list *peer_list, struct package_list *package_list) {
-    struct client_args *new_client_args = calloc(1, sizeof(struct client_args));
-    strncpy(new_client_args->ip, ip, MAX_IP_SIZE);
-    new_client_args->port = port;
-    new_client_args->peer_list = peer_list;
-    new_client_args->package_list = package_list;
-    return new_client_args;
-}
-
-/**
- * Start a client thread to connect to a new peer and handle any packets
- * received from the peer
- * @param arg struct client_args type
- * @return
- */
-void *start_client(void *args) {
-    // Retrieve arguments
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(((struct client_args *) args)->port);
-    if (inet_pton(AF_INET, ((struct client_args *) args)->ip, &server_addr.sin_addr) <= 0) {
-        printf("Unable to connect to request peer\n");
-        free(args);
-        pthread_exit((void *) -1);
-    }
-    struct peer_list *peer_list = ((struct client_args *) args)->peer_list;
-    struct package_list *package_list = ((struct client_args *) args)
-            ->package_list;
-    free(args);
-
-    // Set up a client socket
-    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_fd == -1) {
-        perror("Client: Failed to create socket");
-        pthread_exit((void *) -1);
-    }
-
-    // Connect to the server
-    if (connect(client_fd, (struct sockaddr *) &server_addr, sizeof
-            (server_addr)) == -1) {
-        perror("Client: Failed to connect to server");
-        close(client_fd);
-        pthread_exit((void *) -1);
-    }
-
-    struct btide_packet packet_buf = {0};
-    // Wait for ACP packet
-    if (!get_packet_tm(&packet_buf, client_fd)) {
-        printf("Unable to connect to request peer\n");
-        close(client_fd);
-        pthread_exit((void *) -1);
-    }
-    // Send ACK packet
-    if (!handle_ACP(client_fd)) {
-        printf("Unable to connect to request peer\n");
-        close(client_fd);
-        pthread_exit((void *) -1);
-    }
-
-    // Successfully connected
-    printf("Connection established with peer\n");
-    struct peer new_peer = {0};
-    new_peer.peer_fd = client_fd;
-    inet_ntop(AF_INET, &server_addr.sin_addr, new_peer.peer_ip, MAX_IP_SIZE);
-    new_peer.peer_port = ntohs(server_addr.sin_port);
-    add_peer(peer_list, new_peer);
-
-    // Handle any packets received from the peer
-    while (1) {
-        ssize_t read_result = read(client_fd, &packet_buf, PACKET_SIZE);
-        // Peer disconnected
-        if (read_result <= 0) {
-            // remove_peer(peer_list, new_peer.peer_ip, new_peer.peer_port);
-            close(client_fd);
-            pthread_exit((void *) -1);
-        }
-        // Try again after reading an invalid packet
-        if (read_result < PACKET_SIZE) {
-            printf("Invalid packet from Peer FD: %d LEN: %lu\n", client_fd,
-                   read_result);
-            continue;
-        }
-
-        // Handle different packet types
-        uint16_t msg_code = packet_buf.msg_code;
-        if (msg_code == PKT_MSG_REQ) {
-            p2p_handle_request(&packet_buf, package_list, client_fd);
-            continue;
-        } else if (msg_code == PKT_MSG_RES) {
-            p2p_handle_response(&packet_buf, package_list, client_fd);
-            continue;
-        } else if (msg_code == PKT_MSG_DSN) { // Signal for closing the connection
-            remove_peer(peer_list, new_peer.peer_ip, new_peer.peer_port);
-            break;
-        } else if (msg_code == PKT_MSG_PNG) {
-            handle_PNG(new_peer.peer_fd);
-            continue;
-        } else {
-            // Should not receive: ACP, ACK
-            // No need to handle: POG
-        }
-    }
-
-    pthread_exit((void *) 0);
-}
@@ -1,69 +1,236 @@
+#include "net/packet.h"
 #include "p2p/package.h"
 
 struct package_list *create_package_list() {
-    int init_size = PACKAGES_INIT_SIZE;
     struct package_list *new_list = calloc(1, sizeof(struct package_list));
-    new_list->max_size = init_size;
+    pthread_mutex_init(&new_list->lock, NULL);
     new_list->num_packages = 0;
-    new_list->packages = calloc(init_size, sizeof(struct bpkg_obj *));
-
+    for (int i = 0; i < PACKAGE_HASH_BUCKETS; ++i) {
+        atomic_init(&new_list->buckets[i], -1);
+    }
     return new_list;
 }
 
-void add_package(struct package_list *list, struct bpkg_obj *new_package) {
-    // Double the max size when capacity is almost reached
-    if ((list->max_size - 1) == list->num_packages) {
-        int old_size = list->max_size;
-        list->max_size *= 2;
-        list->packages = realloc(list->packages, list->max_size * sizeof(struct
-                bpkg_obj *));
-
-        for (int i = old_size; i < list->max_size; ++i) {
-            list->packages[i] = NULL;
-        }
+/**
+ * Get an entry of the registry
+ * @param list
+ * @param index
+ * @return the entry
+ */
+struct package_entry *get_entry(struct package_list *list, int index) {
+    return &list->slabs[index / PACKAGE_SLAB_SIZE][index % PACKAGE_SLAB_SIZE];
+}
+
+/**
+ * Hash the characters of an ident that identify a package (FNV-1a)
+ * @param pkg_ident
+ * @return hash of the first MIN_IDENT_MATCH characters
+ */
+uint32_t hash_ident(char *pkg_ident) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MIN_IDENT_MATCH && pkg_ident[i] != '\0'; ++i) {
+        hash = (hash ^ (uint8_t) pkg_ident[i]) * 16777619u;
     }
+    return hash;
+}
+
+/**
+ * Mark the start and end of a change to the hash chains, the lock must be
+ * held
+ * @param list
+ */
+void bump_package_seq(struct package_list *list) {
+    atomic_fetch_add(&list->seq, 1);
+}
 
-    for (int i = 0; i < list->max_size; ++i) {
-        if (list->packages[i] == NULL) {
-            list->packages[i] = new_package;
-            list->num_packages++;
-            return;
+/**
+ * Take a handle unless the package was already destroyed
+ * @param entry
+ * @return 1 if success, 0 otherwise
+ */
+int take_package(struct package_entry *entry) {
+    int refs = atomic_load(&entry->refs);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak(&entry->refs, &refs, refs + 1)) {
+            return 1;
         }
     }
-
-    printf("package.c: add_package: ERROR\n");
+    return 0;
 }
 
 /**
- * Find the package with pkg_ident in the package list
+ * Take a free entry, allocating a new slab when all entries are used, the
+ * lock must be held
  * @param list
- * @param pkg_ident
- * @param match first n character to match
- * @return the index in the package list, -1 when failed
+ * @return index of the entry, -1 if the registry is full
  */
-int find_package(struct package_list *list, char *pkg_ident, int match) {
-    for (int i = 0; i < list->max_size; ++i) {
-        struct bpkg_obj *current_obj = list->packages[i];
-        if (current_obj == NULL) {
+int take_free_entry(struct package_list *list) {
+    // Reuse the first free entry, so packages are listed in the same order
+    int num_entries = atomic_load(&list->num_entries);
+    for (int i = 0; i < num_entries; ++i) {
+        if (get_entry(list, i)->package == NULL) {
+            return i;
+        }
+    }
+    if (num_entries == PACKAGE_MAX_SLABS * PACKAGE_SLAB_SIZE) {
+        return -1;
+    }
+    if (num_entries % PACKAGE_SLAB_SIZE == 0) {
+        struct package_entry *slab = calloc(PACKAGE_SLAB_SIZE, sizeof
+                (struct package_entry));
+        for (int i = 0; i < PACKAGE_SLAB_SIZE; ++i) {
+            pthread_mutex_init(&slab[i].tree_lock, NULL);
+        }
+        list->slabs[num_entries / PACKAGE_SLAB_SIZE] = slab;
+    }
+    atomic_store(&list->num_entries, num_entries + 1);
+    return num_entries;
+}
+
+void add_package(struct package_list *list, struct bpkg_obj *new_package) {
+    pthread_mutex_lock(&list->lock);
+    int index = take_free_entry(list);
+    if (index == -1) {
+        pthread_mutex_unlock(&list->lock);
+        printf("package.c: add_package: ERROR\n");
+        bpkg_obj_destroy(new_package);
+        return;
+    }
+    struct package_entry *entry = get_entry(list, index);
+    uint32_t hash = hash_ident(new_package->ident);
+    entry->package = new_package;
+    entry->listed = 1;
+    atomic_store(&entry->last_used_us, get_time_us());
+    atomic_store(&entry->ident_hash, hash);
+    atomic_store(&entry->refs, 1);
+
+    // Keep each chain ordered by index, so the first added of packages with
+    // the same ident prefix is found first
+    _Atomic int *link = &list->buckets[hash % PACKAGE_HASH_BUCKETS];
+    while (atomic_load(link) != -1 && atomic_load(link) < index) {
+        link = &get_entry(list, atomic_load(link))->next;
+    }
+    bump_package_seq(list);
+    atomic_store(&entry->next, atomic_load(link));
+    atomic_store(link, index);
+    bump_package_seq(list);
+
+    list->num_packages++;
+    pthread_mutex_unlock(&list->lock);
+}
+
+struct package_entry *get_package_header(struct package_list *list, char
+        *pkg_ident) {
+    uint32_t hash = hash_ident(pkg_ident);
+    while (1) {
+        uint32_t seq = atomic_load(&list->seq);
+        // A writer is changing the chains
+        if (seq % 2 == 1) {
             continue;
         }
-        if (strncmp(current_obj->ident, pkg_ident, match) == 0) {
-            return i;
+
+        struct package_entry *found = NULL;
+        int index = atomic_load(&list->buckets[hash % PACKAGE_HASH_BUCKETS]);
+        while (index != -1) {
+            struct package_entry *entry = get_entry(list, index);
+            // The package cannot be destroyed once a handle is taken
+            if (atomic_load(&entry->ident_hash) == hash && take_package
+                    (entry)) {
+                if (strncmp(entry->package->ident, pkg_ident,
+                            MIN_IDENT_MATCH) == 0) {
+                    found = entry;
+                    break;
+                }
+                put_package(list, entry);
+            }
+            index = atomic_load(&entry->next);
+        }
+
+        // The walk may have followed an entry that was removed or reused
+        if (atomic_load(&list->seq) == seq) {
+            return found;
+        }
+        if (found != NULL) {
+            put_package(list, found);
         }
     }
-    return -1;
 }
 
-void remove_package(struct package_list *list, char *pkg_ident) {
-    int package_i = find_package(list, pkg_ident, 20);
-    if (package_i == -1) {
-        printf("Identifier provided does not match managed packages\n");
+/**
+ * Build the tree of a package if it was not built yet or was reclaimed
+ * @param entry held handle
+ * @return 1 if success, 0 if the package file no longer loads
+ */
+int use_package_tree(struct package_entry *entry) {
+    pthread_mutex_lock(&entry->tree_lock);
+    int loaded = bpkg_load_tree(entry->package);
+    atomic_store(&entry->last_used_us, get_time_us());
+    pthread_mutex_unlock(&entry->tree_lock);
+    return loaded;
+}
+
+struct package_entry *get_package(struct package_list *list, char *pkg_ident) {
+    struct package_entry *entry = get_package_header(list, pkg_ident);
+    if (entry != NULL && !use_package_tree(entry)) {
+        printf("Unable to load the hashes of package %.32s\n",
+               entry->package->ident);
+        put_package(list, entry);
+        return NULL;
+    }
+    return entry;
+}
+
+void hold_package(struct package_entry *entry) {
+    atomic_fetch_add(&entry->refs, 1);
+}
+
+void put_package(struct package_list *list, struct package_entry *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) != 1) {
         return;
     }
+    // Last handle of a removed package, the entry becomes free
+    pthread_mutex_lock(&list->lock);
+    bpkg_obj_destroy(entry->package);
+    entry->package = NULL;
+    pthread_mutex_unlock(&list->lock);
+}
+
+int unlist_package(struct package_list *list, char *pkg_ident) {
+    pthread_mutex_lock(&list->lock);
+    uint32_t hash = hash_ident(pkg_ident);
+    _Atomic int *link = &list->buckets[hash % PACKAGE_HASH_BUCKETS];
+    struct package_entry *entry = NULL;
+    while (atomic_load(link) != -1) {
+        struct package_entry *current = get_entry(list, atomic_load(link));
+        if (strncmp(current->package->ident, pkg_ident, MIN_IDENT_MATCH) ==
+            0) {
+            entry = current;
+            break;
+        }
+        link = &current->next;
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&list->lock);
+        return 0;
+    }
 
-    bpkg_obj_destroy(list->packages[package_i]);
-    list->packages[package_i] = NULL;
+    bump_package_seq(list);
+    atomic_store(link, atomic_load(&entry->next));
+    bump_package_seq(list);
+    entry->listed = 0;
     list->num_packages--;
+    pthread_mutex_unlock(&list->lock);
+
+    // Requests being served keep the package until they finish
+    put_package(list, entry);
+    return 1;
+}
+
+void remove_package(struct package_list *list, char *pkg_ident) {
+    if (!unlist_package(list, pkg_ident)) {
+        printf("Identifier provided does not match managed packages\n");
+        return;
+    }
     printf("Package has been removed\n");
 }
 
@@ -78,22 +245,66 @@ void print_package(struct bpkg_obj *package, int count) {
 }
 
 void print_package_list(struct package_list *list) {
-    int print_count = 0;
-    for (int i = 0; i < list->max_size; ++i) {
-        if (list->packages[i] != NULL) {
-            print_count++;
-            print_package(list->packages[i], print_count);
+    // Hashing the data files holds only the handles, not the lock
+    pthread_mutex_lock(&list->lock);
+    int num_entries = atomic_load(&list->num_entries);
+    struct package_entry **entries = calloc(num_entries + 1, sizeof(struct
+            package_entry *));
+    int num_listed = 0;
+    for (int i = 0; i < num_entries; ++i) {
+        struct package_entry *entry = get_entry(list, i);
+        if (entry->package == NULL || !entry->listed) {
+            continue;
         }
+        hold_package(entry);
+        entries[num_listed++] = entry;
     }
+    pthread_mutex_unlock(&list->lock);
 
-    if (print_count == 0) {
+    for (int i = 0; i < num_listed; ++i) {
+        struct package_entry *entry = entries[i];
+        // The status needs the tree, which is kept while the handle is held
+        if (use_package_tree(entry)) {
+            print_package(entry->package, i + 1);
+        } else {
+            printf("%d. %.32s, %s/%s : UNAVAILABLE\n", i + 1,
+                   entry->package->ident, entry->package->directory,
+                   entry->package->filename);
+        }
+        put_package(list, entry);
+    }
+    free(entries);
+
+    if (num_listed == 0) {
         printf("No packages managed\n");
     }
+}
 
-    // Debug check
-    if (print_count != list->num_packages) {
-        printf("package.c: Did not print all packages\n");
+int reclaim_idle_trees(struct package_list *list) {
+    if (list->idle_timeout_us == 0) {
+        return 0;
     }
+    uint64_t now_us = get_time_us();
+    int num_freed = 0;
+    pthread_mutex_lock(&list->lock);
+    int num_entries = atomic_load(&list->num_entries);
+    for (int i = 0; i < num_entries; ++i) {
+        struct package_entry *entry = get_entry(list, i);
+        if (entry->package == NULL || !entry->listed) {
+            continue;
+        }
+        // A handle taken after the check builds the tree again
+        pthread_mutex_lock(&entry->tree_lock);
+        if (entry->package->hashes != NULL && atomic_load(&entry->refs) ==
+                                              1 && now_us - atomic_load(
+                &entry->last_used_us) >= list->idle_timeout_us) {
+            bpkg_unload_tree(entry->package);
+            num_freed++;
+        }
+        pthread_mutex_unlock(&entry->tree_lock);
+    }
+    pthread_mutex_unlock(&list->lock);
+    return num_freed;
 }
 
 void free_package_list(struct package_list *list) {
@@ -101,11 +312,19 @@ void free_package_list(struct package_list *list) {
         return;
     }
 
-    for (int i = 0; i < list->max_size; ++i) {
-        if (list->packages[i] != NULL) {
-            bpkg_obj_destroy(list->packages[i]);
+    int num_entries = atomic_load(&list->num_entries);
+    for (int i = 0; i < num_entries; ++i) {
+        struct package_entry *entry = get_entry(list, i);
+        if (entry->package != NULL) {
+            bpkg_obj_destroy(entry->package);
         }
     }
-    free(list->packages);
+    for (int i = 0; i < num_entries; ++i) {
+        pthread_mutex_destroy(&get_entry(list, i)->tree_lock);
+    }
+    for (int i = 0; i < PACKAGE_MAX_SLABS; ++i) {
+        free(list->slabs[i]);
+    }
+    pthread_mutex_destroy(&list->lock);
     free(list);
 }
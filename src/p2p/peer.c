@@ -1,45 +1,126 @@
+#include <sys/socket.h>
+
 #include "p2p/peer.h"
 
 struct peer_list *create_peer_list() {
-    int init_size = PEERS_INIT_SIZE;
     struct peer_list *new_list = calloc(1, sizeof(struct peer_list));
-    new_list->max_size = init_size;
+    pthread_rwlock_init(&new_list->lock, NULL);
+    new_list->max_size = PEER_TABLE_SIZE;
     new_list->num_peers = 0;
-    new_list->peers = calloc(init_size, sizeof(struct peer));
-
-    struct peer init_peer = {0};
-    init_peer.peer_fd = -1;
-    for (int i = 0; i < init_size; ++i) {
-        new_list->peers[i] = init_peer;
+    new_list->free_slots = -1;
+    for (int i = 0; i < PEER_HASH_BUCKETS; ++i) {
+        new_list->buckets[i] = -1;
     }
-
+    new_list->live = calloc(PEER_TABLE_SIZE, sizeof(int));
     return new_list;
 }
 
-void add_peer(struct peer_list *list, struct peer new_peer) {
-    // Double the max size when capacity is almost reached
-    if ((list->max_size - 1) == list->num_peers) {
-        int old_size = list->max_size;
-        list->max_size *= 2;
-        list->peers = realloc(list->peers, list->max_size * sizeof(struct
-        peer));
+void read_lock_peers(struct peer_list *list) {
+    pthread_rwlock_rdlock(&list->lock);
+}
+
+void unlock_peers(struct peer_list *list) {
+    pthread_rwlock_unlock(&list->lock);
+}
+
+/**
+ * Get a slot of the peer table
+ * @param list
+ * @param index
+ * @return the slot
+ */
+struct peer_slot *get_slot(struct peer_list *list, int index) {
+    return &list->slabs[index / PEER_SLAB_SIZE][index % PEER_SLAB_SIZE];
+}
+
+struct peer *get_peer(struct peer_list *list, int index) {
+    return &get_slot(list, index)->peer;
+}
+
+/**
+ * Hash the address of a peer (FNV-1a)
+ * @param ip
+ * @param port
+ * @return bucket index
+ */
+int hash_peer(char *ip, u_int16_t port) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_IP_SIZE && ip[i] != '\0'; ++i) {
+        hash = (hash ^ (uint8_t) ip[i]) * 16777619u;
+    }
+    hash = (hash ^ (port & 0xFF)) * 16777619u;
+    hash = (hash ^ (port >> 8)) * 16777619u;
+    return (int) (hash % PEER_HASH_BUCKETS);
+}
 
-        struct peer init_peer = {0};
-        init_peer.peer_fd = -1;
-        for (int i = old_size; i < list->max_size; ++i) {
-            list->peers[i] = init_peer;
+/**
+ * Find the slot of a peer, the lock must be held
+ * @param list
+ * @param ip
+ * @param port
+ * @return index of the slot, -1 otherwise
+ */
+int lookup_peer(struct peer_list *list, char *ip, u_int16_t port) {
+    int index = list->buckets[hash_peer(ip, port)];
+    while (index != -1) {
+        struct peer_slot *slot = get_slot(list, index);
+        if (slot->peer.peer_port == port && strncmp(slot->peer.peer_ip, ip,
+                                                    MAX_IP_SIZE) == 0) {
+            return index;
         }
+        index = slot->hash_next;
     }
+    return -1;
+}
 
-    for (int i = 0; i < list->max_size; ++i) {
-        if (list->peers[i].peer_fd == -1) {
-            list->peers[i] = new_peer;
-            list->num_peers++;
-            return;
+/**
+ * Take a free slot, allocating a new slab when all slots are used, the write
+ * lock must be held
+ * @param list
+ * @return index of the slot, -1 if the table is full
+ */
+int take_free_slot(struct peer_list *list) {
+    if (list->free_slots == -1) {
+        if (list->num_slots == PEER_TABLE_SIZE) {
+            return -1;
         }
+        struct peer_slot *slab = calloc(PEER_SLAB_SIZE, sizeof(struct
+                peer_slot));
+        list->slabs[list->num_slots / PEER_SLAB_SIZE] = slab;
+        // Chain the new slots in order, so the lowest one is used first
+        for (int i = PEER_SLAB_SIZE - 1; i >= 0; --i) {
+            slab[i].peer.peer_fd = -1;
+            pthread_mutex_init(&slab[i].stats_lock, NULL);
+            slab[i].hash_next = list->free_slots;
+            list->free_slots = list->num_slots + i;
+        }
+        list->num_slots += PEER_SLAB_SIZE;
+    }
+
+    int index = list->free_slots;
+    list->free_slots = get_slot(list, index)->hash_next;
+    return index;
+}
+
+int add_peer(struct peer_list *list, struct peer new_peer) {
+    pthread_rwlock_wrlock(&list->lock);
+    int index = take_free_slot(list);
+    if (index == -1) {
+        pthread_rwlock_unlock(&list->lock);
+        printf("peer.c: add_peer: Peer table is full\n");
+        return 0;
     }
 
-    printf("peer.c: add_peer: ERROR\n");
+    struct peer_slot *slot = get_slot(list, index);
+    slot->peer = new_peer;
+    int bucket = hash_peer(new_peer.peer_ip, new_peer.peer_port);
+    slot->hash_next = list->buckets[bucket];
+    list->buckets[bucket] = index;
+    slot->live_index = list->num_peers;
+    list->live[list->num_peers] = index;
+    list->num_peers++;
+    pthread_rwlock_unlock(&list->lock);
+    return 1;
 }
 
 /**
@@ -49,56 +130,378 @@ void add_peer(struct peer_list *list, struct peer new_peer) {
  * @return index of the peer, -1 otherwise
  */
 int find_peer(struct peer_list *list, char *ip, u_int16_t port) {
-    for (int i = 0; i < list->max_size; ++i) {
-        struct peer current_peer = list->peers[i];
-        if (current_peer.peer_fd != -1 && (strncmp(current_peer.peer_ip, ip,
-            MAX_IP_SIZE) == 0) && current_peer.peer_port == port) {
-            return i;
+    read_lock_peers(list);
+    int index = lookup_peer(list, ip, port);
+    unlock_peers(list);
+    return index;
+}
+
+/**
+ * Find a peer connected over AF_UNIX by its socket path
+ * @param list
+ * @param path
+ * @return index of the peer, -1 otherwise
+ */
+int find_local_peer(struct peer_list *list, char *path) {
+    read_lock_peers(list);
+    for (int i = 0; i < list->num_peers; ++i) {
+        struct peer *current_peer = get_peer(list, list->live[i]);
+        if (current_peer->local && strncmp(current_peer->path, path,
+                                           MAX_SOCKET_PATH_SIZE) == 0) {
+            unlock_peers(list);
+            return list->live[i];
         }
     }
+    unlock_peers(list);
     return -1;
 }
 
 /**
- * Close the peer socket and remove the peer from peer list
+ * Unlink a slot from the table and shut down the socket of its peer, the
+ * write lock must be held
+ * @param list
+ * @param index
+ */
+void release_slot(struct peer_list *list, int index) {
+    struct peer_slot *slot = get_slot(list, index);
+    int *link = &list->buckets[hash_peer(slot->peer.peer_ip,
+                                         slot->peer.peer_port)];
+    while (*link != index) {
+        link = &get_slot(list, *link)->hash_next;
+    }
+    *link = slot->hash_next;
+
+    list->num_peers--;
+    int moved = list->live[list->num_peers];
+    list->live[slot->live_index] = moved;
+    get_slot(list, moved)->live_index = slot->live_index;
+
+    // The reader thread wakes up and closes the socket, after its shared
+    // memory channel is detached
+    detach_shm_channel(slot->peer.peer_fd);
+    shutdown(slot->peer.peer_fd, SHUT_RDWR);
+    slot->peer.peer_fd = -1;
+    slot->hash_next = list->free_slots;
+    list->free_slots = index;
+}
+
+/**
+ * Remove the peer from peer list and shut down its socket, which ends its
+ * reader thread. The reader thread closes the socket.
  * @param list
  * @param ip
  * @param port
  */
 void remove_peer(struct peer_list *list, char *ip, u_int16_t port) {
-    int index;
-    if ((index = find_peer(list, ip, port)) == -1) {
+    pthread_rwlock_wrlock(&list->lock);
+    int index = lookup_peer(list, ip, port);
+    if (index != -1) {
+        release_slot(list, index);
+    }
+    pthread_rwlock_unlock(&list->lock);
+}
+
+void remove_peer_fd(struct peer_list *list, char *ip, u_int16_t port, int
+        peer_fd) {
+    pthread_rwlock_wrlock(&list->lock);
+    int index = lookup_peer(list, ip, port);
+    if (index != -1 && get_peer(list, index)->peer_fd == peer_fd) {
+        release_slot(list, index);
+    }
+    pthread_rwlock_unlock(&list->lock);
+}
+
+/**
+ * Send PNG to all peers and record the time for RTT measurement
+ * @param list
+ */
+void ping_all_peers(struct peer_list *list) {
+    read_lock_peers(list);
+    for (int i = 0; i < list->num_peers; ++i) {
+        struct peer_slot *slot = get_slot(list, list->live[i]);
+        // Keep the earlier timestamp if the last PNG is still outstanding
+        pthread_mutex_lock(&slot->stats_lock);
+        if (slot->peer.stats.png_sent_us == 0) {
+            slot->peer.stats.png_sent_us = get_time_us();
+        }
+        pthread_mutex_unlock(&slot->stats_lock);
+        send_PNG(slot->peer.peer_fd);
+    }
+    unlock_peers(list);
+}
+
+/**
+ * Send PNG to a peer and record the time for RTT measurement
+ * @param list
+ * @param ip
+ * @param port
+ */
+void ping_peer(struct peer_list *list, char *ip, u_int16_t port) {
+    read_lock_peers(list);
+    int index = lookup_peer(list, ip, port);
+    if (index == -1) {
+        unlock_peers(list);
         return;
     }
+    struct peer_slot *slot = get_slot(list, index);
+    pthread_mutex_lock(&slot->stats_lock);
+    if (slot->peer.stats.png_sent_us == 0) {
+        slot->peer.stats.png_sent_us = get_time_us();
+    }
+    pthread_mutex_unlock(&slot->stats_lock);
+    send_PNG(slot->peer.peer_fd);
+    unlock_peers(list);
+}
 
-    // Close the peer socket
-    close(list->peers[index].peer_fd);
-    list->peers[index].peer_fd = -1;
-    list->num_peers--;
+/**
+ * Fold a new time sample into a smoothed mean and mean deviation
+ * @param mean 0 if there is no sample yet
+ * @param var
+ * @param sample
+ */
+void smooth_time(uint64_t *mean, uint64_t *var, uint64_t sample) {
+    if (*mean == 0) {
+        *mean = sample;
+        *var = sample / 2;
+        return;
+    }
+
+    uint64_t deviation = sample > *mean ? sample - *mean : *mean - sample;
+    *var = (uint64_t) ((1 - RTT_BETA) * *var + RTT_BETA * deviation);
+    *mean = (uint64_t) ((1 - RTT_ALPHA) * *mean + RTT_ALPHA * sample);
+}
+
+/**
+ * Find a peer and lock its stats, together with the read lock of the list
+ * @param list
+ * @param ip
+ * @param port
+ * @return the slot of the peer, NULL if not connected
+ */
+struct peer_slot *lock_peer_stats(struct peer_list *list, char *ip, u_int16_t
+        port) {
+    read_lock_peers(list);
+    int index = lookup_peer(list, ip, port);
+    if (index == -1) {
+        unlock_peers(list);
+        return NULL;
+    }
+    struct peer_slot *slot = get_slot(list, index);
+    pthread_mutex_lock(&slot->stats_lock);
+    return slot;
+}
+
+void unlock_peer_stats(struct peer_list *list, struct peer_slot *slot) {
+    pthread_mutex_unlock(&slot->stats_lock);
+    unlock_peers(list);
+}
+
+/**
+ * Record the round trip time of a PNG when the POG arrives
+ * @param list
+ * @param ip
+ * @param port
+ */
+void peer_record_rtt(struct peer_list *list, char *ip, u_int16_t port) {
+    struct peer_slot *slot = lock_peer_stats(list, ip, port);
+    if (slot == NULL) {
+        return;
+    }
+    struct peer_stats *stats = &slot->peer.stats;
+    // Unsolicited POG
+    if (stats->png_sent_us != 0) {
+        uint64_t rtt = get_time_us() - stats->png_sent_us;
+        stats->png_sent_us = 0;
+        smooth_time(&stats->srtt_us, &stats->rttvar_us, rtt);
+    }
+    unlock_peer_stats(list, slot);
+}
+
+/**
+ * Fold a new throughput sample into a smoothed rate
+ */
+double smooth_rate(double rate, uint32_t bytes, uint64_t elapsed_us) {
+    // Avoid a division by zero for chunks that arrived instantly
+    if (elapsed_us == 0) {
+        elapsed_us = 1;
+    }
+    double sample = (double) bytes * 1000000.0 / (double) elapsed_us;
+    if (rate == 0) {
+        return sample;
+    }
+    return (1 - RATE_ALPHA) * rate + RATE_ALPHA * sample;
+}
+
+/**
+ * Record a chunk delivered by a peer
+ * @param list
+ * @param ip
+ * @param port
+ * @param bytes chunk size
+ * @param sent_us time the REQ was sent, 0 if unknown
+ */
+void peer_record_recv(struct peer_list *list, char *ip, u_int16_t port,
+                      uint32_t bytes, uint64_t sent_us) {
+    struct peer_slot *slot = lock_peer_stats(list, ip, port);
+    if (slot == NULL) {
+        return;
+    }
+    struct peer_stats *stats = &slot->peer.stats;
+    uint64_t now = get_time_us();
+    stats->bytes_recv += bytes;
+    stats->chunks_recv++;
+
+    // Pipelined requests wait behind the previous chunk from the same peer,
+    // so only the time after that chunk completed is counted
+    if (sent_us != 0) {
+        uint64_t start = sent_us > stats->last_recv_us ? sent_us :
+                stats->last_recv_us;
+        stats->recv_rate = smooth_rate(stats->recv_rate, bytes, now - start);
+        smooth_time(&stats->latency_us, &stats->latvar_us, now - start);
+    }
+    stats->last_recv_us = now;
+    unlock_peer_stats(list, slot);
+}
+
+/**
+ * Record a chunk served to a peer
+ * @param list
+ * @param ip
+ * @param port
+ * @param bytes bytes sent in RES packets
+ * @param elapsed_us time spent sending the RES packets
+ */
+void peer_record_sent(struct peer_list *list, char *ip, u_int16_t port,
+                      uint32_t bytes, uint64_t elapsed_us) {
+    struct peer_slot *slot = lock_peer_stats(list, ip, port);
+    if (slot == NULL) {
+        return;
+    }
+    struct peer_stats *stats = &slot->peer.stats;
+    stats->bytes_sent += bytes;
+    stats->send_rate = smooth_rate(stats->send_rate, bytes, elapsed_us);
+    unlock_peer_stats(list, slot);
+}
+
+void peer_record_failure(struct peer_list *list, char *ip, u_int16_t port) {
+    struct peer_slot *slot = lock_peer_stats(list, ip, port);
+    if (slot == NULL) {
+        return;
+    }
+    slot->peer.stats.failures++;
+    unlock_peer_stats(list, slot);
+}
+
+/**
+ * Estimate the time for a peer to deliver a chunk, penalised by failures
+ * @param peer
+ * @param chunk_size
+ * @return expected time in microseconds, lower is better
+ */
+double peer_score(struct peer *peer, uint32_t chunk_size) {
+    struct peer_stats *stats = &peer->stats;
+    double rtt = stats->srtt_us != 0 ? (double) stats->srtt_us :
+            DEFAULT_RTT_US;
+    double rate = stats->recv_rate != 0 ? stats->recv_rate : DEFAULT_RATE;
+    double expected = rtt + (double) chunk_size * 1000000.0 / rate;
+
+    // A peer that failed half of its chunks is treated as twice as slow
+    double reliability = (double) (stats->chunks_recv + 1) /
+            (double) (stats->chunks_recv + stats->failures + 1);
+    return expected / reliability;
+}
+
+/**
+ * Estimate the time within which a peer delivers 95% of its chunks
+ * @param peer
+ * @param chunk_size
+ * @return time in microseconds
+ */
+uint64_t peer_deadline_us(struct peer *peer, uint32_t chunk_size) {
+    struct peer_stats *stats = &peer->stats;
+    // Nothing delivered yet, allow twice the estimated time
+    if (stats->latency_us == 0) {
+        return (uint64_t) (2 * peer_score(peer, chunk_size));
+    }
+    return stats->latency_us + LATENCY_DEVIATIONS * stats->latvar_us;
+}
+
+struct peer_rank {
+    double score;
+    int index;
+};
+
+int compare_peer_rank(const void *a, const void *b) {
+    double score_a = ((const struct peer_rank *) a)->score;
+    double score_b = ((const struct peer_rank *) b)->score;
+    if (score_a < score_b) {
+        return -1;
+    }
+    return score_a > score_b;
+}
+
+/**
+ * Get the indices of connected peers ordered from the best score
+ * @param list
+ * @param chunk_size
+ * @param indices buffer with size >= list->max_size
+ * @return number of indices stored
+ */
+int rank_peers(struct peer_list *list, uint32_t chunk_size, int *indices) {
+    read_lock_peers(list);
+    int num_ranks = list->num_peers;
+    struct peer_rank *ranks = calloc(num_ranks + 1, sizeof(struct
+            peer_rank));
+    for (int i = 0; i < num_ranks; ++i) {
+        struct peer_slot *slot = get_slot(list, list->live[i]);
+        pthread_mutex_lock(&slot->stats_lock);
+        ranks[i].score = peer_score(&slot->peer, chunk_size);
+        pthread_mutex_unlock(&slot->stats_lock);
+        ranks[i].index = list->live[i];
+    }
+    unlock_peers(list);
+
+    qsort(ranks, num_ranks, sizeof(struct peer_rank), compare_peer_rank);
+    for (int i = 0; i < num_ranks; ++i) {
+        indices[i] = ranks[i].index;
+    }
+    free(ranks);
+    return num_ranks;
 }
 
 void print_peer_list(struct peer_list *list) {
     int print_count = 0;
-    for (int i = 0; i < list->max_size; ++i) {
-        struct peer current_peer = list->peers[i];
-        if (current_peer.peer_fd != -1) {
-            print_count++;
-            if (print_count == 1) {
-                printf("Connected to:\n\n");
-            }
-            printf("%d. %s:%hu\n", print_count, current_peer.peer_ip,
-                   current_peer.peer_port);
+    read_lock_peers(list);
+    for (int i = 0; i < list->num_peers; ++i) {
+        struct peer_slot *slot = get_slot(list, list->live[i]);
+        pthread_mutex_lock(&slot->stats_lock);
+        struct peer current_peer = slot->peer;
+        pthread_mutex_unlock(&slot->stats_lock);
+        print_count++;
+        if (print_count == 1) {
+            printf("Connected to:\n\n");
         }
+        // Peers dialed over AF_UNIX are shown by their socket path
+        char address[MAX_SOCKET_PATH_SIZE + MAX_IP_SIZE] = {0};
+        if (current_peer.path[0] != '\0') {
+            snprintf(address, sizeof(address), "%s:%s",
+                     current_peer.peer_ip, current_peer.path);
+        } else {
+            snprintf(address, sizeof(address), "%s:%hu",
+                     current_peer.peer_ip, current_peer.peer_port);
+        }
+        struct peer_stats *stats = &current_peer.stats;
+        printf("%d. %s rtt: %.3f ms, down: %.0f B/s, up: %.0f B/s, "
+               "failures: %u\n", print_count, address, (double)
+               stats->srtt_us / 1000.0, stats->recv_rate,
+               stats->send_rate, stats->failures);
     }
 
+    unlock_peers(list);
+
     if (print_count == 0) {
         printf("Not connected to any peers\n");
     }
-
-    // Debug check
-    if (print_count != list->num_peers) {
-        printf("peer.c: Did not print all peers\n");
-    }
 }
 
 void free_peer_list(struct peer_list *list) {
@@ -106,6 +509,13 @@ void free_peer_list(struct peer_list *list) {
         return;
     }
 
-    free(list->peers);
+    for (int i = 0; i < list->num_slots; ++i) {
+        pthread_mutex_destroy(&get_slot(list, i)->stats_lock);
+    }
+    for (int i = 0; i < list->num_slots / PEER_SLAB_SIZE; ++i) {
+        free(list->slabs[i]);
+    }
+    free(list->live);
+    pthread_rwlock_destroy(&list->lock);
     free(list);
 }
@@ -0,0 +1,928 @@
+#include "net/affinity.h"
+#include "chk/resume.h"
+#include "p2p/scheduler.h"
+#include "p2p/write_back.h"
+
+struct scheduler *create_scheduler(struct peer_list *peer_list, struct
+        package_list *package_list, struct timer_wheel *timers, struct shaper
+        *shaper, struct chunk_store *chunk_store) {
+    struct scheduler *new_scheduler = calloc(1, sizeof(struct scheduler));
+    pthread_mutex_init(&new_scheduler->lock, NULL);
+    pthread_cond_init(&new_scheduler->progress, NULL);
+    new_scheduler->peer_list = peer_list;
+    new_scheduler->package_list = package_list;
+    new_scheduler->timers = timers;
+    new_scheduler->shaper = shaper;
+    new_scheduler->chunk_store = chunk_store;
+
+    new_scheduler->max_downloads = DOWNLOADS_INIT_SIZE;
+    new_scheduler->downloads = calloc(DOWNLOADS_INIT_SIZE, sizeof(struct
+            download *));
+    new_scheduler->max_requests = REQUESTS_INIT_SIZE;
+    new_scheduler->requests = calloc(REQUESTS_INIT_SIZE, sizeof(struct
+            request *));
+    new_scheduler->max_outgoing = OUTBOX_INIT_SIZE;
+    new_scheduler->outbox = calloc(OUTBOX_INIT_SIZE, sizeof(struct
+            outgoing_packet));
+
+    return new_scheduler;
+}
+
+void free_download(struct scheduler *scheduler, struct download *download) {
+    if (download == NULL) {
+        return;
+    }
+
+    put_package(scheduler->package_list, download->entry);
+    free(download->tasks);
+    free(download);
+}
+
+/**
+ * Take the request at index out of the requests array by moving the last
+ * request into its place
+ * @param scheduler
+ * @param index
+ * @return the detached request
+ */
+struct request *detach_request(struct scheduler *scheduler, int index) {
+    struct request *request = scheduler->requests[index];
+    scheduler->num_requests--;
+    scheduler->requests[index] = scheduler->requests[scheduler->num_requests];
+    scheduler->requests[index]->index = index;
+    request->index = -1;
+    return request;
+}
+
+/**
+ * Remove and free the request at index, a request whose timer already fired
+ * is freed by the timer callback instead
+ * @param scheduler
+ * @param index
+ */
+void remove_request(struct scheduler *scheduler, int index) {
+    struct request *request = detach_request(scheduler, index);
+    if (timer_cancel(scheduler->timers, &request->timer)) {
+        free(request);
+    }
+}
+
+/**
+ * Release the chunk of a failed or lost request, the chunk goes back to the
+ * missing state when none of its requests are outstanding
+ * @param request
+ */
+void requeue_request(struct request *request) {
+    if (request->download == NULL) {
+        return;
+    }
+
+    struct chunk_task *task = &request->download->tasks[request->leaf];
+    if (task->status != CHUNK_REQUESTED) {
+        return;
+    }
+    task->num_requests--;
+    task->failures++;
+    strncpy(task->failed_ip, request->peer_ip, MAX_IP_SIZE);
+    task->failed_port = request->peer_port;
+    if (task->num_requests > 0) {
+        return;
+    }
+
+    task->status = CHUNK_MISSING;
+    uint64_t backoff = (uint64_t) task->failures * RETRY_BACKOFF_US;
+    if (backoff > MAX_RETRY_BACKOFF_US) {
+        backoff = MAX_RETRY_BACKOFF_US;
+    }
+    task->retry_us = get_time_us() + backoff;
+}
+
+void request_expired(void *arg);
+
+/**
+ * Record a sent REQ and arm its timeout, the scheduler lock must be held
+ */
+struct request *add_request(struct scheduler *scheduler, union btide_payload
+        *req, char *ip, u_int16_t port) {
+    if (scheduler->num_requests == scheduler->max_requests) {
+        scheduler->max_requests *= 2;
+        scheduler->requests = realloc(scheduler->requests,
+                scheduler->max_requests * sizeof(struct request *));
+    }
+
+    struct request *new_request = calloc(1, sizeof(struct request));
+    strncpy(new_request->ident, req->request.ident, MAX_IDENT_SIZE - 1);
+    strncpy(new_request->chunk_hash, req->request.chunk_hash, SHA256_HEX_LEN);
+    new_request->file_offset = get_request_offset(&req->request,
+                                                  PROTOCOL_VERSION);
+    strncpy(new_request->peer_ip, ip, MAX_IP_SIZE);
+    new_request->peer_port = port;
+    new_request->sent_us = get_time_us();
+    new_request->scheduler = scheduler;
+    new_request->index = scheduler->num_requests;
+    scheduler->requests[scheduler->num_requests] = new_request;
+    scheduler->num_requests++;
+
+    init_timer(&new_request->timer, request_expired, new_request);
+    timer_add(scheduler->timers, &new_request->timer, REQUEST_TIMEOUT_US);
+    return new_request;
+}
+
+/**
+ * Keep track of a REQ sent outside of the scheduler (FETCH)
+ * @param scheduler
+ * @param req REQ payload
+ * @param ip
+ * @param port
+ */
+void track_request(struct scheduler *scheduler, union btide_payload *req,
+                   char *ip, u_int16_t port) {
+    pthread_mutex_lock(&scheduler->lock);
+    add_request(scheduler, req, ip, port);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Find the oldest request sent to a peer that matches the ident and hash,
+ * the scheduler lock must be held
+ * @return index of the request, -1 if not found
+ */
+int find_request(struct scheduler *scheduler, char *ip, u_int16_t port, char
+        *ident, char *hash) {
+    int found = -1;
+    for (int i = 0; i < scheduler->num_requests; ++i) {
+        struct request *current = scheduler->requests[i];
+        if (current->peer_port != port || strncmp(current->peer_ip, ip,
+                                                  MAX_IP_SIZE) != 0) {
+            continue;
+        }
+        // Empty ident and hash match any request of the peer
+        if (ident[0] != '\0' && strncmp(current->ident, ident,
+                                        MAX_IDENT_SIZE) != 0) {
+            continue;
+        }
+        if (hash[0] != '\0' && strncmp(current->chunk_hash, hash,
+                                       SHA256_HEX_LEN) != 0) {
+            continue;
+        }
+        if (found == -1 || current->sent_us < scheduler->requests[found]
+                ->sent_us) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+/**
+ * Mark the leaf of a download as complete, the scheduler lock must be held
+ */
+void complete_task(struct download *download, size_t leaf) {
+    if (download->tasks[leaf].status == CHUNK_COMPLETE) {
+        return;
+    }
+    download->tasks[leaf].status = CHUNK_COMPLETE;
+    download->num_completed++;
+}
+
+/**
+ * Record a packet to send once the scheduler lock is released, the scheduler
+ * lock must be held
+ * @param scheduler
+ * @param msg_code PKT_MSG_REQ or PKT_MSG_CAN
+ * @param payload
+ * @param ip
+ * @param port
+ */
+void queue_packet(struct scheduler *scheduler, uint16_t msg_code, union
+        btide_payload *payload, char *ip, u_int16_t port) {
+    if (scheduler->num_outgoing == scheduler->max_outgoing) {
+        scheduler->max_outgoing *= 2;
+        scheduler->outbox = realloc(scheduler->outbox,
+                scheduler->max_outgoing * sizeof(struct outgoing_packet));
+    }
+    struct outgoing_packet *packet = &scheduler->outbox[scheduler
+            ->num_outgoing++];
+    packet->msg_code = msg_code;
+    strncpy(packet->peer_ip, ip, MAX_IP_SIZE - 1);
+    packet->peer_ip[MAX_IP_SIZE - 1] = '\0';
+    packet->peer_port = port;
+    packet->payload = *payload;
+}
+
+/**
+ * Send the packets recorded by queue_packet, the scheduler lock must not be
+ * held. Packets of peers removed meanwhile are dropped, and a REQ that fails
+ * to send is left to time out, as its peer is disconnecting.
+ * @param scheduler
+ */
+void flush_outbox(struct scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    int num_outgoing = scheduler->num_outgoing;
+    struct outgoing_packet *outbox = scheduler->outbox;
+    if (num_outgoing == 0) {
+        pthread_mutex_unlock(&scheduler->lock);
+        return;
+    }
+    scheduler->num_outgoing = 0;
+    scheduler->outbox = calloc(scheduler->max_outgoing, sizeof(struct
+            outgoing_packet));
+    pthread_mutex_unlock(&scheduler->lock);
+
+    read_lock_peers(scheduler->peer_list);
+    for (int i = 0; i < num_outgoing; ++i) {
+        int peer_index = find_peer(scheduler->peer_list, outbox[i].peer_ip,
+                                   outbox[i].peer_port);
+        if (peer_index == -1) {
+            continue;
+        }
+        int peer_fd = get_peer(scheduler->peer_list, peer_index)->peer_fd;
+        if (outbox[i].msg_code == PKT_MSG_REQ) {
+            send_REQ(&outbox[i].payload, peer_fd);
+        } else {
+            send_CAN(&outbox[i].payload, peer_fd);
+        }
+    }
+    unlock_peers(scheduler->peer_list);
+    free(outbox);
+}
+
+/**
+ * Queue CAN for the hedged and endgame requests of a completed chunk that
+ * are still outstanding, the scheduler lock must be held
+ */
+void cancel_requests(struct scheduler *scheduler, struct download *download,
+                     size_t leaf) {
+    for (int i = scheduler->num_requests - 1; i >= 0; --i) {
+        struct request *current = scheduler->requests[i];
+        if (current->download != download || current->leaf != leaf) {
+            continue;
+        }
+
+        union btide_payload payload = {0};
+        set_request_offset(&payload.request, current->file_offset);
+        strncpy(payload.request.chunk_hash, current->chunk_hash,
+                SHA256_HEX_LEN);
+        strncpy(payload.request.ident, current->ident, IDENT_SIZE);
+        queue_packet(scheduler, PKT_MSG_CAN, &payload, current->peer_ip,
+                     current->peer_port);
+        remove_request(scheduler, i);
+    }
+}
+
+/**
+ * Check if a chunk is still needed, used to discard duplicate RES of hedged
+ * and endgame requests
+ * @param scheduler
+ * @param package
+ * @param hash
+ * @param file_offset offset of the chunk in the file
+ * @return 0 if a download of the package already completed the chunk, 1
+ * otherwise
+ */
+int scheduler_wants_chunk(struct scheduler *scheduler, struct bpkg_obj
+        *package, char *hash, uint64_t file_offset) {
+    int wanted = 1;
+    pthread_mutex_lock(&scheduler->lock);
+    for (int i = 0; i < scheduler->max_downloads && wanted; ++i) {
+        struct download *download = scheduler->downloads[i];
+        if (download == NULL || download->package != package) {
+            continue;
+        }
+        size_t leaf = find_chunk_leaf(package, hash, file_offset);
+        if (leaf < download->num_chunks) {
+            wanted = download->tasks[leaf].status != CHUNK_COMPLETE;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return wanted;
+}
+
+/**
+ * Complete the request of a verified chunk and update the peer measurements
+ * @param scheduler
+ * @param ip peer that delivered the chunk
+ * @param port
+ * @param package package of the chunk
+ * @param ident ident in the RES
+ * @param hash
+ * @param file_offset offset of the chunk in the file
+ * @param bytes
+ */
+void scheduler_on_chunk(struct scheduler *scheduler, char *ip, u_int16_t
+        port, struct bpkg_obj *package, char *ident, char *hash, uint64_t
+        file_offset, uint32_t bytes) {
+    pthread_mutex_lock(&scheduler->lock);
+    uint64_t sent_us = 0;
+    int index = find_request(scheduler, ip, port, ident, hash);
+    if (index != -1) {
+        sent_us = scheduler->requests[index]->sent_us;
+        remove_request(scheduler, index);
+    }
+
+    // The chunk may be requested by a download even if the REQ was sent by
+    // FETCH, so look it up in the downloads of the package
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        struct download *download = scheduler->downloads[i];
+        if (download == NULL || download->package != package) {
+            continue;
+        }
+        size_t leaf = find_chunk_leaf(package, hash, file_offset);
+        if (leaf < download->num_chunks) {
+            complete_task(download, leaf);
+            cancel_requests(scheduler, download, leaf);
+        }
+    }
+    // Streams wait for the chunk at their cursor
+    pthread_cond_broadcast(&scheduler->progress);
+    pthread_mutex_unlock(&scheduler->lock);
+    flush_outbox(scheduler);
+
+    if (scheduler->chunk_store != NULL) {
+        store_chunk(scheduler->chunk_store, package, hash, file_offset, bytes);
+    }
+    peer_record_recv(scheduler->peer_list, ip, port, bytes, sent_us);
+}
+
+/**
+ * Fail the request of a chunk so it is requested from another peer
+ * @param scheduler
+ * @param ip peer that failed to deliver the chunk
+ * @param port
+ * @param ident empty if unknown
+ * @param hash empty if unknown
+ */
+void scheduler_on_failure(struct scheduler *scheduler, char *ip, u_int16_t
+        port, char *ident, char *hash) {
+    pthread_mutex_lock(&scheduler->lock);
+    int index = find_request(scheduler, ip, port, ident, hash);
+    if (index != -1) {
+        requeue_request(scheduler->requests[index]);
+        remove_request(scheduler, index);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    peer_record_failure(scheduler->peer_list, ip, port);
+}
+
+/**
+ * Download all incomplete chunks of a managed package, chunks held by other
+ * packages are copied locally instead
+ * @param scheduler
+ * @param entry handle of the package, the download takes its own handle
+ * @return number of chunks to download, -1 if already downloading
+ */
+int add_download(struct scheduler *scheduler, struct package_entry *entry) {
+    struct bpkg_obj *package = entry->package;
+    pthread_mutex_lock(&scheduler->lock);
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        if (scheduler->downloads[i] != NULL && scheduler->downloads[i]
+                ->package == package) {
+            pthread_mutex_unlock(&scheduler->lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    // Hash the existing data outside of the lock
+    struct download *new_download = calloc(1, sizeof(struct download));
+    strncpy(new_download->ident, package->ident, MAX_IDENT_SIZE);
+    new_download->package = package;
+    new_download->entry = entry;
+    hold_package(entry);
+    new_download->num_chunks = package->hashes->num_leaves;
+    new_download->tasks = calloc(new_download->num_chunks, sizeof(struct
+            chunk_task));
+    merkle_tree *hashes = package->hashes;
+    int hashed = compute_chunk_hashes(package);
+    int num_copied = 0;
+    for (size_t leaf = 0; leaf < new_download->num_chunks; ++leaf) {
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes + leaf];
+        if (hashed && compare_node_hash(node)) {
+            complete_task(new_download, leaf);
+        } else if (scheduler->chunk_store != NULL && fill_from_store
+                (scheduler->chunk_store, scheduler->package_list, package,
+                 node->value, node->expected_hash)) {
+            complete_task(new_download, leaf);
+            record_verified_chunk(package, node->expected_hash,
+                                  node->value->offset);
+            num_copied++;
+        }
+    }
+    // The copies are synced before the resume file claims them
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    if (package->resume_state && num_copied > 0 && sync_data_file
+            (full_path)) {
+        save_resume_state(package);
+    }
+    int remaining = (int) (new_download->num_chunks -
+            new_download->num_completed);
+    if (remaining == 0) {
+        free_download(scheduler, new_download);
+        return 0;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    // Double the max size when capacity is almost reached
+    if ((scheduler->max_downloads - 1) == scheduler->num_downloads) {
+        int old_size = scheduler->max_downloads;
+        scheduler->max_downloads *= 2;
+        scheduler->downloads = realloc(scheduler->downloads,
+                scheduler->max_downloads * sizeof(struct download *));
+        for (int i = old_size; i < scheduler->max_downloads; ++i) {
+            scheduler->downloads[i] = NULL;
+        }
+    }
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        if (scheduler->downloads[i] == NULL) {
+            scheduler->downloads[i] = new_download;
+            scheduler->num_downloads++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return remaining;
+}
+
+/**
+ * Drop the download at index and its requests, the scheduler lock must be
+ * held
+ */
+void drop_download(struct scheduler *scheduler, int index) {
+    struct download *download = scheduler->downloads[index];
+    for (int i = scheduler->num_requests - 1; i >= 0; --i) {
+        if (scheduler->requests[i]->download == download) {
+            remove_request(scheduler, i);
+        }
+    }
+    free_download(scheduler, download);
+    scheduler->downloads[index] = NULL;
+    scheduler->num_downloads--;
+    pthread_cond_broadcast(&scheduler->progress);
+}
+
+/**
+ * Find the download of a package, the scheduler lock must be held
+ * @param scheduler
+ * @param package
+ * @return the download, NULL if the package is not downloading
+ */
+struct download *find_download(struct scheduler *scheduler, struct bpkg_obj
+        *package) {
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        if (scheduler->downloads[i] != NULL && scheduler->downloads[i]
+                ->package == package) {
+            return scheduler->downloads[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stop downloading a package, used when the package is removed
+ * @param scheduler
+ * @param package
+ */
+void remove_download(struct scheduler *scheduler, struct bpkg_obj *package) {
+    pthread_mutex_lock(&scheduler->lock);
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        if (scheduler->downloads[i] != NULL && scheduler->downloads[i]
+                ->package == package) {
+            drop_download(scheduler, i);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Check whether the task was last failed by the peer
+ */
+int task_failed_by(struct chunk_task *task, struct peer *peer) {
+    return task->failures > 0 && task->failed_port == peer->peer_port &&
+           strncmp(task->failed_ip, peer->peer_ip, MAX_IP_SIZE) == 0;
+}
+
+/**
+ * Check whether a chunk is already requested from the peer, the scheduler
+ * lock must be held
+ */
+int task_requested_from(struct scheduler *scheduler, struct download
+        *download, size_t leaf, struct peer *peer) {
+    for (int i = 0; i < scheduler->num_requests; ++i) {
+        struct request *current = scheduler->requests[i];
+        if (current->download == download && current->leaf == leaf &&
+            current->peer_port == peer->peer_port && strncmp
+                    (current->peer_ip, peer->peer_ip, MAX_IP_SIZE) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Time to wait for the first RES of a chunk from a peer before hedging it
+ */
+uint64_t hedge_delay_us(struct download *download, struct peer *peer) {
+    struct bpkg_obj *package = download->package;
+    uint64_t deadline = peer_deadline_us(peer, package->size /
+            package->nchunks);
+    if (deadline < MIN_HEDGE_DELAY_US) {
+        deadline = MIN_HEDGE_DELAY_US;
+    }
+    return deadline;
+}
+
+/**
+ * Request a leaf of a download from a peer, the REQ is sent by flush_outbox.
+ * The scheduler lock and the read lock of the peer list must be held.
+ * @return the new request, NULL if the download limits are reached
+ */
+struct request *request_task(struct scheduler *scheduler, struct download
+        *download, size_t leaf, int peer_index) {
+    merkle_tree *hashes = download->package->hashes;
+    merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes + leaf];
+    union btide_payload payload = {0};
+    set_request_offset(&payload.request, node->value->offset);
+    payload.request.data_len = node->value->size;
+    strncpy(payload.request.chunk_hash, node->expected_hash, SHA256_HEX_LEN);
+    strncpy(payload.request.ident, download->ident, IDENT_SIZE);
+
+    struct peer *peer = get_peer(scheduler->peer_list, peer_index);
+    if (!shape_download(scheduler->shaper, peer->peer_fd,
+                        node->value->size)) {
+        return NULL;
+    }
+    queue_packet(scheduler, PKT_MSG_REQ, &payload, peer->peer_ip,
+                 peer->peer_port);
+    struct request *new_request = add_request(scheduler, &payload,
+                                              peer->peer_ip, peer->peer_port);
+    new_request->download = download;
+    new_request->leaf = leaf;
+    timer_add(scheduler->timers, &new_request->timer, hedge_delay_us
+            (download, peer));
+
+    struct chunk_task *task = &download->tasks[leaf];
+    task->status = CHUNK_REQUESTED;
+    task->num_requests++;
+    return new_request;
+}
+
+/**
+ * Select the best peer for a leaf, the scheduler lock and the read lock of
+ * the peer list must be held
+ * @param ranked peer indices ordered from the best score
+ * @param num_ranked
+ * @param peer_requests number of requests sent to each peer
+ * @param max_requests capacity of each peer
+ * @param exclude_requested skip peers that the leaf is already requested
+ * from
+ * @return index of the peer, -1 if all peers are busy
+ */
+int select_peer(struct scheduler *scheduler, struct download *download,
+                size_t leaf, int *ranked, int num_ranked, int *peer_requests,
+                int max_requests, int exclude_requested) {
+    struct chunk_task *task = &download->tasks[leaf];
+    merkle_tree *hashes = download->package->hashes;
+    chunk *target_chunk = hashes->nodes[hashes->num_inner_nodes + leaf]->value;
+    // Peers of version 1 cannot address data beyond 4 GB
+    int needs_v2 = ((target_chunk->offset + target_chunk->size - 1) >> 32) !=
+                   0;
+    for (int i = 0; i < num_ranked; ++i) {
+        int peer_index = ranked[i];
+        struct peer *peer = get_peer(scheduler->peer_list, peer_index);
+        if (peer_requests[peer_index] >= max_requests) {
+            continue;
+        }
+        if (needs_v2 && peer->version < 2) {
+            continue;
+        }
+        // Avoid the peer that just failed unless it is the only choice
+        if (task_failed_by(task, peer) && num_ranked > 1) {
+            continue;
+        }
+        if (exclude_requested && task_requested_from(scheduler, download,
+                                                      leaf, peer)) {
+            continue;
+        }
+        return peer_index;
+    }
+    return -1;
+}
+
+/**
+ * Request the missing chunks of a download from the peers with the best
+ * scores, the scheduler lock and the read lock of the peer list must be held
+ * @param scheduler
+ * @param download
+ * @param ranked peer indices ordered from the best score
+ * @param num_ranked
+ * @param peer_requests number of requests sent to each peer
+ */
+void schedule_download(struct scheduler *scheduler, struct download
+        *download, int *ranked, int num_ranked, int *peer_requests) {
+    uint64_t now = get_time_us();
+
+    // A streamed download is requested from its read cursor, and the chunks
+    // past its window leave room on each peer for the window to move into
+    size_t first = download->streaming ? download->cursor : 0;
+    for (size_t leaf = first; leaf < download->num_chunks; ++leaf) {
+        struct chunk_task *task = &download->tasks[leaf];
+        if (task->status != CHUNK_MISSING || task->retry_us > now) {
+            continue;
+        }
+
+        int max_requests = MAX_REQUESTS_PER_PEER;
+        if (download->streaming && leaf >= first + STREAM_WINDOW_CHUNKS) {
+            max_requests = STREAM_BACKGROUND_REQUESTS;
+        }
+        int selected = select_peer(scheduler, download, leaf, ranked,
+                                   num_ranked, peer_requests, max_requests,
+                                   0);
+        // All peers are busy
+        if (selected == -1) {
+            return;
+        }
+        if (request_task(scheduler, download, leaf, selected) == NULL) {
+            peer_requests[selected] = MAX_REQUESTS_PER_PEER;
+            continue;
+        }
+        peer_requests[selected]++;
+    }
+}
+
+/**
+ * Request every remaining chunk of a download from all peers, so a single
+ * stalled peer cannot hold back the last chunks, the scheduler lock and the
+ * read lock of the peer list must be held
+ */
+void schedule_endgame(struct scheduler *scheduler, struct download
+        *download, int *ranked, int num_ranked, int *peer_requests) {
+    uint64_t now = get_time_us();
+
+    for (size_t leaf = 0; leaf < download->num_chunks; ++leaf) {
+        struct chunk_task *task = &download->tasks[leaf];
+        if (task->status == CHUNK_COMPLETE || task->retry_us > now) {
+            continue;
+        }
+
+        int selected;
+        while ((selected = select_peer(scheduler, download, leaf, ranked,
+                                       num_ranked, peer_requests,
+                                       ENDGAME_REQUESTS_PER_PEER, 1)) != -1) {
+            if (request_task(scheduler, download, leaf, selected) == NULL) {
+                peer_requests[selected] = ENDGAME_REQUESTS_PER_PEER;
+                continue;
+            }
+            peer_requests[selected]++;
+        }
+    }
+}
+
+/**
+ * Count the outstanding requests of every peer, the scheduler lock must be
+ * held
+ * @param scheduler
+ * @param peer_requests indexed by peer, size of the peer list capacity
+ */
+void count_peer_requests(struct scheduler *scheduler, int *peer_requests) {
+    for (int i = 0; i < scheduler->num_requests; ++i) {
+        struct request *current = scheduler->requests[i];
+        int peer_index = find_peer(scheduler->peer_list, current->peer_ip,
+                                   current->peer_port);
+        if (peer_index != -1) {
+            peer_requests[peer_index]++;
+        }
+    }
+}
+
+/**
+ * Send a second REQ for the chunk of a slow request to the best other peer,
+ * the scheduler lock and the read lock of the peer list must be held
+ * @return 1 if the chunk was requested from another peer, 0 otherwise
+ */
+int hedge_request(struct scheduler *scheduler, struct request *request) {
+    struct peer_list *peer_list = scheduler->peer_list;
+    struct download *download = request->download;
+    struct bpkg_obj *package = download->package;
+
+    int *peer_requests = calloc(peer_list->max_size, sizeof(int));
+    int *ranked = calloc(peer_list->max_size, sizeof(int));
+    count_peer_requests(scheduler, peer_requests);
+    int num_ranked = rank_peers(peer_list, package->size / package->nchunks,
+                                ranked);
+
+    int hedged = 0;
+    int selected = select_peer(scheduler, download, request->leaf, ranked,
+                               num_ranked, peer_requests,
+                               MAX_REQUESTS_PER_PEER, 1);
+    if (selected != -1) {
+        struct request *hedge = request_task(scheduler, download,
+                                             request->leaf, selected);
+        if (hedge != NULL) {
+            hedge->hedged = 1;
+            request->hedged = 1;
+            hedged = 1;
+        }
+    }
+
+    free(ranked);
+    free(peer_requests);
+    return hedged;
+}
+
+/**
+ * Timer callback of a request, hedges the request once it is outstanding
+ * longer than the deadline of its peer and gives it up after
+ * REQUEST_TIMEOUT_US. The timer is armed again while the request is within
+ * its deadlines.
+ * @param arg the request
+ */
+void request_expired(void *arg) {
+    struct request *request = arg;
+    struct scheduler *scheduler = request->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    // Removed after the timer fired
+    if (request->index == -1) {
+        pthread_mutex_unlock(&scheduler->lock);
+        free(request);
+        return;
+    }
+
+    uint64_t now = get_time_us();
+    uint64_t next_us = REQUEST_TIMEOUT_US;
+    read_lock_peers(scheduler->peer_list);
+    int peer_index = find_peer(scheduler->peer_list, request->peer_ip,
+                               request->peer_port);
+    if (peer_index != -1) {
+        // Requests queued behind other chunks of the peer only start when
+        // the previous chunk arrives
+        struct peer *peer = get_peer(scheduler->peer_list, peer_index);
+        uint64_t start = request->sent_us > peer->stats.last_recv_us ?
+                request->sent_us : peer->stats.last_recv_us;
+        uint64_t elapsed = now - start;
+        if (elapsed < REQUEST_TIMEOUT_US) {
+            next_us = REQUEST_TIMEOUT_US - elapsed;
+        } else {
+            next_us = 0;
+        }
+
+        if (next_us > 0 && request->download != NULL && !request->hedged) {
+            uint64_t deadline = hedge_delay_us(request->download, peer);
+            if (elapsed < deadline) {
+                next_us = deadline - elapsed;
+            } else if (!hedge_request(scheduler, request) &&
+                       next_us > MIN_HEDGE_DELAY_US) {
+                // No other peer is free, try again later
+                next_us = MIN_HEDGE_DELAY_US;
+            }
+        }
+    } else {
+        next_us = 0;
+    }
+    unlock_peers(scheduler->peer_list);
+
+    if (next_us > 0) {
+        timer_add(scheduler->timers, &request->timer, next_us);
+        pthread_mutex_unlock(&scheduler->lock);
+        flush_outbox(scheduler);
+        return;
+    }
+
+    requeue_request(request);
+    detach_request(scheduler, request->index);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    peer_record_failure(scheduler->peer_list, request->peer_ip,
+                        request->peer_port);
+    free(request);
+}
+
+/**
+ * One round of scheduling, the scheduler lock and the read lock of the peer
+ * list must be held
+ */
+void schedule_requests(struct scheduler *scheduler) {
+    struct peer_list *peer_list = scheduler->peer_list;
+
+    // Requests to disconnected peers will never be answered
+    for (int i = scheduler->num_requests - 1; i >= 0; --i) {
+        struct request *current = scheduler->requests[i];
+        if (find_peer(peer_list, current->peer_ip, current->peer_port) ==
+            -1) {
+            requeue_request(current);
+            remove_request(scheduler, i);
+        }
+    }
+
+    // Finished downloads
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        struct download *download = scheduler->downloads[i];
+        if (download != NULL && download->num_completed ==
+                                download->num_chunks) {
+            drop_download(scheduler, i);
+        }
+    }
+    if (scheduler->num_downloads == 0 || peer_list->num_peers == 0) {
+        return;
+    }
+
+    int *peer_requests = calloc(peer_list->max_size, sizeof(int));
+    count_peer_requests(scheduler, peer_requests);
+
+    int *ranked = calloc(peer_list->max_size, sizeof(int));
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        struct download *download = scheduler->downloads[i];
+        if (download == NULL) {
+            continue;
+        }
+        struct bpkg_obj *package = download->package;
+        uint32_t chunk_size = package->size / package->nchunks;
+        int num_ranked = rank_peers(peer_list, chunk_size, ranked);
+
+        size_t remaining = download->num_chunks - download->num_completed;
+        if (remaining * 100 <= ENDGAME_PERCENT * download->num_chunks ||
+            remaining <= ENDGAME_MIN_CHUNKS) {
+            schedule_endgame(scheduler, download, ranked, num_ranked,
+                             peer_requests);
+            continue;
+        }
+        schedule_download(scheduler, download, ranked, num_ranked,
+                          peer_requests);
+    }
+
+    free(ranked);
+    free(peer_requests);
+}
+
+void *run_scheduler(void *args) {
+    struct scheduler *scheduler = args;
+    pin_current_thread(THREAD_NETWORK);
+    while (1) {
+        pthread_mutex_lock(&scheduler->lock);
+        if (!scheduler->running) {
+            pthread_mutex_unlock(&scheduler->lock);
+            break;
+        }
+        // Peers stay in their slots for the whole round
+        read_lock_peers(scheduler->peer_list);
+        schedule_requests(scheduler);
+        unlock_peers(scheduler->peer_list);
+        pthread_mutex_unlock(&scheduler->lock);
+        flush_outbox(scheduler);
+
+        // Downloads hold handles, so their trees are never freed
+        uint64_t now_us = get_time_us();
+        if (now_us - scheduler->last_reclaim_us >= TREE_RECLAIM_INTERVAL_US) {
+            scheduler->last_reclaim_us = now_us;
+            reclaim_idle_trees(scheduler->package_list);
+        }
+
+        struct timespec tick = {0, SCHEDULER_TICK_US * 1000};
+        nanosleep(&tick, NULL);
+    }
+
+    pthread_exit((void *) 0);
+}
+
+/**
+ * Start the scheduler thread that keeps requesting missing chunks of the
+ * downloads from the peers with the best scores
+ * @param scheduler
+ * @return 1 if success, 0 otherwise
+ */
+int start_scheduler(struct scheduler *scheduler) {
+    scheduler->running = 1;
+    if (pthread_create(&scheduler->thread, NULL, run_scheduler, scheduler)
+        != 0) {
+        scheduler->running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void free_scheduler(struct scheduler *scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    int was_running = scheduler->running;
+    scheduler->running = 0;
+    pthread_mutex_unlock(&scheduler->lock);
+    if (was_running) {
+        pthread_join(scheduler->thread, NULL);
+    }
+
+    for (int i = scheduler->num_requests - 1; i >= 0; --i) {
+        remove_request(scheduler, i);
+    }
+    for (int i = 0; i < scheduler->max_downloads; ++i) {
+        free_download(scheduler, scheduler->downloads[i]);
+    }
+    free(scheduler->downloads);
+    free(scheduler->requests);
+    free(scheduler->outbox);
+    pthread_cond_destroy(&scheduler->progress);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler);
+}
@@ -0,0 +1,147 @@
+#include <limits.h>
+
+#include "p2p/startup_scan.h"
+#include "p2p/chunk_store.h"
+
+/**
+ * Select the text packages of a directory, indexes are found next to them
+ * @param entry
+ * @return 1 if the entry is a .bpkg file, 0 otherwise
+ */
+int select_bpkg(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    size_t suffix_length = strlen(BPKG_SUFFIX);
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+        entry->d_type != DT_UNKNOWN) {
+        return 0;
+    }
+    return length > suffix_length && strcmp(entry->d_name + length -
+                                            suffix_length, BPKG_SUFFIX) == 0;
+}
+
+struct startup_scan *create_startup_scan(struct p2p_node *node, struct
+        config *config) {
+    struct dirent **names = NULL;
+    int num_names = scandir(config->directory, &names, select_bpkg,
+                            alphasort);
+    if (num_names == -1) {
+        perror("Failed to scan the data directory");
+        return NULL;
+    }
+
+    struct startup_scan *scan = calloc(1, sizeof(struct startup_scan));
+    strncpy(scan->directory, config->directory, MAX_DIRECTORY_SIZE - 1);
+    scan->direct_io = config->direct_io;
+    scan->resume_state = config->resume_state;
+    scan->names = names;
+    scan->num_names = num_names;
+    scan->node = node;
+    return scan;
+}
+
+/**
+ * Load a package of the directory, verify its data file and register it
+ * @param scan
+ * @param name file name of the package in the directory
+ * @return 1 if its data file is complete, 0 if incomplete, -1 if failed
+ */
+int scan_package(struct startup_scan *scan, char *name) {
+    char path[MAX_DIRECTORY_SIZE + NAME_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s", scan->directory, name);
+    struct bpkg_obj *package = bpkg_load_no_message(path, scan->directory);
+    if (package == NULL) {
+        printf("Unable to parse bpkg file %s\n", path);
+        return -1;
+    }
+    create_data_file(package);
+    package->direct_io = scan->direct_io;
+    package->resume_state = scan->resume_state;
+
+    // The data file is read once, for the status and the chunk store
+    int complete = compute_chunk_hashes(package);
+    merkle_tree *hashes = package->hashes;
+    for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
+        complete = complete && compare_node_hash(hashes->nodes[i]);
+    }
+    if (scan->node->chunk_store != NULL) {
+        store_computed_chunks(scan->node->chunk_store, package);
+    }
+    add_package(scan->node->package_list, package);
+    return complete;
+}
+
+/**
+ * Print the progress of the scan after a package is loaded
+ * @param scan
+ */
+void report_scan_progress(struct startup_scan *scan) {
+    int num_done = atomic_fetch_add(&scan->num_done, 1) + 1;
+    int step = num_done * SCAN_PROGRESS_STEPS / scan->num_names;
+    int last_step = (num_done - 1) * SCAN_PROGRESS_STEPS / scan->num_names;
+    if (num_done == scan->num_names) {
+        printf("Startup scan finished: %d packages, %d complete, %d failed\n",
+               num_done, atomic_load(&scan->num_complete),
+               atomic_load(&scan->num_failed));
+    } else if (step != last_step) {
+        printf("Scanned %d of %d packages\n", num_done, scan->num_names);
+    }
+}
+
+/**
+ * Thread loading the packages of the directory until none is left
+ * @param arg scan
+ */
+void *run_startup_scan(void *arg) {
+    struct startup_scan *scan = arg;
+    pin_current_thread(THREAD_VERIFY);
+    while (!atomic_load(&scan->stopping)) {
+        int index = atomic_fetch_add(&scan->next, 1);
+        if (index >= scan->num_names) {
+            break;
+        }
+        int result = scan_package(scan, scan->names[index]->d_name);
+        if (result == 1) {
+            atomic_fetch_add(&scan->num_complete, 1);
+        } else if (result == -1) {
+            atomic_fetch_add(&scan->num_failed, 1);
+        }
+        report_scan_progress(scan);
+    }
+    return NULL;
+}
+
+int start_startup_scan(struct startup_scan *scan) {
+    printf("Scanning %d packages in %s\n", scan->num_names, scan->directory);
+    int num_threads = count_role_cpus(THREAD_VERIFY);
+    if (num_threads > scan->num_names) {
+        num_threads = scan->num_names;
+    }
+    if (num_threads > MAX_SCAN_THREADS) {
+        num_threads = MAX_SCAN_THREADS;
+    }
+
+    // The packages left are taken by the threads that did start
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(&scan->threads[i], NULL, run_startup_scan, scan) !=
+            0) {
+            break;
+        }
+        scan->num_threads++;
+    }
+    return scan->num_threads > 0 || scan->num_names == 0;
+}
+
+void free_startup_scan(struct startup_scan *scan) {
+    if (scan == NULL) {
+        return;
+    }
+    atomic_store(&scan->stopping, 1);
+    for (int i = 0; i < scan->num_threads; ++i) {
+        pthread_join(scan->threads[i], NULL);
+    }
+    for (int i = 0; i < scan->num_names; ++i) {
+        free(scan->names[i]);
+    }
+    free(scan->names);
+    free(scan);
+}
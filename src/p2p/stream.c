@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "chk/direct_io.h"
+#include "net/affinity.h"
+#include "p2p/stream.h"
+
+/**
+ * Join and free the streams whose thread finished, the scheduler lock must
+ * be held
+ * @param scheduler
+ */
+void reap_streams(struct scheduler *scheduler) {
+    struct stream **link = &scheduler->streams;
+    while (*link != NULL) {
+        struct stream *current = *link;
+        if (!current->done) {
+            link = &current->next;
+            continue;
+        }
+        *link = current->next;
+        pthread_join(current->thread, NULL);
+        free(current);
+    }
+}
+
+/**
+ * Wait until a leaf can be read, the scheduler lock must be held
+ * @param stream
+ * @param leaf
+ * @param verified set to 1 if the download verified the chunk, 0 if the
+ * package is not downloading and the chunk has to be verified when read
+ * @return 1 if the leaf can be read, 0 if the stream was stopped
+ */
+int wait_for_chunk(struct stream *stream, size_t leaf, int *verified) {
+    struct scheduler *scheduler = stream->scheduler;
+    while (!stream->stopped) {
+        struct download *download = find_download(scheduler,
+                                                  stream->entry->package);
+        if (download == NULL) {
+            *verified = 0;
+            return 1;
+        }
+        download->cursor = leaf;
+        if (download->tasks[leaf].status == CHUNK_COMPLETE) {
+            *verified = 1;
+            return 1;
+        }
+        pthread_cond_wait(&scheduler->progress, &scheduler->lock);
+    }
+    return 0;
+}
+
+/**
+ * Check whether the stream was stopped
+ * @param stream
+ * @return 1 if stopped, 0 otherwise
+ */
+int stream_stopped(struct stream *stream) {
+    pthread_mutex_lock(&stream->scheduler->lock);
+    int stopped = stream->stopped;
+    pthread_mutex_unlock(&stream->scheduler->lock);
+    return stopped;
+}
+
+/**
+ * Open the output of a stream without blocking, a FIFO is opened once it
+ * has a reader
+ * @param stream
+ * @return fd of the output, -1 if failed or stopped
+ */
+int open_stream_output(struct stream *stream) {
+    if (strncmp(stream->path, STREAM_STDOUT, MAX_STREAM_PATH_SIZE) == 0) {
+        return STDOUT_FILENO;
+    }
+
+    while (!stream_stopped(stream)) {
+        int out_fd = open(stream->path, O_WRONLY | O_CREAT | O_TRUNC |
+                                        O_NONBLOCK | O_CLOEXEC, 0644);
+        if (out_fd != -1) {
+            return out_fd;
+        }
+        if (errno != ENXIO) {
+            perror("Stream: Failed to open the output");
+            return -1;
+        }
+        struct timespec wait = {0, STREAM_POLL_MS * 1000000L};
+        nanosleep(&wait, NULL);
+    }
+    return -1;
+}
+
+/**
+ * Write a chunk to the output of a stream, waiting for a slow reader
+ * @param stream
+ * @param out_fd
+ * @param data
+ * @param size
+ * @return 1 if success, 0 if the output failed or the stream was stopped
+ */
+int write_stream(struct stream *stream, int out_fd, char *data, uint32_t
+        size) {
+    uint32_t bytes_written = 0;
+    while (bytes_written < size) {
+        ssize_t written = write(out_fd, data + bytes_written, size -
+                                                             bytes_written);
+        if (written > 0) {
+            bytes_written += written;
+            continue;
+        }
+        if (written == -1 && errno != EAGAIN && errno != EINTR) {
+            return 0;
+        }
+
+        struct pollfd space = {out_fd, POLLOUT, 0};
+        poll(&space, 1, STREAM_POLL_MS);
+        if (stream_stopped(stream)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Read a chunk of the package, verifying it unless the download did
+ * @param package
+ * @param node leaf of the chunk
+ * @param verified
+ * @param data buffer with size >= chunk size
+ * @return 1 if the chunk matches its hash, 0 otherwise
+ */
+int read_stream_chunk(struct bpkg_obj *package, merkle_tree_node *node, int
+        verified, char *data) {
+    if (!read_package_data(package, data, node->value->size,
+                           node->value->offset)) {
+        return 0;
+    }
+    if (verified) {
+        return 1;
+    }
+    char chunk_hash[SHA256_HEX_STRLEN] = {0};
+    compute_hash(data, node->value->size, chunk_hash);
+    return strncmp(chunk_hash, node->expected_hash, SHA256_HEX_LEN) == 0;
+}
+
+void *run_stream(void *args) {
+    struct stream *stream = args;
+    struct scheduler *scheduler = stream->scheduler;
+    struct bpkg_obj *package = stream->entry->package;
+    merkle_tree *hashes = package->hashes;
+    pin_current_thread(THREAD_IO);
+
+    // A reader that goes away ends the stream instead of the process
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    int out_fd = open_stream_output(stream);
+    for (size_t leaf = 0; out_fd != -1 && leaf < hashes->num_leaves; ++leaf) {
+        int verified = 0;
+        pthread_mutex_lock(&scheduler->lock);
+        int ready = wait_for_chunk(stream, leaf, &verified);
+        pthread_mutex_unlock(&scheduler->lock);
+        if (!ready) {
+            break;
+        }
+
+        merkle_tree_node *node = hashes->nodes[hashes->num_inner_nodes +
+                leaf];
+        char *data = calloc(node->value->size + 1, sizeof(char));
+        int valid = read_stream_chunk(package, node, verified, data) &&
+                    write_stream(stream, out_fd, data, node->value->size);
+        free(data);
+        // The package was removed before the chunk was downloaded
+        if (!valid) {
+            break;
+        }
+    }
+    if (out_fd != -1 && out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+
+    pthread_mutex_lock(&scheduler->lock);
+    struct download *download = find_download(scheduler, package);
+    if (download != NULL) {
+        download->streaming = 0;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    put_package(scheduler->package_list, stream->entry);
+
+    pthread_mutex_lock(&scheduler->lock);
+    stream->done = 1;
+    pthread_mutex_unlock(&scheduler->lock);
+    pthread_exit((void *) 0);
+}
+
+int start_stream(struct scheduler *scheduler, struct package_entry *entry,
+                 char *path) {
+    pthread_mutex_lock(&scheduler->lock);
+    reap_streams(scheduler);
+    struct download *download = find_download(scheduler, entry->package);
+    if (download != NULL && download->streaming) {
+        pthread_mutex_unlock(&scheduler->lock);
+        put_package(scheduler->package_list, entry);
+        return 0;
+    }
+
+    struct stream *new_stream = calloc(1, sizeof(struct stream));
+    new_stream->scheduler = scheduler;
+    new_stream->entry = entry;
+    strncpy(new_stream->path, path, MAX_STREAM_PATH_SIZE - 1);
+    if (pthread_create(&new_stream->thread, NULL, run_stream, new_stream) !=
+        0) {
+        pthread_mutex_unlock(&scheduler->lock);
+        free(new_stream);
+        put_package(scheduler->package_list, entry);
+        return 0;
+    }
+    if (download != NULL) {
+        download->streaming = 1;
+        download->cursor = 0;
+    }
+    new_stream->next = scheduler->streams;
+    scheduler->streams = new_stream;
+    pthread_mutex_unlock(&scheduler->lock);
+    return 1;
+}
+
+void stop_streams(struct scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    for (struct stream *current = scheduler->streams; current != NULL;
+         current = current->next) {
+        current->stopped = 1;
+    }
+    pthread_cond_broadcast(&scheduler->progress);
+    struct stream *streams = scheduler->streams;
+    scheduler->streams = NULL;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    while (streams != NULL) {
+        struct stream *next = streams->next;
+        pthread_join(streams->thread, NULL);
+        free(streams);
+        streams = next;
+    }
+}
+
+void stop_package_streams(struct scheduler *scheduler, struct bpkg_obj
+        *package) {
+    pthread_mutex_lock(&scheduler->lock);
+    struct stream *stopped = NULL;
+    struct stream **link = &scheduler->streams;
+    while (*link != NULL) {
+        struct stream *current = *link;
+        if (current->entry->package != package) {
+            link = &current->next;
+            continue;
+        }
+        current->stopped = 1;
+        *link = current->next;
+        current->next = stopped;
+        stopped = current;
+    }
+    pthread_cond_broadcast(&scheduler->progress);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    while (stopped != NULL) {
+        struct stream *next = stopped->next;
+        pthread_join(stopped->thread, NULL);
+        free(stopped);
+        stopped = next;
+    }
+}
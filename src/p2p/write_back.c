@@ -0,0 +1,439 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "net/affinity.h"
+#include "chk/resume.h"
+#include "p2p/write_back.h"
+
+struct write_back *create_write_back(struct scheduler *scheduler, struct
+        package_list *package_list, enum durability durability) {
+    struct write_back *new_writer = calloc(1, sizeof(struct write_back));
+    pthread_mutex_init(&new_writer->lock, NULL);
+    pthread_cond_init(&new_writer->queued, NULL);
+    pthread_cond_init(&new_writer->drained, NULL);
+    new_writer->durability = durability;
+    new_writer->scheduler = scheduler;
+    new_writer->package_list = package_list;
+    new_writer->synced_us = get_time_us();
+    return new_writer;
+}
+
+/**
+ * Order pending chunks by package, then by file offset
+ */
+int compare_pending(const void *a, const void *b) {
+    struct pending_chunk *chunk_a = *(struct pending_chunk **) a;
+    struct pending_chunk *chunk_b = *(struct pending_chunk **) b;
+    uintptr_t package_a = (uintptr_t) chunk_a->entry->package;
+    uintptr_t package_b = (uintptr_t) chunk_b->entry->package;
+    if (package_a != package_b) {
+        return package_a < package_b ? -1 : 1;
+    }
+    if (chunk_a->file_offset != chunk_b->file_offset) {
+        return chunk_a->file_offset < chunk_b->file_offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Write buffers at an offset, continuing after short writes
+ * @param fd
+ * @param iov buffers, changed while writing
+ * @param num_iov
+ * @param offset
+ * @return 1 if success, 0 otherwise
+ */
+int pwritev_all(int fd, struct iovec *iov, int num_iov, off_t offset) {
+    while (num_iov > 0) {
+        ssize_t written = pwritev(fd, iov, num_iov, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 0;
+        }
+        offset += written;
+        // Skip the buffers written in full and advance into a partial one
+        while (num_iov > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            num_iov--;
+        }
+        if (num_iov > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 1;
+}
+
+int sync_data_file(char *full_path) {
+    int data_fd = open(full_path, O_WRONLY | O_CLOEXEC);
+    if (data_fd == -1 || fdatasync(data_fd) == -1) {
+        perror("Write back: Failed to sync the data file");
+        if (data_fd != -1) {
+            close(data_fd);
+        }
+        return 0;
+    }
+    close(data_fd);
+    return 1;
+}
+
+/**
+ * Remember a data file to sync at the next periodic sync
+ * @param writer
+ * @param full_path
+ * @param entry handle of the package whose resume file is saved after the
+ * sync, NULL if none, the writer takes its own handle
+ */
+void mark_dirty(struct write_back *writer, char *full_path, struct
+        package_entry *entry) {
+    pthread_mutex_lock(&writer->lock);
+    for (struct dirty_file *current = writer->dirty; current != NULL;
+         current = current->next) {
+        if (strcmp(current->path, full_path) == 0) {
+            if (entry != NULL && current->entry == NULL) {
+                hold_package(entry);
+                current->entry = entry;
+            }
+            pthread_mutex_unlock(&writer->lock);
+            return;
+        }
+    }
+    struct dirty_file *new_file = calloc(1, sizeof(struct dirty_file));
+    strncpy(new_file->path, full_path, sizeof(new_file->path) - 1);
+    if (entry != NULL) {
+        hold_package(entry);
+        new_file->entry = entry;
+    }
+    new_file->next = writer->dirty;
+    writer->dirty = new_file;
+    // The thread now has a sync deadline to wait for
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * Sync all data files written since the last periodic sync, then save the
+ * resume files of their packages
+ * @param writer
+ */
+void sync_dirty_files(struct write_back *writer) {
+    pthread_mutex_lock(&writer->lock);
+    struct dirty_file *dirty = writer->dirty;
+    writer->dirty = NULL;
+    pthread_mutex_unlock(&writer->lock);
+
+    while (dirty != NULL) {
+        struct dirty_file *next = dirty->next;
+        int synced = sync_data_file(dirty->path);
+        if (dirty->entry != NULL) {
+            if (synced) {
+                save_resume_state(dirty->entry->package);
+            }
+            put_package(writer->package_list, dirty->entry);
+        }
+        free(dirty);
+        dirty = next;
+    }
+    writer->synced_us = get_time_us();
+}
+
+/**
+ * Write the pending chunks of a package, adjacent chunks with a single
+ * pwritev, and apply the durability policy
+ * @param writer
+ * @param chunks chunks of the same package ordered by file offset
+ * @param num_chunks
+ * @return 1 if all chunks were written, 0 otherwise
+ */
+int write_package_chunks(struct write_back *writer, struct pending_chunk
+        **chunks, int num_chunks) {
+    struct bpkg_obj *package = chunks[0]->entry->package;
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    int data_fd = open_data_file(package);
+    if (data_fd == -1) {
+        perror("Write back: Failed to open the data file");
+        return 0;
+    }
+
+    // Aligned blocks of a package that bypasses the page cache are written
+    // with O_DIRECT, the filesystem may not support it
+    int direct_fd = -1;
+    if (package->direct_io) {
+        direct_fd = open_direct(full_path, O_WRONLY);
+    }
+
+    struct iovec *iov = calloc(num_chunks < IOV_MAX ? num_chunks : IOV_MAX,
+                               sizeof(struct iovec));
+    int written = 1;
+    int index = 0;
+    while (index < num_chunks && written) {
+        uint64_t run_offset = chunks[index]->file_offset;
+        uint64_t run_end = run_offset;
+        int num_iov = 0;
+        while (index < num_chunks && num_iov < IOV_MAX) {
+            struct pending_chunk *current = chunks[index];
+            // Copies of a hedged chunk are written once
+            if (current->file_offset < run_end) {
+                index++;
+                continue;
+            }
+            if (current->file_offset != run_end) {
+                break;
+            }
+            iov[num_iov].iov_base = current->data;
+            iov[num_iov].iov_len = current->size;
+            num_iov++;
+            run_end += current->size;
+            index++;
+        }
+        if (direct_fd != -1) {
+            written = direct_pwritev(direct_fd, data_fd, iov, num_iov,
+                                     run_offset);
+        } else {
+            written = pwritev_all(data_fd, iov, num_iov, run_offset);
+        }
+    }
+    free(iov);
+    if (direct_fd != -1) {
+        close(direct_fd);
+    }
+
+    if (!written) {
+        perror("Write back: Failed to write chunks");
+    } else if (writer->durability == DURABILITY_SYNC && fdatasync(data_fd) ==
+                                                        -1) {
+        perror("Write back: Failed to sync the data file");
+        written = 0;
+    } else if (writer->durability == DURABILITY_PERIODIC) {
+        mark_dirty(writer, full_path, NULL);
+    }
+    close(data_fd);
+    return written;
+}
+
+/**
+ * Mark a chunk complete once it is written and free it. A chunk that failed
+ * to be written is requested again once its request expires.
+ * @param writer
+ * @param chunk
+ * @param written
+ */
+void finish_chunk(struct write_back *writer, struct pending_chunk *chunk,
+                  int written) {
+    if (written) {
+        scheduler_on_chunk(writer->scheduler, chunk->peer_ip,
+                           chunk->peer_port, chunk->entry->package,
+                           chunk->ident, chunk->hash, chunk->file_offset,
+                           chunk->size);
+    }
+    put_package(writer->package_list, chunk->entry);
+    free(chunk->data);
+    free(chunk);
+}
+
+/**
+ * Write a batch of chunks taken from the queue
+ * @param writer
+ * @param batch list of chunks, freed
+ */
+void write_batch(struct write_back *writer, struct pending_chunk *batch) {
+    int num_chunks = 0;
+    for (struct pending_chunk *current = batch; current != NULL; current =
+            current->next) {
+        num_chunks++;
+    }
+    struct pending_chunk **chunks = calloc(num_chunks, sizeof(struct
+            pending_chunk *));
+    int index = 0;
+    for (struct pending_chunk *current = batch; current != NULL; current =
+            current->next) {
+        chunks[index++] = current;
+    }
+    qsort(chunks, num_chunks, sizeof(struct pending_chunk *),
+          compare_pending);
+
+    int start = 0;
+    while (start < num_chunks) {
+        int end = start + 1;
+        while (end < num_chunks && chunks[end]->entry->package ==
+                                   chunks[start]->entry->package) {
+            end++;
+        }
+        int written = write_package_chunks(writer, chunks + start, end -
+                                                                  start);
+        // The resume file is replaced once per package and batch
+        struct bpkg_obj *package = chunks[start]->entry->package;
+        if (written && package->resume_state) {
+            for (int i = start; i < end; ++i) {
+                record_verified_chunk(package, chunks[i]->hash,
+                                      chunks[i]->file_offset);
+            }
+            commit_resume_state(writer, chunks[start]->entry);
+        }
+        for (int i = start; i < end; ++i) {
+            finish_chunk(writer, chunks[i], written);
+        }
+        start = end;
+    }
+    free(chunks);
+}
+
+/**
+ * Wait for chunks to be queued, or for the next periodic sync if files are
+ * dirty, the lock must be held
+ * @param writer
+ */
+void wait_for_chunks(struct write_back *writer) {
+    if (writer->dirty == NULL || writer->durability != DURABILITY_PERIODIC) {
+        pthread_cond_wait(&writer->queued, &writer->lock);
+        return;
+    }
+    uint64_t elapsed = get_time_us() - writer->synced_us;
+    if (elapsed >= WRITE_BACK_SYNC_INTERVAL_US) {
+        return;
+    }
+    uint64_t wait_us = WRITE_BACK_SYNC_INTERVAL_US - elapsed;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_us / 1000000;
+    deadline.tv_nsec += (wait_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&writer->queued, &writer->lock, &deadline);
+}
+
+void *run_write_back(void *args) {
+    struct write_back *writer = args;
+    pin_current_thread(THREAD_IO);
+    pthread_mutex_lock(&writer->lock);
+    // Chunks queued before stopping are still written
+    while (writer->running || writer->pending != NULL) {
+        if (writer->pending == NULL) {
+            wait_for_chunks(writer);
+        }
+        // Chunks arriving while a batch is written form the next batch
+        struct pending_chunk *batch = writer->pending;
+        writer->pending = NULL;
+        writer->writing = 1;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (batch != NULL) {
+            write_batch(writer, batch);
+        }
+        if (writer->durability == DURABILITY_PERIODIC && get_time_us() -
+                writer->synced_us >= WRITE_BACK_SYNC_INTERVAL_US) {
+            sync_dirty_files(writer);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->writing = 0;
+        pthread_cond_broadcast(&writer->drained);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    sync_dirty_files(writer);
+    pthread_exit((void *) 0);
+}
+
+int start_write_back(struct write_back *writer) {
+    writer->running = 1;
+    if (pthread_create(&writer->thread, NULL, run_write_back, writer) != 0) {
+        writer->running = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void queue_chunk(struct write_back *writer, struct package_entry *entry, char
+        *ip, u_int16_t port, char *ident, char *hash, uint64_t file_offset,
+                 char *data, uint32_t size) {
+    struct pending_chunk *new_chunk = calloc(1, sizeof(struct pending_chunk));
+    new_chunk->entry = entry;
+    strncpy(new_chunk->peer_ip, ip, MAX_IP_SIZE - 1);
+    new_chunk->peer_port = port;
+    strncpy(new_chunk->ident, ident, MAX_IDENT_SIZE - 1);
+    strncpy(new_chunk->hash, hash, SHA256_HEX_LEN);
+    new_chunk->file_offset = file_offset;
+    new_chunk->size = size;
+    new_chunk->data = data;
+
+    pthread_mutex_lock(&writer->lock);
+    if (!writer->running) {
+        pthread_mutex_unlock(&writer->lock);
+        write_batch(writer, new_chunk);
+        return;
+    }
+    new_chunk->next = writer->pending;
+    writer->pending = new_chunk;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+int commit_written_chunk(struct write_back *writer, struct bpkg_obj *package) {
+    if (writer->durability == DURABILITY_NONE) {
+        return 1;
+    }
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    if (writer->durability == DURABILITY_PERIODIC) {
+        mark_dirty(writer, full_path, NULL);
+        return 1;
+    }
+    return sync_data_file(full_path);
+}
+
+void commit_resume_state(struct write_back *writer, struct package_entry
+        *entry) {
+    struct bpkg_obj *package = entry->package;
+    if (!package->resume_state) {
+        return;
+    }
+    // A resume file saved before the data is synced could claim chunks lost
+    // in a crash
+    char full_path[MAX_DATA_DIRECTORY_SIZE + MAX_FILENAME_SIZE];
+    get_file_full_path(full_path, package);
+    if (writer->durability == DURABILITY_PERIODIC) {
+        mark_dirty(writer, full_path, entry);
+    } else if (writer->durability == DURABILITY_SYNC ||
+               sync_data_file(full_path)) {
+        save_resume_state(package);
+    }
+}
+
+void flush_write_back(struct write_back *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending != NULL || writer->writing) {
+        pthread_cond_wait(&writer->drained, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void free_write_back(struct write_back *writer) {
+    if (writer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    int was_running = writer->running;
+    writer->running = 0;
+    pthread_cond_signal(&writer->queued);
+    pthread_mutex_unlock(&writer->lock);
+    if (was_running) {
+        pthread_join(writer->thread, NULL);
+    }
+    // Files marked dirty while the thread was not running
+    sync_dirty_files(writer);
+
+    pthread_cond_destroy(&writer->drained);
+    pthread_cond_destroy(&writer->queued);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
@@ -1,4 +1,5 @@
 #include <chk/pkgchk.h>
+#include <chk/bpkg_index.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,6 +34,21 @@ int arg_select(int argc, char **argv, int *asel, char *harg) {
     if (strcmp(cursor, "-file_check") == 0) {
         *asel = 5;
     }
+    if (strcmp(cursor, "-delta") == 0) {
+        if (argc < 4) {
+            puts("old bpkg not provided");
+            exit(1);
+        }
+        *asel = 6;
+    }
+    if (strcmp(cursor, "-write_index") == 0 ||
+        strcmp(cursor, "-write_text") == 0) {
+        if (argc < 4) {
+            puts("output path not provided");
+            exit(1);
+        }
+        *asel = strcmp(cursor, "-write_index") == 0 ? 7 : 8;
+    }
     return *asel;
 }
 
@@ -44,6 +60,29 @@ void bpkg_print_hashes(struct bpkg_query *qry) {
 
 }
 
+/**
+ * Print where each chunk of the new version comes from, and how much data
+ * has to be fetched
+ */
+void bpkg_print_delta(struct bpkg_delta *delta) {
+    uint64_t fetch_bytes = 0;
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < delta->len; i++) {
+        if (delta->old_offsets[i] == -1) {
+            printf("fetch %.64s %" PRIu64 "\n", delta->hashes[i],
+                   delta->chunks[i]->offset);
+            fetch_bytes += delta->chunks[i]->size;
+        } else {
+            printf("copy %.64s %ld %" PRIu64 "\n", delta->hashes[i],
+                   (long) delta->old_offsets[i], delta->chunks[i]->offset);
+        }
+        total_bytes += delta->chunks[i]->size;
+    }
+    printf("%zu chunks copied, %zu chunks to fetch (%lu of %lu bytes)\n",
+           delta->num_copied, delta->len - delta->num_copied,
+           (unsigned long) fetch_bytes, (unsigned long) total_bytes);
+}
+
 int main(int argc, char **argv) {
 
     int argselect = 0;
@@ -84,6 +123,30 @@ int main(int argc, char **argv) {
             qry = bpkg_file_check(obj);
             bpkg_print_hashes(&qry);
             bpkg_query_destroy(&qry);
+        } else if (argselect == 6) {
+
+            struct bpkg_obj *old_obj = bpkg_load(argv[3]);
+            if (!old_obj) {
+                bpkg_obj_destroy(obj);
+                puts("Unable to load old pkg and tree");
+                exit(1);
+            }
+            struct bpkg_delta delta = bpkg_get_delta(old_obj, obj);
+            bpkg_print_delta(&delta);
+            bpkg_delta_destroy(&delta);
+            bpkg_obj_destroy(old_obj);
+        } else if (argselect == 7) {
+
+            if (!bpkg_index_write(obj, argv[3])) {
+                bpkg_obj_destroy(obj);
+                exit(1);
+            }
+        } else if (argselect == 8) {
+
+            if (!bpkg_text_write(obj, argv[3])) {
+                bpkg_obj_destroy(obj);
+                exit(1);
+            }
         } else {
             puts("Argument is invalid");
             return 1;
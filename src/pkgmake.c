@@ -0,0 +1,568 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "chk/pkgchk.h"
+#include "chk/bpkg_index.h"
+#include "chk/cdc.h"
+
+#define DEFAULT_CHUNK_SIZE (1 << 20)
+#define MAX_PKGMAKE_THREADS 256
+// Each thread reads and hashes runs of consecutive chunks of about this size
+#define READ_RUN_SIZE (8 << 20)
+// Levels with fewer nodes are hashed by the main thread alone
+#define PARALLEL_LEVEL_NODES 4096
+#define MAX_OUTPUT_SIZE 4097
+
+struct pkgmake_options {
+    char *data_path;
+    char output_path[MAX_OUTPUT_SIZE];
+    uint64_t chunk_size; // 0 if the number of chunks is given
+    uint64_t nchunks;
+    int cdc; // content-defined chunking, chunk_size is the average size
+    uint64_t min_size; // 0 for a quarter of the average size
+    uint64_t max_size; // 0 for four times the average size
+    int write_index;
+    int num_threads;
+};
+
+/**
+ * Work shared by the hashing threads: runs of leaves, then the nodes of one
+ * level of the tree at a time
+ */
+struct pkgmake_job {
+    int data_fd;
+    merkle_tree *hashes;
+    int leaves_hashed; // the leaves were hashed while the chunks were found
+    size_t run_leaves; // leaves per run
+    _Atomic size_t next_run;
+    size_t level_start; // first node of the level being hashed
+    size_t level_end;
+    _Atomic size_t next_node;
+    _Atomic int failed;
+};
+
+// Content-defined chunk with the hash of its data
+struct cdc_chunk {
+    chunk range;
+    char hash[SHA256_HEX_STRLEN];
+};
+
+void print_usage() {
+    puts("Usage: pkgmake <file> [--chunksz <chunk size>] [--nchunks <number "
+         "of chunks>] [--cdc [--minsz <size>] [--maxsz <size>]] [--output "
+         "<filename>] [--index] [--threads <number>]");
+}
+
+/**
+ * Parse a positive number argument
+ * @return 1 if success, 0 otherwise
+ */
+int parse_count(char *arg, uint64_t *value) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (arg[0] == '-' || end == arg || *end != '\0' || errno != 0 ||
+        parsed == 0) {
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+/**
+ * Parse the command line, the output defaults to <file>.bpkg
+ * @return 1 if success, 0 otherwise
+ */
+int parse_options(int argc, char **argv, struct pkgmake_options *options) {
+    if (argc < 2) {
+        return 0;
+    }
+    options->data_path = argv[1];
+    options->chunk_size = DEFAULT_CHUNK_SIZE;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    options->num_threads = num_cpus > 0 ? (int) num_cpus : 1;
+    snprintf(options->output_path, MAX_OUTPUT_SIZE, "%s.bpkg", argv[1]);
+
+    for (int i = 2; i < argc; ++i) {
+        uint64_t value = 0;
+        if (strcmp(argv[i], "--index") == 0) {
+            options->write_index = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--cdc") == 0) {
+            options->cdc = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return 0;
+        }
+        char *arg = argv[++i];
+        if (strcmp(argv[i - 1], "--output") == 0) {
+            snprintf(options->output_path, MAX_OUTPUT_SIZE, "%s", arg);
+        } else if (strcmp(argv[i - 1], "--chunksz") == 0 && parse_count(arg,
+                                                                   &value)) {
+            options->chunk_size = value;
+            options->nchunks = 0;
+        } else if (strcmp(argv[i - 1], "--nchunks") == 0 && parse_count(arg,
+                                                                   &value)) {
+            options->nchunks = value;
+            options->chunk_size = 0;
+        } else if (strcmp(argv[i - 1], "--minsz") == 0 && parse_count(arg,
+                                                                 &value)) {
+            options->min_size = value;
+        } else if (strcmp(argv[i - 1], "--maxsz") == 0 && parse_count(arg,
+                                                                 &value)) {
+            options->max_size = value;
+        } else if (strcmp(argv[i - 1], "--threads") == 0 && parse_count(arg,
+                                                                   &value)) {
+            options->num_threads = value < MAX_PKGMAKE_THREADS ? (int) value :
+                                   MAX_PKGMAKE_THREADS;
+        } else {
+            return 0;
+        }
+    }
+    // The bounds only apply to content-defined chunks
+    return options->cdc || (options->min_size == 0 && options->max_size == 0);
+}
+
+/**
+ * Choose the number of chunks of a file: a power of two, as every inner node
+ * has two children and all leaves are on the last level, with chunks of at
+ * least one byte that fit in a chunk size field
+ * @param size file size
+ * @param options
+ * @return number of chunks
+ */
+uint64_t choose_nchunks(uint64_t size, struct pkgmake_options *options) {
+    uint64_t wanted = options->nchunks;
+    if (options->chunk_size != 0) {
+        wanted = size / options->chunk_size;
+    }
+    if (wanted > size) {
+        wanted = size;
+    }
+    uint64_t nchunks = 1;
+    while (nchunks * 2 <= wanted) {
+        nchunks *= 2;
+    }
+    while (size / nchunks >= UINT32_MAX) {
+        nchunks *= 2;
+    }
+    return nchunks;
+}
+
+/**
+ * Split a file into the leaves of a tree, the first size % nchunks chunks
+ * are one byte larger than the others
+ * @param hashes
+ * @param size
+ */
+void plan_fixed_chunks(merkle_tree *hashes, uint64_t size) {
+    uint64_t base_size = size / hashes->num_leaves;
+    uint64_t num_larger = size % hashes->num_leaves;
+    uint64_t offset = 0;
+    for (size_t leaf = 0; leaf < hashes->num_leaves; ++leaf) {
+        chunk *current = &hashes->chunk_block[leaf];
+        current->offset = offset;
+        current->size = base_size + (leaf < num_larger);
+        offset += current->size;
+    }
+}
+
+/**
+ * Read a range of a file, continuing after short reads
+ * @return 1 if success, 0 otherwise
+ */
+int pread_full(int fd, char *buffer, size_t length, uint64_t offset) {
+    size_t bytes_read = 0;
+    while (bytes_read < length) {
+        ssize_t result = pread(fd, buffer + bytes_read, length - bytes_read,
+                               (off_t) (offset + bytes_read));
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return 0;
+        }
+        bytes_read += result;
+    }
+    return 1;
+}
+
+/**
+ * Choose the bounds of content-defined chunking, the average size is the
+ * chunk size or the file size over the number of chunks
+ * @param params
+ * @param size file size
+ * @param options
+ * @return 1 if success, 0 if the bounds are invalid
+ */
+int choose_cdc_params(struct cdc_params *params, uint64_t size, struct
+        pkgmake_options *options) {
+    uint64_t avg_size = options->chunk_size;
+    if (avg_size == 0) {
+        // An average derived from the number of chunks fits a chunk size
+        // field even for files that need more chunks than asked for
+        avg_size = size / options->nchunks > 0 ? size / options->nchunks : 1;
+        avg_size = avg_size < UINT32_MAX ? avg_size : UINT32_MAX;
+    }
+    uint64_t min_size = options->min_size;
+    uint64_t max_size = options->max_size;
+    if (min_size == 0) {
+        min_size = avg_size / 4;
+    }
+    if (max_size == 0) {
+        max_size = avg_size * 4 < UINT32_MAX ? avg_size * 4 : UINT32_MAX;
+    }
+    if (min_size > UINT32_MAX || avg_size > UINT32_MAX ||
+        max_size > UINT32_MAX) {
+        return 0;
+    }
+    return init_cdc_params(params, min_size, avg_size, max_size);
+}
+
+/**
+ * Find the content-defined chunks of a file and hash them in one pass over
+ * it, so the file is read only once
+ * @param data_fd
+ * @param size file size
+ * @param params
+ * @param count set to the number of chunks
+ * @return heap address of the chunks, NULL if the file could not be read
+ */
+struct cdc_chunk *find_cdc_chunks(int data_fd, uint64_t size, struct
+        cdc_params *params, uint64_t *count) {
+    size_t capacity = size / params->avg_size + 1;
+    struct cdc_chunk *chunks = malloc(capacity * sizeof(struct cdc_chunk));
+    uint8_t *buffer = malloc(READ_RUN_SIZE);
+    struct cdc_state state = {0};
+    struct sha256_compute_data hash_state = {0};
+    sha256_compute_data_init(&hash_state);
+    uint64_t position = 0;
+    uint64_t chunk_start = 0;
+    *count = 0;
+
+    while (position < size) {
+        size_t length = size - position < READ_RUN_SIZE ? size - position :
+                        READ_RUN_SIZE;
+        if (!pread_full(data_fd, (char *) buffer, length, position)) {
+            free(buffer);
+            free(chunks);
+            return NULL;
+        }
+        size_t used = 0;
+        while (used < length) {
+            int cut = 0;
+            size_t piece = scan_cdc_boundary(params, &state, buffer + used,
+                                             length - used, &cut);
+            sha256_update(&hash_state, buffer + used, piece);
+            used += piece;
+            // The last chunk ends with the file
+            if (!cut && position + used < size) {
+                continue;
+            }
+            if (*count == capacity) {
+                capacity *= 2;
+                chunks = realloc(chunks, capacity * sizeof(struct
+                        cdc_chunk));
+            }
+            struct cdc_chunk *current = &chunks[*count];
+            current->range.offset = chunk_start;
+            current->range.size = position + used - chunk_start;
+            uint8_t hash_out[SHA256_INT_SZ];
+            sha256_finalize(&hash_state, hash_out);
+            sha256_output_hex(&hash_state, current->hash);
+            sha256_compute_data_init(&hash_state);
+            chunk_start = position + used;
+            (*count)++;
+        }
+        position += length;
+    }
+    free(buffer);
+    return chunks;
+}
+
+/**
+ * Split a file into content-defined chunks and hash them, so data inserted
+ * or removed in a file only changes the chunks around it. The tree needs a
+ * power of two number of leaves, so empty chunks at the end of the file are
+ * added.
+ * @param obj package to set the chunks of
+ * @param data_fd
+ * @param options
+ * @return 1 if success, 0 otherwise
+ */
+int plan_cdc_chunks(struct bpkg_obj *obj, int data_fd, struct
+        pkgmake_options *options) {
+    struct cdc_params params;
+    if (!choose_cdc_params(&params, obj->size, options)) {
+        printf("Invalid chunk size bounds\n");
+        return 0;
+    }
+    uint64_t count = 0;
+    struct cdc_chunk *chunks = find_cdc_chunks(data_fd, obj->size, &params,
+                                               &count);
+    if (chunks == NULL) {
+        printf("Failed to read the file: %s\n", options->data_path);
+        return 0;
+    }
+
+    obj->nchunks = 1;
+    while (obj->nchunks < count) {
+        obj->nchunks *= 2;
+    }
+    obj->nhashes = obj->nchunks - 1;
+    obj->hashes = create_tree_block(obj->nhashes, obj->nchunks);
+    char empty_hash[SHA256_HEX_STRLEN];
+    compute_hash("", 0, empty_hash);
+    for (size_t leaf = 0; leaf < obj->nchunks; ++leaf) {
+        chunk *current = &obj->hashes->chunk_block[leaf];
+        current->offset = leaf < count ? chunks[leaf].range.offset : obj->size;
+        current->size = leaf < count ? chunks[leaf].range.size : 0;
+        memcpy(obj->hashes->node_block[obj->nhashes + leaf].computed_hash,
+               leaf < count ? chunks[leaf].hash : empty_hash,
+               SHA256_HEX_STRLEN);
+    }
+    free(chunks);
+    return 1;
+}
+
+/**
+ * Hash a run of consecutive leaves, streaming their data through a buffer so
+ * a chunk larger than the buffer is hashed in pieces
+ * @param job
+ * @param first first leaf of the run
+ * @param last leaf after the run
+ * @param buffer buffer with size >= READ_RUN_SIZE
+ * @return 1 if success, 0 if the file could not be read
+ */
+int hash_leaf_run(struct pkgmake_job *job, size_t first, size_t last, char
+        *buffer) {
+    merkle_tree *hashes = job->hashes;
+    chunk *chunks = hashes->chunk_block;
+    uint64_t position = chunks[first].offset;
+    uint64_t end = chunks[last - 1].offset + chunks[last - 1].size;
+    size_t length = 0;
+    size_t used = 0;
+    uint64_t chunk_hashed = 0;
+    struct sha256_compute_data state = {0};
+    sha256_compute_data_init(&state);
+
+    size_t leaf = first;
+    while (leaf < last) {
+        if (chunk_hashed == chunks[leaf].size) {
+            uint8_t hash_out[SHA256_INT_SZ];
+            sha256_finalize(&state, hash_out);
+            sha256_output_hex(&state, hashes->node_block[
+                    hashes->num_inner_nodes + leaf].computed_hash);
+            sha256_compute_data_init(&state);
+            chunk_hashed = 0;
+            leaf++;
+            continue;
+        }
+        if (used == length) {
+            position += length;
+            length = end - position < READ_RUN_SIZE ? end - position :
+                     READ_RUN_SIZE;
+            used = 0;
+            if (!pread_full(job->data_fd, buffer, length, position)) {
+                return 0;
+            }
+            continue;
+        }
+        uint64_t wanted = chunks[leaf].size - chunk_hashed;
+        uint32_t piece = wanted < length - used ? wanted : length - used;
+        sha256_update(&state, buffer + used, piece);
+        used += piece;
+        chunk_hashed += piece;
+    }
+    return 1;
+}
+
+/**
+ * Thread hashing runs of leaves until none is left
+ * @param arg job
+ */
+void *hash_leaves(void *arg) {
+    struct pkgmake_job *job = arg;
+    size_t num_leaves = job->hashes->num_leaves;
+    char *buffer = malloc(READ_RUN_SIZE);
+    while (!atomic_load(&job->failed)) {
+        size_t first = atomic_fetch_add(&job->next_run, 1) * job->run_leaves;
+        if (first >= num_leaves) {
+            break;
+        }
+        size_t last = first + job->run_leaves < num_leaves ? first +
+                                                             job->run_leaves :
+                      num_leaves;
+        if (!hash_leaf_run(job, first, last, buffer)) {
+            atomic_store(&job->failed, 1);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Thread hashing the nodes of the current level until none is left
+ * @param arg job
+ */
+void *hash_level(void *arg) {
+    struct pkgmake_job *job = arg;
+    size_t node;
+    while ((node = atomic_fetch_add(&job->next_node, 1) + job->level_start) <
+           job->level_end) {
+        compute_inner_hash(job->hashes->nodes[node]);
+    }
+    return NULL;
+}
+
+/**
+ * Run a function on a number of threads and wait for them, the calling
+ * thread runs it too if a thread cannot be started
+ */
+void run_threads(void *(*function)(void *), struct pkgmake_job *job, int
+        num_threads) {
+    pthread_t threads[MAX_PKGMAKE_THREADS];
+    int num_started = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        if (pthread_create(&threads[num_started], NULL, function, job) == 0) {
+            num_started++;
+        }
+    }
+    if (num_started == 0) {
+        function(job);
+    }
+    for (int i = 0; i < num_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Hash the leaves of a file on all threads unless they are already hashed,
+ * then the levels of the tree from the bottom up, each level split between
+ * the threads
+ * @param job
+ * @param num_threads
+ * @return 1 if success, 0 if the file could not be read
+ */
+int hash_tree(struct pkgmake_job *job, int num_threads) {
+    merkle_tree *hashes = job->hashes;
+    if (!job->leaves_hashed) {
+        run_threads(hash_leaves, job, num_threads);
+        if (atomic_load(&job->failed)) {
+            return 0;
+        }
+    }
+
+    // Level d holds the nodes 2^d - 1 to 2^(d + 1) - 2
+    for (size_t level_size = (hashes->num_leaves) / 2; level_size > 0;
+         level_size /= 2) {
+        job->level_start = level_size - 1;
+        job->level_end = 2 * level_size - 1;
+        atomic_store(&job->next_node, 0);
+        if (level_size < PARALLEL_LEVEL_NODES) {
+            hash_level(job);
+        } else {
+            run_threads(hash_level, job, num_threads);
+        }
+    }
+    for (size_t i = 0; i < hashes->num_nodes; ++i) {
+        memcpy(hashes->nodes[i]->expected_hash,
+               hashes->nodes[i]->computed_hash, SHA256_HEX_STRLEN);
+    }
+    return 1;
+}
+
+/**
+ * Derive the ident of a package from its root hash, so the same file and
+ * chunking always give the same package
+ * @param root_hash
+ * @param ident buffer with size >= MAX_IDENT_SIZE
+ */
+void derive_ident(char *root_hash, char *ident) {
+    char seed_buf[SHA256_HEX_LEN + 16];
+    for (size_t i = 0; i + SHA256_HEX_LEN < MAX_IDENT_SIZE; i +=
+            SHA256_HEX_LEN) {
+        int length = snprintf(seed_buf, sizeof(seed_buf), "%.64s%zu",
+                              root_hash, i / SHA256_HEX_LEN);
+        char hash_buf[SHA256_HEX_STRLEN];
+        compute_hash(seed_buf, length, hash_buf);
+        memcpy(ident + i, hash_buf, SHA256_HEX_LEN);
+    }
+    ident[MAX_IDENT_SIZE - 1] = '\0';
+}
+
+int main(int argc, char **argv) {
+    struct pkgmake_options options = {0};
+    if (!parse_options(argc, argv, &options)) {
+        print_usage();
+        return 1;
+    }
+    int data_fd = open(options.data_path, O_RDONLY | O_CLOEXEC);
+    struct stat data_stat;
+    if (data_fd == -1 || fstat(data_fd, &data_stat) == -1 ||
+        !S_ISREG(data_stat.st_mode)) {
+        printf("Unable to open file: %s\n", options.data_path);
+        if (data_fd != -1) {
+            close(data_fd);
+        }
+        return 1;
+    }
+    char *filename = basename(options.data_path);
+    if (strlen(filename) >= MAX_FILENAME_SIZE) {
+        printf("File name is too long: %s\n", filename);
+        close(data_fd);
+        return 1;
+    }
+    posix_fadvise(data_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct bpkg_obj *obj = calloc(1, sizeof(struct bpkg_obj));
+    strcpy(obj->filename, filename);
+    obj->size = data_stat.st_size;
+    if (options.cdc) {
+        if (!plan_cdc_chunks(obj, data_fd, &options)) {
+            close(data_fd);
+            bpkg_obj_destroy(obj);
+            return 1;
+        }
+    } else {
+        obj->nchunks = choose_nchunks(obj->size, &options);
+        obj->nhashes = obj->nchunks - 1;
+        obj->hashes = create_tree_block(obj->nhashes, obj->nchunks);
+        plan_fixed_chunks(obj->hashes, obj->size);
+    }
+
+    struct pkgmake_job job = {0};
+    job.data_fd = data_fd;
+    job.hashes = obj->hashes;
+    job.leaves_hashed = options.cdc;
+    uint64_t chunk_size = obj->size / obj->nchunks + 1;
+    job.run_leaves = chunk_size < READ_RUN_SIZE ? READ_RUN_SIZE / chunk_size :
+                     1;
+    int hashed = hash_tree(&job, options.num_threads);
+    close(data_fd);
+    if (!hashed) {
+        printf("Failed to read the file: %s\n", options.data_path);
+        bpkg_obj_destroy(obj);
+        return 1;
+    }
+
+    memcpy(obj->root_hash, obj->hashes->nodes[0]->expected_hash,
+           SHA256_HEX_STRLEN);
+    derive_ident(obj->root_hash, obj->ident);
+    int written = bpkg_text_write(obj, options.output_path);
+    // The index is written after the package, so it is not older than it
+    if (written && options.write_index) {
+        char index_path[MAX_OUTPUT_SIZE + sizeof(BPKG_INDEX_SUFFIX)];
+        snprintf(index_path, sizeof(index_path), "%s%s", options.output_path,
+                 BPKG_INDEX_SUFFIX);
+        written = bpkg_index_write(obj, index_path);
+    }
+    bpkg_obj_destroy(obj);
+    return written ? 0 : 1;
+}
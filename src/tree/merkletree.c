@@ -1,6 +1,6 @@
 #include "tree/merkletree.h"
 
-chunk *create_chunk(uint32_t offset, uint32_t size) {
+chunk *create_chunk(uint64_t offset, uint32_t size) {
     chunk *new_chunk = calloc(1, sizeof(chunk));
 
     new_chunk->offset = offset;
@@ -9,7 +9,7 @@ chunk *create_chunk(uint32_t offset, uint32_t size) {
     return new_chunk;
 }
 
-merkle_tree_node *create_node(int key, chunk *value, char
+merkle_tree_node *create_node(size_t key, chunk *value, char
         *expected_hash) {
     merkle_tree_node *new_node = calloc(1, sizeof(merkle_tree_node));
 
@@ -22,7 +22,7 @@ merkle_tree_node *create_node(int key, chunk *value, char
     return new_node;
 }
 
-merkle_tree *create_tree(merkle_tree_node **nodes, uint32_t nhashes, uint32_t
+merkle_tree *create_tree(merkle_tree_node **nodes, uint64_t nhashes, uint64_t
 nchunks) {
     if (nodes == NULL) {
         printf("Error Creating Tree\n");
@@ -46,6 +46,169 @@ nchunks) {
     return new_tree;
 }
 
+merkle_tree *create_tree_block(uint64_t nhashes, uint64_t nchunks) {
+    size_t num_nodes = nhashes + nchunks;
+    merkle_tree_node **nodes = calloc(num_nodes, sizeof(merkle_tree_node *));
+    merkle_tree_node *node_block = calloc(num_nodes, sizeof
+            (merkle_tree_node));
+    chunk *chunk_block = calloc(nchunks, sizeof(chunk));
+    for (size_t i = 0; i < num_nodes; ++i) {
+        node_block[i].key = i;
+        if (i >= nhashes) {
+            node_block[i].value = &chunk_block[i - nhashes];
+        }
+        nodes[i] = &node_block[i];
+    }
+
+    merkle_tree *new_tree = create_tree(nodes, nhashes, nchunks);
+    new_tree->node_block = node_block;
+    new_tree->chunk_block = chunk_block;
+    return new_tree;
+}
+
+/**
+ * Check if the chunks of a tree are of one size, apart from leading chunks
+ * one byte larger (as in chunk layouts that spread the remainder of the
+ * file size) and a smaller last chunk
+ * @param hashes set to CHUNKS_UNIFORM if true
+ * @return 1 if true, 0 otherwise
+ */
+int detect_uniform_chunks(merkle_tree *hashes) {
+    merkle_tree_node **nodes = hashes->nodes + hashes->num_inner_nodes;
+    size_t num_leaves = hashes->num_leaves;
+    uint64_t large_size = nodes[0]->value->size;
+    size_t num_larger = 0;
+    while (num_larger < num_leaves && nodes[num_larger]->value->size ==
+                                      large_size) {
+        num_larger++;
+    }
+    uint64_t size = large_size - 1;
+    if (num_larger == num_leaves) {
+        size = large_size;
+        num_larger = 0;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_leaves; ++i) {
+        chunk *current = nodes[i]->value;
+        uint64_t expected_size = i < num_larger ? size + 1 : size;
+        uint64_t expected_offset = i * size + (i < num_larger ? i :
+                                               num_larger);
+        if (current->offset != expected_offset ||
+            (i + 1 < num_leaves && current->size != expected_size) ||
+            current->size > expected_size) {
+            return 0;
+        }
+    }
+    hashes->layout = CHUNKS_UNIFORM;
+    hashes->uniform_size = size;
+    hashes->num_larger = num_larger;
+    return 1;
+}
+
+/**
+ * Check if a chunk ends before the next one starts, empty chunks sharing an
+ * offset with the next one included
+ * @return 1 if true, 0 otherwise
+ */
+int chunk_before(chunk *current, chunk *next) {
+    return current->offset + current->size <= next->offset;
+}
+
+int compare_leaf_offsets(const void *a, const void *b, void *arg) {
+    merkle_tree_node **nodes = arg;
+    chunk *chunk_a = nodes[*(const size_t *) a]->value;
+    chunk *chunk_b = nodes[*(const size_t *) b]->value;
+    if (chunk_a->offset != chunk_b->offset) {
+        return chunk_a->offset < chunk_b->offset ? -1 : 1;
+    }
+    return (chunk_a->size > chunk_b->size) - (chunk_a->size < chunk_b->size);
+}
+
+void index_chunk_offsets(merkle_tree *hashes) {
+    free(hashes->leaves_by_offset);
+    hashes->leaves_by_offset = NULL;
+    hashes->layout = CHUNKS_UNINDEXED;
+    if (detect_uniform_chunks(hashes)) {
+        return;
+    }
+
+    // Leaves already in offset order are searched in place
+    merkle_tree_node **nodes = hashes->nodes;
+    size_t first_leaf = hashes->num_inner_nodes;
+    size_t i = first_leaf;
+    while (i + 1 < hashes->num_nodes && chunk_before(nodes[i]->value,
+                                                     nodes[i + 1]->value)) {
+        i++;
+    }
+    if (i + 1 == hashes->num_nodes) {
+        hashes->layout = CHUNKS_SORTED;
+        return;
+    }
+
+    size_t *keys = malloc(hashes->num_leaves * sizeof(size_t));
+    for (i = 0; i < hashes->num_leaves; ++i) {
+        keys[i] = first_leaf + i;
+    }
+    qsort_r(keys, hashes->num_leaves, sizeof(size_t), compare_leaf_offsets,
+            nodes);
+    for (i = 0; i + 1 < hashes->num_leaves; ++i) {
+        if (!chunk_before(nodes[keys[i]]->value, nodes[keys[i + 1]]->value)) {
+            free(keys);
+            return;
+        }
+    }
+    hashes->leaves_by_offset = keys;
+    hashes->layout = CHUNKS_INDEXED;
+}
+
+size_t find_leaf_by_offset(merkle_tree *hashes, uint64_t file_offset) {
+    size_t key = hashes->num_nodes;
+    if (hashes->layout == CHUNKS_UNIFORM) {
+        uint64_t larger_end = hashes->num_larger * (hashes->uniform_size + 1);
+        uint64_t leaf = file_offset < larger_end ?
+                        file_offset / (hashes->uniform_size + 1) :
+                        hashes->num_larger + (file_offset - larger_end) /
+                                             hashes->uniform_size;
+        if (leaf < hashes->num_leaves) {
+            key = hashes->num_inner_nodes + leaf;
+        }
+    } else {
+        // Last chunk starting at or before the offset
+        size_t low = 0;
+        size_t high = hashes->num_leaves;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            size_t middle_key = hashes->leaves_by_offset != NULL ?
+                                hashes->leaves_by_offset[middle] :
+                                hashes->num_inner_nodes + middle;
+            if (hashes->nodes[middle_key]->value->offset <= file_offset) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low > 0) {
+            key = hashes->leaves_by_offset != NULL ?
+                  hashes->leaves_by_offset[low - 1] :
+                  hashes->num_inner_nodes + low - 1;
+        }
+    }
+
+    // The last chunk may be smaller, and offsets past the end are in no chunk
+    if (key == hashes->num_nodes) {
+        return key;
+    }
+    chunk *found = hashes->nodes[key]->value;
+    if (file_offset < found->offset || file_offset - found->offset >=
+                                       found->size) {
+        return hashes->num_nodes;
+    }
+    return key;
+}
+
 void free_node(merkle_tree_node *node) {
     if(node->value != NULL) {
         free(node->value);
@@ -58,6 +221,14 @@ void free_tree(merkle_tree *tree) {
         return;
     }
 
+    free(tree->leaves_by_offset);
+    if (tree->node_block != NULL) {
+        free(tree->node_block);
+        free(tree->chunk_block);
+        free(tree->nodes);
+        free(tree);
+        return;
+    }
     for (size_t i = 0; i < tree->num_nodes; ++i) {
         if (tree->nodes[i] != NULL) {
             free_node(tree->nodes[i]);
@@ -94,7 +265,7 @@ void compute_leaf_hashes(merkle_tree *hashes, char *full_filename) {
         merkle_tree_node *current_node = hashes->nodes[i];
         chunk *current_chunk = current_node->value;
 
-        if (fseek(data_file, current_chunk->offset, SEEK_SET) != 0) {
+        if (fseeko(data_file, (off_t) current_chunk->offset, SEEK_SET) != 0) {
             perror("Failed to offset the file");
             fclose(data_file);
             return;
@@ -111,22 +282,21 @@ void compute_leaf_hashes(merkle_tree *hashes, char *full_filename) {
     fclose(data_file);
 }
 
+void compute_inner_hash(merkle_tree_node *node) {
+    // Concatenate the computed hashes of two children without null
+    // terminator
+    char data_buf[2 * SHA256_HEX_LEN];
+    strncpy(data_buf, node->left->computed_hash, SHA256_HEX_LEN);
+    memcpy(data_buf + SHA256_HEX_LEN, node->right->computed_hash,
+           SHA256_HEX_LEN);
+
+    // Compute the hash of the inner node
+    compute_hash(data_buf, 2 * SHA256_HEX_LEN, node->computed_hash);
+}
+
 void compute_inner_hashes(merkle_tree  *hashes) {
     for (size_t i = hashes->num_inner_nodes; i > 0; --i) {
-        merkle_tree_node *current_node = hashes->nodes[i - 1];
-
-        // Concatenate the computed hashes of two children without null
-        // terminator
-        char *data_buf = calloc(2 * SHA256_HEX_LEN, sizeof(char));
-        strncpy(data_buf, current_node->left->computed_hash, SHA256_HEX_LEN);
-        for (size_t j = SHA256_HEX_LEN; j < 2 * SHA256_HEX_LEN; ++j) {
-            data_buf[j] = current_node->right->computed_hash[j -
-                                                             SHA256_HEX_LEN];
-        }
-
-        // Compute the hash of the current inner node
-        compute_hash(data_buf, 2 * SHA256_HEX_LEN, current_node->computed_hash);
-        free(data_buf);
+        compute_inner_hash(hashes->nodes[i - 1]);
     }
 }
 
@@ -145,82 +315,3 @@ int compare_node_hash(merkle_tree_node *node) {
     }
     return 0;
 }
-
-char **get_all_leaf_hashes_from_node(merkle_tree *hashes, merkle_tree_node
-*node) {
-    // Root node
-    if (node->key == 0) {
-        // NULL at the end to signal end of leaf hashes
-        char **leaf_hashes = calloc(hashes->num_leaves + 1, sizeof(char *));
-        for (size_t i = hashes->num_inner_nodes; i < hashes->num_nodes; ++i) {
-            leaf_hashes[i - hashes->num_inner_nodes] = calloc
-                    (SHA256_HEX_STRLEN, sizeof(char));
-            strcpy(leaf_hashes[i - hashes->num_inner_nodes],
-                   hashes->nodes[i]->expected_hash);
-        }
-        return leaf_hashes;
-    }
-
-    // Total number of nodes given depth d: 2^(d+1) - 1, given root node is
-    // depth 0
-    int node_depth = 1;
-    int node_depth_offset = 0;
-    // Calculates the depth of the node
-    for (int d = 1; d <= hashes->max_depth; ++d) {
-        int max_index_at_d = (int) pow(2, (d+1)) - 1 - 1;
-        if (node->key <= max_index_at_d) {
-            node_depth = d;
-            // The offset of the node at depth d
-            node_depth_offset =  node->key - ((int) pow(2, d) - 1);
-            break;
-        }
-    }
-
-    // Calculates the leaf indices of subtree with the selected node as root
-    size_t subtree_num_leaves = (size_t)pow(2, ((int)hashes->max_depth -
-    node_depth));
-    size_t left_index = hashes->num_inner_nodes + (node_depth_offset *
-            subtree_num_leaves);
-    size_t right_index = hashes->num_inner_nodes + ((node_depth_offset + 1) *
-            subtree_num_leaves);
-    // NULL at the end to signal end of leaf hashes
-    char **leaf_hashes = calloc(subtree_num_leaves + 1, sizeof(char *));
-    for (size_t i = left_index; i < right_index; ++i) {
-        leaf_hashes[i - left_index] = calloc(SHA256_HEX_STRLEN, sizeof(char));
-        strcpy(leaf_hashes[i - left_index],hashes->nodes[i]->expected_hash);
-    }
-    return leaf_hashes;
-}
-
-/**
- * Check if a node (with child_key) is a descendant of another node (with
- * parent_key)
- * @param parent_key
- * @param child_key
- * @return 1 if true, 0 otherwise
- */
-int check_child_from_node(int parent_key, int child_key) {
-    // Not possible that child key is smaller than parent key
-    if (child_key < parent_key) {
-        return 0;
-    }
-    // Same node
-    if (child_key == parent_key) {
-        return 1;
-    }
-
-    // Relative depth from parent to child
-    int rel_d = 1;
-    // Left and right indices for the subtree starting from parent node
-    int left_index = ((int)pow(2, rel_d) * (parent_key + 1)) - 1;
-    int right_index = ((int)pow(2, rel_d) * (parent_key + 2)) - 2;
-    while (child_key >= left_index) {
-        if (child_key <= right_index) {
-            return 1;
-        }
-        rel_d++;
-        left_index = ((int)pow(2, rel_d) * (parent_key + 1)) - 1;
-        right_index = ((int)pow(2, rel_d) * (parent_key + 2)) - 2;
-    }
-    return 0;
-}